@@ -0,0 +1,408 @@
+// Microbenchmarks for fhash's hot paths, linked against the same objects as
+// the fhash binary. Each case runs warmup iterations, then timed repetitions,
+// and prints one JSON line with median/p99 and a throughput figure.
+#include "common.h"
+#include "hashing.h"
+#include "utils.h"
+#include "db.h"
+#include "stats.h"
+#include <errno.h>
+#include <sqlite3.h>
+
+#define BENCH_USAGE "Usage: fhash_bench [-k md5,audio,upsert,dupe] [-reps n] [-warmup n] [-dir workdir]\n" \
+                    "                   [-audio file|dir]... [-rows n] [-dupe-rows n]\n"
+#define MAX_AUDIO_FILES 64
+
+typedef int (*BenchFn)(void *ctx);
+
+typedef struct {
+    int reps;
+    int warmup;
+    const char *work_dir;
+    long upsert_rows;
+    long dupe_rows;
+    char *audio_files[MAX_AUDIO_FILES];
+    int audio_count;
+} BenchOptions;
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Runs fn warmup + reps times and prints one result line. `units` is the
+// amount of work per call (bytes, rows or files) used for throughput.
+static int run_case(const BenchOptions *opt, const char *kernel, const char *param,
+                    BenchFn fn, void *ctx, double units, const char *unit_name, double unit_scale) {
+    uint64_t *samples = calloc((size_t)opt->reps, sizeof(uint64_t));
+    if (!samples) return -1;
+    int failures = 0;
+    for (int i = 0; i < opt->warmup; i++) {
+        failures += (fn(ctx) != 0);
+    }
+    for (int i = 0; i < opt->reps; i++) {
+        uint64_t start = stats_now_ns();
+        failures += (fn(ctx) != 0);
+        samples[i] = stats_now_ns() - start;
+    }
+    qsort(samples, (size_t)opt->reps, sizeof(uint64_t), cmp_u64);
+    double median_ms = samples[opt->reps / 2] / 1e6;
+    int p99_index = (int)((opt->reps * 99 + 99) / 100) - 1;
+    if (p99_index >= opt->reps) p99_index = opt->reps - 1;
+    double p99_ms = samples[p99_index] / 1e6;
+    double throughput = median_ms > 0 ? units / unit_scale / (median_ms / 1e3) : 0.0;
+    printf("{\"kernel\":\"%s\",\"param\":\"%s\",\"reps\":%d,\"warmup\":%d,\"min_ms\":%.3f,\"median_ms\":%.3f,"
+           "\"p99_ms\":%.3f,\"throughput\":%.1f,\"unit\":\"%s\",\"failures\":%d}\n",
+           kernel, param, opt->reps, opt->warmup, samples[0] / 1e6, median_ms, p99_ms,
+           throughput, unit_name, failures);
+    fflush(stdout);
+    free(samples);
+    return 0;
+}
+
+// ---- md5 ----
+
+typedef struct {
+    char path[MAX_PATH_LENGTH];
+} Md5Case;
+
+static int bench_md5(void *ctx) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    return calculate_md5(((Md5Case *)ctx)->path, digest);
+}
+
+static int write_random_file(const char *path, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    unsigned char buf[65536];
+    uint64_t state = 0x9E3779B97F4A7C15ULL ^ size;
+    while (size > 0) {
+        for (size_t i = 0; i < sizeof(buf); i += 8) {
+            state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+            memcpy(buf + i, &state, 8);
+        }
+        size_t n = size < sizeof(buf) ? size : sizeof(buf);
+        if (write(fd, buf, n) != (ssize_t)n) {
+            close(fd);
+            return -1;
+        }
+        size -= n;
+    }
+    close(fd);
+    return 0;
+}
+
+// File sizes stand in for buffer sizes: calculate_md5 reads through a fixed
+// 1 MiB buffer, so small inputs expose per-call overhead and large ones the
+// digest throughput. Files are page-cache warm after the warmup runs.
+static int bench_md5_kernel(const BenchOptions *opt) {
+    static const size_t sizes[] = { 4096, 65536, 1 << 20, 16 << 20, 64 << 20 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        Md5Case c;
+        char param[32];
+        snprintf(c.path, sizeof(c.path), "%s/md5_%zu.bin", opt->work_dir, sizes[i]);
+        if (write_random_file(c.path, sizes[i]) != 0) return -1;
+        snprintf(param, sizeof(param), "size=%zu", sizes[i]);
+        run_case(opt, "md5", param, bench_md5, &c, (double)sizes[i], "MB/s", 1024.0 * 1024.0);
+        unlink(c.path);
+    }
+    return 0;
+}
+
+// ---- audio ----
+
+typedef struct {
+    const char *path;
+} AudioCase;
+
+static int bench_audio_md5(void *ctx) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    return calculate_audio_md5(((AudioCase *)ctx)->path, digest);
+}
+
+static int bench_validate(void *ctx) {
+    int result = AUDIO_CHECK_NOT_CHECKED;
+    return validate_audio_stream(((AudioCase *)ctx)->path, &result);
+}
+
+static int bench_validate_quick(void *ctx) {
+    int result = AUDIO_CHECK_NOT_CHECKED;
+    return validate_audio_stream_quick(((AudioCase *)ctx)->path, &result);
+}
+
+static int bench_audio_kernel(const BenchOptions *opt) {
+    for (int i = 0; i < opt->audio_count; i++) {
+        AudioCase c = { opt->audio_files[i] };
+        struct stat st;
+        if (stat(c.path, &st) != 0) continue;
+        const char *base = strrchr(c.path, '/');
+        char param[MAX_PATH_LENGTH];
+        char escaped[MAX_PATH_LENGTH];
+        snprintf(param, sizeof(param), "%s (%lld bytes)", base ? base + 1 : c.path, (long long)st.st_size);
+        json_escape(escaped, sizeof(escaped), param);
+        run_case(opt, "audio_md5", escaped, bench_audio_md5, &c, 1, "files/s", 1);
+        run_case(opt, "check_full", escaped, bench_validate, &c, 1, "files/s", 1);
+        run_case(opt, "check_quick", escaped, bench_validate_quick, &c, 1, "files/s", 1);
+    }
+    return 0;
+}
+
+// ---- upsert ----
+
+typedef struct {
+    char db_path[MAX_PATH_LENGTH];
+    const char *journal_mode;
+    int batch_size;
+    long rows;
+} UpsertCase;
+
+static void remove_db(const char *path) {
+    char side[MAX_PATH_LENGTH + 8];
+    unlink(path);
+    snprintf(side, sizeof(side), "%s-wal", path);
+    unlink(side);
+    snprintf(side, sizeof(side), "%s-shm", path);
+    unlink(side);
+    snprintf(side, sizeof(side), "%s-journal", path);
+    unlink(side);
+}
+
+static sqlite3 *open_bench_db(const char *path, const char *journal_mode) {
+    sqlite3 *db = NULL;
+    remove_db(path);
+    if (sqlite3_open(path, &db) != SQLITE_OK || ensure_schema_and_version(db) != 0) {
+        fprintf(stderr, "Error: cannot initialize %s\n", path);
+        sqlite3_close(db);
+        return NULL;
+    }
+    if (journal_mode) {
+        char pragma[64];
+        snprintf(pragma, sizeof(pragma), "PRAGMA journal_mode=%s;", journal_mode);
+        sqlite3_exec(db, pragma, NULL, NULL, NULL);
+    }
+    return db;
+}
+
+// Binds a row the way process_file does for a scan with -h.
+static int upsert_row(sqlite3_stmt *stmt, long i, const char *md5_hex) {
+    char path[96];
+    char name[32];
+    snprintf(name, sizeof(name), "file%08ld.mp3", i);
+    snprintf(path, sizeof(path), "/bench/d%03ld/%s", i % 997, name);
+    sqlite3_bind_text(stmt, 1, md5_hex, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, "Not calculated", -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, path, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 4, name, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 5, "mp3", -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 6, 4000000 + i);
+    sqlite3_bind_int64(stmt, 7, 1700000000);
+    sqlite3_bind_int64(stmt, 8, 1600000000 + i);
+    sqlite3_bind_text(stmt, 9, "F", -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 10, AUDIO_CHECK_NOT_CHECKED);
+    sqlite3_bind_int(stmt, 11, AUDIO_CHECK_LEVEL_NONE);
+    sqlite3_bind_null(stmt, 12);
+    sqlite3_bind_int(stmt, 13, 1);
+    sqlite3_bind_int(stmt, 14, 0);
+    sqlite3_bind_int(stmt, 15, 0);
+    sqlite3_bind_int(stmt, 16, 0);
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+static void md5_hex_for(long i, long distinct, char *out) {
+    // group keys: rows sharing i % distinct share an md5
+    snprintf(out, 33, "%016lx%016lx", (unsigned long)(i % distinct) * 2654435761UL, (unsigned long)(i % distinct));
+}
+
+static int bench_upsert(void *ctx) {
+    UpsertCase *c = ctx;
+    sqlite3 *db = open_bench_db(c->db_path, c->journal_mode);
+    if (!db) return -1;
+    sqlite3_stmt *stmt = NULL;
+    int rc = -1;
+    if (sqlite3_prepare_v2(db, FILES_UPSERT_SQL, -1, &stmt, NULL) != SQLITE_OK) goto done;
+    if (begin_transaction(db) != 0) goto done;
+    int batch = 0;
+    for (long i = 0; i < c->rows; i++) {
+        char md5_hex[33];
+        md5_hex_for(i, c->rows, md5_hex);
+        if (upsert_row(stmt, i, md5_hex) != 0) {
+            rollback_transaction(db);
+            goto done;
+        }
+        if (++batch >= c->batch_size) {
+            if (commit_transaction(db) != 0 || begin_transaction(db) != 0) goto done;
+            batch = 0;
+        }
+    }
+    rc = commit_transaction(db);
+done:
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return rc;
+}
+
+static int bench_upsert_kernel(const BenchOptions *opt) {
+    static const char *journal_modes[] = { "delete", "wal", "memory" };
+    static const int batch_sizes[] = { 100, BATCH_SIZE, 10000 };
+    for (size_t j = 0; j < sizeof(journal_modes) / sizeof(journal_modes[0]); j++) {
+        for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); b++) {
+            UpsertCase c = { .journal_mode = journal_modes[j], .batch_size = batch_sizes[b], .rows = opt->upsert_rows };
+            char param[96];
+            snprintf(c.db_path, sizeof(c.db_path), "%s/upsert.db", opt->work_dir);
+            snprintf(param, sizeof(param), "journal=%s batch=%d rows=%ld", journal_modes[j], batch_sizes[b], opt->upsert_rows);
+            run_case(opt, "upsert", param, bench_upsert, &c, (double)opt->upsert_rows, "rows/s", 1);
+            remove_db(c.db_path);
+        }
+    }
+    return 0;
+}
+
+// ---- dupe ----
+
+typedef struct {
+    sqlite3 *db;
+} DupeCase;
+
+static int bench_dupe(void *ctx) {
+    DupeCase *c = ctx;
+    // process_duplicates reports on stdout; keep it out of the results
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (saved < 0 || devnull < 0) return -1;
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    process_duplicates(c->db, DUPE_FILE, 2, LINK_NONE, 0, NULL, 0, NULL, 0, NULL);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return 0;
+}
+
+static int bench_dupe_kernel(const BenchOptions *opt) {
+    // group size distributions: distinct md5 count per row count, except
+    // "skewed" which makes a few large groups and a long tail of singles
+    static const struct { const char *name; int group; } dists[] = {
+        { "unique", 1 }, { "pairs", 2 }, { "groups10", 10 }, { "skewed", 0 }
+    };
+    for (size_t d = 0; d < sizeof(dists) / sizeof(dists[0]); d++) {
+        DupeCase c;
+        char db_path[MAX_PATH_LENGTH];
+        snprintf(db_path, sizeof(db_path), "%s/dupe.db", opt->work_dir);
+        c.db = open_bench_db(db_path, NULL);
+        if (!c.db) return -1;
+        sqlite3_stmt *stmt = NULL;
+        if (sqlite3_prepare_v2(c.db, FILES_UPSERT_SQL, -1, &stmt, NULL) != SQLITE_OK || begin_transaction(c.db) != 0) {
+            sqlite3_finalize(stmt);
+            sqlite3_close(c.db);
+            return -1;
+        }
+        for (long i = 0; i < opt->dupe_rows; i++) {
+            char md5_hex[33];
+            if (dists[d].group > 0) {
+                md5_hex_for(i, opt->dupe_rows / dists[d].group, md5_hex);
+            } else {
+                // first 10% of rows fall into 10 groups, the rest are unique
+                long tenth = opt->dupe_rows / 10;
+                md5_hex_for(i < tenth ? i % 10 : i, opt->dupe_rows, md5_hex);
+            }
+            upsert_row(stmt, i, md5_hex);
+        }
+        commit_transaction(c.db);
+        sqlite3_finalize(stmt);
+
+        char param[64];
+        snprintf(param, sizeof(param), "dist=%s rows=%ld", dists[d].name, opt->dupe_rows);
+        run_case(opt, "dupe", param, bench_dupe, &c, (double)opt->dupe_rows, "rows/s", 1);
+        sqlite3_close(c.db);
+        remove_db(db_path);
+    }
+    return 0;
+}
+
+static int add_audio_path(BenchOptions *opt, const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "Error: cannot stat %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (opt->audio_count < MAX_AUDIO_FILES) opt->audio_files[opt->audio_count++] = strdup(path);
+        return 0;
+    }
+    DIR *dir = opendir(path);
+    if (!dir) return -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && opt->audio_count < MAX_AUDIO_FILES) {
+        const char *ext = strrchr(entry->d_name, '.');
+        if (!ext || strcmp(ext, ".md") == 0 || entry->d_name[0] == '.') continue;
+        char *full = NULL;
+        if (asprintf(&full, "%s/%s", path, entry->d_name) < 0) break;
+        opt->audio_files[opt->audio_count++] = full;
+    }
+    closedir(dir);
+    return 0;
+}
+
+static int kernel_selected(const char *list, const char *name) {
+    char haystack[256];
+    char needle[32];
+    snprintf(haystack, sizeof(haystack), ",%s,", list);
+    snprintf(needle, sizeof(needle), ",%s,", name);
+    return strstr(haystack, needle) != NULL;
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions opt = { .reps = 15, .warmup = 3, .work_dir = "/tmp/fhash-microbench",
+                         .upsert_rows = 20000, .dupe_rows = 50000 };
+    const char *kernels = "md5,audio,upsert,dupe";
+
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        if (strcmp(a, "-help") == 0) {
+            printf("%s", BENCH_USAGE);
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Error: Missing argument for %s option\n", a);
+            return 1;
+        }
+        const char *v = argv[++i];
+        if (strcmp(a, "-k") == 0) kernels = v;
+        else if (strcmp(a, "-reps") == 0) opt.reps = atoi(v);
+        else if (strcmp(a, "-warmup") == 0) opt.warmup = atoi(v);
+        else if (strcmp(a, "-dir") == 0) opt.work_dir = v;
+        else if (strcmp(a, "-rows") == 0) opt.upsert_rows = atol(v);
+        else if (strcmp(a, "-dupe-rows") == 0) opt.dupe_rows = atol(v);
+        else if (strcmp(a, "-audio") == 0) {
+            if (add_audio_path(&opt, v) != 0) return 1;
+        } else {
+            fprintf(stderr, "Error: unknown option: %s\n%s", a, BENCH_USAGE);
+            return 1;
+        }
+    }
+    if (opt.reps < 1 || opt.warmup < 0 || opt.upsert_rows < 1 || opt.dupe_rows < 10) {
+        fprintf(stderr, "Error: invalid arguments\n%s", BENCH_USAGE);
+        return 1;
+    }
+    if (mkdir(opt.work_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: cannot create %s: %s\n", opt.work_dir, strerror(errno));
+        return 1;
+    }
+    init_logging_callback(0);
+
+    int rc = 0;
+    if (kernel_selected(kernels, "md5")) rc |= bench_md5_kernel(&opt);
+    if (kernel_selected(kernels, "audio")) rc |= bench_audio_kernel(&opt);
+    if (kernel_selected(kernels, "upsert")) rc |= bench_upsert_kernel(&opt);
+    if (kernel_selected(kernels, "dupe")) rc |= bench_dupe_kernel(&opt);
+
+    release_hash_context_pool();
+    for (int i = 0; i < opt.audio_count; i++) free(opt.audio_files[i]);
+    return rc ? 1 : 0;
+}
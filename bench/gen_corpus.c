@@ -0,0 +1,574 @@
+// Synthetic corpus generator for fhash benchmarks.
+//
+// Builds a directory tree of unique files, byte-identical duplicates and hard
+// links. Unique files are either filler (.bin, log-normal sizes) or real muxed
+// audio (.mp3/.flac/.wav). Audio is encoded once per variant through the
+// libavformat encoders and every file gets its own tag, so audio files have
+// distinct file MD5s but share their variant's audio MD5. Output is
+// deterministic for a given -seed.
+#include "common.h"
+#include <errno.h>
+#include <math.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/error.h>
+#include <libavutil/frame.h>
+#include <libavutil/log.h>
+#include <libavutil/mem.h>
+
+// FFmpeg 7 made the AVIO write callback take a const buffer.
+#if defined(LIBAVFORMAT_VERSION_MAJOR) && LIBAVFORMAT_VERSION_MAJOR < 61
+#define AVIO_WRITE_CONST
+#else
+#define AVIO_WRITE_CONST const
+#endif
+
+#define GEN_USAGE "Usage: gen_corpus -o <dir> [-n files] [-depth d] [-fanout f] [-size-median bytes] [-size-sigma s]\n" \
+                  "                  [-size-max bytes] [-dup ratio] [-hardlink ratio] [-audio ratio]\n" \
+                  "                  [-formats mp3,flac,wav] [-variants n] [-seconds s] [-seed n]\n"
+#define WRITE_CHUNK (1024 * 1024)
+#define SAMPLE_RATE 44100
+#define MAX_FORMATS 3
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    size_t pos;
+} MemBuffer;
+
+typedef struct {
+    const char *ext;
+    const char *muxer;
+    enum AVCodecID codec_id;
+    MemBuffer *variants;
+    int enabled;
+} AudioFormat;
+
+enum { KIND_FILLER = 0, KIND_AUDIO = 1 };
+
+typedef struct {
+    uint64_t seed;
+    uint64_t size;
+    uint32_t dir;
+    uint32_t file_no;
+    uint8_t kind;
+    uint8_t format;
+    uint16_t variant;
+} FileSpec;
+
+typedef struct {
+    char **paths;
+    size_t count;
+    size_t capacity;
+} DirList;
+
+static AudioFormat audio_formats[MAX_FORMATS] = {
+    { "mp3", "mp3", AV_CODEC_ID_MP3, NULL, 0 },
+    { "flac", "flac", AV_CODEC_ID_FLAC, NULL, 0 },
+    { "wav", "wav", AV_CODEC_ID_PCM_S16LE, NULL, 0 },
+};
+
+static uint64_t rng_next(uint64_t *state) {
+    // xorshift64*; state must never be zero
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_unit(uint64_t *state) {
+    return (double)(rng_next(state) >> 11) / (double)(1ULL << 53);
+}
+
+static double rng_normal(uint64_t *state) {
+    double u1 = rng_unit(state);
+    double u2 = rng_unit(state);
+    if (u1 < 1e-12) u1 = 1e-12;
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+static uint64_t seed_for(uint64_t base, uint64_t index) {
+    uint64_t s = base ^ (index * 0x9E3779B97F4A7C15ULL);
+    return s ? s : 1;
+}
+
+static int parse_ratio(const char *arg, const char *flag, double *out) {
+    char *end = NULL;
+    double v = strtod(arg, &end);
+    if (end == arg || *end != '\0' || v < 0.0 || v > 1.0) {
+        fprintf(stderr, "Error: %s expects a ratio between 0 and 1\n", flag);
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static int add_dir(DirList *dirs, const char *path) {
+    if (dirs->count == dirs->capacity) {
+        size_t cap = dirs->capacity ? dirs->capacity * 2 : 64;
+        char **paths = realloc(dirs->paths, cap * sizeof(char *));
+        if (!paths) return -1;
+        dirs->paths = paths;
+        dirs->capacity = cap;
+    }
+    dirs->paths[dirs->count] = strdup(path);
+    if (!dirs->paths[dirs->count]) return -1;
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: cannot create %s: %s\n", path, strerror(errno));
+        free(dirs->paths[dirs->count]);
+        return -1;
+    }
+    dirs->count++;
+    return 0;
+}
+
+// Creates root plus fanout^1..fanout^depth subdirectories, breadth first.
+static int build_tree(DirList *dirs, const char *root, int depth, int fanout) {
+    if (add_dir(dirs, root) != 0) return -1;
+    size_t level_start = 0;
+    size_t level_end = 1;
+    for (int level = 0; level < depth; level++) {
+        for (size_t d = level_start; d < level_end; d++) {
+            for (int f = 0; f < fanout; f++) {
+                char path[MAX_PATH_LENGTH];
+                if (snprintf(path, sizeof(path), "%s/d%03d", dirs->paths[d], f) >= (int)sizeof(path)) {
+                    fprintf(stderr, "Error: directory path too long\n");
+                    return -1;
+                }
+                if (add_dir(dirs, path) != 0) return -1;
+            }
+        }
+        level_start = level_end;
+        level_end = dirs->count;
+    }
+    return 0;
+}
+
+static int mem_reserve(MemBuffer *mb, size_t needed) {
+    if (needed <= mb->capacity) return 0;
+    size_t cap = mb->capacity ? mb->capacity : 65536;
+    while (cap < needed) cap *= 2;
+    uint8_t *data = realloc(mb->data, cap);
+    if (!data) return -1;
+    mb->data = data;
+    mb->capacity = cap;
+    return 0;
+}
+
+static int mem_write(void *opaque, AVIO_WRITE_CONST uint8_t *buf, int buf_size) {
+    MemBuffer *mb = opaque;
+    if (mem_reserve(mb, mb->pos + (size_t)buf_size) != 0) return AVERROR(ENOMEM);
+    memcpy(mb->data + mb->pos, buf, (size_t)buf_size);
+    mb->pos += (size_t)buf_size;
+    if (mb->pos > mb->size) mb->size = mb->pos;
+    return buf_size;
+}
+
+static int64_t mem_seek(void *opaque, int64_t offset, int whence) {
+    MemBuffer *mb = opaque;
+    int64_t base;
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE: return (int64_t)mb->size;
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = (int64_t)mb->pos; break;
+        case SEEK_END: base = (int64_t)mb->size; break;
+        default: return AVERROR(EINVAL);
+    }
+    if (base + offset < 0) return AVERROR(EINVAL);
+    mb->pos = (size_t)(base + offset);
+    return (int64_t)mb->pos;
+}
+
+static enum AVSampleFormat pick_sample_fmt(const AVCodec *codec) {
+    if (!codec->sample_fmts) return AV_SAMPLE_FMT_S16;
+    static const enum AVSampleFormat preferred[] = {
+        AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_FLT,
+        AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_S32P
+    };
+    for (size_t p = 0; p < sizeof(preferred) / sizeof(preferred[0]); p++) {
+        for (const enum AVSampleFormat *f = codec->sample_fmts; *f != AV_SAMPLE_FMT_NONE; f++) {
+            if (*f == preferred[p]) return *f;
+        }
+    }
+    return AV_SAMPLE_FMT_NONE;
+}
+
+// Fills one frame with a variant-specific tone plus a little noise.
+static void fill_frame(AVFrame *frame, int channels, int64_t first_sample, double freq, uint64_t *noise) {
+    for (int i = 0; i < frame->nb_samples; i++) {
+        double t = (double)(first_sample + i) / SAMPLE_RATE;
+        for (int c = 0; c < channels; c++) {
+            double v = 0.3 * sin(2.0 * M_PI * freq * (1.0 + 0.01 * c) * t) + 0.02 * (rng_unit(noise) - 0.5);
+            switch (frame->format) {
+                case AV_SAMPLE_FMT_S16: ((int16_t *)frame->data[0])[i * channels + c] = (int16_t)(v * 32767); break;
+                case AV_SAMPLE_FMT_S16P: ((int16_t *)frame->data[c])[i] = (int16_t)(v * 32767); break;
+                case AV_SAMPLE_FMT_S32: ((int32_t *)frame->data[0])[i * channels + c] = (int32_t)(v * 2147483647.0); break;
+                case AV_SAMPLE_FMT_S32P: ((int32_t *)frame->data[c])[i] = (int32_t)(v * 2147483647.0); break;
+                case AV_SAMPLE_FMT_FLT: ((float *)frame->data[0])[i * channels + c] = (float)v; break;
+                case AV_SAMPLE_FMT_FLTP: ((float *)frame->data[c])[i] = (float)v; break;
+                default: break;
+            }
+        }
+    }
+}
+
+static int drain_packets(AVCodecContext *enc, AVFormatContext *oc, AVStream *st, AVPacket *pkt) {
+    for (;;) {
+        int ret = avcodec_receive_packet(enc, pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+        if (ret < 0) return ret;
+        av_packet_rescale_ts(pkt, enc->time_base, st->time_base);
+        pkt->stream_index = st->index;
+        ret = av_interleaved_write_frame(oc, pkt);
+        if (ret < 0) return ret;
+    }
+}
+
+// Encodes `seconds` of stereo audio into an in-memory container.
+static int encode_template(const AudioFormat *fmt, int variant, double seconds, MemBuffer *out) {
+    const AVCodec *codec = avcodec_find_encoder(fmt->codec_id);
+    if (!codec) return AVERROR_ENCODER_NOT_FOUND;
+
+    AVFormatContext *oc = NULL;
+    AVCodecContext *enc = NULL;
+    AVFrame *frame = NULL;
+    AVPacket *pkt = NULL;
+    int ret = avformat_alloc_output_context2(&oc, NULL, fmt->muxer, NULL);
+    if (ret < 0 || !oc) goto cleanup;
+
+    AVStream *st = avformat_new_stream(oc, NULL);
+    enc = avcodec_alloc_context3(codec);
+    frame = av_frame_alloc();
+    pkt = av_packet_alloc();
+    if (!st || !enc || !frame || !pkt) {
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    enc->sample_rate = SAMPLE_RATE;
+    enc->sample_fmt = pick_sample_fmt(codec);
+    enc->bit_rate = 128000;
+    enc->time_base = (AVRational){1, SAMPLE_RATE};
+    av_channel_layout_default(&enc->ch_layout, 2);
+    if (enc->sample_fmt == AV_SAMPLE_FMT_NONE) {
+        ret = AVERROR(EINVAL);
+        goto cleanup;
+    }
+    if (oc->oformat->flags & AVFMT_GLOBALHEADER) enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if ((ret = avcodec_open2(enc, codec, NULL)) < 0) goto cleanup;
+    if ((ret = avcodec_parameters_from_context(st->codecpar, enc)) < 0) goto cleanup;
+    st->time_base = enc->time_base;
+
+    unsigned char *io_buffer = av_malloc(65536);
+    if (!io_buffer) {
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    oc->pb = avio_alloc_context(io_buffer, 65536, 1, out, NULL, mem_write, mem_seek);
+    if (!oc->pb) {
+        av_free(io_buffer);
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    oc->flags |= AVFMT_FLAG_CUSTOM_IO;
+    if ((ret = avformat_write_header(oc, NULL)) < 0) goto cleanup;
+
+    int frame_size = (enc->frame_size > 0 && !(codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+                         ? enc->frame_size : 1152;
+    frame->nb_samples = frame_size;
+    frame->format = enc->sample_fmt;
+    frame->sample_rate = SAMPLE_RATE;
+    if ((ret = av_channel_layout_copy(&frame->ch_layout, &enc->ch_layout)) < 0) goto cleanup;
+    if ((ret = av_frame_get_buffer(frame, 0)) < 0) goto cleanup;
+
+    uint64_t noise = seed_for(0xA0D10ULL, (uint64_t)variant + 1);
+    double freq = 220.0 * (1.0 + 0.37 * variant);
+    int64_t total = (int64_t)(seconds * SAMPLE_RATE);
+    for (int64_t done = 0; done < total; done += frame_size) {
+        if ((ret = av_frame_make_writable(frame)) < 0) goto cleanup;
+        fill_frame(frame, 2, done, freq, &noise);
+        frame->pts = done;
+        if ((ret = avcodec_send_frame(enc, frame)) < 0) goto cleanup;
+        if ((ret = drain_packets(enc, oc, st, pkt)) < 0) goto cleanup;
+    }
+    if ((ret = avcodec_send_frame(enc, NULL)) < 0) goto cleanup;
+    if ((ret = drain_packets(enc, oc, st, pkt)) < 0) goto cleanup;
+    ret = av_write_trailer(oc);
+
+cleanup:
+    if (oc && oc->pb) {
+        av_freep(&oc->pb->buffer);
+        avio_context_free(&oc->pb);
+    }
+    if (oc) avformat_free_context(oc);
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    avcodec_free_context(&enc);
+    return ret < 0 ? ret : 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24);
+}
+
+// MP3/FLAC: prefix an ID3v2.3 TXXX frame. WAV: append a private RIFF chunk
+// and patch the RIFF size. Either way the audio stream is untouched.
+static int write_audio(int fd, const MemBuffer *tpl, const char *ext, uint64_t seed) {
+    char tag[48];
+    int tag_len = snprintf(tag, sizeof(tag), "fhash-bench%c%016llx", '\0', (unsigned long long)seed);
+    if (strcmp(ext, "wav") == 0 && tpl->size >= 12 && memcmp(tpl->data, "RIFF", 4) == 0) {
+        uint8_t header[8];
+        uint8_t chunk[8 + 24];
+        uint32_t riff_size = (uint32_t)tpl->data[4] | ((uint32_t)tpl->data[5] << 8) |
+                             ((uint32_t)tpl->data[6] << 16) | ((uint32_t)tpl->data[7] << 24);
+        memcpy(header, "RIFF", 4);
+        put_le32(header + 4, riff_size + (uint32_t)sizeof(chunk));
+        memcpy(chunk, "fhsh", 4);
+        put_le32(chunk + 4, 24);
+        memset(chunk + 8, 0, 24);
+        memcpy(chunk + 8, tag, (size_t)tag_len < 24 ? (size_t)tag_len : 24);
+        for (int i = 0; i < 8; i++) chunk[8 + 16 + i] = (uint8_t)(seed >> (8 * i));
+        if (write_all(fd, header, sizeof(header)) != 0) return -1;
+        if (write_all(fd, tpl->data + 8, tpl->size - 8) != 0) return -1;
+        return write_all(fd, chunk, sizeof(chunk));
+    }
+
+    uint8_t id3[10 + 10 + 1 + 48];
+    uint32_t frame_len = 1 + (uint32_t)tag_len;
+    uint32_t body_len = 10 + frame_len;
+    memcpy(id3, "ID3\x03\x00\x00", 6);
+    id3[6] = (uint8_t)((body_len >> 21) & 0x7F);
+    id3[7] = (uint8_t)((body_len >> 14) & 0x7F);
+    id3[8] = (uint8_t)((body_len >> 7) & 0x7F);
+    id3[9] = (uint8_t)(body_len & 0x7F);
+    memcpy(id3 + 10, "TXXX", 4);
+    id3[14] = (uint8_t)(frame_len >> 24); id3[15] = (uint8_t)(frame_len >> 16);
+    id3[16] = (uint8_t)(frame_len >> 8); id3[17] = (uint8_t)frame_len;
+    id3[18] = 0; id3[19] = 0;
+    id3[20] = 0; // ISO-8859-1 description + value
+    memcpy(id3 + 21, tag, (size_t)tag_len);
+    if (write_all(fd, id3, 10 + body_len) != 0) return -1;
+    return write_all(fd, tpl->data, tpl->size);
+}
+
+static int write_filler(int fd, uint64_t size, uint64_t seed, uint8_t *chunk) {
+    uint64_t state = seed;
+    while (size > 0) {
+        size_t n = size < WRITE_CHUNK ? (size_t)size : WRITE_CHUNK;
+        for (size_t i = 0; i < n; i += 8) {
+            uint64_t r = rng_next(&state);
+            memcpy(chunk + i, &r, (n - i) < 8 ? (n - i) : 8);
+        }
+        if (write_all(fd, chunk, n) != 0) return -1;
+        size -= n;
+    }
+    return 0;
+}
+
+static const char *spec_ext(const FileSpec *spec) {
+    return spec->kind == KIND_AUDIO ? audio_formats[spec->format].ext : "bin";
+}
+
+static int write_spec(const char *path, const FileSpec *spec, uint8_t *chunk, uint64_t *bytes) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int rc;
+    if (spec->kind == KIND_AUDIO) {
+        const MemBuffer *tpl = &audio_formats[spec->format].variants[spec->variant];
+        rc = write_audio(fd, tpl, spec_ext(spec), spec->seed);
+    } else {
+        rc = write_filler(fd, spec->size, spec->seed, chunk);
+    }
+    if (rc == 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0) *bytes += (uint64_t)st.st_size;
+    } else {
+        fprintf(stderr, "Error: write failed for %s: %s\n", path, strerror(errno));
+    }
+    close(fd);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    const char *out_dir = NULL;
+    long files = 10000;
+    int depth = 3;
+    int fanout = 8;
+    double size_median = 256 * 1024;
+    double size_sigma = 1.5;
+    double size_max = 64.0 * 1024 * 1024;
+    double dup_ratio = 0.10;
+    double link_ratio = 0.05;
+    double audio_ratio = 0.50;
+    const char *formats = "mp3,flac,wav";
+    int variants = 16;
+    double seconds = 5.0;
+    uint64_t seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+        int takes_value = strcmp(a, "-help") != 0;
+        if (takes_value && !v) {
+            fprintf(stderr, "Error: Missing argument for %s option\n", a);
+            return 1;
+        }
+        if (strcmp(a, "-o") == 0) out_dir = v;
+        else if (strcmp(a, "-n") == 0) files = atol(v);
+        else if (strcmp(a, "-depth") == 0) depth = atoi(v);
+        else if (strcmp(a, "-fanout") == 0) fanout = atoi(v);
+        else if (strcmp(a, "-size-median") == 0) size_median = strtod(v, NULL);
+        else if (strcmp(a, "-size-sigma") == 0) size_sigma = strtod(v, NULL);
+        else if (strcmp(a, "-size-max") == 0) size_max = strtod(v, NULL);
+        else if (strcmp(a, "-dup") == 0) { if (parse_ratio(v, a, &dup_ratio) != 0) return 1; }
+        else if (strcmp(a, "-hardlink") == 0) { if (parse_ratio(v, a, &link_ratio) != 0) return 1; }
+        else if (strcmp(a, "-audio") == 0) { if (parse_ratio(v, a, &audio_ratio) != 0) return 1; }
+        else if (strcmp(a, "-formats") == 0) formats = v;
+        else if (strcmp(a, "-variants") == 0) variants = atoi(v);
+        else if (strcmp(a, "-seconds") == 0) seconds = strtod(v, NULL);
+        else if (strcmp(a, "-seed") == 0) seed = strtoull(v, NULL, 10);
+        else if (strcmp(a, "-help") == 0) { printf("%s", GEN_USAGE); return 0; }
+        else {
+            fprintf(stderr, "Error: unknown option: %s\n%s", a, GEN_USAGE);
+            return 1;
+        }
+        i++;
+    }
+    if (!out_dir || files < 1 || depth < 0 || fanout < 1 || variants < 1 || variants > 65535 ||
+        seconds <= 0 || size_median < 0 || size_max < 0 || dup_ratio + link_ratio >= 1.0) {
+        fprintf(stderr, "Error: invalid arguments (need -o, -n >= 1, -dup + -hardlink < 1)\n%s", GEN_USAGE);
+        return 1;
+    }
+    if (seed == 0) seed = 1;
+
+    av_log_set_level(AV_LOG_ERROR);
+    int format_count = 0;
+    if (audio_ratio > 0) {
+        for (int f = 0; f < MAX_FORMATS; f++) {
+            char needle[16];
+            snprintf(needle, sizeof(needle), ",%s,", audio_formats[f].ext);
+            char haystack[256];
+            snprintf(haystack, sizeof(haystack), ",%s,", formats);
+            if (!strstr(haystack, needle)) continue;
+            audio_formats[f].variants = calloc((size_t)variants, sizeof(MemBuffer));
+            if (!audio_formats[f].variants) return 1;
+            int ok = 1;
+            for (int v = 0; v < variants && ok; v++) {
+                // spread durations from 0.5x to 1.5x of -seconds
+                double len = seconds * (0.5 + (double)v / variants);
+                int ret = encode_template(&audio_formats[f], v, len, &audio_formats[f].variants[v]);
+                if (ret < 0) {
+                    char err[AV_ERROR_MAX_STRING_SIZE];
+                    av_strerror(ret, err, sizeof(err));
+                    fprintf(stderr, "Warning: %s encoding unavailable (%s); skipping format\n", audio_formats[f].ext, err);
+                    ok = 0;
+                }
+            }
+            audio_formats[f].enabled = ok;
+            format_count += ok;
+        }
+        if (format_count == 0) {
+            fprintf(stderr, "Warning: no audio encoder available; generating filler files only\n");
+        }
+    }
+    int enabled[MAX_FORMATS];
+    int enabled_count = 0;
+    for (int f = 0; f < MAX_FORMATS; f++) {
+        if (audio_formats[f].enabled) enabled[enabled_count++] = f;
+    }
+
+    DirList dirs = {0};
+    if (build_tree(&dirs, out_dir, depth, fanout) != 0) return 1;
+
+    FileSpec *uniques = calloc((size_t)files, sizeof(FileSpec));
+    uint8_t *chunk = malloc(WRITE_CHUNK);
+    if (!uniques || !chunk) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    uint64_t rng = seed_for(seed, 0);
+    long unique_count = 0, dup_count = 0, link_count = 0, audio_count = 0;
+    uint64_t bytes = 0;
+    for (long i = 0; i < files; i++) {
+        uint32_t dir = (uint32_t)(rng_next(&rng) % dirs.count);
+        double roll = rng_unit(&rng);
+        char path[MAX_PATH_LENGTH];
+
+        if (unique_count > 0 && roll < dup_ratio + link_ratio) {
+            const FileSpec *src = &uniques[rng_next(&rng) % (uint64_t)unique_count];
+            snprintf(path, sizeof(path), "%s/f%08ld.%s", dirs.paths[dir], i, spec_ext(src));
+            if (roll < dup_ratio) {
+                if (write_spec(path, src, chunk, &bytes) != 0) return 1;
+                dup_count++;
+            } else {
+                char src_path[MAX_PATH_LENGTH];
+                snprintf(src_path, sizeof(src_path), "%s/f%08u.%s", dirs.paths[src->dir], src->file_no, spec_ext(src));
+                unlink(path);
+                if (link(src_path, path) != 0) {
+                    fprintf(stderr, "Error: link %s -> %s failed: %s\n", path, src_path, strerror(errno));
+                    return 1;
+                }
+                link_count++;
+            }
+            continue;
+        }
+
+        FileSpec *spec = &uniques[unique_count++];
+        spec->seed = seed_for(seed, (uint64_t)i + 1);
+        spec->dir = dir;
+        spec->file_no = (uint32_t)i;
+        if (enabled_count > 0 && rng_unit(&rng) < audio_ratio) {
+            spec->kind = KIND_AUDIO;
+            spec->format = (uint8_t)enabled[rng_next(&rng) % (uint64_t)enabled_count];
+            spec->variant = (uint16_t)(rng_next(&rng) % (uint64_t)variants);
+            audio_count++;
+        } else {
+            double size = size_median * exp(size_sigma * rng_normal(&rng));
+            spec->kind = KIND_FILLER;
+            spec->size = (uint64_t)(size > size_max ? size_max : size);
+        }
+        snprintf(path, sizeof(path), "%s/f%08ld.%s", dirs.paths[dir], i, spec_ext(spec));
+        if (write_spec(path, spec, chunk, &bytes) != 0) return 1;
+    }
+
+    printf("{\"files\":%ld,\"unique\":%ld,\"duplicates\":%ld,\"hardlinks\":%ld,\"audio\":%ld,\"filler\":%ld,"
+           "\"dirs\":%zu,\"bytes\":%llu,\"seed\":%llu,\"formats\":\"",
+           files, unique_count, dup_count, link_count, audio_count, unique_count - audio_count,
+           dirs.count, (unsigned long long)bytes, (unsigned long long)seed);
+    for (int f = 0; f < enabled_count; f++) {
+        printf("%s%s", f ? "," : "", audio_formats[enabled[f]].ext);
+    }
+    printf("\"}\n");
+
+    for (size_t d = 0; d < dirs.count; d++) free(dirs.paths[d]);
+    free(dirs.paths);
+    for (int f = 0; f < MAX_FORMATS; f++) {
+        if (!audio_formats[f].variants) continue;
+        for (int v = 0; v < variants; v++) free(audio_formats[f].variants[v].data);
+        free(audio_formats[f].variants);
+    }
+    free(uniques);
+    free(chunk);
+    return 0;
+}
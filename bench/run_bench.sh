@@ -0,0 +1,126 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# End-to-end throughput suite. Generates (or reuses) a synthetic corpus and
+# times each fhash command against it with a warm and a cold page cache.
+# Results go to one JSON document; run `make bench` from the repo root.
+#
+# Environment:
+#   BENCH_FILES     corpus size in files (default 10000)
+#   BENCH_GEN_ARGS  extra gen_corpus arguments, e.g. "-depth 4 -dup 0.3"
+#   BENCH_WORK      corpus/DB directory (default ${TMPDIR:-/tmp}/fhash-bench)
+#   BENCH_CACHE     cache modes to run (default "warm cold")
+#   BENCH_EXT       extensions passed to -e (default mp3,flac,wav,bin)
+#   BENCH_OUT       results file (default $BENCH_WORK/results-<version>-<timestamp>.json)
+
+ROOT="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+FHASH="${ROOT}/fhash"
+GEN="${ROOT}/bench/gen_corpus"
+BENCH_FILES="${BENCH_FILES:-10000}"
+BENCH_GEN_ARGS="${BENCH_GEN_ARGS:-}"
+BENCH_WORK="${BENCH_WORK:-${TMPDIR:-/tmp}/fhash-bench}"
+BENCH_CACHE="${BENCH_CACHE:-warm cold}"
+BENCH_EXT="${BENCH_EXT:-mp3,flac,wav,bin}"
+VERSION="$(sed -n 's/^const char \*FHASH_VERSION = "\(.*\)";/\1/p' "${ROOT}/src/version.c")"
+GIT_REV="$(git -C "${ROOT}" rev-parse --short HEAD 2>/dev/null || echo unknown)"
+BENCH_OUT="${BENCH_OUT:-${BENCH_WORK}/results-${VERSION}-$(date +%Y%m%d-%H%M%S).json}"
+
+CORPUS="${BENCH_WORK}/corpus"
+MANIFEST="${BENCH_WORK}/corpus.json"
+GEN_KEY="-n ${BENCH_FILES} ${BENCH_GEN_ARGS}"
+DB_H="${BENCH_WORK}/bench_h.db"
+DB_A="${BENCH_WORK}/bench_a.db"
+DB_O="${BENCH_WORK}/bench_order.db"
+ERR="${BENCH_WORK}/stderr.txt"
+
+for bin in "${FHASH}" "${GEN}"; do
+    if [ ! -x "${bin}" ]; then
+        echo "[ERROR] ${bin} not built; run make bench" >&2
+        exit 1
+    fi
+done
+mkdir -p "${BENCH_WORK}"
+
+# Regenerate only when the corpus parameters change; generation dominates
+# wall time at large file counts.
+if [ ! -s "${MANIFEST}" ] || [ "$(cat "${BENCH_WORK}/corpus.args" 2>/dev/null)" != "${GEN_KEY}" ]; then
+    echo "[INFO] Generating corpus (${GEN_KEY}) in ${CORPUS}..."
+    rm -rf "${CORPUS}"
+    # shellcheck disable=SC2086
+    "${GEN}" -o "${CORPUS}" -n "${BENCH_FILES}" ${BENCH_GEN_ARGS} > "${MANIFEST}"
+    echo "${GEN_KEY}" > "${BENCH_WORK}/corpus.args"
+fi
+
+drop_caches() {
+    sync
+    echo 3 2>/dev/null > /proc/sys/vm/drop_caches
+}
+
+warm_caches() {
+    find "${CORPUS}" -type f -print0 | xargs -0 cat > /dev/null
+}
+
+now_ns() {
+    date +%s%N
+}
+
+RUNS=()
+
+# run_case <step> <cache> <fhash args...>
+run_case() {
+    local step="$1" cache="$2"; shift 2
+    if [ "${cache}" = "cold" ]; then
+        drop_caches
+    fi
+    local start end rc stats
+    start="$(now_ns)"
+    set +e
+    "${FHASH}" "$@" -stats > /dev/null 2> "${ERR}"
+    rc=$?
+    set -e
+    end="$(now_ns)"
+    stats="$(grep '^{"command"' "${ERR}" | tail -n 1 || true)"
+    [ -n "${stats}" ] || stats="null"
+    local seconds
+    seconds="$(awk -v s="${start}" -v e="${end}" 'BEGIN { printf "%.3f", (e - s) / 1e9 }')"
+    printf "  %-14s %-5s %8ss  exit %d\n" "${step}" "${cache}" "${seconds}" "${rc}"
+    RUNS+=("{\"step\":\"${step}\",\"cache\":\"${cache}\",\"seconds\":${seconds},\"exit\":${rc},\"stats\":${stats}}")
+}
+
+for cache in ${BENCH_CACHE}; do
+    if [ "${cache}" = "cold" ] && ! drop_caches; then
+        echo "[WARN] cannot drop the page cache (needs root); skipping cold runs" >&2
+        RUNS+=("{\"cache\":\"cold\",\"skipped\":\"cannot write /proc/sys/vm/drop_caches\"}")
+        continue
+    fi
+    if [ "${cache}" = "warm" ]; then
+        warm_caches
+    fi
+    echo "[INFO] ${cache} cache:"
+    rm -f "${DB_H}" "${DB_A}" "${DB_O}"
+    run_case scan_h "${cache}" scan -r -h -s "${CORPUS}" -e "${BENCH_EXT}" -d "${DB_H}"
+    # Same full hash pass in physical order; compare against scan_h on a
+    # cold cache to see the seek savings on rotational disks.
+    for order in inode extent; do
+        rm -f "${DB_O}"
+        run_case "scan_h_${order}" "${cache}" scan -r -h -order "${order}" -s "${CORPUS}" -e "${BENCH_EXT}" -d "${DB_O}"
+    done
+    run_case scan_a "${cache}" scan -r -a -s "${CORPUS}" -e "${BENCH_EXT}" -d "${DB_A}"
+    run_case check "${cache}" check -r -s "${CORPUS}" -e "${BENCH_EXT}" -d "${DB_A}"
+    run_case rescan_noop "${cache}" scan -r -h -s "${CORPUS}" -e "${BENCH_EXT}" -d "${DB_H}"
+    run_case dupe "${cache}" dupe -xh -r -s "${CORPUS}" -e "${BENCH_EXT}" -d "${DB_H}"
+    run_case link_dry "${cache}" link -xh -ls -dry -r -s "${CORPUS}" -e "${BENCH_EXT}" -d "${DB_H}"
+done
+
+{
+    printf '{"fhash_version":"%s","git":"%s","date":"%s",' "${VERSION}" "${GIT_REV}" "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+    printf '"host":{"nproc":%s,"kernel":"%s"},' "$(nproc)" "$(uname -r)"
+    printf '"corpus":%s,"runs":[' "$(cat "${MANIFEST}")"
+    sep=""
+    for run in "${RUNS[@]}"; do
+        printf '%s%s' "${sep}" "${run}"
+        sep=","
+    done
+    printf ']}\n'
+} > "${BENCH_OUT}"
+echo "[INFO] Results written to ${BENCH_OUT}"
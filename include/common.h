@@ -22,6 +22,6 @@
 #define BATCH_SIZE 1500
 #define STACK_SIZE 32000
 
-#define USAGE_TEXT "Usage: fhash <scan|dupe|link|check> [options]. fhash -help for more information.\n"
+#define USAGE_TEXT "Usage: fhash <scan|dupe|link|check|watch|serve|query|lookup|compare|merge> [options]. fhash -help for more information.\n"
 
 #endif
@@ -0,0 +1,23 @@
+#ifndef COMPARE_H
+#define COMPARE_H
+
+#include "common.h"
+
+// `fhash compare` diffs two indexes (say an archive and its backup) without
+// touching either tree. Each index is read in filepath order and paths are
+// matched relative to a root, one per DB, so the two trees may be mounted
+// at different places. Paths found on one side only are then matched on
+// md5 to tell moved content from missing and extra files.
+typedef struct {
+    const char *db_a;
+    const char *db_b;
+    const char *root_a;     // -s; NULL: the common directory of A's paths
+    const char *root_b;     // -s2; likewise for B
+    int verbose;
+} CompareOptions;
+
+// Returns 0 when the indexes match, 1 when they differ and 2 on error,
+// like diff.
+int compare_indexes(const CompareOptions *opts);
+
+#endif
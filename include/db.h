@@ -2,10 +2,69 @@
 #define DB_H
 
 #include <sqlite3.h>
+#include <stdint.h>
+
+extern const char *FILES_UPSERT_SQL;
 
 int begin_transaction(sqlite3 *db);
 int commit_transaction(sqlite3 *db);
 int rollback_transaction(sqlite3 *db);
 int ensure_schema_and_version(sqlite3 *db);
 
+// Persistent record of one scan/check over a root. A run that stops early
+// (budget, signal, crash) keeps its pending directory frontier so the next
+// invocation with the same command, root and options picks up from there.
+typedef struct {
+    int64_t files_seen;
+    int64_t files_hashed;
+    int64_t bytes_hashed;
+    int64_t errors;
+} ScanRunCounters;
+
+typedef struct {
+    sqlite3 *db;
+    int64_t id;
+    int resumed;
+    ScanRunCounters base;       // totals from earlier sessions
+    sqlite3_stmt *frontier_insert;
+    int frontier_seq;
+    int complete;               // last saved as done
+    int64_t errors;             // errors across sessions, as last saved
+} ScanRun;
+
+typedef int (*ScanRunFrontierFn)(void *arg, const char *path, int64_t dev, int files_only);
+
+int scan_run_begin(ScanRun *run, sqlite3 *db, const char *command, const char *root, const char *params, int restart);
+int scan_run_load_frontier(ScanRun *run, ScanRunFrontierFn visit, void *arg);
+int scan_run_frontier_reset(ScanRun *run);
+int scan_run_frontier_add(ScanRun *run, const char *path, int64_t dev, int files_only);
+int scan_run_update(ScanRun *run, const char *status, const ScanRunCounters *session);
+void scan_run_end(ScanRun *run);
+int prune_unseen_files(sqlite3 *db, const char *root, int recursive, char **ext_list, int ext_count, int64_t scan_gen, int dry_run);
+
+// Per-directory state for fast rescans (-fast), keyed by scope (command and
+// options). A directory whose mtime/ctime match its stored row, and whose
+// last full listing is recent enough, is not listed again; its known
+// subdirectories are queued straight from the table instead.
+typedef struct {
+    sqlite3 *db;
+    const char *scope;
+    int64_t verify_before;      // rows verified before this epoch are re-listed
+    sqlite3_stmt *lookup_stmt;
+    sqlite3_stmt *children_stmt;
+    sqlite3_stmt *store_stmt;
+    sqlite3_stmt *add_child_stmt;
+    sqlite3_stmt *remove_stmt;
+} DirIndex;
+
+typedef int (*DirIndexChildFn)(void *arg, const char *path, int64_t dev);
+
+int dir_index_open(DirIndex *index, sqlite3 *db, const char *scope, int64_t verify_before);
+int dir_index_unchanged(DirIndex *index, const char *path, int64_t mtime_ns, int64_t ctime_ns);
+int dir_index_children(DirIndex *index, const char *path, DirIndexChildFn visit, void *arg);
+int dir_index_add_child(DirIndex *index, const char *path, const char *parent, int64_t dev);
+int dir_index_store(DirIndex *index, const char *path, const char *parent, int64_t dev, int64_t mtime_ns, int64_t ctime_ns);
+int dir_index_remove(DirIndex *index, const char *path);
+void dir_index_close(DirIndex *index);
+
 #endif
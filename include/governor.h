@@ -0,0 +1,53 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include "common.h"
+
+// Resource governor for scans on shared hosts. Read bytes/s and files/s are
+// capped with token buckets shared by every thread; when the smoothed
+// latency of individual reads climbs past a threshold, readers add a growing
+// pause until it recovers. Hashing reads (plain and through FFmpeg) and the
+// directory walk all charge it. Off by default; each hook is then a single
+// branch.
+typedef struct {
+    uint64_t max_bytes_per_sec;  // 0 = unlimited
+    double max_files_per_sec;    // 0 = unlimited
+    double max_latency_ms;       // back off above this read latency; 0 = off
+    int idle;                    // idle I/O class and lowest CPU priority
+    int drop_cache;              // keep hashed files out of the page cache
+} GovernorOptions;
+
+extern int governor_enabled;
+extern int governor_drop_cache;
+
+int governor_start(const GovernorOptions *opts);
+void governor_charge_read(uint64_t bytes, uint64_t latency_ns);
+void governor_charge_file(void);
+int governor_file_open(int fd);
+void governor_file_done(int fd);
+uint64_t governor_now_ns(void);
+int parse_byte_rate(const char *text, uint64_t *out);
+
+static inline uint64_t governor_read_begin(void) {
+    return governor_enabled ? governor_now_ns() : 0;
+}
+
+static inline void governor_read_end(uint64_t start_ns, uint64_t bytes) {
+    if (start_ns) governor_charge_read(bytes, governor_now_ns() - start_ns);
+}
+
+static inline void governor_file(void) {
+    if (governor_enabled) governor_charge_file();
+}
+
+// Bracket a file's reads. governor_open returns non-zero when the pages may
+// be dropped afterwards (nobody else had them cached).
+static inline int governor_open(int fd) {
+    return governor_drop_cache ? governor_file_open(fd) : 0;
+}
+
+static inline void governor_close(int fd, int drop) {
+    if (drop) governor_file_done(fd);
+}
+
+#endif
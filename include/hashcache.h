@@ -0,0 +1,28 @@
+#ifndef HASHCACHE_H
+#define HASHCACHE_H
+
+#include "common.h"
+
+// -xattr keeps each file's digests in user.fhash.* extended attributes, so
+// they outlive the DB and travel with `rsync -X` or `cp -a` copies. A scan
+// that finds no current row trusts the attributes instead of reading the
+// file, as long as user.fhash.stamp still matches the file's size and mtime.
+#define HASHCACHE_ALG "md5"
+
+typedef struct {
+    int valid;          // the stamp matched the file
+    char md5[MD5_DIGEST_LENGTH * 2 + 1];        // "" when not cached
+    char audio_md5[MD5_DIGEST_LENGTH * 2 + 1];  // "" when not cached
+    int check_result;   // -1 when not cached
+    int check_level;
+} HashCache;
+
+// Fills cache from the file's attributes. Only a matching stamp and digest
+// algorithm set valid; otherwise the cache is left empty.
+void hashcache_read(const char *path, const struct stat *st, HashCache *cache);
+// Stores the cached values and stamps them with st, unless the file has
+// changed since st was taken. Values cached under an older stamp are
+// dropped first. Returns 0 on success, -1 with errno set.
+int hashcache_write(const char *path, const struct stat *st, const HashCache *cache);
+
+#endif
@@ -3,7 +3,8 @@
 
 #include "common.h"
 
-extern char current_processing_file[MAX_PATH_LENGTH];
+extern __thread char current_processing_file[MAX_PATH_LENGTH];
+extern __thread int current_file_log_errors;
 
 typedef enum {
     AUDIO_CHECK_GOOD = 0,
@@ -13,9 +14,18 @@ typedef enum {
     AUDIO_CHECK_NOT_CHECKED = 4
 } AudioCheckResult;
 
+typedef enum {
+    AUDIO_CHECK_LEVEL_NONE = 0,
+    AUDIO_CHECK_LEVEL_QUICK = 1,
+    AUDIO_CHECK_LEVEL_FULL = 2
+} AudioCheckLevel;
+
 int calculate_md5(const char *file_path, unsigned char *md5_hash);
 int calculate_audio_md5(const char *file_path, unsigned char *md5_hash);
 int validate_audio_stream(const char *file_path, int *result_out);
+int validate_audio_stream_quick(const char *file_path, int *result_out);
+void release_hash_context_pool(void);
 const char *audio_check_result_to_string(int result);
+const char *audio_check_level_to_string(int level);
 
 #endif
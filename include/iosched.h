@@ -0,0 +1,38 @@
+#ifndef IOSCHED_H
+#define IOSCHED_H
+
+#include "common.h"
+
+// Per-device work queues. Jobs are grouped by st_dev; each device gets its
+// own worker threads, one for rotational disks by default so a spindle only
+// ever sees one sequential reader, several for SSD/NVMe. Completed jobs are
+// handed back to the submitting thread, which owns the database.
+typedef struct IoJob {
+    dev_t dev;
+    struct IoJob *next;
+} IoJob;
+
+typedef void (*IoWorkFn)(IoJob *job);
+
+typedef struct {
+    int ssd_workers;         // workers per non-rotational (or unknown) device
+    int hdd_workers;         // workers per rotational device
+    int verbose;
+    void (*worker_exit)(void);  // per-thread cleanup run by each worker
+} IoSchedOptions;
+
+int iosched_start(IoWorkFn work, const IoSchedOptions *opts);
+int iosched_submit(IoJob *job);
+IoJob *iosched_next_done(int wait);
+int iosched_pending(dev_t dev);
+int iosched_device_limit(dev_t dev);
+int iosched_in_flight(void);
+void iosched_stop(void);
+int device_is_rotational(dev_t dev);
+
+// Physical byte offset of a file's first extent via FIEMAP. Returns 0 on
+// success (offset 0 for files with no mapped extents), -1 when the
+// filesystem cannot report it.
+int file_first_extent(const char *path, uint64_t *physical_out);
+
+#endif
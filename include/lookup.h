@@ -0,0 +1,29 @@
+#ifndef LOOKUP_H
+#define LOOKUP_H
+
+#include "common.h"
+#include "iosched.h"
+#include <sqlite3.h>
+
+// `fhash lookup` hashes files that are not in the index and reports which
+// ones the index already holds, without writing to `files`. Every md5 and
+// audio_md5 in the DB goes into a Bloom filter kept next to the DB as
+// <db>.bloom, so most files that are not in the index never reach SQLite.
+// The sidecar is stamped with the size and mtime of the DB and its WAL, and
+// rebuilt once either has changed.
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES 7
+
+typedef struct {
+    const char *db_path;
+    char **paths;       // from the command line; none means stdin
+    int path_count;
+    int nul_input;      // -0: stdin paths are NUL-terminated
+    int hash_audio;     // -a: also match audio_md5
+    IoSchedOptions sched;
+    int verbose;
+} LookupOptions;
+
+int lookup_files(sqlite3 *db, const LookupOptions *opts);
+
+#endif
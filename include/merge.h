@@ -0,0 +1,29 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include "common.h"
+#include <sqlite3.h>
+
+// `fhash merge` imports the files tables of other fhash DBs (one per host or
+// volume) into this one, so dupe and link can work across all of them. Each
+// imported row keeps its source name and its id in the source DB. The
+// merge_sources table remembers the row_version each source had at its last
+// merge, so merging it again only copies rows changed since then and drops
+// the rows deleted there.
+typedef struct {
+    const char *from;   // path prefix in the source DB
+    const char *to;     // what it becomes here
+} MergeMap;
+
+typedef struct {
+    const char *db_path;
+    const char *name;   // -source; default: the resolved db_path
+    MergeMap *maps;     // -map, tried in order; first match wins
+    int map_count;
+} MergeSource;
+
+// Loads that add at least as many rows as the table already holds drop the
+// secondary indexes first and rebuild them once at the end.
+int merge_indexes(sqlite3 *db, MergeSource *sources, int source_count, int verbose);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include "common.h"
+
+// Machine-readable records for -o. A record is a kind plus named fields:
+// jsonl writes one JSON object per line; tsv writes the kind and the field
+// values tab-separated, with tab, newline, CR and backslash escaped; nul
+// writes the same columns as tsv, raw, each followed by a NUL. Every kind
+// has a fixed column list, so nul needs no record separator.
+enum { OUTPUT_TEXT = 0, OUTPUT_JSONL, OUTPUT_TSV, OUTPUT_NUL };
+
+// Records collect in one process-wide buffer that is written out with
+// write(2) once it holds this much, and at exit.
+#define OUTPUT_FLUSH_BYTES (1024 * 1024)
+
+// A private record buffer for threads that must not touch the shared one;
+// output_emit hands its records over from the main thread. output_printf
+// appends plain text, for buffering text-mode lines the same way.
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t record_start;
+    int failed;         // an append of the current record was dropped
+} OutputBuf;
+
+extern int output_format;
+
+int parse_output_format(const char *text, int *format_out);
+int output_open(int format, const char *path);
+// buf NULL means the process-wide buffer (main thread only).
+void output_record_begin(OutputBuf *buf, const char *kind);
+void output_str(OutputBuf *buf, const char *key, const char *value);
+void output_int(OutputBuf *buf, const char *key, int64_t value);
+void output_record_end(OutputBuf *buf);
+void output_printf(OutputBuf *buf, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void output_emit(OutputBuf *buf);
+void output_flush(void);
+void output_buf_free(OutputBuf *buf);
+void output_close(void);
+// Non-zero once a record was dropped for lack of memory or a write failed;
+// main then exits non-zero.
+int output_failed(void);
+
+#endif
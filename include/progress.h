@@ -0,0 +1,27 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include "common.h"
+
+typedef struct {
+    int status_line;            // refresh a status line on stderr
+    const char *snapshot_path;  // append JSON snapshots to this file/FIFO
+    int precount;               // estimate totals in the background for ETA
+    const char *root;
+    int recurse_dirs;
+    char **ext_list;
+    int ext_count;
+} ProgressOptions;
+
+extern int progress_enabled;
+
+int progress_start(const ProgressOptions *opts);
+void progress_stop(void);
+void progress_set_directory(const char *path);
+void progress_set_walk_complete(void);
+
+static inline void progress_note_directory(const char *path) {
+    if (progress_enabled) progress_set_directory(path);
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "common.h"
+#include <signal.h>
+
+// `fhash serve` keeps the files table in memory, hashed by path, md5 and
+// audio_md5, and answers lookups over a Unix stream socket. The DB is polled
+// with PRAGMA data_version; once another connection has committed, a
+// second index is built on a loader thread and swapped in, while the
+// current one keeps answering.
+//
+// Every message is a frame: a 4-byte big-endian payload length, then the
+// payload. A request payload is an op byte followed by its argument (not
+// NUL-terminated). A response payload starts with a status byte: 'O' and
+// zero or more rows, each five NUL-terminated fields (path, md5, audio_md5,
+// size, mtime); or 'E' and an error message. One connection may carry any
+// number of requests.
+enum {
+    SERVE_OP_HASH = 'H',   // rows whose md5 equals the argument
+    SERVE_OP_AUDIO = 'A',  // rows whose audio_md5 equals the argument
+    SERVE_OP_PATH = 'P',   // the row for this exact path
+    SERVE_OP_GROUP = 'G'   // every row sharing the md5 of this path
+};
+
+#define SERVE_MAX_REQUEST 65536
+#define SERVE_MAX_CLIENTS 64
+// Minimum gap between data_version polls, and so between rebuild starts.
+#define SERVE_RELOAD_MS 1000
+
+int serve_run(const char *db_path, const char *sock_path, int verbose, volatile sig_atomic_t *stop);
+// Returns 0 when rows matched, 1 when none did and 2 on error, like grep.
+int serve_query(const char *sock_path, int op, const char *arg);
+
+#endif
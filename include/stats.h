@@ -0,0 +1,63 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "common.h"
+#include <stdatomic.h>
+
+typedef enum {
+    PHASE_READDIR = 0,
+    PHASE_LSTAT,
+    PHASE_FIEMAP,
+    PHASE_LOOKUP,
+    PHASE_FILE_MD5,
+    PHASE_AUDIO_PROBE,
+    PHASE_AUDIO_MD5,
+    PHASE_AUDIO_QUICK,
+    PHASE_AUDIO_DECODE,
+    PHASE_UPSERT,
+    PHASE_COMMIT,
+    PHASE_COUNT
+} StatsPhase;
+
+typedef enum {
+    COUNTER_DIRS = 0,
+    COUNTER_DIRS_SKIPPED,
+    COUNTER_FILES_SEEN,
+    COUNTER_BYTES_SEEN,
+    COUNTER_FILES_SKIPPED,
+    COUNTER_FILES_HASHED,
+    COUNTER_BYTES_HASHED,
+    COUNTER_CHECKS_REUSED,
+    COUNTER_XATTR_HITS,
+    COUNTER_ERRORS,
+    COUNTER_COUNT
+} StatsCounter;
+
+// Instrumentation is always compiled in; when stats are off each probe is a
+// single predictable branch and no clock is read. Counters can be collected
+// on their own (for progress reporting) without phase timing.
+extern int stats_enabled;
+extern int stats_counting;
+
+uint64_t stats_now_ns(void);
+const char *stats_phase_name(StatsPhase phase);
+void stats_record(StatsPhase phase, uint64_t start_ns, uint64_t bytes);
+void stats_add(StatsCounter counter, uint64_t n);
+void stats_enable(void);
+void stats_enable_counters(void);
+uint64_t stats_counter_value(StatsCounter counter);
+void stats_print_json(FILE *out, const char *command);
+
+static inline uint64_t stats_begin(void) {
+    return stats_enabled ? stats_now_ns() : 0;
+}
+
+static inline void stats_end(StatsPhase phase, uint64_t start_ns, uint64_t bytes) {
+    if (start_ns) stats_record(phase, start_ns, bytes);
+}
+
+static inline void stats_count(StatsCounter counter, uint64_t n) {
+    if (stats_counting) stats_add(counter, n);
+}
+
+#endif
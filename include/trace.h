@@ -0,0 +1,31 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "stats.h"
+
+// Span kinds beyond the stats phases: whole-file and whole-directory spans
+// carry the path, the phase spans nested inside them do not.
+typedef enum {
+    TRACE_FILE = PHASE_COUNT,
+    TRACE_DIR,
+    TRACE_KIND_COUNT
+} TraceKind;
+
+// Tracing piggybacks on the stats probes: trace_open turns on phase timing
+// and every timed phase also lands in the calling thread's buffer. Spans
+// shorter than the -tracemin threshold are dropped at record time.
+extern int trace_enabled;
+
+int trace_open(const char *path, uint64_t min_us, const char *command);
+void trace_span(int kind, uint64_t start_ns, uint64_t end_ns, uint64_t bytes, const char *detail);
+void trace_close(void);
+
+static inline uint64_t trace_begin(void) {
+    return trace_enabled ? stats_now_ns() : 0;
+}
+
+static inline void trace_end(int kind, uint64_t start_ns, const char *detail) {
+    if (start_ns) trace_span(kind, start_ns, stats_now_ns(), 0, detail);
+}
+
+#endif
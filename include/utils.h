@@ -2,6 +2,7 @@
 #define UTILS_H
 
 #include "common.h"
+#include "iosched.h"
 #include <sqlite3.h>
 
 typedef struct {
@@ -15,13 +16,21 @@ typedef struct {
 } DirStack;
 
 void help();
+int is_md5_hex(const char *value);
+size_t json_escape(char *out, size_t out_len, const char *in);
+int parse_duration(const char *text, long *seconds_out);
 DirStack* create_dir_stack(int capacity);
-void push_dir(DirStack *stack, const char *path);
+int push_dir(DirStack *stack, const char *path);
 char* pop_dir(DirStack *stack);
 void destroy_dir_stack(DirStack *stack);
 
 void init_logging_callback(int verbose);
-void process_duplicates(sqlite3 *db, int type, int min_count, int link_mode, int dry_run, const char *path_filter, int recurse_filter, char **ext_list, int ext_count);
+// Longest per-file FFmpeg message summary, as printed and as stored in
+// audio_check_log.
+#define LOG_SINK_SUMMARY_LEN 1024
+int log_sink_finish_file(char *summary_out, size_t summary_len);
+void process_duplicates(sqlite3 *db, int type, int min_count, int link_mode, int dry_run, const char *path_filter, int recurse_filter, char **ext_list, int ext_count, const IoSchedOptions *sched);
+void report_top_dupes(sqlite3 *db, int type, int min_count, int top_k, const char *path_filter, int recurse_filter, char **ext_list, int ext_count);
 int path_matches_filter(const char *filepath, const char *base, int recurse_dirs);
 int ext_matches_filter(const char *extension, char **ext_list, int ext_count);
 
@@ -33,5 +42,9 @@ int ext_matches_filter(const char *extension, char **ext_list, int ext_count);
 #define LINK_METADATA 3
 #define LINK_OLDEST 4
 #define LINK_NEWEST 5
+// Or'ed into a keeper mode: share extents with FIDEDUPERANGE instead of
+// hard-linking.
+#define LINK_REFLINK 0x100
+#define LINK_KEEPER_MASK 0xff
 
 #endif
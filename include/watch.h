@@ -0,0 +1,38 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "common.h"
+
+// Filesystem change notification for `fhash watch`. fanotify with
+// FAN_MARK_FILESYSTEM is used when permitted (it needs CAP_SYS_ADMIN and
+// reports changes anywhere on the root's filesystem with one mark);
+// otherwise one inotify watch per directory. Events are reduced to
+// directories to re-read: a changed file dirties its directory, a new or
+// moved-in directory dirties its whole subtree, and a queue overflow
+// dirties the root.
+enum { WATCH_FANOTIFY = 1, WATCH_INOTIFY };
+
+// A burst is handed over once no event arrived for WATCH_SETTLE_MS, or
+// WATCH_MAX_DELAY_MS after its first event under a steady trickle.
+#define WATCH_SETTLE_MS 2000
+#define WATCH_MAX_DELAY_MS 30000
+
+typedef struct {
+    char *path;
+    int subtree;  // re-read recursively
+} WatchChange;
+
+// Decides whether a changed file name is worth a re-read (extension filter).
+typedef int (*WatchAcceptFn)(void *arg, const char *name);
+
+typedef struct Watcher Watcher;
+
+Watcher *watch_open(const char *root, int recursive, int force_inotify, WatchAcceptFn accept, void *accept_arg);
+int watch_backend(const Watcher *watcher);
+int watch_poll(Watcher *watcher, int timeout_ms);
+int watch_ready(const Watcher *watcher);
+size_t watch_take(Watcher *watcher, WatchChange **changes_out);
+void watch_free_changes(WatchChange *changes, size_t count);
+void watch_close(Watcher *watcher);
+
+#endif
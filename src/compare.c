@@ -0,0 +1,304 @@
+#include "compare.h"
+#include "output.h"
+#include "utils.h"
+#include <sqlite3.h>
+
+typedef struct {
+    char *path;         // relative to the side's root
+    const char *moved_to;
+    int64_t size;
+    char md5[MD5_DIGEST_LENGTH * 2 + 1];
+} CompareEntry;
+
+typedef struct {
+    CompareEntry *entries;
+    size_t count;
+    size_t cap;
+} CompareList;
+
+typedef struct {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    char root[PATH_MAX + 1];
+    size_t root_len;
+    long long rows;
+    int has_row;
+} CompareSide;
+
+typedef struct {
+    long long same;
+    long long changed;
+    long long moved;
+    long long missing;
+    long long extra;
+    long long unverified;
+} CompareTally;
+
+static void report(const char *status, const char *path, const char *moved_to, const char *md5, int64_t size) {
+    if (output_format == OUTPUT_TEXT) {
+        printf(moved_to ? "[%s] %s -> %s\n" : "[%s] %s\n", status, path, moved_to);
+        return;
+    }
+    output_record_begin(NULL, "compare");
+    output_str(NULL, "status", status);
+    output_str(NULL, "path", path);
+    output_str(NULL, "to", moved_to);
+    output_str(NULL, "md5", md5);
+    output_int(NULL, "size", size);
+    output_record_end(NULL);
+}
+
+static int list_add(CompareList *list, const char *path, const char *md5, int64_t size) {
+    if (list->count == list->cap) {
+        size_t new_cap = list->cap ? list->cap * 2 : 256;
+        CompareEntry *grown = realloc(list->entries, new_cap * sizeof(CompareEntry));
+        if (!grown) return -1;
+        list->entries = grown;
+        list->cap = new_cap;
+    }
+    CompareEntry *entry = &list->entries[list->count];
+    memset(entry, 0, sizeof(*entry));
+    if (!(entry->path = strdup(path))) return -1;
+    snprintf(entry->md5, sizeof(entry->md5), "%s", md5);
+    entry->size = size;
+    list->count++;
+    return 0;
+}
+
+static void list_free(CompareList *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->entries[i].path);
+    free(list->entries);
+}
+
+// Without -s, the root is the directory shared by every path. MIN and MAX
+// come straight off the filepath index, and any prefix common to those two
+// is common to all rows between them.
+static int find_root(CompareSide *side, const char *given) {
+    if (given) {
+        snprintf(side->root, sizeof(side->root), "%s", given);
+        side->root_len = strlen(side->root);
+        if (side->root_len == 0 || side->root[side->root_len - 1] != '/') {
+            if (side->root_len + 1 >= sizeof(side->root)) return -1;
+            side->root[side->root_len++] = '/';
+            side->root[side->root_len] = '\0';
+        }
+        return 0;
+    }
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(side->db, "SELECT MIN(filepath), MAX(filepath) FROM files;", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL: Error reading index: %s\n", sqlite3_errmsg(side->db));
+        return -1;
+    }
+    side->root[0] = '\0';
+    side->root_len = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0)) {
+        const char *lo = (const char *)sqlite3_column_text(stmt, 0);
+        const char *hi = (const char *)sqlite3_column_text(stmt, 1);
+        size_t common = 0;
+        while (lo[common] && lo[common] == hi[common]) common++;
+        // A single row's own name is not part of its root.
+        if (lo[common] == '\0' && hi[common] == '\0') common = strlen(lo);
+        while (common > 0 && lo[common - 1] != '/') common--;
+        if (common >= sizeof(side->root)) common = 0;
+        memcpy(side->root, lo, common);
+        side->root[common] = '\0';
+        side->root_len = common;
+    }
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+static int open_side(CompareSide *side, const char *db_path, const char *given_root) {
+    memset(side, 0, sizeof(*side));
+    if (sqlite3_open_v2(db_path, &side->db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Can't open database %s: %s\n", db_path, sqlite3_errmsg(side->db));
+        return -1;
+    }
+    sqlite3_busy_timeout(side->db, 5000);
+    if (find_root(side, given_root) != 0) return -1;
+
+    // The range keeps the walk on the filepath index; '0' sorts right
+    // after '/', so [root, root-without-slash + '0') is the subtree.
+    const char *sql = side->root_len
+        ? "SELECT filepath, md5, filesize FROM files WHERE filepath >= ?1 AND filepath < ?2 ORDER BY filepath;"
+        : "SELECT filepath, md5, filesize FROM files ORDER BY filepath;";
+    if (sqlite3_prepare_v2(side->db, sql, -1, &side->stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL: Error preparing comparison of %s: %s\n", db_path, sqlite3_errmsg(side->db));
+        return -1;
+    }
+    if (side->root_len) {
+        char upper[PATH_MAX + 1];
+        memcpy(upper, side->root, side->root_len);
+        upper[side->root_len - 1] = '0';
+        upper[side->root_len] = '\0';
+        sqlite3_bind_text(side->stmt, 1, side->root, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(side->stmt, 2, upper, -1, SQLITE_TRANSIENT);
+    }
+    return 0;
+}
+
+static int advance(CompareSide *side) {
+    int rc = sqlite3_step(side->stmt);
+    side->has_row = (rc == SQLITE_ROW);
+    if (side->has_row) side->rows++;
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL: Error reading index: %s\n", sqlite3_errmsg(side->db));
+        return -1;
+    }
+    return 0;
+}
+
+static const char *column_str(sqlite3_stmt *stmt, int col) {
+    const char *text = (const char *)sqlite3_column_text(stmt, col);
+    return text ? text : "";
+}
+
+static void close_side(CompareSide *side) {
+    sqlite3_finalize(side->stmt);
+    sqlite3_close(side->db);
+}
+
+static int compare_entry_md5(const void *a, const void *b) {
+    const CompareEntry *ea = *(const CompareEntry *const *)a;
+    const CompareEntry *eb = *(const CompareEntry *const *)b;
+    int cmp = strcmp(ea->md5, eb->md5);
+    return cmp ? cmp : strcmp(ea->path, eb->path);
+}
+
+static CompareEntry **hashed_entries(CompareList *list, size_t *count_out) {
+    CompareEntry **sorted = malloc((list->count + 1) * sizeof(CompareEntry *));
+    size_t count = 0;
+    if (!sorted) return NULL;
+    for (size_t i = 0; i < list->count; i++) {
+        if (is_md5_hex(list->entries[i].md5)) sorted[count++] = &list->entries[i];
+    }
+    qsort(sorted, count, sizeof(CompareEntry *), compare_entry_md5);
+    *count_out = count;
+    return sorted;
+}
+
+// Merge-joins the one-sided paths on md5. Within a hash, paths pair up in
+// order; whatever is left over stays missing or extra.
+static int match_moves(CompareList *missing, CompareList *extra, CompareTally *tally) {
+    size_t na, nb;
+    CompareEntry **a = hashed_entries(missing, &na);
+    CompareEntry **b = hashed_entries(extra, &nb);
+    if (!a || !b) {
+        free(a);
+        free(b);
+        return -1;
+    }
+    size_t i = 0, j = 0;
+    while (i < na && j < nb) {
+        int cmp = strcmp(a[i]->md5, b[j]->md5);
+        if (cmp < 0) {
+            i++;
+        } else if (cmp > 0) {
+            j++;
+        } else {
+            a[i]->moved_to = b[j]->path;
+            b[j]->moved_to = a[i]->path;
+            report("moved", a[i]->path, b[j]->path, a[i]->md5, a[i]->size);
+            tally->moved++;
+            i++;
+            j++;
+        }
+    }
+    free(a);
+    free(b);
+    return 0;
+}
+
+int compare_indexes(const CompareOptions *opts) {
+    CompareSide a, b;
+    CompareList missing = {0}, extra = {0};
+    CompareTally tally = {0};
+    int ret = 2;
+
+    if (open_side(&a, opts->db_a, opts->root_a) != 0) {
+        close_side(&a);
+        return 2;
+    }
+    if (open_side(&b, opts->db_b, opts->root_b) != 0) {
+        close_side(&a);
+        close_side(&b);
+        return 2;
+    }
+    if (opts->verbose) {
+        printf("Comparing %s (root %s) with %s (root %s)\n", opts->db_a, a.root_len ? a.root : "(none)",
+               opts->db_b, b.root_len ? b.root : "(none)");
+    }
+
+    if (advance(&a) != 0 || advance(&b) != 0) goto done;
+    while (a.has_row || b.has_row) {
+        const char *rel_a = a.has_row ? column_str(a.stmt, 0) + a.root_len : NULL;
+        const char *rel_b = b.has_row ? column_str(b.stmt, 0) + b.root_len : NULL;
+        int cmp = !a.has_row ? 1 : !b.has_row ? -1 : strcmp(rel_a, rel_b);
+        if (cmp < 0) {
+            if (list_add(&missing, rel_a, column_str(a.stmt, 1), sqlite3_column_int64(a.stmt, 2)) != 0) goto oom;
+            if (advance(&a) != 0) goto done;
+            continue;
+        }
+        if (cmp > 0) {
+            if (list_add(&extra, rel_b, column_str(b.stmt, 1), sqlite3_column_int64(b.stmt, 2)) != 0) goto oom;
+            if (advance(&b) != 0) goto done;
+            continue;
+        }
+        const char *md5_a = column_str(a.stmt, 1);
+        const char *md5_b = column_str(b.stmt, 1);
+        int64_t size_a = sqlite3_column_int64(a.stmt, 2);
+        int64_t size_b = sqlite3_column_int64(b.stmt, 2);
+        if (size_a != size_b || (is_md5_hex(md5_a) && is_md5_hex(md5_b) && strcmp(md5_a, md5_b) != 0)) {
+            report("changed", rel_a, NULL, md5_b, size_b);
+            tally.changed++;
+        } else if (strcmp(md5_a, md5_b) == 0 && strcmp(md5_a, "Not calculated") != 0) {
+            tally.same++;
+        } else {
+            // Same size, but at least one side was never hashed.
+            report("unverified", rel_a, NULL, md5_a, size_a);
+            tally.unverified++;
+        }
+        if (advance(&a) != 0 || advance(&b) != 0) goto done;
+    }
+
+    if (match_moves(&missing, &extra, &tally) != 0) goto oom;
+    for (size_t i = 0; i < missing.count; i++) {
+        CompareEntry *entry = &missing.entries[i];
+        if (entry->moved_to) continue;
+        report("missing", entry->path, NULL, entry->md5, entry->size);
+        tally.missing++;
+    }
+    for (size_t i = 0; i < extra.count; i++) {
+        CompareEntry *entry = &extra.entries[i];
+        if (entry->moved_to) continue;
+        report("extra", entry->path, NULL, entry->md5, entry->size);
+        tally.extra++;
+    }
+
+    if (output_format == OUTPUT_TEXT) {
+        printf("Compared %lld files with %lld: %lld same, %lld changed, %lld moved, %lld missing, %lld extra, %lld unverified\n",
+               a.rows, b.rows, tally.same, tally.changed, tally.moved, tally.missing, tally.extra, tally.unverified);
+    } else {
+        output_record_begin(NULL, "compare_total");
+        output_int(NULL, "files_a", a.rows);
+        output_int(NULL, "files_b", b.rows);
+        output_int(NULL, "same", tally.same);
+        output_int(NULL, "changed", tally.changed);
+        output_int(NULL, "moved", tally.moved);
+        output_int(NULL, "missing", tally.missing);
+        output_int(NULL, "extra", tally.extra);
+        output_int(NULL, "unverified", tally.unverified);
+        output_record_end(NULL);
+    }
+    ret = (tally.changed || tally.moved || tally.missing || tally.extra) ? 1 : 0;
+    goto done;
+
+oom:
+    fprintf(stderr, "Memory: Error allocating comparison entries\n");
+done:
+    list_free(&missing);
+    list_free(&extra);
+    close_side(&a);
+    close_side(&b);
+    return ret;
+}
@@ -2,14 +2,37 @@
 #include "fhash.h"
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
-static int ensure_filetype_column(sqlite3 *db) {
+// Shared by scan/check and the microbenchmarks. Parameters 1-12 are the row
+// values; 13-16 select which of md5, audio_md5, the check result/level and
+// the check log an existing row takes from the new values; 17 is the
+// writing run's scan_gen.
+const char *FILES_UPSERT_SQL =
+    "INSERT INTO files (md5, audio_md5, filepath, filename, extension, filesize, last_check_timestamp, modified_timestamp, filetype, audio_check_result, audio_check_level, audio_check_log, scan_gen) "
+    "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?17) "
+    "ON CONFLICT(filepath) DO UPDATE SET "
+    "md5 = CASE WHEN ?13 THEN excluded.md5 ELSE files.md5 END, "
+    "audio_md5 = CASE WHEN ?14 THEN excluded.audio_md5 ELSE files.audio_md5 END, "
+    "audio_check_result = CASE WHEN ?15 THEN excluded.audio_check_result ELSE files.audio_check_result END, "
+    "audio_check_level = CASE WHEN ?15 THEN excluded.audio_check_level ELSE files.audio_check_level END, "
+    "audio_check_log = CASE WHEN ?16 THEN excluded.audio_check_log ELSE files.audio_check_log END, "
+    "filename = excluded.filename, "
+    "extension = excluded.extension, "
+    "filesize = excluded.filesize, "
+    "last_check_timestamp = excluded.last_check_timestamp, "
+    "modified_timestamp = excluded.modified_timestamp, "
+    "filetype = excluded.filetype, "
+    "scan_gen = excluded.scan_gen;";
+
+static int ensure_column(sqlite3 *db, const char *column, const char *definition, int *added_out) {
     int has_column = 0;
-    sqlite3_stmt *stmt;
+    sqlite3_stmt *stmt = NULL;
+    if (added_out) *added_out = 0;
     if (sqlite3_prepare_v2(db, "PRAGMA table_info(files);", -1, &stmt, NULL) == SQLITE_OK) {
         while (sqlite3_step(stmt) == SQLITE_ROW) {
             const unsigned char *col_name = sqlite3_column_text(stmt, 1);
-            if (col_name && strcmp((const char *)col_name, "filetype") == 0) {
+            if (col_name && strcmp((const char *)col_name, column) == 0) {
                 has_column = 1;
                 break;
             }
@@ -17,54 +40,92 @@ static int ensure_filetype_column(sqlite3 *db) {
     }
     sqlite3_finalize(stmt);
     if (!has_column) {
-        if (sqlite3_exec(db, "ALTER TABLE files ADD COLUMN filetype TEXT DEFAULT 'F';", NULL, NULL, NULL) != SQLITE_OK) {
-            fprintf(stderr, "SQL error adding filetype column: %s\n", sqlite3_errmsg(db));
+        char *alter_sql = sqlite3_mprintf("ALTER TABLE files ADD COLUMN %s %s;", column, definition);
+        if (!alter_sql) {
+            fprintf(stderr, "Memory: Error allocating ALTER statement for %s\n", column);
+            return 1;
+        }
+        int rc = sqlite3_exec(db, alter_sql, NULL, NULL, NULL);
+        sqlite3_free(alter_sql);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "SQL error adding %s column: %s\n", column, sqlite3_errmsg(db));
             return 1;
         }
+        if (added_out) *added_out = 1;
     }
     return 0;
 }
 
+static int ensure_filetype_column(sqlite3 *db) {
+    return ensure_column(db, "filetype", "TEXT DEFAULT 'F'", NULL);
+}
+
 static int ensure_modified_column(sqlite3 *db) {
-    int has_column = 0;
-    sqlite3_stmt *stmt = NULL;
-    if (sqlite3_prepare_v2(db, "PRAGMA table_info(files);", -1, &stmt, NULL) == SQLITE_OK) {
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const unsigned char *col_name = sqlite3_column_text(stmt, 1);
-            if (col_name && strcmp((const char *)col_name, "modified_timestamp") == 0) {
-                has_column = 1;
-                break;
-            }
-        }
+    return ensure_column(db, "modified_timestamp", "INTEGER DEFAULT 0", NULL);
+}
+
+static int ensure_audio_check_result_column(sqlite3 *db) {
+    return ensure_column(db, "audio_check_result", "INTEGER DEFAULT 4", NULL);
+}
+
+static int ensure_audio_check_log_column(sqlite3 *db) {
+    return ensure_column(db, "audio_check_log", "TEXT", NULL);
+}
+
+static int ensure_scan_gen_column(sqlite3 *db) {
+    return ensure_column(db, "scan_gen", "INTEGER DEFAULT 0", NULL);
+}
+
+// Rows imported by `merge` remember their source and their id there.
+// row_version is stamped from the sys.row_version counter whenever a row is
+// inserted or its content changes, so a later merge of this DB only copies
+// rows newer than the version it last saw. Scans that find nothing new do
+// not touch it.
+static int ensure_row_version_tracking(sqlite3 *db) {
+    if (ensure_column(db, "source", "TEXT", NULL) != 0 ||
+        ensure_column(db, "source_id", "INTEGER", NULL) != 0 ||
+        ensure_column(db, "row_version", "INTEGER DEFAULT 0", NULL) != 0) {
+        return 1;
+    }
+    sqlite3_stmt *stmt;
+    int has_triggers = 0;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'trigger' AND name = 'files_row_version_update';", -1, &stmt, NULL) == SQLITE_OK) {
+        has_triggers = (sqlite3_step(stmt) == SQLITE_ROW);
     }
     sqlite3_finalize(stmt);
-    if (!has_column) {
-        if (sqlite3_exec(db, "ALTER TABLE files ADD COLUMN modified_timestamp INTEGER DEFAULT 0;", NULL, NULL, NULL) != SQLITE_OK) {
-            fprintf(stderr, "SQL error adding modified_timestamp column: %s\n", sqlite3_errmsg(db));
-            return 1;
-        }
+    if (has_triggers) return 0;
+
+    const char *tracking_sql =
+        "INSERT OR IGNORE INTO sys (key, value) VALUES ('row_version', '0');"
+        "CREATE TRIGGER IF NOT EXISTS files_row_version_insert AFTER INSERT ON files BEGIN "
+        "UPDATE sys SET value = CAST(value AS INTEGER) + 1 WHERE key = 'row_version'; "
+        "UPDATE files SET row_version = (SELECT CAST(value AS INTEGER) FROM sys WHERE key = 'row_version') WHERE id = NEW.id; "
+        "END;"
+        "CREATE TRIGGER IF NOT EXISTS files_row_version_update AFTER UPDATE ON files "
+        "WHEN OLD.md5 IS NOT NEW.md5 OR OLD.audio_md5 IS NOT NEW.audio_md5 OR OLD.filepath IS NOT NEW.filepath "
+        "OR OLD.filesize IS NOT NEW.filesize OR OLD.modified_timestamp IS NOT NEW.modified_timestamp "
+        "OR OLD.filetype IS NOT NEW.filetype OR OLD.audio_check_result IS NOT NEW.audio_check_result "
+        "OR OLD.audio_check_level IS NOT NEW.audio_check_level BEGIN "
+        "UPDATE sys SET value = CAST(value AS INTEGER) + 1 WHERE key = 'row_version'; "
+        "UPDATE files SET row_version = (SELECT CAST(value AS INTEGER) FROM sys WHERE key = 'row_version') WHERE id = NEW.id; "
+        "END;";
+    if (sqlite3_exec(db, tracking_sql, NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error creating row_version triggers: %s\n", sqlite3_errmsg(db));
+        return 1;
     }
     return 0;
 }
 
-static int ensure_audio_check_result_column(sqlite3 *db) {
-    int has_column = 0;
-    sqlite3_stmt *stmt = NULL;
-    if (sqlite3_prepare_v2(db, "PRAGMA table_info(files);", -1, &stmt, NULL) == SQLITE_OK) {
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const unsigned char *col_name = sqlite3_column_text(stmt, 1);
-            if (col_name && strcmp((const char *)col_name, "audio_check_result") == 0) {
-                has_column = 1;
-                break;
-            }
-        }
+// Rows validated before check tiers existed were all fully decoded, so they
+// are backfilled as level 2 (full) when the column is first added.
+static int ensure_audio_check_level_column(sqlite3 *db) {
+    int added = 0;
+    if (ensure_column(db, "audio_check_level", "INTEGER DEFAULT 0", &added) != 0) {
+        return 1;
     }
-    sqlite3_finalize(stmt);
-    if (!has_column) {
-        if (sqlite3_exec(db, "ALTER TABLE files ADD COLUMN audio_check_result INTEGER DEFAULT 4;", NULL, NULL, NULL) != SQLITE_OK) {
-            fprintf(stderr, "SQL error adding audio_check_result column: %s\n", sqlite3_errmsg(db));
-            return 1;
-        }
+    if (added && sqlite3_exec(db, "UPDATE files SET audio_check_level = 2 WHERE audio_check_result != 4;", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error backfilling audio_check_level: %s\n", sqlite3_errmsg(db));
+        return 1;
     }
     return 0;
 }
@@ -192,6 +253,12 @@ int ensure_schema_and_version(sqlite3 *db) {
         "modified_timestamp INTEGER DEFAULT 0, "
         "filetype TEXT DEFAULT 'F', "
         "audio_check_result INTEGER DEFAULT 4, "
+        "audio_check_level INTEGER DEFAULT 0, "
+        "audio_check_log TEXT, "
+        "scan_gen INTEGER DEFAULT 0, "
+        "source TEXT, "
+        "source_id INTEGER, "
+        "row_version INTEGER DEFAULT 0, "
         "UNIQUE(filepath)"
         ");";
     if (sqlite3_exec(db, create_files_sql, NULL, NULL, NULL) != SQLITE_OK) {
@@ -208,6 +275,18 @@ int ensure_schema_and_version(sqlite3 *db) {
     if (ensure_audio_check_result_column(db) != 0) {
         return 1;
     }
+    if (ensure_audio_check_level_column(db) != 0) {
+        return 1;
+    }
+    if (ensure_audio_check_log_column(db) != 0) {
+        return 1;
+    }
+    if (ensure_scan_gen_column(db) != 0) {
+        return 1;
+    }
+    if (ensure_row_version_tracking(db) != 0) {
+        return 1;
+    }
 
     if (sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS idx_files_md5 ON files(md5);", NULL, NULL, NULL) != SQLITE_OK) {
         fprintf(stderr, "SQL error creating idx_files_md5: %s\n", sqlite3_errmsg(db));
@@ -225,6 +304,83 @@ int ensure_schema_and_version(sqlite3 *db) {
         fprintf(stderr, "SQL error creating idx_files_audio_check_result: %s\n", sqlite3_errmsg(db));
         return 1;
     }
+    if (sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS idx_files_row_version ON files(row_version);", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error creating idx_files_row_version: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    if (sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS idx_files_source ON files(source, source_id);", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error creating idx_files_source: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    const char *create_scan_runs_sql =
+        "CREATE TABLE IF NOT EXISTS scan_runs ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "command TEXT, "
+        "root TEXT, "
+        "params TEXT, "
+        "status TEXT, "
+        "started_at INTEGER, "
+        "updated_at INTEGER, "
+        "sessions INTEGER DEFAULT 0, "
+        "files_seen INTEGER DEFAULT 0, "
+        "files_hashed INTEGER DEFAULT 0, "
+        "bytes_hashed INTEGER DEFAULT 0, "
+        "errors INTEGER DEFAULT 0"
+        ");";
+    if (sqlite3_exec(db, create_scan_runs_sql, NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error ensuring scan_runs table: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    const char *create_scan_frontier_sql =
+        "CREATE TABLE IF NOT EXISTS scan_frontier ("
+        "run_id INTEGER, "
+        "seq INTEGER, "
+        "path TEXT, "
+        "dev INTEGER, "
+        "files_only INTEGER DEFAULT 0"
+        ");";
+    if (sqlite3_exec(db, create_scan_frontier_sql, NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error ensuring scan_frontier table: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    if (sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS idx_scan_frontier_run ON scan_frontier(run_id, seq);", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error creating idx_scan_frontier_run: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    const char *create_dirs_sql =
+        "CREATE TABLE IF NOT EXISTS dirs ("
+        "scope TEXT, "
+        "path TEXT, "
+        "parent TEXT, "
+        "dev INTEGER, "
+        "mtime_ns INTEGER DEFAULT 0, "
+        "ctime_ns INTEGER DEFAULT 0, "
+        "verified_at INTEGER DEFAULT 0, "
+        "PRIMARY KEY(scope, path)"
+        ");";
+    if (sqlite3_exec(db, create_dirs_sql, NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error ensuring dirs table: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    if (sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS idx_dirs_parent ON dirs(scope, parent);", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error creating idx_dirs_parent: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    const char *create_merge_sources_sql =
+        "CREATE TABLE IF NOT EXISTS merge_sources ("
+        "source TEXT PRIMARY KEY, "
+        "db_path TEXT, "
+        "maps TEXT, "
+        "row_version INTEGER DEFAULT 0, "
+        "merged_at INTEGER DEFAULT 0"
+        ");";
+    if (sqlite3_exec(db, create_merge_sources_sql, NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error ensuring merge_sources table: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
 
     return 0;
 }
@@ -252,3 +408,392 @@ int rollback_transaction(sqlite3 *db) {
     }
     return 0;
 }
+
+// Finished and abandoned runs kept in scan_runs; older ones are pruned each
+// time a new run starts. Unfinished runs are never pruned.
+#define SCAN_RUNS_KEEP 50
+
+static int prune_scan_runs(sqlite3 *db) {
+    const char *prune_sql =
+        "DELETE FROM scan_frontier WHERE run_id IN (SELECT id FROM scan_runs WHERE status IN ('done', 'abandoned') ORDER BY id DESC LIMIT -1 OFFSET ?1);"
+        "DELETE FROM scan_runs WHERE id IN (SELECT id FROM scan_runs WHERE status IN ('done', 'abandoned') ORDER BY id DESC LIMIT -1 OFFSET ?1);";
+    const char *tail = prune_sql;
+    while (tail && *tail) {
+        sqlite3_stmt *stmt = NULL;
+        if (sqlite3_prepare_v2(db, tail, -1, &stmt, &tail) != SQLITE_OK) {
+            fprintf(stderr, "SQL error pruning scan runs: %s\n", sqlite3_errmsg(db));
+            return 1;
+        }
+        if (!stmt) break;
+        sqlite3_bind_int(stmt, 1, SCAN_RUNS_KEEP);
+        int rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "SQL error pruning scan runs: %s\n", sqlite3_errmsg(db));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Finds the newest unfinished run with the same command, root and options
+// and resumes it, saying so on stdout, or starts a new one. With restart,
+// unfinished matches are marked abandoned first. Runs inside the caller's
+// transaction, so a run that never reached its first commit leaves no trace.
+int scan_run_begin(ScanRun *run, sqlite3 *db, const char *command, const char *root, const char *params, int restart) {
+    memset(run, 0, sizeof(*run));
+    run->db = db;
+
+    sqlite3_stmt *stmt = NULL;
+    if (restart) {
+        const char *abandon_sql =
+            "DELETE FROM scan_frontier WHERE run_id IN (SELECT id FROM scan_runs WHERE command = ?1 AND root = ?2 AND params = ?3 AND status != 'done' AND status != 'abandoned');"
+            "UPDATE scan_runs SET status = 'abandoned' WHERE command = ?1 AND root = ?2 AND params = ?3 AND status != 'done' AND status != 'abandoned';";
+        const char *tail = abandon_sql;
+        while (tail && *tail) {
+            if (sqlite3_prepare_v2(db, tail, -1, &stmt, &tail) != SQLITE_OK) {
+                fprintf(stderr, "SQL error abandoning scan runs: %s\n", sqlite3_errmsg(db));
+                return 1;
+            }
+            if (!stmt) break;
+            sqlite3_bind_text(stmt, 1, command, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, root, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, params, -1, SQLITE_STATIC);
+            int rc = sqlite3_step(stmt);
+            sqlite3_finalize(stmt);
+            if (rc != SQLITE_DONE) {
+                fprintf(stderr, "SQL error abandoning scan runs: %s\n", sqlite3_errmsg(db));
+                return 1;
+            }
+        }
+    }
+
+    const char *find_sql =
+        "SELECT id, files_seen, files_hashed, bytes_hashed, errors, status, "
+        "(SELECT COUNT(*) FROM scan_frontier WHERE run_id = scan_runs.id) FROM scan_runs "
+        "WHERE command = ? AND root = ? AND params = ? AND status IN ('running', 'paused') "
+        "ORDER BY id DESC LIMIT 1;";
+    if (sqlite3_prepare_v2(db, find_sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error looking up scan runs: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    sqlite3_bind_text(stmt, 1, command, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, root, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, params, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        run->id = sqlite3_column_int64(stmt, 0);
+        run->base.files_seen = sqlite3_column_int64(stmt, 1);
+        run->base.files_hashed = sqlite3_column_int64(stmt, 2);
+        run->base.bytes_hashed = sqlite3_column_int64(stmt, 3);
+        run->base.errors = sqlite3_column_int64(stmt, 4);
+        run->resumed = 1;
+        // A run still marked running was killed before it could pause.
+        const unsigned char *status = sqlite3_column_text(stmt, 5);
+        printf("Resuming scan run %lld (%s): %lld directories pending; use -restart to start over.\n",
+               (long long)run->id, (status && strcmp((const char *)status, "paused") == 0) ? "paused" : "interrupted",
+               (long long)sqlite3_column_int64(stmt, 6));
+    }
+    sqlite3_finalize(stmt);
+
+    if (!run->resumed && prune_scan_runs(db) != 0) {
+        return 1;
+    }
+
+    int64_t now = (int64_t)time(NULL);
+    if (run->resumed) {
+        if (sqlite3_prepare_v2(db, "UPDATE scan_runs SET status = 'running', sessions = sessions + 1, updated_at = ? WHERE id = ?;", -1, &stmt, NULL) != SQLITE_OK) {
+            fprintf(stderr, "SQL error resuming scan run: %s\n", sqlite3_errmsg(db));
+            return 1;
+        }
+        sqlite3_bind_int64(stmt, 1, now);
+        sqlite3_bind_int64(stmt, 2, run->id);
+    } else {
+        if (sqlite3_prepare_v2(db, "INSERT INTO scan_runs (command, root, params, status, started_at, updated_at, sessions) VALUES (?, ?, ?, 'running', ?, ?, 1);", -1, &stmt, NULL) != SQLITE_OK) {
+            fprintf(stderr, "SQL error creating scan run: %s\n", sqlite3_errmsg(db));
+            return 1;
+        }
+        sqlite3_bind_text(stmt, 1, command, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, root, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, params, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 4, now);
+        sqlite3_bind_int64(stmt, 5, now);
+    }
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error recording scan run: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    if (!run->resumed) {
+        run->id = sqlite3_last_insert_rowid(db);
+    }
+
+    if (sqlite3_prepare_v2(db, "INSERT INTO scan_frontier (run_id, seq, path, dev, files_only) VALUES (?, ?, ?, ?, ?);", -1, &run->frontier_insert, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error preparing scan frontier insert: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    return 0;
+}
+
+// Calls visit for each saved frontier directory in the order it was saved.
+// Returns the number of directories, or -1 on error or when visit fails.
+int scan_run_load_frontier(ScanRun *run, ScanRunFrontierFn visit, void *arg) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(run->db, "SELECT path, dev, files_only FROM scan_frontier WHERE run_id = ? ORDER BY seq;", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error reading scan frontier: %s\n", sqlite3_errmsg(run->db));
+        return -1;
+    }
+    sqlite3_bind_int64(stmt, 1, run->id);
+    int count = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const unsigned char *path = sqlite3_column_text(stmt, 0);
+        if (!path) continue;
+        if (visit(arg, (const char *)path, sqlite3_column_int64(stmt, 1), sqlite3_column_int(stmt, 2)) != 0) {
+            count = -1;
+            break;
+        }
+        count++;
+    }
+    sqlite3_finalize(stmt);
+    return count;
+}
+
+int scan_run_frontier_reset(ScanRun *run) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(run->db, "DELETE FROM scan_frontier WHERE run_id = ?;", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error clearing scan frontier: %s\n", sqlite3_errmsg(run->db));
+        return 1;
+    }
+    sqlite3_bind_int64(stmt, 1, run->id);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    run->frontier_seq = 0;
+    return (rc == SQLITE_DONE) ? 0 : 1;
+}
+
+int scan_run_frontier_add(ScanRun *run, const char *path, int64_t dev, int files_only) {
+    sqlite3_stmt *stmt = run->frontier_insert;
+    sqlite3_bind_int64(stmt, 1, run->id);
+    sqlite3_bind_int(stmt, 2, run->frontier_seq++);
+    sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, dev);
+    sqlite3_bind_int(stmt, 5, files_only);
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error saving scan frontier: %s\n", sqlite3_errmsg(run->db));
+        return 1;
+    }
+    return 0;
+}
+
+// Stores base + this session's counters under the given status.
+int scan_run_update(ScanRun *run, const char *status, const ScanRunCounters *session) {
+    sqlite3_stmt *stmt = NULL;
+    const char *sql =
+        "UPDATE scan_runs SET status = ?, updated_at = ?, files_seen = ?, files_hashed = ?, bytes_hashed = ?, errors = ? WHERE id = ?;";
+    if (sqlite3_prepare_v2(run->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error updating scan run: %s\n", sqlite3_errmsg(run->db));
+        return 1;
+    }
+    sqlite3_bind_text(stmt, 1, status, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, (int64_t)time(NULL));
+    sqlite3_bind_int64(stmt, 3, run->base.files_seen + session->files_seen);
+    sqlite3_bind_int64(stmt, 4, run->base.files_hashed + session->files_hashed);
+    sqlite3_bind_int64(stmt, 5, run->base.bytes_hashed + session->bytes_hashed);
+    sqlite3_bind_int64(stmt, 6, run->base.errors + session->errors);
+    sqlite3_bind_int64(stmt, 7, run->id);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error updating scan run: %s\n", sqlite3_errmsg(run->db));
+        return 1;
+    }
+    run->complete = (strcmp(status, "done") == 0);
+    run->errors = run->base.errors + session->errors;
+    return 0;
+}
+
+// Sweep after a complete -prune walk: every row under root the walk would
+// have visited but did not stamp with scan_gen belongs to a file that is
+// gone. One range delete over the filepath index; with dry_run the rows are
+// only listed. Returns the number of rows, or -1 on error.
+int prune_unseen_files(sqlite3 *db, const char *root, int recursive, char **ext_list, int ext_count, int64_t scan_gen, int dry_run) {
+    int root_is_slash = (strcmp(root, "/") == 0);
+    char *lower = sqlite3_mprintf("%s/", root_is_slash ? "" : root);
+    char *upper = sqlite3_mprintf("%s0", root_is_slash ? "" : root);
+    char *where = sqlite3_mprintf("filepath >= ?1 AND filepath < ?2 AND scan_gen IS NOT ?3%s",
+                                  recursive ? "" : " AND instr(substr(filepath, length(?1) + 1), '/') = 0");
+    for (int i = 0; where && i < ext_count; i++) {
+        char *next = sqlite3_mprintf("%s%s%Q", where, (i == 0) ? " AND extension IN (" : ", ", ext_list[i]);
+        sqlite3_free(where);
+        where = next;
+    }
+    if (where && ext_count > 0) {
+        char *next = sqlite3_mprintf("%s)", where);
+        sqlite3_free(where);
+        where = next;
+    }
+    char *sql = where ? sqlite3_mprintf(dry_run ? "SELECT filepath FROM files WHERE %s ORDER BY filepath;" : "DELETE FROM files WHERE %s;", where) : NULL;
+    int count = -1;
+    sqlite3_stmt *stmt = NULL;
+    if (!lower || !upper || !sql) {
+        fprintf(stderr, "Memory: Error building prune statement\n");
+    } else if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error preparing prune: %s\n", sqlite3_errmsg(db));
+    } else {
+        sqlite3_bind_text(stmt, 1, lower, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, upper, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, scan_gen);
+        int rc;
+        count = 0;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            printf("Would prune: %s\n", (const char *)sqlite3_column_text(stmt, 0));
+            count++;
+        }
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "SQL error pruning vanished files: %s\n", sqlite3_errmsg(db));
+            count = -1;
+        } else if (!dry_run) {
+            count = sqlite3_changes(db);
+        }
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_free(sql);
+    sqlite3_free(where);
+    sqlite3_free(lower);
+    sqlite3_free(upper);
+    return count;
+}
+
+void scan_run_end(ScanRun *run) {
+    sqlite3_finalize(run->frontier_insert);
+    run->frontier_insert = NULL;
+}
+
+int dir_index_open(DirIndex *index, sqlite3 *db, const char *scope, int64_t verify_before) {
+    memset(index, 0, sizeof(*index));
+    index->db = db;
+    index->scope = scope;
+    index->verify_before = verify_before;
+    struct {
+        sqlite3_stmt **stmt;
+        const char *sql;
+    } statements[] = {
+        { &index->lookup_stmt, "SELECT mtime_ns, ctime_ns, verified_at FROM dirs WHERE scope = ? AND path = ?;" },
+        { &index->children_stmt, "SELECT path, dev FROM dirs WHERE scope = ? AND parent = ? ORDER BY path DESC;" },
+        { &index->store_stmt,
+          "INSERT INTO dirs (scope, path, parent, dev, mtime_ns, ctime_ns, verified_at) VALUES (?, ?, ?, ?, ?, ?, ?) "
+          "ON CONFLICT(scope, path) DO UPDATE SET parent = excluded.parent, dev = excluded.dev, mtime_ns = excluded.mtime_ns, "
+          "ctime_ns = excluded.ctime_ns, verified_at = excluded.verified_at;" },
+        { &index->add_child_stmt, "INSERT OR IGNORE INTO dirs (scope, path, parent, dev) VALUES (?, ?, ?, ?);" },
+        { &index->remove_stmt, "DELETE FROM dirs WHERE scope = ?1 AND (path = ?2 OR substr(path, 1, length(?2) + 1) = ?2 || '/');" }
+    };
+    for (size_t i = 0; i < sizeof(statements) / sizeof(statements[0]); i++) {
+        if (sqlite3_prepare_v2(db, statements[i].sql, -1, statements[i].stmt, NULL) != SQLITE_OK) {
+            fprintf(stderr, "SQL error preparing directory index statement: %s\n", sqlite3_errmsg(db));
+            dir_index_close(index);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Returns 1 when the stored row matches and was verified recently enough,
+// 0 when the directory must be listed, -1 on error.
+int dir_index_unchanged(DirIndex *index, const char *path, int64_t mtime_ns, int64_t ctime_ns) {
+    sqlite3_stmt *stmt = index->lookup_stmt;
+    sqlite3_bind_text(stmt, 1, index->scope, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+    int result = 0;
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        int64_t stored_mtime = sqlite3_column_int64(stmt, 0);
+        int64_t stored_ctime = sqlite3_column_int64(stmt, 1);
+        int64_t verified_at = sqlite3_column_int64(stmt, 2);
+        result = (stored_mtime != 0 && stored_mtime == mtime_ns && stored_ctime == ctime_ns &&
+                  verified_at >= index->verify_before);
+    } else if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error looking up directory %s: %s\n", path, sqlite3_errmsg(index->db));
+        result = -1;
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return result;
+}
+
+// Returns 0 once every child is visited, 1 on an SQL error and -1 when visit
+// fails.
+int dir_index_children(DirIndex *index, const char *path, DirIndexChildFn visit, void *arg) {
+    sqlite3_stmt *stmt = index->children_stmt;
+    sqlite3_bind_text(stmt, 1, index->scope, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const unsigned char *child = sqlite3_column_text(stmt, 0);
+        if (child && visit(arg, (const char *)child, sqlite3_column_int64(stmt, 1)) != 0) {
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+            return -1;
+        }
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error listing subdirectories of %s: %s\n", path, sqlite3_errmsg(index->db));
+        return 1;
+    }
+    return 0;
+}
+
+static int dir_index_step(DirIndex *index, sqlite3_stmt *stmt, const char *path) {
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error updating directory index for %s: %s\n", path, sqlite3_errmsg(index->db));
+        return 1;
+    }
+    return 0;
+}
+
+// Registers a subdirectory seen while listing its parent. New rows carry no
+// mtime, so the child is listed until its own walk completes and stores one.
+int dir_index_add_child(DirIndex *index, const char *path, const char *parent, int64_t dev) {
+    sqlite3_stmt *stmt = index->add_child_stmt;
+    sqlite3_bind_text(stmt, 1, index->scope, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, parent, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, dev);
+    return dir_index_step(index, stmt, path);
+}
+
+int dir_index_store(DirIndex *index, const char *path, const char *parent, int64_t dev, int64_t mtime_ns, int64_t ctime_ns) {
+    sqlite3_stmt *stmt = index->store_stmt;
+    sqlite3_bind_text(stmt, 1, index->scope, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, parent, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, dev);
+    sqlite3_bind_int64(stmt, 5, mtime_ns);
+    sqlite3_bind_int64(stmt, 6, ctime_ns);
+    sqlite3_bind_int64(stmt, 7, (int64_t)time(NULL));
+    return dir_index_step(index, stmt, path);
+}
+
+// Drops a vanished directory and everything recorded below it.
+int dir_index_remove(DirIndex *index, const char *path) {
+    sqlite3_stmt *stmt = index->remove_stmt;
+    sqlite3_bind_text(stmt, 1, index->scope, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+    return dir_index_step(index, stmt, path);
+}
+
+void dir_index_close(DirIndex *index) {
+    sqlite3_finalize(index->lookup_stmt);
+    sqlite3_finalize(index->children_stmt);
+    sqlite3_finalize(index->store_stmt);
+    sqlite3_finalize(index->add_child_stmt);
+    sqlite3_finalize(index->remove_stmt);
+    memset(index, 0, sizeof(*index));
+}
@@ -3,12 +3,24 @@
 #include "hashing.h"
 #include "db.h"
 #include "fhash.h"
+#include "stats.h"
+#include "progress.h"
+#include "trace.h"
+#include "iosched.h"
+#include "governor.h"
+#include "watch.h"
+#include "output.h"
+#include "serve.h"
+#include "lookup.h"
+#include "hashcache.h"
+#include "compare.h"
+#include "merge.h"
 #include <sqlite3.h>
 #include <libavutil/log.h>
 #include <ctype.h>
+#include <signal.h>
+#include <errno.h>
 
-const char *FHASH_VERSION = "1.01";
-const char *DB_VERSION = "1.01";
 
 static int ext_cmp(const void *a, const void *b) {
     const char *ea = *(const char *const *)a;
@@ -169,12 +181,13 @@ static int hash_value_reusable(const char *value) {
            strcmp(value, "N/A") != 0;
 }
 
-static int try_reuse_check_result_by_hash(sqlite3_stmt *stmt, const char *hash_value, int *result_out) {
+static int try_reuse_check_result_by_hash(sqlite3_stmt *stmt, const char *hash_value, int check_level, int *result_out) {
     if (!stmt || !hash_value_reusable(hash_value)) {
         return 0;
     }
 
     sqlite3_bind_text(stmt, 1, hash_value, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 2, check_level);
     int rc = sqlite3_step(stmt);
     int found = 0;
     if (rc == SQLITE_ROW) {
@@ -186,16 +199,119 @@ static int try_reuse_check_result_by_hash(sqlite3_stmt *stmt, const char *hash_v
     return found;
 }
 
-int process_file(const char *file_path, sqlite3 *db, sqlite3_stmt *upsert_stmt, sqlite3_stmt *lookup_stmt, sqlite3_stmt *reuse_md5_stmt, sqlite3_stmt *reuse_audio_md5_stmt, InodeCheckCache *inode_cache, int *file_count, int verbose, int hash_file, int hash_audio, int run_audio_check, int force_rescan, char filetype, const struct stat *st, const char *filename, const char *extension) {
+enum { ORDER_NONE = 0, ORDER_INODE, ORDER_EXTENT };
+
+// Pending directories, one stack per device. With device scheduling the
+// walker picks the device with the shortest queue next, so every disk under
+// the root gets work even though a single thread does the walking.
+typedef struct {
+    dev_t dev;
+    DirStack *stack;
+    int mark;  // stack size before the current directory's walk
+} DeviceDirs;
+
+typedef struct {
+    DeviceDirs *items;
+    size_t count;
+} DirQueues;
+
+// A directory taken off the queues whose files are not all written back
+// yet. It stays in the saved frontier until it is fully walked and its last
+// file is done; walked ones resume without re-queueing their subdirectories.
+typedef struct OpenDir {
+    char *path;
+    dev_t dev;
+    int walked;
+    int files_only;  // resumed without re-queueing subdirectories
+    int pending;
+    int errors;
+    int64_t mtime_ns;  // as stat'ed before listing, for -fast
+    int64_t ctime_ns;
+    struct OpenDir *prev;
+    struct OpenDir *next;
+} OpenDir;
+
+enum { STOP_NONE = 0, STOP_BUDGET, STOP_SIGNAL };
+
+// Everything process_directory needs to handle one file. The DB handles,
+// inode cache and counters belong to the walking thread; workers only read
+// the flags.
+typedef struct {
+    sqlite3 *db;
+    sqlite3_stmt *upsert_stmt;
+    sqlite3_stmt *lookup_stmt;
+    sqlite3_stmt *reuse_md5_stmt;
+    sqlite3_stmt *reuse_audio_md5_stmt;
+    InodeCheckCache inode_cache;
+    int *file_count;
+    int *batch_count;
+    int verbose;
+    int hash_file;
+    int hash_audio;
+    int audio_check_level;
+    int store_check_log;
+    int use_xattr;          // -xattr
+    int force_rescan;
+    int scheduled;
+    int order;
+    int extent_warned;
+    ScanRun *run;
+    DirQueues *queues;
+    OpenDir *open_dirs;
+    uint64_t deadline_ns;
+    char **files_only;      // resumed directories whose subdirectories are already queued
+    size_t files_only_count;
+    DirIndex *dir_index;    // -fast
+    int64_t scan_gen;       // stamped on every row written
+    sqlite3_stmt *stamp_stmt;  // -prune: also stamps rows found current
+} ScanContext;
+
+// One file's work, split so that hashing can run on a device worker while
+// the lookup, check-result reuse and upsert stay on the thread that owns the
+// DB connection.
+typedef struct {
+    IoJob io;  // must stay first: workers get the IoJob pointer back
+    const ScanContext *ctx;
+    char *file_path;
+    char filename[NAME_MAX + 1];
+    char extension[64];
+    char filetype;
+    struct stat st;
+    int check_reused;
+    const char *check_source;
+    int rc;
+    char md5_string[MD5_DIGEST_LENGTH * 2 + 1];
+    char audio_md5_string[MD5_DIGEST_LENGTH * 2 + 1];
+    int audio_check_result;
+    int xattr_hit;  // every value came from the xattr cache; nothing was read
+    char log_summary[LOG_SINK_SUMMARY_LEN];
+    uint64_t order_key;
+    OpenDir *dir;
+} FileJob;
+
+static void free_file_job(FileJob *job) {
+    free(job->file_path);
+    free(job);
+}
+
+// Looks the file up and resolves any reusable check result. Returns 0 when
+// the DB row is current (nothing to do), 1 when the job needs hashing, -1 on
+// error.
+static int prepare_file_job(ScanContext *ctx, FileJob *job) {
+    const char *file_path = job->file_path;
+    const struct stat *st = &job->st;
     int64_t filesize = (int64_t)st->st_size;
     int64_t modified_timestamp = (int64_t)st->st_mtime;
-    time_t current_time = time(NULL);
     char db_md5_value[MD5_DIGEST_LENGTH * 2 + 32] = {0};
     char db_audio_md5_value[MD5_DIGEST_LENGTH * 2 + 32] = {0};
+    int run_audio_check = (ctx->audio_check_level != AUDIO_CHECK_LEVEL_NONE);
+    sqlite3_stmt *lookup_stmt = ctx->lookup_stmt;
 
-    if (!force_rescan) {
+    if (!ctx->force_rescan) {
+        uint64_t lookup_start = stats_begin();
         sqlite3_bind_text(lookup_stmt, 1, file_path, -1, SQLITE_TRANSIENT);
         int lookup_rc = sqlite3_step(lookup_stmt);
+        stats_end(PHASE_LOOKUP, lookup_start, 0);
         if (lookup_rc == SQLITE_ROW) {
             int64_t db_size = sqlite3_column_int64(lookup_stmt, 0);
             int64_t db_mtime = sqlite3_column_int64(lookup_stmt, 1);
@@ -203,145 +319,244 @@ int process_file(const char *file_path, sqlite3 *db, sqlite3_stmt *upsert_stmt,
             const unsigned char *db_md5 = sqlite3_column_text(lookup_stmt, 3);
             const unsigned char *db_audio_md5 = sqlite3_column_text(lookup_stmt, 4);
             int db_audio_check = sqlite3_column_int(lookup_stmt, 5);
+            int db_audio_check_level = sqlite3_column_int(lookup_stmt, 6);
             if (db_md5) snprintf(db_md5_value, sizeof(db_md5_value), "%s", (const char *)db_md5);
             if (db_audio_md5) snprintf(db_audio_md5_value, sizeof(db_audio_md5_value), "%s", (const char *)db_audio_md5);
-            int file_hash_ready = !hash_file || (db_md5 && strcmp((const char *)db_md5, "Not calculated") != 0);
-            int audio_hash_ready = !hash_audio || (db_audio_md5 && strcmp((const char *)db_audio_md5, "Not calculated") != 0);
-            int audio_check_ready = !run_audio_check || (db_audio_check != AUDIO_CHECK_NOT_CHECKED);
+            int file_hash_ready = !ctx->hash_file || (db_md5 && strcmp((const char *)db_md5, "Not calculated") != 0);
+            int audio_hash_ready = !ctx->hash_audio || (db_audio_md5 && strcmp((const char *)db_audio_md5, "Not calculated") != 0);
+            int audio_check_ready = !run_audio_check ||
+                                    (db_audio_check != AUDIO_CHECK_NOT_CHECKED && db_audio_check_level >= ctx->audio_check_level);
 
             if (db_size == filesize &&
                 db_mtime == modified_timestamp &&
-                db_type && db_type[0] == (unsigned char)filetype &&
+                db_type && db_type[0] == (unsigned char)job->filetype &&
                 file_hash_ready &&
                 audio_hash_ready &&
                 audio_check_ready) {
                 sqlite3_reset(lookup_stmt);
                 sqlite3_clear_bindings(lookup_stmt);
+                stats_count(COUNTER_FILES_SKIPPED, 1);
+                if (ctx->stamp_stmt) {
+                    sqlite3_bind_int64(ctx->stamp_stmt, 1, ctx->scan_gen);
+                    sqlite3_bind_text(ctx->stamp_stmt, 2, file_path, -1, SQLITE_TRANSIENT);
+                    int stamp_rc = sqlite3_step(ctx->stamp_stmt);
+                    sqlite3_reset(ctx->stamp_stmt);
+                    sqlite3_clear_bindings(ctx->stamp_stmt);
+                    if (stamp_rc != SQLITE_DONE) {
+                        fprintf(stderr, "SQL: Error stamping %s: %s\n", file_path, sqlite3_errmsg(ctx->db));
+                        return -1;
+                    }
+                }
                 return 0;
             }
         } else if (lookup_rc != SQLITE_DONE) {
-            fprintf(stderr, "SQL: Error during metadata lookup for %s: %s\n", file_path, sqlite3_errmsg(db));
+            fprintf(stderr, "SQL: Error during metadata lookup for %s: %s\n", file_path, sqlite3_errmsg(ctx->db));
             sqlite3_reset(lookup_stmt);
             sqlite3_clear_bindings(lookup_stmt);
-            return 1;
+            return -1;
         }
 
         sqlite3_reset(lookup_stmt);
         sqlite3_clear_bindings(lookup_stmt);
     }
 
-    char md5_string[MD5_DIGEST_LENGTH * 2 + 1] = {0};
-    char audio_md5_string[MD5_DIGEST_LENGTH * 2 + 1] = {0};
-    int audio_check_result = AUDIO_CHECK_NOT_CHECKED;
-    snprintf(md5_string, sizeof(md5_string), "Not calculated");
-    snprintf(audio_md5_string, sizeof(audio_md5_string), "Not calculated");
+    job->audio_check_result = AUDIO_CHECK_NOT_CHECKED;
+    if (!run_audio_check || filesize == 0) {
+        return 1;
+    }
 
-    if (filesize == 0) {
-        if (hash_file) strncpy(md5_string, "0-byte-file", sizeof(md5_string) - 1);
-        if (hash_audio) strncpy(audio_md5_string, "0-byte-file", sizeof(audio_md5_string) - 1);
-        if (run_audio_check) audio_check_result = AUDIO_CHECK_NO_AUDIO_DATA;
+    // Reuse only looks at what the DB already knows (the previous hashes of
+    // this path), so it is settled here rather than after hashing.
+    if (inode_cache_get(&ctx->inode_cache, st->st_dev, st->st_ino, &job->audio_check_result)) {
+        job->check_reused = 1;
+        job->check_source = "reused inode cache";
+    }
+    if (!job->check_reused && try_reuse_check_result_by_hash(ctx->reuse_md5_stmt, db_md5_value, ctx->audio_check_level, &job->audio_check_result)) {
+        job->check_reused = 1;
+        job->check_source = "reused by md5";
+    }
+    if (!job->check_reused && try_reuse_check_result_by_hash(ctx->reuse_audio_md5_stmt, db_audio_md5_value, ctx->audio_check_level, &job->audio_check_result)) {
+        job->check_reused = 1;
+        job->check_source = "reused by audio_md5";
+    }
+    if (job->check_reused) {
+        stats_count(COUNTER_CHECKS_REUSED, 1);
+    }
+    if (!job->check_reused && strcmp(db_audio_md5_value, "Bad audio") == 0) {
+        job->audio_check_result = AUDIO_CHECK_CORRUPTED_STREAM;
+        job->check_reused = 1;
+        job->check_source = "reused legacy Bad audio sentinel";
+    }
+    return 1;
+}
+
+// Hashing and validation. Touches no shared state besides the stats
+// counters, so it runs unchanged on the walking thread or a device worker.
+static void compute_file_job(FileJob *job) {
+    const ScanContext *ctx = job->ctx;
+    const char *file_path = job->file_path;
+    int run_audio_check = (ctx->audio_check_level != AUDIO_CHECK_LEVEL_NONE);
+
+    snprintf(job->md5_string, sizeof(job->md5_string), "Not calculated");
+    snprintf(job->audio_md5_string, sizeof(job->audio_md5_string), "Not calculated");
+    job->rc = 0;
+
+    HashCache cache = {.check_result = -1};
+    int use_cache = ctx->use_xattr && job->st.st_size != 0;
+    int computed = 0;
+    int cache_used = 0;
+    if (use_cache) hashcache_read(file_path, &job->st, &cache);
+    if (ctx->force_rescan) {
+        // -f recomputes what this run asks for; other cached values stay.
+        if (ctx->hash_file) cache.md5[0] = '\0';
+        if (ctx->hash_audio) cache.audio_md5[0] = '\0';
+        if (run_audio_check) cache.check_result = -1;
+    }
+
+    if (job->st.st_size == 0) {
+        if (ctx->hash_file) snprintf(job->md5_string, sizeof(job->md5_string), "0-byte-file");
+        if (ctx->hash_audio) snprintf(job->audio_md5_string, sizeof(job->audio_md5_string), "0-byte-file");
+        if (run_audio_check) job->audio_check_result = AUDIO_CHECK_NO_AUDIO_DATA;
     } else {
-        if (hash_file) {
+        if (ctx->hash_file && cache.md5[0]) {
+            snprintf(job->md5_string, sizeof(job->md5_string), "%s", cache.md5);
+            cache_used = 1;
+        } else if (ctx->hash_file) {
             unsigned char md5_hash[MD5_DIGEST_LENGTH];
+            computed = 1;
             if (calculate_md5(file_path, md5_hash) != 0) {
                 fprintf(stderr, "Error calculating MD5 hash for file: %s\n", file_path);
-                return 1;
+                job->rc = 1;
+                log_sink_finish_file(NULL, 0);
+                return;
             }
             for (int i = 0; i < MD5_DIGEST_LENGTH; i++) {
-                snprintf(&md5_string[i * 2], 3, "%02x", (unsigned int)md5_hash[i]);
+                snprintf(&job->md5_string[i * 2], 3, "%02x", (unsigned int)md5_hash[i]);
             }
         }
 
-        if (hash_audio) {
+        if (ctx->hash_audio && cache.audio_md5[0]) {
+            snprintf(job->audio_md5_string, sizeof(job->audio_md5_string), "%s", cache.audio_md5);
+            cache_used = 1;
+        } else if (ctx->hash_audio) {
             unsigned char raw_hash[MD5_DIGEST_LENGTH] = {0};
+            computed = 1;
             if (calculate_audio_md5(file_path, raw_hash) != 0) {
-                snprintf(audio_md5_string, sizeof(audio_md5_string), "Bad audio");
+                snprintf(job->audio_md5_string, sizeof(job->audio_md5_string), "Bad audio");
             } else {
                 for (int i = 0; i < MD5_DIGEST_LENGTH; i++) {
-                    snprintf(&audio_md5_string[i * 2], 3, "%02x", (unsigned int)raw_hash[i]);
+                    snprintf(&job->audio_md5_string[i * 2], 3, "%02x", (unsigned int)raw_hash[i]);
                 }
             }
         }
 
-        if (run_audio_check) {
-            int reused = 0;
-
-            if (inode_cache && inode_cache_get(inode_cache, st->st_dev, st->st_ino, &audio_check_result)) {
-                reused = 1;
-                if (verbose) {
-                    printf("\tAudio Check Source: reused inode cache\n");
+        if (run_audio_check && !job->check_reused && cache.check_result >= 0 && cache.check_level >= ctx->audio_check_level) {
+            job->audio_check_result = cache.check_result;
+            job->check_source = "xattr cache";
+            cache_used = 1;
+        } else if (run_audio_check && !job->check_reused) {
+            computed = 1;
+            if (ctx->audio_check_level == AUDIO_CHECK_LEVEL_QUICK) {
+                if (validate_audio_stream_quick(file_path, &job->audio_check_result) != 0) {
+                    job->audio_check_result = AUDIO_CHECK_CORRUPTED_STREAM;
                 }
-            }
-
-            if (!reused && try_reuse_check_result_by_hash(reuse_md5_stmt, db_md5_value, &audio_check_result)) {
-                reused = 1;
-                if (verbose) {
-                    printf("\tAudio Check Source: reused by md5\n");
+                job->check_source = "quick packet scan";
+            } else {
+                if (validate_audio_stream(file_path, &job->audio_check_result) != 0) {
+                    job->audio_check_result = AUDIO_CHECK_CORRUPTED_STREAM;
                 }
+                job->check_source = "full decode";
             }
+        }
 
-            if (!reused && try_reuse_check_result_by_hash(reuse_audio_md5_stmt, db_audio_md5_value, &audio_check_result)) {
-                reused = 1;
-                if (verbose) {
-                    printf("\tAudio Check Source: reused by audio_md5\n");
-                }
+        if (use_cache && computed) {
+            if (ctx->hash_file) snprintf(cache.md5, sizeof(cache.md5), "%s", job->md5_string);
+            if (ctx->hash_audio) snprintf(cache.audio_md5, sizeof(cache.audio_md5), "%s", job->audio_md5_string);
+            if (run_audio_check) {
+                cache.check_result = job->audio_check_result;
+                cache.check_level = ctx->audio_check_level;
             }
-
-            if (!reused && strcmp(db_audio_md5_value, "Bad audio") == 0) {
-                audio_check_result = AUDIO_CHECK_CORRUPTED_STREAM;
-                reused = 1;
-                if (verbose) {
-                    printf("\tAudio Check Source: reused legacy Bad audio sentinel\n");
-                }
+            if (hashcache_write(file_path, &job->st, &cache) != 0 && ctx->verbose) {
+                fprintf(stderr, "Warning: cannot cache hashes in xattrs of %s: %m\n", file_path);
             }
+        } else if (cache_used) {
+            job->xattr_hit = 1;
+            stats_count(COUNTER_XATTR_HITS, 1);
+        }
+    }
 
-            if (!reused) {
-                if (validate_audio_stream(file_path, &audio_check_result) != 0) {
-                    audio_check_result = AUDIO_CHECK_CORRUPTED_STREAM;
-                }
-                if (verbose) {
-                    printf("\tAudio Check Source: full decode\n");
-                }
-            }
+    log_sink_finish_file(job->log_summary, sizeof(job->log_summary));
+}
 
-            if (inode_cache) {
-                if (inode_cache_put(inode_cache, st->st_dev, st->st_ino, audio_check_result) != 0) {
-                    fprintf(stderr, "Memory: failed to cache inode check result for %s\n", file_path);
-                }
-            }
+static void compute_file_job_worker(IoJob *io) {
+    FileJob *job = (FileJob *)io;
+    uint64_t file_span = trace_begin();
+    compute_file_job(job);
+    trace_end(TRACE_FILE, file_span, job->file_path);
+}
+
+// Writes the job's row. Returns 0 on success, 1 if the row was not written.
+static int finish_file_job(ScanContext *ctx, FileJob *job) {
+    const char *file_path = job->file_path;
+    int run_audio_check = (ctx->audio_check_level != AUDIO_CHECK_LEVEL_NONE);
+    int verbose = ctx->verbose;
+    time_t current_time = time(NULL);
+    sqlite3_stmt *upsert_stmt = ctx->upsert_stmt;
+
+    if (job->rc != 0) {
+        return 1;
+    }
+    if (run_audio_check && job->st.st_size != 0) {
+        if (verbose && job->check_source) {
+            printf("\tAudio Check Source: %s\n", job->check_source);
+        }
+        if (inode_cache_put(&ctx->inode_cache, job->st.st_dev, job->st.st_ino, job->audio_check_result) != 0) {
+            fprintf(stderr, "Memory: failed to cache inode check result for %s\n", file_path);
         }
     }
 
     if (verbose) {
-        printf("\tMD5: %s\n", md5_string);
-        printf("\tAudio MD5: %s\n", audio_md5_string);
+        printf("\tMD5: %s\n", job->md5_string);
+        printf("\tAudio MD5: %s\n", job->audio_md5_string);
         printf("\tFilepath: %s\n", file_path);
-        printf("\tFilename: %s\n", filename);
-        printf("\tExtension: %s\n", extension);
-        printf("\tFilesize: %ld\n", (long)filesize);
+        printf("\tFilename: %s\n", job->filename);
+        printf("\tExtension: %s\n", job->extension);
+        printf("\tFilesize: %ld\n", (long)job->st.st_size);
         printf("\tTimestamp: %ld\n", (long)current_time);
         if (run_audio_check) {
-            printf("\tAudio Check: %d (%s)\n", audio_check_result, audio_check_result_to_string(audio_check_result));
+            printf("\tAudio Check: %d (%s, %s)\n", job->audio_check_result, audio_check_result_to_string(job->audio_check_result), audio_check_level_to_string(ctx->audio_check_level));
         }
     }
 
-    char ft_str[2] = {filetype, '\0'};
-    sqlite3_bind_text(upsert_stmt, 1, md5_string, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(upsert_stmt, 2, audio_md5_string, -1, SQLITE_TRANSIENT);
+    char ft_str[2] = {job->filetype, '\0'};
+    sqlite3_bind_text(upsert_stmt, 1, job->md5_string, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(upsert_stmt, 2, job->audio_md5_string, -1, SQLITE_TRANSIENT);
     sqlite3_bind_text(upsert_stmt, 3, file_path, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(upsert_stmt, 4, filename, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(upsert_stmt, 5, extension, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int64(upsert_stmt, 6, filesize);
+    sqlite3_bind_text(upsert_stmt, 4, job->filename, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(upsert_stmt, 5, job->extension, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(upsert_stmt, 6, (int64_t)job->st.st_size);
     sqlite3_bind_int64(upsert_stmt, 7, current_time);
-    sqlite3_bind_int64(upsert_stmt, 8, modified_timestamp);
+    sqlite3_bind_int64(upsert_stmt, 8, (int64_t)job->st.st_mtime);
     sqlite3_bind_text(upsert_stmt, 9, ft_str, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(upsert_stmt, 10, audio_check_result);
-    sqlite3_bind_int(upsert_stmt, 11, hash_file);
-    sqlite3_bind_int(upsert_stmt, 12, hash_audio);
-    sqlite3_bind_int(upsert_stmt, 13, run_audio_check);
-
-    if (sqlite3_step(upsert_stmt) != SQLITE_DONE) {
-        fprintf(stderr, "SQL: Error executing statement for %s: %s\n", file_path, sqlite3_errmsg(db));
+    sqlite3_bind_int(upsert_stmt, 10, job->audio_check_result);
+    sqlite3_bind_int(upsert_stmt, 11, ctx->audio_check_level);
+    // Without -logdb the column is left alone on update and NULL on insert.
+    if (ctx->store_check_log && job->log_summary[0] != '\0') {
+        sqlite3_bind_text(upsert_stmt, 12, job->log_summary, -1, SQLITE_TRANSIENT);
+    } else {
+        sqlite3_bind_null(upsert_stmt, 12);
+    }
+    sqlite3_bind_int(upsert_stmt, 13, ctx->hash_file);
+    sqlite3_bind_int(upsert_stmt, 14, ctx->hash_audio);
+    sqlite3_bind_int(upsert_stmt, 15, run_audio_check);
+    sqlite3_bind_int(upsert_stmt, 16, ctx->store_check_log && (ctx->hash_audio || run_audio_check));
+    sqlite3_bind_int64(upsert_stmt, 17, ctx->scan_gen);
+
+    uint64_t upsert_start = stats_begin();
+    int upsert_rc = sqlite3_step(upsert_stmt);
+    stats_end(PHASE_UPSERT, upsert_start, 0);
+    if (upsert_rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL: Error executing statement for %s: %s\n", file_path, sqlite3_errmsg(ctx->db));
         sqlite3_reset(upsert_stmt);
         sqlite3_clear_bindings(upsert_stmt);
         return 1;
@@ -350,56 +565,626 @@ int process_file(const char *file_path, sqlite3 *db, sqlite3_stmt *upsert_stmt,
     sqlite3_reset(upsert_stmt);
     sqlite3_clear_bindings(upsert_stmt);
 
-    (*file_count)++;
+    (*ctx->file_count)++;
+    stats_count(COUNTER_FILES_HASHED, 1);
+    if (!job->xattr_hit) stats_count(COUNTER_BYTES_HASHED, (uint64_t)job->st.st_size);
     if (verbose) {
         printf("Processed file: %s\n", file_path);
     }
+    if (output_format != OUTPUT_TEXT) {
+        if (run_audio_check) {
+            output_record_begin(NULL, "check");
+            output_str(NULL, "path", file_path);
+            output_int(NULL, "result", job->audio_check_result);
+            output_str(NULL, "status", audio_check_result_to_string(job->audio_check_result));
+            output_str(NULL, "level", audio_check_level_to_string(ctx->audio_check_level));
+        } else {
+            output_record_begin(NULL, "file");
+            output_str(NULL, "path", file_path);
+            output_int(NULL, "size", (int64_t)job->st.st_size);
+            output_int(NULL, "mtime", (int64_t)job->st.st_mtime);
+            output_str(NULL, "md5", job->md5_string);
+            output_str(NULL, "audio_md5", job->audio_md5_string);
+        }
+        output_record_end(NULL);
+    }
     return 0;
 }
 
-int process_directory(const char *dir_path, sqlite3 *db, sqlite3_stmt *upsert_stmt, sqlite3_stmt *lookup_stmt, sqlite3_stmt *reuse_md5_stmt, sqlite3_stmt *reuse_audio_md5_stmt, int *file_count, int verbose, const char *extensions_concatenated, int force_rescan, int *batch_count, int hash_files, int hash_audio, int run_audio_check, int recurse_dirs) {
-    DirStack *stack = create_dir_stack(STACK_SIZE);
-    push_dir(stack, dir_path);
-    InodeCheckCache inode_cache;
-    init_inode_cache(&inode_cache);
+static OpenDir *open_dir_add(ScanContext *ctx, const char *path, dev_t dev) {
+    OpenDir *dir = calloc(1, sizeof(OpenDir));
+    if (!dir || !(dir->path = strdup(path))) {
+        fprintf(stderr, "Memory: Error allocating directory state for %s\n", path);
+        free(dir);
+        return NULL;
+    }
+    dir->dev = dev;
+    dir->next = ctx->open_dirs;
+    if (ctx->open_dirs) ctx->open_dirs->prev = dir;
+    ctx->open_dirs = dir;
+    return dir;
+}
+
+static char *parent_path(const char *path, char *out, size_t out_len) {
+    snprintf(out, out_len, "%s", path);
+    char *slash = strrchr(out, '/');
+    if (slash == out) slash[1] = '\0';
+    else if (slash) *slash = '\0';
+    else out[0] = '\0';
+    return out;
+}
+
+static void open_dir_release(ScanContext *ctx, OpenDir *dir) {
+    if (!dir->walked || dir->pending > 0) return;
+    // Every file is written back, so the listing can stand in for the next
+    // -fast run. A directory with errors stores no mtime and is listed again.
+    if (ctx->dir_index && dir->mtime_ns) {
+        char parent[MAX_PATH_LENGTH];
+        dir_index_store(ctx->dir_index, dir->path, parent_path(dir->path, parent, sizeof(parent)), (int64_t)dir->dev,
+                        dir->errors ? 0 : dir->mtime_ns, dir->ctime_ns);
+    }
+    if (dir->prev) dir->prev->next = dir->next;
+    else ctx->open_dirs = dir->next;
+    if (dir->next) dir->next->prev = dir->prev;
+    free(dir->path);
+    free(dir);
+}
+
+static void free_open_dirs(ScanContext *ctx) {
+    while (ctx->open_dirs) {
+        OpenDir *next = ctx->open_dirs->next;
+        free(ctx->open_dirs->path);
+        free(ctx->open_dirs);
+        ctx->open_dirs = next;
+    }
+}
+
+// Saves the frontier (queued directories, then open ones so they come off
+// the stacks first on resume) and the run counters under status. Runs in the
+// current transaction, so it is exactly as durable as the file rows.
+// Subdirectories queued by a walk still in progress are left out: that
+// directory is saved unwalked and queues them again when it is re-read.
+static int save_scan_run(ScanContext *ctx, const char *status) {
+    ScanRun *run = ctx->run;
+    if (scan_run_frontier_reset(run) != 0) return 1;
+    for (size_t i = 0; i < ctx->queues->count; i++) {
+        const DeviceDirs *queue = &ctx->queues->items[i];
+        int saved = (queue->mark < queue->stack->size) ? queue->mark : queue->stack->size;
+        for (int j = 0; j < saved; j++) {
+            if (scan_run_frontier_add(run, queue->stack->entries[j].path, (int64_t)queue->dev, 0) != 0) return 1;
+        }
+    }
+    for (const OpenDir *dir = ctx->open_dirs; dir; dir = dir->next) {
+        if (scan_run_frontier_add(run, dir->path, (int64_t)dir->dev, dir->walked || dir->files_only) != 0) return 1;
+    }
+    ScanRunCounters session = {
+        .files_seen = (int64_t)stats_counter_value(COUNTER_FILES_SEEN),
+        .files_hashed = (int64_t)stats_counter_value(COUNTER_FILES_HASHED),
+        .bytes_hashed = (int64_t)stats_counter_value(COUNTER_BYTES_HASHED),
+        .errors = (int64_t)stats_counter_value(COUNTER_ERRORS)
+    };
+    return scan_run_update(run, status, &session);
+}
+
+// Counts a handled file toward the transaction batch and rotates the
+// transaction when the batch is full. Returns non-zero if rotation failed.
+static int note_file_done(ScanContext *ctx, FileJob *job, int rc) {
+    if (rc != 0) {
+        fprintf(stderr, "Error processing file: %s\n", job->file_path);
+        stats_count(COUNTER_ERRORS, 1);
+        if (job->dir) job->dir->errors++;
+    } else {
+        (*ctx->batch_count)++;
+    }
+    if (job->dir) {
+        job->dir->pending--;
+        open_dir_release(ctx, job->dir);
+        job->dir = NULL;
+    }
+
+    if (*ctx->batch_count >= BATCH_SIZE) {
+        uint64_t commit_start = stats_begin();
+        int rotate_rc = ((ctx->run && save_scan_run(ctx, "running") != 0) ||
+                         commit_transaction(ctx->db) != 0 || begin_transaction(ctx->db) != 0);
+        stats_end(PHASE_COMMIT, commit_start, 0);
+        if (rotate_rc) {
+            fprintf(stderr, "SQL: Error rotating transaction batch at %s\n", job->file_path);
+            return 1;
+        }
+        *ctx->batch_count = 0;
+    }
+    return 0;
+}
+
+// Writes back every finished job; with wait set, until nothing is in flight.
+static int reap_file_jobs(ScanContext *ctx, int wait, int *failed) {
+    IoJob *io;
+    while ((io = iosched_next_done(wait)) != NULL) {
+        FileJob *job = (FileJob *)io;
+        if (!*failed) {
+            int rc = finish_file_job(ctx, job);
+            if (note_file_done(ctx, job, rc) != 0) *failed = 1;
+        }
+        free_file_job(job);
+    }
+    return *failed;
+}
+
+static struct dirent *timed_readdir(DIR *dir) {
+    uint64_t start = stats_begin();
+    struct dirent *entry = readdir(dir);
+    stats_end(PHASE_READDIR, start, 0);
+    return entry;
+}
+
+// Runs a prepared job serially or queues it on its device. prep is the
+// prepare_file_job result.
+static int dispatch_file_job(ScanContext *ctx, FileJob *job, int prep, uint64_t file_span, int *failed) {
+    if (prep <= 0 || !ctx->scheduled) {
+        int rc = (prep < 0) ? 1 : 0;
+        if (prep > 0) {
+            compute_file_job(job);
+            rc = finish_file_job(ctx, job);
+        }
+        trace_end(TRACE_FILE, file_span, job->file_path);
+        int fatal = note_file_done(ctx, job, rc);
+        free_file_job(job);
+        return fatal;
+    }
+
+    // Keep each device's queue bounded; other devices keep draining theirs
+    // while the walker waits here.
+    while (iosched_pending(job->io.dev) >= iosched_device_limit(job->io.dev)) {
+        IoJob *io = iosched_next_done(1);
+        if (!io) break;
+        FileJob *done = (FileJob *)io;
+        if (!*failed && note_file_done(ctx, done, finish_file_job(ctx, done)) != 0) *failed = 1;
+        free_file_job(done);
+    }
+    if (iosched_submit(&job->io) != 0) {
+        compute_file_job(job);
+        int fatal = note_file_done(ctx, job, finish_file_job(ctx, job));
+        free_file_job(job);
+        return fatal;
+    }
+    return reap_file_jobs(ctx, 0, failed);
+}
+
+// Handles one matching file: synchronously, or by queueing the hashing on
+// the file's device. Returns non-zero on a fatal DB error.
+static int handle_file(ScanContext *ctx, FileJob *job, uint64_t file_span, int *failed) {
+    return dispatch_file_job(ctx, job, prepare_file_job(ctx, job), file_span, failed);
+}
+
+// Physical-order hashing (-order). Files that need hashing are held back
+// until ORDER_BATCH_FILES have accumulated (across directories) or the walk
+// ends, then read in inode or first-extent order so a spindle sweeps
+// forward instead of seeking back and forth in readdir order.
+#define ORDER_BATCH_FILES 4096
+
+typedef struct {
+    FileJob **items;
+    size_t count;
+} OrderBatch;
+
+static int order_key_cmp(const void *a, const void *b) {
+    const FileJob *x = *(FileJob *const *)a;
+    const FileJob *y = *(FileJob *const *)b;
+    if (x->io.dev != y->io.dev) return (x->io.dev < y->io.dev) ? -1 : 1;
+    if (x->order_key != y->order_key) return (x->order_key < y->order_key) ? -1 : 1;
+    if (x->st.st_ino != y->st.st_ino) return (x->st.st_ino < y->st.st_ino) ? -1 : 1;
+    return 0;
+}
+
+static int flush_order_batch(ScanContext *ctx, OrderBatch *batch, int *failed) {
+    for (size_t i = 0; i < batch->count; i++) {
+        batch->items[i]->order_key = (uint64_t)batch->items[i]->st.st_ino;
+    }
+    // Extent keys are not comparable with inode numbers, so a file the
+    // filesystem cannot map (or that vanished) sorts after every mapped file
+    // of its device, by inode. On a filesystem without FIEMAP that is plain
+    // inode order.
+    for (size_t i = 0; ctx->order == ORDER_EXTENT && i < batch->count; i++) {
+        uint64_t physical;
+        uint64_t start = stats_begin();
+        int rc = file_first_extent(batch->items[i]->file_path, &physical);
+        stats_end(PHASE_FIEMAP, start, 0);
+        if (rc != 0) {
+            if (!ctx->extent_warned) {
+                fprintf(stderr, "Warning: FIEMAP unavailable for %s; files without extents are read last, by inode\n", batch->items[i]->file_path);
+                ctx->extent_warned = 1;
+            }
+            batch->items[i]->order_key = UINT64_MAX;
+            continue;
+        }
+        batch->items[i]->order_key = physical;
+    }
+    qsort(batch->items, batch->count, sizeof(FileJob *), order_key_cmp);
+
+    int fatal = 0;
+    size_t i = 0;
+    for (; i < batch->count && !fatal && !*failed; i++) {
+        fatal = dispatch_file_job(ctx, batch->items[i], 1, trace_begin(), failed);
+    }
+    for (; i < batch->count; i++) {
+        free_file_job(batch->items[i]);
+    }
+    batch->count = 0;
+    return fatal;
+}
+
+static int defer_file(ScanContext *ctx, OrderBatch *batch, FileJob *job, uint64_t file_span, int *failed) {
+    int prep = prepare_file_job(ctx, job);
+    if (prep <= 0) {
+        return dispatch_file_job(ctx, job, prep, file_span, failed);
+    }
+    if (!batch->items) {
+        batch->items = malloc(ORDER_BATCH_FILES * sizeof(FileJob *));
+        if (!batch->items) {
+            return dispatch_file_job(ctx, job, prep, file_span, failed);
+        }
+    }
+    batch->items[batch->count++] = job;
+    if (batch->count == ORDER_BATCH_FILES) {
+        return flush_order_batch(ctx, batch, failed);
+    }
+    return 0;
+}
+
+// Directory entries read up front and sorted by inode, so the lstat pass
+// over a huge directory walks the inode table in order too.
+typedef struct {
+    ino_t ino;
+    char *name;
+} DirName;
+
+static int dir_name_cmp(const void *a, const void *b) {
+    const DirName *x = a;
+    const DirName *y = b;
+    if (x->ino != y->ino) return (x->ino < y->ino) ? -1 : 1;
+    return 0;
+}
+
+// Entries that cannot be kept count as errors on dir, so a partial listing
+// never drives prune or stores the directory as unchanged.
+static DirName *read_dir_names(DIR *dir, OpenDir *open_dir, size_t *count_out) {
+    DirName *names = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = timed_readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (count == capacity) {
+            size_t grown_capacity = capacity ? capacity * 2 : 64;
+            DirName *grown = realloc(names, grown_capacity * sizeof(DirName));
+            if (!grown) {
+                fprintf(stderr, "Memory: Error allocating directory listing for %s\n", entry->d_name);
+                stats_count(COUNTER_ERRORS, 1);
+                open_dir->errors++;
+                continue;
+            }
+            names = grown;
+            capacity = grown_capacity;
+        }
+        names[count].ino = entry->d_ino;
+        names[count].name = strdup(entry->d_name);
+        if (!names[count].name) {
+            fprintf(stderr, "Memory: Error allocating directory listing for %s\n", entry->d_name);
+            stats_count(COUNTER_ERRORS, 1);
+            open_dir->errors++;
+            continue;
+        }
+        count++;
+    }
+    if (count > 1) {
+        qsort(names, count, sizeof(DirName), dir_name_cmp);
+    }
+    *count_out = count;
+    return names;
+}
+
+static void free_dir_names(DirName *names, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(names[i].name);
+    }
+    free(names);
+}
+
+// Returns -1 when the queues cannot grow; the caller fails the walk.
+static int push_device_dir(DirQueues *queues, dev_t dev, const char *path) {
+    for (size_t i = 0; i < queues->count; i++) {
+        if (queues->items[i].dev == dev) {
+            return push_dir(queues->items[i].stack, path);
+        }
+    }
+    DeviceDirs *grown = realloc(queues->items, (queues->count + 1) * sizeof(DeviceDirs));
+    if (!grown) {
+        fprintf(stderr, "Memory: Error allocating directory queue for %s\n", path);
+        return -1;
+    }
+    queues->items = grown;
+    DirStack *stack = create_dir_stack(64);
+    if (!stack) return -1;
+    if (push_dir(stack, path) != 0) {
+        destroy_dir_stack(stack);
+        return -1;
+    }
+    queues->items[queues->count].dev = dev;
+    queues->items[queues->count].stack = stack;
+    queues->items[queues->count].mark = 0;
+    queues->count++;
+    return 0;
+}
+
+static DeviceDirs *next_device_dirs(DirQueues *queues, int scheduled) {
+    DeviceDirs *best = NULL;
+    int best_pending = 0;
+    for (size_t i = 0; i < queues->count; i++) {
+        if (queues->items[i].stack->size == 0) continue;
+        if (!scheduled) return &queues->items[i];
+        int pending = iosched_pending(queues->items[i].dev);
+        if (!best || pending < best_pending) {
+            best = &queues->items[i];
+            best_pending = pending;
+        }
+    }
+    return best;
+}
+
+static void free_dir_queues(DirQueues *queues) {
+    for (size_t i = 0; i < queues->count; i++) {
+        destroy_dir_stack(queues->items[i].stack);
+    }
+    free(queues->items);
+}
+
+static volatile sig_atomic_t stop_signal = 0;
+
+static void handle_stop_signal(int sig) {
+    stop_signal = sig;
+    // A second signal kills the scan outright.
+    signal(sig, SIG_DFL);
+}
+
+static int scan_stop_reason(const ScanContext *ctx) {
+    if (stop_signal) return STOP_SIGNAL;
+    if (ctx->deadline_ns && stats_now_ns() >= ctx->deadline_ns) return STOP_BUDGET;
+    return STOP_NONE;
+}
+
+static void mark_dir_queues(DirQueues *queues) {
+    for (size_t i = 0; i < queues->count; i++) {
+        queues->items[i].mark = queues->items[i].stack->size;
+    }
+}
+
+// Drops the subdirectories queued by a walk that was cut short; the
+// directory itself stays open and is walked again in full on resume.
+static void rewind_dir_queues(DirQueues *queues) {
+    for (size_t i = 0; i < queues->count; i++) {
+        queues->items[i].stack->size = queues->items[i].mark;
+    }
+}
+
+static int load_frontier_dir(void *arg, const char *path, int64_t dev, int files_only) {
+    ScanContext *ctx = arg;
+    if (push_device_dir(ctx->queues, (dev_t)dev, path) != 0) return -1;
+    if (files_only) {
+        char **grown = realloc(ctx->files_only, (ctx->files_only_count + 1) * sizeof(char *));
+        if (grown) ctx->files_only = grown;
+        if (!grown || !(grown[ctx->files_only_count] = strdup(path))) {
+            fprintf(stderr, "Memory: Error allocating scan frontier entry for %s\n", path);
+            return -1;
+        }
+        ctx->files_only_count++;
+    }
+    return 0;
+}
+
+static int take_files_only(ScanContext *ctx, const char *path) {
+    for (size_t i = 0; i < ctx->files_only_count; i++) {
+        if (strcmp(ctx->files_only[i], path) == 0) {
+            free(ctx->files_only[i]);
+            ctx->files_only[i] = ctx->files_only[--ctx->files_only_count];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static size_t frontier_size(const ScanContext *ctx) {
+    size_t count = 0;
+    for (size_t i = 0; i < ctx->queues->count; i++) {
+        count += (size_t)ctx->queues->items[i].stack->size;
+    }
+    for (const OpenDir *dir = ctx->open_dirs; dir; dir = dir->next) {
+        count++;
+    }
+    return count;
+}
+
+static int64_t timespec_ns(const struct timespec *ts) {
+    return (int64_t)ts->tv_sec * 1000000000LL + (int64_t)ts->tv_nsec;
+}
+
+static int queue_known_subdir(void *arg, const char *path, int64_t dev) {
+    ScanContext *ctx = arg;
+    return push_device_dir(ctx->queues, (dev_t)dev, path);
+}
+
+// -fast: a directory whose entry set cannot have changed since its last
+// complete listing is not listed; its known subdirectories are queued from
+// the dirs table. Returns 1 when skipped, 0 when it must be listed and -1
+// when the queues cannot grow. The stat result is kept for storing once the
+// listing completes.
+static int skip_unchanged_dir(ScanContext *ctx, const char *path, int walk_subdirs, struct stat *dir_st) {
+    uint64_t stat_start = stats_begin();
+    int stat_rc = stat(path, dir_st);
+    stats_end(PHASE_LSTAT, stat_start, 0);
+    if (stat_rc != 0) {
+        if (errno == ENOENT) {
+            dir_index_remove(ctx->dir_index, path);
+        }
+        return 0;
+    }
+    if (dir_index_unchanged(ctx->dir_index, path, timespec_ns(&dir_st->st_mtim), timespec_ns(&dir_st->st_ctim)) != 1) {
+        return 0;
+    }
+    if (walk_subdirs) {
+        int rc = dir_index_children(ctx->dir_index, path, queue_known_subdir, ctx);
+        if (rc < 0) return -1;
+        if (rc != 0) return 0;
+    }
+    if (ctx->verbose) {
+        printf("Unchanged directory: %s\n", path);
+    }
+    stats_count(COUNTER_DIRS_SKIPPED, 1);
+    return 1;
+}
+
+int process_directory(const char *dir_path, sqlite3 *db, sqlite3_stmt *upsert_stmt, sqlite3_stmt *lookup_stmt, sqlite3_stmt *reuse_md5_stmt, sqlite3_stmt *reuse_audio_md5_stmt, int *file_count, int verbose, const char *extensions_concatenated, int force_rescan, int *batch_count, int hash_files, int hash_audio, int audio_check_level, int store_check_log, int use_xattr, int recurse_dirs, int scheduled, int order, ScanRun *run, uint64_t deadline_ns, DirIndex *dir_index, int64_t scan_gen, sqlite3_stmt *stamp_stmt) {
+    DirQueues queues = {0};
+    ScanContext ctx = {
+        .db = db,
+        .upsert_stmt = upsert_stmt,
+        .lookup_stmt = lookup_stmt,
+        .reuse_md5_stmt = reuse_md5_stmt,
+        .reuse_audio_md5_stmt = reuse_audio_md5_stmt,
+        .file_count = file_count,
+        .batch_count = batch_count,
+        .verbose = verbose,
+        .hash_file = hash_files,
+        .hash_audio = hash_audio,
+        .audio_check_level = audio_check_level,
+        .store_check_log = store_check_log,
+        .use_xattr = use_xattr,
+        .force_rescan = force_rescan,
+        .scheduled = scheduled,
+        .order = order,
+        .run = run,
+        .queues = &queues,
+        .deadline_ns = deadline_ns,
+        .dir_index = dir_index,
+        .scan_gen = scan_gen,
+        .stamp_stmt = stamp_stmt
+    };
+    init_inode_cache(&ctx.inode_cache);
 
     char **ext_list = NULL;
     int ext_count = 0;
     if (parse_extensions(extensions_concatenated, &ext_list, &ext_count) != 0) {
-        destroy_dir_stack(stack);
         return 1;
     }
 
-    while (stack->size > 0) {
+    int failed = 0;
+    int resumed_dirs = 0;
+    if (run && run->resumed) {
+        // A partly loaded frontier is freed with the queues below.
+        resumed_dirs = scan_run_load_frontier(run, load_frontier_dir, &ctx);
+        if (resumed_dirs < 0) {
+            failed = 1;
+        }
+    }
+    if (resumed_dirs == 0) {
+        struct stat root_st;
+        if (push_device_dir(&queues, (stat(dir_path, &root_st) == 0) ? root_st.st_dev : 0, dir_path) != 0) {
+            failed = 1;
+        }
+    }
+
+    int stopped = STOP_NONE;
+    OrderBatch order_batch = {0};
+    DeviceDirs *next;
+    while (!failed && (next = next_device_dirs(&queues, scheduled)) != NULL) {
+        if ((stopped = scan_stop_reason(&ctx)) != STOP_NONE) break;
         char current_path[MAX_PATH_LENGTH];
-        strncpy(current_path, pop_dir(stack), MAX_PATH_LENGTH - 1);
+        strncpy(current_path, pop_dir(next->stack), MAX_PATH_LENGTH - 1);
         current_path[MAX_PATH_LENGTH - 1] = '\0';
+        dev_t current_dev = next->dev;
+        int walk_subdirs = recurse_dirs && !(ctx.files_only_count && take_files_only(&ctx, current_path));
+
+        struct stat dir_st = {0};
+        if (dir_index) {
+            int skipped = skip_unchanged_dir(&ctx, current_path, walk_subdirs, &dir_st);
+            if (skipped < 0) {
+                stats_count(COUNTER_ERRORS, 1);
+                failed = 1;
+                break;
+            }
+            mark_dir_queues(&queues);
+            if (skipped) continue;
+        }
 
         if (verbose) {
             printf("Current Path: %s\n", current_path);
         }
+        progress_note_directory(current_path);
 
+        uint64_t dir_span = trace_begin();
+        uint64_t opendir_start = stats_begin();
         DIR *dir = opendir(current_path);
+        stats_end(PHASE_READDIR, opendir_start, 0);
         if (!dir) {
             fprintf(stderr, "OS: Error opening directory %s: %m\n", current_path);
+            stats_count(COUNTER_ERRORS, 1);
             continue;
         }
+        stats_count(COUNTER_DIRS, 1);
+        OpenDir *open_dir = open_dir_add(&ctx, current_path, current_dev);
+        if (!open_dir) {
+            stats_count(COUNTER_ERRORS, 1);
+            closedir(dir);
+            failed = 1;
+            break;
+        }
+        open_dir->files_only = recurse_dirs && !walk_subdirs;
+        open_dir->mtime_ns = timespec_ns(&dir_st.st_mtim);
+        open_dir->ctime_ns = timespec_ns(&dir_st.st_ctim);
+        mark_dir_queues(&queues);
+
+        DirName *names = NULL;
+        size_t name_count = 0;
+        size_t name_index = 0;
+        if (order != ORDER_NONE) {
+            names = read_dir_names(dir, open_dir, &name_count);
+        }
 
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                continue;
+        while (!failed) {
+            if (deadline_ns || stop_signal) {
+                if ((stopped = scan_stop_reason(&ctx)) != STOP_NONE) break;
+            }
+            const char *d_name;
+            if (order != ORDER_NONE) {
+                if (name_index == name_count) break;
+                d_name = names[name_index++].name;
+            } else {
+                struct dirent *entry = timed_readdir(dir);
+                if (!entry) break;
+                d_name = entry->d_name;
+                if (strcmp(d_name, ".") == 0 || strcmp(d_name, "..") == 0) {
+                    continue;
+                }
             }
 
             char *file_path = NULL;
-            if (asprintf(&file_path, "%s/%s", current_path, entry->d_name) == -1) {
-                fprintf(stderr, "Memory: Error allocating path for %s\n", entry->d_name);
+            if (asprintf(&file_path, "%s/%s", current_path, d_name) == -1) {
+                fprintf(stderr, "Memory: Error allocating path for %s\n", d_name);
+                stats_count(COUNTER_ERRORS, 1);
+                open_dir->errors++;
                 continue;
             }
 
             struct stat st;
-            if (lstat(file_path, &st) == -1) {
+            uint64_t file_span = trace_begin();
+            uint64_t lstat_start = stats_begin();
+            int lstat_rc = lstat(file_path, &st);
+            stats_end(PHASE_LSTAT, lstat_start, 0);
+            if (lstat_rc == -1) {
                 fprintf(stderr, "OS: Error getting file information for %s: %m\n", file_path);
+                stats_count(COUNTER_ERRORS, 1);
+                open_dir->errors++;
                 free(file_path);
                 continue;
             }
@@ -408,43 +1193,160 @@ int process_directory(const char *dir_path, sqlite3 *db, sqlite3_stmt *upsert_st
 
             if (S_ISREG(st.st_mode)) {
                 char extension[64];
-                if (extension_allowed(entry->d_name, ext_list, ext_count, extension, sizeof(extension))) {
-                    if (process_file(file_path, db, upsert_stmt, lookup_stmt, reuse_md5_stmt, reuse_audio_md5_stmt, &inode_cache, file_count, verbose, hash_files, hash_audio, run_audio_check, force_rescan, filetype, &st, entry->d_name, extension) != 0) {
-                        fprintf(stderr, "Error processing file: %s\n", file_path);
-                    } else {
-                        (*batch_count)++;
+                if (extension_allowed(d_name, ext_list, ext_count, extension, sizeof(extension))) {
+                    stats_count(COUNTER_FILES_SEEN, 1);
+                    stats_count(COUNTER_BYTES_SEEN, (uint64_t)st.st_size);
+                    governor_file();
+                    FileJob *job = calloc(1, sizeof(FileJob));
+                    if (!job) {
+                        fprintf(stderr, "Memory: Error allocating job for %s\n", file_path);
+                        stats_count(COUNTER_ERRORS, 1);
+                        open_dir->errors++;
+                        free(file_path);
+                        continue;
                     }
-
-                    if (*batch_count >= BATCH_SIZE) {
-                        if (commit_transaction(db) != 0 || begin_transaction(db) != 0) {
-                            fprintf(stderr, "SQL: Error rotating transaction batch at %s\n", file_path);
-                            free(file_path);
-                            closedir(dir);
-                            free_extensions(ext_list, ext_count);
-                            free_inode_cache(&inode_cache);
-                            destroy_dir_stack(stack);
-                            return 1;
-                        }
-                        *batch_count = 0;
+                    job->io.dev = st.st_dev;
+                    job->ctx = &ctx;
+                    job->file_path = file_path;
+                    job->filetype = filetype;
+                    job->st = st;
+                    job->dir = open_dir;
+                    open_dir->pending++;
+                    snprintf(job->filename, sizeof(job->filename), "%s", d_name);
+                    snprintf(job->extension, sizeof(job->extension), "%s", extension);
+                    int fatal = (order != ORDER_NONE)
+                        ? defer_file(&ctx, &order_batch, job, file_span, &failed)
+                        : handle_file(&ctx, job, file_span, &failed);
+                    if (fatal != 0) {
+                        failed = 1;
                     }
+                    continue;
+                }
+            } else if (S_ISDIR(st.st_mode) && walk_subdirs) {
+                if (push_device_dir(&queues, st.st_dev, file_path) != 0) {
+                    stats_count(COUNTER_ERRORS, 1);
+                    free(file_path);
+                    failed = 1;
+                    break;
+                }
+                if (dir_index && dir_index_add_child(dir_index, file_path, current_path, (int64_t)st.st_dev) != 0) {
+                    open_dir->errors++;
                 }
-            } else if (S_ISDIR(st.st_mode) && recurse_dirs) {
-                push_dir(stack, file_path);
             }
 
             free(file_path);
         }
 
+        free_dir_names(names, name_count);
         closedir(dir);
+        trace_end(TRACE_DIR, dir_span, current_path);
+        if (stopped) {
+            rewind_dir_queues(&queues);
+            break;
+        }
+        open_dir->walked = 1;
+        open_dir_release(&ctx, open_dir);
+        mark_dir_queues(&queues);
     }
 
+    // Jobs still waiting for their physical-order slot are dropped on a
+    // stop; their directories stay open and are re-read on resume.
+    if (order_batch.count > 0 && !failed && !stopped && flush_order_batch(&ctx, &order_batch, &failed) != 0) {
+        failed = 1;
+    }
+    for (size_t i = 0; i < order_batch.count; i++) {
+        free_file_job(order_batch.items[i]);
+    }
+    free(order_batch.items);
+
+    if (scheduled) {
+        reap_file_jobs(&ctx, 1, &failed);
+    }
+
+    if (!failed && !stopped && progress_enabled) {
+        progress_set_walk_complete();
+    }
+
+    if (run && !failed) {
+        size_t pending = frontier_size(&ctx);
+        if (stopped && pending > 0) {
+            if (save_scan_run(&ctx, "paused") != 0) {
+                failed = 1;
+            } else {
+                printf("%s: %zu directories pending; run the same command again to resume.\n",
+                       (stopped == STOP_BUDGET) ? "Budget reached" : "Interrupted", pending);
+            }
+        } else if (save_scan_run(&ctx, "done") != 0) {
+            failed = 1;
+        }
+    }
+
+    for (size_t i = 0; i < ctx.files_only_count; i++) {
+        free(ctx.files_only[i]);
+    }
+    free(ctx.files_only);
+    free_open_dirs(&ctx);
     free_extensions(ext_list, ext_count);
-    free_inode_cache(&inode_cache);
-    destroy_dir_stack(stack);
+    free_inode_cache(&ctx.inode_cache);
+    free_dir_queues(&queues);
+    return failed ? 1 : 0;
+}
+
+typedef struct {
+    char **ext_list;
+    int ext_count;
+    const char *db_name;  // our own commits must not wake the watcher
+} WatchFilter;
+
+static int watch_accept(void *arg, const char *name) {
+    const WatchFilter *filter = arg;
+    char extension[64];
+    if (strncmp(name, filter->db_name, strlen(filter->db_name)) == 0) return 0;
+    return extension_allowed(name, filter->ext_list, filter->ext_count, extension, sizeof(extension));
+}
+
+// `fhash watch` after its baseline scan: re-reads each settled burst of
+// changed directories through process_directory and commits it, until
+// SIGINT/SIGTERM.
+static int watch_directories(Watcher *watcher, const char *root, sqlite3 *db, sqlite3_stmt *upsert_stmt, sqlite3_stmt *lookup_stmt, sqlite3_stmt *reuse_md5_stmt, sqlite3_stmt *reuse_audio_md5_stmt, int *file_count, int verbose, const char *extensions_concatenated, int *batch_count, int hash_files, int hash_audio, int store_check_log, int use_xattr, int recurse_dirs, int scheduled, int64_t scan_gen) {
+    printf("Watching %s (%s); stop with Ctrl-C\n", root, (watch_backend(watcher) == WATCH_FANOTIFY) ? "fanotify" : "inotify");
+    fflush(stdout);
+    while (!stop_signal) {
+        if (watch_poll(watcher, 250) != 0) return 1;
+        if (!watch_ready(watcher)) continue;
+
+        WatchChange *changes = NULL;
+        size_t count = watch_take(watcher, &changes);
+        int before = *file_count;
+        int failed = 0;
+        for (size_t i = 0; i < count && !failed && !stop_signal; i++) {
+            struct stat st;
+            if (stat(changes[i].path, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+            if (verbose) {
+                printf("Changed: %s%s\n", changes[i].path, changes[i].subtree ? " (subtree)" : "");
+            }
+            if (process_directory(changes[i].path, db, upsert_stmt, lookup_stmt, reuse_md5_stmt, reuse_audio_md5_stmt, file_count, verbose, extensions_concatenated, 0, batch_count, hash_files, hash_audio, AUDIO_CHECK_LEVEL_NONE, store_check_log, use_xattr, recurse_dirs && changes[i].subtree, scheduled, ORDER_NONE, NULL, 0, NULL, scan_gen, NULL) != 0) {
+                failed = 1;
+            }
+        }
+        watch_free_changes(changes, count);
+        if (failed) return 1;
+
+        uint64_t commit_start = stats_begin();
+        int commit_rc = (commit_transaction(db) != 0 || begin_transaction(db) != 0);
+        stats_end(PHASE_COMMIT, commit_start, 0);
+        if (commit_rc) return 1;
+        *batch_count = 0;
+        if (*file_count > before) {
+            printf("Indexed %d changed files\n", *file_count - before);
+            fflush(stdout);
+            output_flush();
+        }
+    }
     return 0;
 }
 
-int main(int argc, char *argv[]) {
+static int fhash_main(int argc, char *argv[]) {
     if (argc < 2) {
         printf("Too few arguments: %s", USAGE_TEXT);
         return 1;
@@ -455,12 +1357,18 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
-    enum { CMD_UNKNOWN = 0, CMD_SCAN, CMD_DUPE, CMD_LINK, CMD_CHECK } command = CMD_UNKNOWN;
+    enum { CMD_UNKNOWN = 0, CMD_SCAN, CMD_DUPE, CMD_LINK, CMD_CHECK, CMD_WATCH, CMD_SERVE, CMD_QUERY, CMD_LOOKUP, CMD_COMPARE, CMD_MERGE } command = CMD_UNKNOWN;
     int arg_index = 1;
     if (strcmp(argv[arg_index], "scan") == 0) command = CMD_SCAN;
     else if (strcmp(argv[arg_index], "dupe") == 0) command = CMD_DUPE;
     else if (strcmp(argv[arg_index], "link") == 0) command = CMD_LINK;
     else if (strcmp(argv[arg_index], "check") == 0) command = CMD_CHECK;
+    else if (strcmp(argv[arg_index], "watch") == 0) command = CMD_WATCH;
+    else if (strcmp(argv[arg_index], "serve") == 0) command = CMD_SERVE;
+    else if (strcmp(argv[arg_index], "query") == 0) command = CMD_QUERY;
+    else if (strcmp(argv[arg_index], "lookup") == 0) command = CMD_LOOKUP;
+    else if (strcmp(argv[arg_index], "compare") == 0) command = CMD_COMPARE;
+    else if (strcmp(argv[arg_index], "merge") == 0) command = CMD_MERGE;
     else if (strcmp(argv[arg_index], "help") == 0) {
         help();
         return 0;
@@ -476,12 +1384,49 @@ int main(int argc, char *argv[]) {
     int force_rescan = 0;
     int hash_files = 0;
     int hash_audio = 0;
+    int quick_check = 0;
+    int store_check_log = 0;
+    int use_xattr = 0;
+    int print_stats = 0;
+    int show_progress = 0;
+    int precount = 0;
+    char *progress_file = NULL;
+    char *trace_path = NULL;
+    int ssd_workers = 0;
+    int hdd_workers = 0;
+    int order_mode = ORDER_NONE;
+    GovernorOptions governor_opts = {0};
+    long budget_seconds = 0;
+    int restart_run = 0;
+    int fast_rescan = 0;
+    long fast_verify_days = 30;
+    int force_inotify = 0;
+    int prune = 0;
+    long trace_min_us = 0;
     int recurse_dirs = 0;
     int dupe_mode = 0;
     int min_dupes = 2;
+    int top_groups = 0;
+    int output_fmt = OUTPUT_TEXT;
+    const char *output_path = NULL;
+    const char *sock_path = NULL;
+    int query_op = 0;
+    const char *query_arg = NULL;
+    // lookup takes its files as bare arguments; argc bounds how many.
+    char *lookup_paths[argc];
+    int lookup_count = 0;
+    int nul_input = 0;
     int link_mode = LINK_NONE;
     int dry_run = 0;
     char *database_path = "./file_hashes.db";
+    const char *database_path_b = NULL;
+    const char *start_path_b = NULL;
+    // merge: -source and -map apply to the -from before them, so each
+    // source's maps are consecutive in merge_maps.
+    MergeSource merge_sources[argc];
+    MergeMap merge_maps[argc];
+    int merge_count = 0;
+    int merge_map_count = 0;
     char *start_path = NULL;
     char *extensions_concatenated = "";
 
@@ -519,6 +1464,180 @@ int main(int argc, char *argv[]) {
             hash_files = 1;
         } else if (strcmp(argv[arg_index], "-a") == 0) {
             hash_audio = 1;
+        } else if (strcmp(argv[arg_index], "-q") == 0) {
+            quick_check = 1;
+        } else if (strcmp(argv[arg_index], "-logdb") == 0) {
+            store_check_log = 1;
+        } else if (strcmp(argv[arg_index], "-xattr") == 0) {
+            use_xattr = 1;
+        } else if (strcmp(argv[arg_index], "-stats") == 0) {
+            print_stats = 1;
+        } else if (strcmp(argv[arg_index], "-progress") == 0) {
+            show_progress = 1;
+        } else if (strcmp(argv[arg_index], "-precount") == 0) {
+            precount = 1;
+        } else if (strcmp(argv[arg_index], "-progfile") == 0) {
+            if (arg_index + 1 < argc) {
+                progress_file = argv[++arg_index];
+            } else {
+                printf("Error: Missing argument for -progfile option\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-j") == 0 || strcmp(argv[arg_index], "-jr") == 0) {
+            int rotational = (argv[arg_index][2] == 'r');
+            if (arg_index + 1 < argc) {
+                int workers = atoi(argv[++arg_index]);
+                if (workers < 1) {
+                    fprintf(stderr, "Error: %s requires a worker count >= 1\n", rotational ? "-jr" : "-j");
+                    return 1;
+                }
+                if (rotational) hdd_workers = workers; else ssd_workers = workers;
+            } else {
+                printf("Error: Missing argument for %s option\n", rotational ? "-jr" : "-j");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-top") == 0) {
+            if (arg_index + 1 < argc) {
+                top_groups = atoi(argv[++arg_index]);
+                if (top_groups < 1) {
+                    fprintf(stderr, "Error: -top requires a group count >= 1\n");
+                    return 1;
+                }
+            } else {
+                printf("Error: Missing argument for -top option\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-o") == 0) {
+            if (arg_index + 1 < argc) {
+                if (parse_output_format(argv[++arg_index], &output_fmt) != 0) {
+                    fprintf(stderr, "Error: -o takes text, jsonl, tsv or nul\n");
+                    return 1;
+                }
+            } else {
+                printf("Error: Missing argument for -o option\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-out") == 0) {
+            if (arg_index + 1 < argc) {
+                output_path = argv[++arg_index];
+            } else {
+                printf("Error: Missing argument for -out option\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-sock") == 0) {
+            if (arg_index + 1 < argc) {
+                sock_path = argv[++arg_index];
+            } else {
+                printf("Error: Missing argument for -sock option\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-hash") == 0 || strcmp(argv[arg_index], "-ahash") == 0 ||
+                   strcmp(argv[arg_index], "-path") == 0 || strcmp(argv[arg_index], "-group") == 0) {
+            const char *flag = argv[arg_index];
+            if (query_op) {
+                fprintf(stderr, "Error: query takes one of -hash, -ahash, -path or -group\n");
+                return 1;
+            }
+            query_op = (flag[1] == 'h') ? SERVE_OP_HASH : (flag[1] == 'a') ? SERVE_OP_AUDIO : (flag[1] == 'p') ? SERVE_OP_PATH : SERVE_OP_GROUP;
+            if (arg_index + 1 < argc) {
+                query_arg = argv[++arg_index];
+            } else {
+                printf("Error: Missing argument for %s option\n", flag);
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-budget") == 0) {
+            if (arg_index + 1 < argc) {
+                if (parse_duration(argv[++arg_index], &budget_seconds) != 0) {
+                    fprintf(stderr, "Error: -budget takes a duration such as 45s, 30m, 2h or 1h30m\n");
+                    return 1;
+                }
+            } else {
+                printf("Error: Missing argument for -budget option\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-restart") == 0) {
+            restart_run = 1;
+        } else if (strcmp(argv[arg_index], "-prune") == 0) {
+            prune = 1;
+        } else if (strcmp(argv[arg_index], "-inotify") == 0) {
+            force_inotify = 1;
+        } else if (strcmp(argv[arg_index], "-fast") == 0) {
+            fast_rescan = 1;
+        } else if (strcmp(argv[arg_index], "-fastverify") == 0) {
+            if (arg_index + 1 < argc) {
+                char *end = NULL;
+                fast_verify_days = strtol(argv[++arg_index], &end, 10);
+                if (*end != '\0' || fast_verify_days < 0) {
+                    fprintf(stderr, "Error: -fastverify takes a number of days (0 = never re-verify)\n");
+                    return 1;
+                }
+            } else {
+                printf("Error: Missing argument for -fastverify option\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-maxbps") == 0) {
+            if (arg_index + 1 < argc) {
+                if (parse_byte_rate(argv[++arg_index], &governor_opts.max_bytes_per_sec) != 0) {
+                    fprintf(stderr, "Error: -maxbps takes a positive rate such as 500K, 40M or 1G\n");
+                    return 1;
+                }
+            } else {
+                printf("Error: Missing argument for -maxbps option\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-maxfps") == 0) {
+            if (arg_index + 1 < argc) {
+                governor_opts.max_files_per_sec = atof(argv[++arg_index]);
+                if (governor_opts.max_files_per_sec <= 0) {
+                    fprintf(stderr, "Error: -maxfps must be > 0\n");
+                    return 1;
+                }
+            } else {
+                printf("Error: Missing argument for -maxfps option\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-maxlat") == 0) {
+            if (arg_index + 1 < argc) {
+                governor_opts.max_latency_ms = atof(argv[++arg_index]);
+                if (governor_opts.max_latency_ms <= 0) {
+                    fprintf(stderr, "Error: -maxlat must be > 0\n");
+                    return 1;
+                }
+            } else {
+                printf("Error: Missing argument for -maxlat option\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-idle") == 0) {
+            governor_opts.idle = 1;
+        } else if (strcmp(argv[arg_index], "-nocache") == 0) {
+            governor_opts.drop_cache = 1;
+        } else if (strcmp(argv[arg_index], "-order") == 0) {
+            if (arg_index + 1 < argc) {
+                const char *order_name = argv[++arg_index];
+                if (strcmp(order_name, "inode") == 0) order_mode = ORDER_INODE;
+                else if (strcmp(order_name, "extent") == 0) order_mode = ORDER_EXTENT;
+                else {
+                    fprintf(stderr, "Error: Unknown -order mode '%s' (use inode or extent)\n", order_name);
+                    return 1;
+                }
+            } else {
+                printf("Error: Missing argument for -order option\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-trace") == 0) {
+            if (arg_index + 1 < argc) {
+                trace_path = argv[++arg_index];
+            } else {
+                printf("Error: Missing argument for -trace option\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-tracemin") == 0) {
+            if (arg_index + 1 < argc) {
+                trace_min_us = atol(argv[++arg_index]);
+            } else {
+                printf("Error: Missing argument for -tracemin option\n");
+                return 1;
+            }
         } else if (strncmp(argv[arg_index], "-xa", 3) == 0 ||
                    strncmp(argv[arg_index], "-xh", 3) == 0) {
             int requested_mode = (argv[arg_index][2] == 'a') ? DUPE_AUDIO : DUPE_FILE;
@@ -536,19 +1655,70 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "Error: -l requires a mode (s,d,m,o,n)\n");
                 return 1;
             }
-            switch (argv[arg_index][2]) {
+            // -lr{mode}: the same keeper choice, deduplicated with reflinks
+            // (shallowest path when no mode follows).
+            const char *mode = argv[arg_index] + 2;
+            int reflink = 0;
+            if (mode[0] == 'r') {
+                reflink = LINK_REFLINK;
+                mode = (mode[1] != '\0') ? mode + 1 : "s";
+            }
+            switch (mode[0]) {
                 case 's': link_mode = LINK_SHALLOW; break;
                 case 'd': link_mode = LINK_DEEP; break;
                 case 'm': link_mode = LINK_METADATA; break;
                 case 'o': link_mode = LINK_OLDEST; break;
                 case 'n': link_mode = LINK_NEWEST; break;
                 default:
-                    fprintf(stderr, "Error: Unknown -l mode '%c' (use s,d,m,o,n)\n", argv[arg_index][2]);
+                    fprintf(stderr, "Error: Unknown -l mode '%c' (use s,d,m,o,n)\n", mode[0]);
                     return 1;
             }
+            link_mode |= reflink;
+        } else if (strcmp(argv[arg_index], "-d2") == 0) {
+            if (arg_index + 1 < argc) {
+                database_path_b = argv[++arg_index];
+            } else {
+                printf("Error: Missing argument for -d2 option\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-s2") == 0) {
+            if (arg_index + 1 < argc) {
+                start_path_b = argv[++arg_index];
+            } else {
+                printf("Error: Missing argument for -s2 option\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-from") == 0) {
+            if (arg_index + 1 < argc) {
+                merge_sources[merge_count++] = (MergeSource){ .db_path = argv[++arg_index], .maps = &merge_maps[merge_map_count] };
+            } else {
+                printf("Error: Missing argument for -from option\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-source") == 0) {
+            if (arg_index + 1 < argc && merge_count > 0) {
+                merge_sources[merge_count - 1].name = argv[++arg_index];
+            } else {
+                printf("Error: -source needs a name and follows -from <dbpath>\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-map") == 0) {
+            char *sep = (arg_index + 1 < argc) ? strchr(argv[arg_index + 1], '=') : NULL;
+            if (sep && merge_count > 0) {
+                *sep = '\0';
+                merge_maps[merge_map_count++] = (MergeMap){ .from = argv[++arg_index], .to = sep + 1 };
+                merge_sources[merge_count - 1].map_count++;
+            } else {
+                printf("Error: -map needs <old>=<new> and follows -from <dbpath>\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg_index], "-0") == 0) {
+            nul_input = 1;
         } else if (strcmp(argv[arg_index], "-help") == 0 || strcmp(argv[arg_index], "help") == 0) {
             help();
             return 0;
+        } else if (command == CMD_LOOKUP && argv[arg_index][0] != '-') {
+            lookup_paths[lookup_count++] = argv[arg_index];
         } else {
             fprintf(stderr, "Error: unknown option: %s\n%s", argv[arg_index], USAGE_TEXT);
             return 1;
@@ -556,9 +1726,13 @@ int main(int argc, char *argv[]) {
         arg_index++;
     }
 
-    if (command == CMD_SCAN) {
+    if (command == CMD_SCAN || command == CMD_WATCH) {
         if (dupe_mode != 0 || link_mode != LINK_NONE) {
-            fprintf(stderr, "Error: duplicate/link flags not allowed with scan\n");
+            fprintf(stderr, "Error: duplicate/link flags not allowed with %s\n", argv[1]);
+            return 1;
+        }
+        if (quick_check) {
+            fprintf(stderr, "Error: -q is only valid in check mode\n");
             return 1;
         }
     } else if (command == CMD_CHECK) {
@@ -566,7 +1740,7 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Error: duplicate/link flags not allowed with check\n");
             return 1;
         }
-        if (hash_files || hash_audio || dry_run) {
+        if (hash_files || hash_audio || (dry_run && !prune)) {
             fprintf(stderr, "Error: scan/link flags are not valid in check mode\n");
             return 1;
         }
@@ -575,7 +1749,7 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Error: dupe requires -xa or -xh\n");
             return 1;
         }
-        if (link_mode != LINK_NONE || hash_files || hash_audio || force_rescan) {
+        if (link_mode != LINK_NONE || hash_files || hash_audio || force_rescan || quick_check || store_check_log) {
             fprintf(stderr, "Error: scanning/link flags are not valid in dupe mode\n");
             return 1;
         }
@@ -588,13 +1762,186 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Error: link requires -l{mode}\n");
             return 1;
         }
-        if (hash_files || hash_audio || force_rescan) {
+        if ((link_mode & LINK_REFLINK) && dupe_mode != DUPE_FILE) {
+            // Audio-hash groups differ in their tags, so their bytes never match.
+            fprintf(stderr, "Error: -lr requires -xh\n");
+            return 1;
+        }
+        if (hash_files || hash_audio || force_rescan || quick_check || store_check_log) {
             fprintf(stderr, "Error: scanning flags are not valid in link mode\n");
             return 1;
         }
     }
+    if (command == CMD_SERVE || command == CMD_QUERY) {
+        if (dupe_mode || link_mode != LINK_NONE || hash_files || hash_audio || force_rescan || quick_check || store_check_log ||
+            show_progress || precount || progress_file || trace_path || ssd_workers || hdd_workers || order_mode != ORDER_NONE ||
+            budget_seconds || restart_run || prune || fast_rescan || force_inotify || top_groups || dry_run || start_path ||
+            recurse_dirs || extensions_concatenated[0] || governor_opts.max_bytes_per_sec || governor_opts.max_files_per_sec > 0 ||
+            governor_opts.max_latency_ms > 0 || governor_opts.idle || governor_opts.drop_cache) {
+            fprintf(stderr, "Error: scan, dupe and link flags are not valid with %s\n", argv[1]);
+            return 1;
+        }
+        if (!sock_path) {
+            fprintf(stderr, "Error: %s requires -sock <path>\n", argv[1]);
+            return 1;
+        }
+    } else if (sock_path) {
+        fprintf(stderr, "Error: -sock is only valid with serve and query\n");
+        return 1;
+    }
+    if (command == CMD_LOOKUP) {
+        if (dupe_mode || link_mode != LINK_NONE || hash_files || force_rescan || quick_check || store_check_log ||
+            show_progress || precount || progress_file || trace_path || order_mode != ORDER_NONE || budget_seconds ||
+            restart_run || prune || fast_rescan || force_inotify || top_groups || dry_run || start_path || recurse_dirs ||
+            extensions_concatenated[0] || governor_opts.max_bytes_per_sec || governor_opts.max_files_per_sec > 0 ||
+            governor_opts.max_latency_ms > 0 || governor_opts.idle || governor_opts.drop_cache) {
+            fprintf(stderr, "Error: only -a, -0, -j/-jr and output flags are valid with lookup\n");
+            return 1;
+        }
+    } else if (nul_input) {
+        fprintf(stderr, "Error: -0 is only valid with lookup\n");
+        return 1;
+    }
+    if (command == CMD_COMPARE) {
+        if (dupe_mode || link_mode != LINK_NONE || hash_files || hash_audio || force_rescan || quick_check || store_check_log ||
+            use_xattr || show_progress || precount || progress_file || trace_path || ssd_workers || hdd_workers ||
+            order_mode != ORDER_NONE || budget_seconds || restart_run || prune || fast_rescan || force_inotify || top_groups ||
+            dry_run || recurse_dirs || extensions_concatenated[0] || governor_opts.max_bytes_per_sec ||
+            governor_opts.max_files_per_sec > 0 || governor_opts.max_latency_ms > 0 || governor_opts.idle || governor_opts.drop_cache) {
+            fprintf(stderr, "Error: only -d, -d2, -s, -s2 and output flags are valid with compare\n");
+            return 1;
+        }
+        if (!database_path_b) {
+            fprintf(stderr, "Error: compare requires -d2 <dbpath>\n");
+            return 1;
+        }
+    } else if (database_path_b || start_path_b) {
+        fprintf(stderr, "Error: -d2/-s2 are only valid with compare\n");
+        return 1;
+    }
+    if (command == CMD_MERGE) {
+        if (dupe_mode || link_mode != LINK_NONE || hash_files || hash_audio || force_rescan || quick_check || store_check_log ||
+            use_xattr || show_progress || precount || progress_file || trace_path || ssd_workers || hdd_workers ||
+            order_mode != ORDER_NONE || budget_seconds || restart_run || prune || fast_rescan || force_inotify || top_groups ||
+            dry_run || start_path || recurse_dirs || extensions_concatenated[0] || governor_opts.max_bytes_per_sec ||
+            governor_opts.max_files_per_sec > 0 || governor_opts.max_latency_ms > 0 || governor_opts.idle || governor_opts.drop_cache) {
+            fprintf(stderr, "Error: only -d, -from, -source, -map and output flags are valid with merge\n");
+            return 1;
+        }
+        if (merge_count == 0) {
+            fprintf(stderr, "Error: merge requires -from <dbpath>\n");
+            return 1;
+        }
+    } else if (merge_count) {
+        fprintf(stderr, "Error: -from/-source/-map are only valid with merge\n");
+        return 1;
+    }
+    if ((command == CMD_QUERY) != (query_op != 0)) {
+        fprintf(stderr, command == CMD_QUERY ? "Error: query requires one of -hash, -ahash, -path or -group\n"
+                                             : "Error: -hash/-ahash/-path/-group are only valid with query\n");
+        return 1;
+    }
+    if (command != CMD_DUPE && top_groups) {
+        fprintf(stderr, "Error: -top is only valid with dupe\n");
+        return 1;
+    }
+    if ((command == CMD_DUPE || command == CMD_LINK) && (show_progress || precount || progress_file)) {
+        fprintf(stderr, "Error: progress flags are only valid with scan and check\n");
+        return 1;
+    }
+    if (command == CMD_DUPE && (ssd_workers || hdd_workers)) {
+        fprintf(stderr, "Error: -j/-jr are only valid with scan, check and link\n");
+        return 1;
+    }
+    if ((command == CMD_DUPE || command == CMD_LINK) &&
+        (governor_opts.max_bytes_per_sec || governor_opts.max_files_per_sec > 0 || governor_opts.max_latency_ms > 0 || governor_opts.idle || governor_opts.drop_cache)) {
+        fprintf(stderr, "Error: governor flags are only valid with scan and check\n");
+        return 1;
+    }
+    if ((command == CMD_DUPE || command == CMD_LINK) && (budget_seconds || restart_run)) {
+        fprintf(stderr, "Error: -budget/-restart are only valid with scan and check\n");
+        return 1;
+    }
+    if (command == CMD_WATCH && (budget_seconds || show_progress || precount || progress_file)) {
+        fprintf(stderr, "Error: -budget and progress flags are not valid with watch\n");
+        return 1;
+    }
+    if (use_xattr && command != CMD_SCAN && command != CMD_CHECK && command != CMD_WATCH) {
+        fprintf(stderr, "Error: -xattr is only valid with scan, check and watch\n");
+        return 1;
+    }
+    if (command != CMD_WATCH && force_inotify) {
+        fprintf(stderr, "Error: -inotify is only valid with watch\n");
+        return 1;
+    }
+    if (prune && command != CMD_SCAN && command != CMD_CHECK) {
+        fprintf(stderr, "Error: -prune is only valid with scan and check\n");
+        return 1;
+    }
+    if (prune && fast_rescan) {
+        // Files under a skipped directory are never seen, so they would all
+        // look vanished.
+        fprintf(stderr, "Error: -prune cannot be combined with -fast\n");
+        return 1;
+    }
+    if (command != CMD_SCAN && fast_rescan) {
+        fprintf(stderr, "Error: -fast is only valid with scan\n");
+        return 1;
+    }
+    if (fast_rescan && force_rescan) {
+        fprintf(stderr, "Error: -fast and -f cannot be combined\n");
+        return 1;
+    }
+    if ((command == CMD_DUPE || command == CMD_LINK) && order_mode != ORDER_NONE) {
+        fprintf(stderr, "Error: -order is only valid with scan and check\n");
+        return 1;
+    }
+    if ((command == CMD_DUPE || command == CMD_LINK) && trace_path) {
+        fprintf(stderr, "Error: -trace is only valid with scan and check\n");
+        return 1;
+    }
+    if (trace_min_us < 0) {
+        fprintf(stderr, "Error: -tracemin must be >= 0\n");
+        return 1;
+    }
+    if (precount && !show_progress && !progress_file) {
+        fprintf(stderr, "Error: -precount requires -progress or -progfile\n");
+        return 1;
+    }
+
+    if ((output_fmt != OUTPUT_TEXT || output_path) && output_open(output_fmt, output_path) != 0) {
+        return 1;
+    }
+
+    if (command == CMD_QUERY) {
+        // Paths are indexed absolute; resolve the argument the way scan did.
+        char resolved_query[PATH_MAX];
+        if ((query_op == SERVE_OP_PATH || query_op == SERVE_OP_GROUP) && realpath(query_arg, resolved_query)) {
+            query_arg = resolved_query;
+        }
+        return serve_query(sock_path, query_op, query_arg);
+    }
+    if (command == CMD_COMPARE) {
+        // Roots are taken literally: the indexed trees may be on other hosts.
+        CompareOptions compare_opts = {
+            .db_a = database_path,
+            .db_b = database_path_b,
+            .root_a = start_path,
+            .root_b = start_path_b,
+            .verbose = verbose
+        };
+        return compare_indexes(&compare_opts);
+    }
+    if (command == CMD_SERVE) {
+        signal(SIGINT, handle_stop_signal);
+        signal(SIGTERM, handle_stop_signal);
+        return serve_run(database_path, sock_path, verbose, &stop_signal);
+    }
 
     init_logging_callback(verbose);
+    if (print_stats) {
+        stats_enable();
+    }
 
     if (verbose) {
         printf("fhash version: %s (DB schema: %s)\n", FHASH_VERSION, DB_VERSION);
@@ -610,6 +1957,38 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (command == CMD_MERGE) {
+        mainret = merge_indexes(db, merge_sources, merge_count, verbose);
+        sqlite3_close(db);
+        if (print_stats) {
+            stats_print_json(stderr, argv[1]);
+        }
+        return mainret;
+    }
+
+    if (command == CMD_LOOKUP) {
+        LookupOptions lookup_opts = {
+            .db_path = database_path,
+            .paths = lookup_paths,
+            .path_count = lookup_count,
+            .nul_input = nul_input,
+            .hash_audio = hash_audio,
+            .sched = {
+                .ssd_workers = ssd_workers ? ssd_workers : 4,
+                .hdd_workers = hdd_workers ? hdd_workers : 1,
+                .verbose = verbose,
+                .worker_exit = release_hash_context_pool
+            },
+            .verbose = verbose
+        };
+        mainret = lookup_files(db, &lookup_opts);
+        sqlite3_close(db);
+        if (print_stats) {
+            stats_print_json(stderr, argv[1]);
+        }
+        return mainret;
+    }
+
     if (command == CMD_DUPE || command == CMD_LINK) {
         char resolved_filter[PATH_MAX] = {0};
         const char *path_filter = NULL;
@@ -629,10 +2008,24 @@ int main(int argc, char *argv[]) {
             return 1;
         }
 
-        process_duplicates(db, dupe_mode, min_dupes, (command == CMD_LINK) ? link_mode : LINK_NONE, dry_run, path_filter, recurse_dirs, ext_list, ext_count);
+        IoSchedOptions link_sched = {
+            .ssd_workers = ssd_workers ? ssd_workers : 4,
+            .hdd_workers = hdd_workers ? hdd_workers : 1,
+            .verbose = verbose
+        };
+        int link_scheduled = (command == CMD_LINK && (ssd_workers || hdd_workers));
+        if (top_groups) {
+            report_top_dupes(db, dupe_mode, min_dupes, top_groups, path_filter, recurse_dirs, ext_list, ext_count);
+        } else {
+                process_duplicates(db, dupe_mode, min_dupes, (command == CMD_LINK) ? link_mode : LINK_NONE, dry_run, path_filter, recurse_dirs, ext_list, ext_count,
+                               link_scheduled ? &link_sched : NULL);
+        }
 
         free_extensions(ext_list, ext_count);
         sqlite3_close(db);
+        if (print_stats) {
+            stats_print_json(stderr, argv[1]);
+        }
         return 0;
     }
 
@@ -650,22 +2043,8 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    const char *upsert_sql =
-        "INSERT INTO files (md5, audio_md5, filepath, filename, extension, filesize, last_check_timestamp, modified_timestamp, filetype, audio_check_result) "
-        "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?) "
-        "ON CONFLICT(filepath) DO UPDATE SET "
-        "md5 = CASE WHEN ? THEN excluded.md5 ELSE files.md5 END, "
-        "audio_md5 = CASE WHEN ? THEN excluded.audio_md5 ELSE files.audio_md5 END, "
-        "audio_check_result = CASE WHEN ? THEN excluded.audio_check_result ELSE files.audio_check_result END, "
-        "filename = excluded.filename, "
-        "extension = excluded.extension, "
-        "filesize = excluded.filesize, "
-        "last_check_timestamp = excluded.last_check_timestamp, "
-        "modified_timestamp = excluded.modified_timestamp, "
-        "filetype = excluded.filetype;";
-
     sqlite3_stmt *upsert_stmt = NULL;
-    if (sqlite3_prepare_v2(db, upsert_sql, -1, &upsert_stmt, NULL) != SQLITE_OK) {
+    if (sqlite3_prepare_v2(db, FILES_UPSERT_SQL, -1, &upsert_stmt, NULL) != SQLITE_OK) {
         fprintf(stderr, "Failed to prepare upsert statement: %s\n", sqlite3_errmsg(db));
         rollback_transaction(db);
         sqlite3_close(db);
@@ -673,7 +2052,7 @@ int main(int argc, char *argv[]) {
     }
 
     sqlite3_stmt *lookup_stmt = NULL;
-    const char *lookup_sql = "SELECT filesize, modified_timestamp, filetype, md5, audio_md5, audio_check_result FROM files WHERE filepath = ?;";
+    const char *lookup_sql = "SELECT filesize, modified_timestamp, filetype, md5, audio_md5, audio_check_result, audio_check_level FROM files WHERE filepath = ?;";
     if (sqlite3_prepare_v2(db, lookup_sql, -1, &lookup_stmt, NULL) != SQLITE_OK) {
         fprintf(stderr, "Failed to prepare metadata lookup statement: %s\n", sqlite3_errmsg(db));
         sqlite3_finalize(upsert_stmt);
@@ -683,7 +2062,7 @@ int main(int argc, char *argv[]) {
     }
 
     sqlite3_stmt *reuse_md5_stmt = NULL;
-    const char *reuse_md5_sql = "SELECT audio_check_result FROM files WHERE md5 = ? AND audio_check_result != 4 LIMIT 1;";
+    const char *reuse_md5_sql = "SELECT audio_check_result FROM files WHERE md5 = ? AND audio_check_result != 4 AND audio_check_level >= ? LIMIT 1;";
     if (sqlite3_prepare_v2(db, reuse_md5_sql, -1, &reuse_md5_stmt, NULL) != SQLITE_OK) {
         fprintf(stderr, "Failed to prepare md5 reuse statement: %s\n", sqlite3_errmsg(db));
         sqlite3_finalize(lookup_stmt);
@@ -694,7 +2073,7 @@ int main(int argc, char *argv[]) {
     }
 
     sqlite3_stmt *reuse_audio_md5_stmt = NULL;
-    const char *reuse_audio_md5_sql = "SELECT audio_check_result FROM files WHERE audio_md5 = ? AND audio_check_result != 4 LIMIT 1;";
+    const char *reuse_audio_md5_sql = "SELECT audio_check_result FROM files WHERE audio_md5 = ? AND audio_check_result != 4 AND audio_check_level >= ? LIMIT 1;";
     if (sqlite3_prepare_v2(db, reuse_audio_md5_sql, -1, &reuse_audio_md5_stmt, NULL) != SQLITE_OK) {
         fprintf(stderr, "Failed to prepare audio_md5 reuse statement: %s\n", sqlite3_errmsg(db));
         sqlite3_finalize(reuse_md5_stmt);
@@ -705,31 +2084,193 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    // Every scan/check keeps a run record so an interrupted one resumes from
+    // its saved frontier; the counters feed the record's totals. A pruning
+    // run (p=1) never resumes a plain one, whose sessions stamped only the
+    // rows they wrote.
+    char run_params[512];
+    snprintf(run_params, sizeof(run_params), "r=%d h=%d a=%d f=%d q=%d e=%s%s",
+             recurse_dirs, hash_files, hash_audio, force_rescan, quick_check, extensions_concatenated, prune ? " p=1" : "");
+    ScanRun scan_run;
+    if (scan_run_begin(&scan_run, db, argv[1], resolved_dir, run_params, restart_run) != 0) {
+        scan_run_end(&scan_run);
+        sqlite3_finalize(reuse_audio_md5_stmt);
+        sqlite3_finalize(reuse_md5_stmt);
+        sqlite3_finalize(lookup_stmt);
+        sqlite3_finalize(upsert_stmt);
+        rollback_transaction(db);
+        sqlite3_close(db);
+        return 1;
+    }
+    // Directory listings are only trusted for the exact scan parameters that
+    // produced them, and only until the verify window runs out.
+    DirIndex dir_index;
+    int dir_index_active = 0;
+    if (fast_rescan) {
+        int64_t verify_before = fast_verify_days ? (int64_t)time(NULL) - (int64_t)fast_verify_days * 86400 : 0;
+        if (dir_index_open(&dir_index, db, run_params, verify_before) != 0) {
+            scan_run_end(&scan_run);
+            sqlite3_finalize(reuse_audio_md5_stmt);
+            sqlite3_finalize(reuse_md5_stmt);
+            sqlite3_finalize(lookup_stmt);
+            sqlite3_finalize(upsert_stmt);
+            rollback_transaction(db);
+            sqlite3_close(db);
+            return 1;
+        }
+        dir_index_active = 1;
+    }
+    // -prune also stamps rows found current, so the sweep can tell them from
+    // rows whose files are gone.
+    sqlite3_stmt *stamp_stmt = NULL;
+    if (prune && sqlite3_prepare_v2(db, "UPDATE files SET scan_gen = ? WHERE filepath = ?;", -1, &stamp_stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare prune stamp statement: %s\n", sqlite3_errmsg(db));
+        mainret = 1;
+    }
+    stats_enable_counters();
+    uint64_t deadline_ns = budget_seconds ? stats_now_ns() + (uint64_t)budget_seconds * 1000000000ULL : 0;
+    signal(SIGINT, handle_stop_signal);
+    signal(SIGTERM, handle_stop_signal);
+
     int file_count = 0;
     int batch_count = 0;
 
-    int run_audio_check = (command == CMD_CHECK);
-    if (process_directory(resolved_dir, db, upsert_stmt, lookup_stmt, reuse_md5_stmt, reuse_audio_md5_stmt, &file_count, verbose, extensions_concatenated, force_rescan, &batch_count, hash_files, hash_audio, run_audio_check, recurse_dirs) != 0) {
+    int audio_check_level = AUDIO_CHECK_LEVEL_NONE;
+    if (command == CMD_CHECK) {
+        audio_check_level = quick_check ? AUDIO_CHECK_LEVEL_QUICK : AUDIO_CHECK_LEVEL_FULL;
+    }
+    // Before any helper thread starts, so they inherit the idle priorities.
+    governor_start(&governor_opts);
+
+    // With a progress reporter the per-file verbose lines are dropped: they
+    // cost throughput and would break the status line.
+    int verbose_files = verbose && !show_progress && !progress_file;
+    char **progress_ext_list = NULL;
+    int progress_ext_count = 0;
+    if (show_progress || progress_file) {
+        if (parse_extensions(extensions_concatenated, &progress_ext_list, &progress_ext_count) != 0) {
+            mainret = 1;
+        } else {
+            ProgressOptions progress_opts = {
+                .status_line = show_progress,
+                .snapshot_path = progress_file,
+                .precount = precount,
+                .root = resolved_dir,
+                .recurse_dirs = recurse_dirs,
+                .ext_list = progress_ext_list,
+                .ext_count = progress_ext_count
+            };
+            if (progress_start(&progress_opts) != 0) {
+                mainret = 1;
+            }
+        }
+    }
+
+    if (mainret == 0 && trace_path && trace_open(trace_path, (uint64_t)trace_min_us, argv[1]) != 0) {
         mainret = 1;
     }
+    int scheduled = (ssd_workers > 0 || hdd_workers > 0);
+    if (scheduled) {
+        IoSchedOptions sched_opts = {
+            .ssd_workers = ssd_workers ? ssd_workers : 4,
+            .hdd_workers = hdd_workers ? hdd_workers : 1,
+            .verbose = verbose,
+            .worker_exit = release_hash_context_pool
+        };
+        iosched_start(compute_file_job_worker, &sched_opts);
+    }
+    // Subscribed before the baseline scan so nothing landing during it is missed.
+    Watcher *watcher = NULL;
+    WatchFilter watch_filter = {0};
+    if (mainret == 0 && command == CMD_WATCH) {
+        const char *db_slash = strrchr(database_path, '/');
+        watch_filter.db_name = db_slash ? db_slash + 1 : database_path;
+        if (parse_extensions(extensions_concatenated, &watch_filter.ext_list, &watch_filter.ext_count) != 0 ||
+            (watcher = watch_open(resolved_dir, recurse_dirs, force_inotify, watch_accept, &watch_filter)) == NULL) {
+            mainret = 1;
+        }
+    }
+    if (mainret == 0 && process_directory(resolved_dir, db, upsert_stmt, lookup_stmt, reuse_md5_stmt, reuse_audio_md5_stmt, &file_count, verbose_files, extensions_concatenated, force_rescan, &batch_count, hash_files, hash_audio, audio_check_level, store_check_log, use_xattr, recurse_dirs, scheduled, order_mode, &scan_run, deadline_ns, dir_index_active ? &dir_index : NULL, scan_run.id, stamp_stmt) != 0) {
+        mainret = 1;
+    }
+    if (mainret == 0 && prune && scan_run.complete) {
+        if (scan_run.errors > 0) {
+            printf("Prune skipped: %lld errors during the walk; no rows removed.\n", (long long)scan_run.errors);
+        } else {
+            char **prune_ext_list = NULL;
+            int prune_ext_count = 0;
+            int pruned = -1;
+            if (parse_extensions(extensions_concatenated, &prune_ext_list, &prune_ext_count) == 0) {
+                pruned = prune_unseen_files(db, resolved_dir, recurse_dirs, prune_ext_list, prune_ext_count, scan_run.id, dry_run);
+                free_extensions(prune_ext_list, prune_ext_count);
+            }
+            if (pruned < 0) {
+                mainret = 1;
+            } else {
+                printf(dry_run ? "Would prune %d vanished files\n" : "Pruned %d vanished files\n", pruned);
+            }
+        }
+    }
+    if (mainret == 0 && watcher) {
+        uint64_t commit_start = stats_begin();
+        int commit_rc = (commit_transaction(db) != 0 || begin_transaction(db) != 0);
+        stats_end(PHASE_COMMIT, commit_start, 0);
+        batch_count = 0;
+        if (commit_rc || watch_directories(watcher, resolved_dir, db, upsert_stmt, lookup_stmt, reuse_md5_stmt, reuse_audio_md5_stmt, &file_count, verbose_files, extensions_concatenated, &batch_count, hash_files, hash_audio, store_check_log, use_xattr, recurse_dirs, scheduled, scan_run.id) != 0) {
+            mainret = 1;
+        }
+    }
+    watch_close(watcher);
+    free_extensions(watch_filter.ext_list, watch_filter.ext_count);
+    if (scheduled) {
+        iosched_stop();
+    }
+    progress_stop();
+    free_extensions(progress_ext_list, progress_ext_count);
 
     if (mainret == 0) {
+        uint64_t commit_start = stats_begin();
         if (commit_transaction(db) != 0) {
             mainret = 1;
         }
+        stats_end(PHASE_COMMIT, commit_start, 0);
     } else {
         rollback_transaction(db);
     }
+    trace_close();
+    if (dir_index_active) {
+        dir_index_close(&dir_index);
+    }
+    scan_run_end(&scan_run);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    if (stop_signal && command != CMD_WATCH) {
+        mainret = 1;
+    }
 
+    sqlite3_finalize(stamp_stmt);
     sqlite3_finalize(upsert_stmt);
     sqlite3_finalize(lookup_stmt);
     sqlite3_finalize(reuse_md5_stmt);
     sqlite3_finalize(reuse_audio_md5_stmt);
     sqlite3_close(db);
+    release_hash_context_pool();
 
     if (verbose) {
         printf("Treated %d files.\n", file_count);
     }
+    if (print_stats) {
+        stats_print_json(stderr, argv[1]);
+    }
 
     return mainret;
 }
+
+int main(int argc, char *argv[]) {
+    int ret = fhash_main(argc, argv);
+    // Records are buffered until here; a dropped record or a failed write
+    // must still fail the run.
+    output_close();
+    if (ret == 0 && output_failed()) ret = 1;
+    return ret;
+}
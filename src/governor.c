@@ -0,0 +1,161 @@
+#include "governor.h"
+#include <pthread.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+// Unused credit a bucket may bank while idle, so short bursts after a
+// directory walk are not penalised but a long pause cannot buy a flood.
+#define GOVERNOR_BURST_NS 250000000ULL
+// Latency back-off: the pause starts here, doubles while the smoothed read
+// latency stays high and halves once it recovers. It moves at most one step
+// per interval, so the rate of reads (and of threads) cannot drive it to the
+// cap within a few calls.
+#define GOVERNOR_PENALTY_MIN_NS 5000000ULL
+#define GOVERNOR_PENALTY_MAX_NS 1000000000ULL
+#define GOVERNOR_PENALTY_STEP_NS 250000000ULL
+// Residency probe window at the head of a file.
+#define GOVERNOR_PROBE_BYTES (1024 * 1024)
+
+#define FHASH_IOPRIO_CLASS_IDLE 3
+#define FHASH_IOPRIO_CLASS_SHIFT 13
+#define FHASH_IOPRIO_WHO_PROCESS 1
+
+int governor_enabled = 0;
+int governor_drop_cache = 0;
+
+static GovernorOptions gov_opts;
+static pthread_mutex_t gov_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t next_byte_ns = 0;
+static uint64_t next_file_ns = 0;
+static uint64_t latency_ewma_ns = 0;
+static uint64_t penalty_ns = 0;
+static uint64_t penalty_step_ns = 0;
+
+uint64_t governor_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec ts = { .tv_sec = (time_t)(ns / 1000000000ULL), .tv_nsec = (long)(ns % 1000000000ULL) };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+}
+
+// Advances a virtual-clock bucket by cost_ns and returns how long the caller
+// must wait for its share.
+static uint64_t bucket_take(uint64_t *next_ns, uint64_t now, uint64_t cost_ns) {
+    uint64_t floor_ns = (now > GOVERNOR_BURST_NS) ? now - GOVERNOR_BURST_NS : 0;
+    if (*next_ns < floor_ns) *next_ns = floor_ns;
+    *next_ns += cost_ns;
+    return (*next_ns > now) ? *next_ns - now : 0;
+}
+
+int governor_start(const GovernorOptions *opts) {
+    gov_opts = *opts;
+    governor_drop_cache = opts->drop_cache;
+    governor_enabled = (opts->max_bytes_per_sec > 0 || opts->max_files_per_sec > 0 || opts->max_latency_ms > 0);
+
+    if (opts->idle) {
+        // Both are per-thread on Linux and inherited by threads created
+        // later, so this must run before the worker and progress threads.
+        int ioprio = FHASH_IOPRIO_CLASS_IDLE << FHASH_IOPRIO_CLASS_SHIFT;
+        if (syscall(SYS_ioprio_set, FHASH_IOPRIO_WHO_PROCESS, 0, ioprio) != 0) {
+            fprintf(stderr, "Warning: cannot set idle I/O priority: %m\n");
+        }
+        if (setpriority(PRIO_PROCESS, 0, 19) != 0) {
+            fprintf(stderr, "Warning: cannot lower CPU priority: %m\n");
+        }
+    }
+    return 0;
+}
+
+void governor_charge_read(uint64_t bytes, uint64_t latency_ns) {
+    uint64_t wait = 0;
+    pthread_mutex_lock(&gov_lock);
+    uint64_t now = governor_now_ns();
+    if (gov_opts.max_bytes_per_sec > 0) {
+        uint64_t cost = (uint64_t)((double)bytes * 1e9 / (double)gov_opts.max_bytes_per_sec);
+        wait = bucket_take(&next_byte_ns, now, cost);
+    }
+    if (gov_opts.max_latency_ms > 0) {
+        latency_ewma_ns = latency_ewma_ns
+            ? latency_ewma_ns - latency_ewma_ns / 8 + latency_ns / 8
+            : latency_ns;
+        int high = (double)latency_ewma_ns > gov_opts.max_latency_ms * 1e6;
+        if (high && !penalty_ns) {
+            // First sign of trouble backs off at once; growth is paced below.
+            penalty_ns = GOVERNOR_PENALTY_MIN_NS;
+            penalty_step_ns = now;
+        } else if (penalty_ns && now - penalty_step_ns >= GOVERNOR_PENALTY_STEP_NS) {
+            if (high) {
+                penalty_ns *= 2;
+                if (penalty_ns > GOVERNOR_PENALTY_MAX_NS) penalty_ns = GOVERNOR_PENALTY_MAX_NS;
+            } else {
+                penalty_ns /= 2;
+                if (penalty_ns < GOVERNOR_PENALTY_MIN_NS) penalty_ns = 0;
+            }
+            penalty_step_ns = now;
+        }
+        wait += penalty_ns;
+    }
+    pthread_mutex_unlock(&gov_lock);
+    if (wait) sleep_ns(wait);
+}
+
+void governor_charge_file(void) {
+    if (gov_opts.max_files_per_sec <= 0) return;
+    pthread_mutex_lock(&gov_lock);
+    uint64_t wait = bucket_take(&next_file_ns, governor_now_ns(), (uint64_t)(1e9 / gov_opts.max_files_per_sec));
+    pthread_mutex_unlock(&gov_lock);
+    if (wait) sleep_ns(wait);
+}
+
+// Dropping a file someone else is serving from cache would hurt the very
+// services the governor protects, so only files whose head was not already
+// resident are marked for eviction.
+int governor_file_open(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) return 0;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+
+    size_t probe = (st.st_size < GOVERNOR_PROBE_BYTES) ? (size_t)st.st_size : GOVERNOR_PROBE_BYTES;
+    void *map = mmap(NULL, probe, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return 1;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t pages = (probe + (size_t)page - 1) / (size_t)page;
+    unsigned char vec[GOVERNOR_PROBE_BYTES / 4096];
+    int resident = 0;
+    if (pages <= sizeof(vec) && mincore(map, probe, vec) == 0) {
+        for (size_t i = 0; i < pages && !resident; i++) {
+            resident = vec[i] & 1;
+        }
+    }
+    munmap(map, probe);
+    return !resident;
+}
+
+void governor_file_done(int fd) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// Accepts "50M", "1.5G", "800k" or plain bytes; suffixes are binary.
+int parse_byte_rate(const char *text, uint64_t *out) {
+    char *end = NULL;
+    errno = 0;
+    double value = strtod(text, &end);
+    if (errno != 0 || end == text || value <= 0) return -1;
+    switch (toupper((unsigned char)*end)) {
+        case 'K': value *= 1024.0; end++; break;
+        case 'M': value *= 1024.0 * 1024.0; end++; break;
+        case 'G': value *= 1024.0 * 1024.0 * 1024.0; end++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if (*end != '\0' || value < 1) return -1;
+    *out = (uint64_t)value;
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include "hashcache.h"
+#include <errno.h>
+#include <sys/xattr.h>
+
+#define ATTR_ALG "user.fhash.alg"
+#define ATTR_MD5 "user.fhash.md5"
+#define ATTR_AUDIO_MD5 "user.fhash.audio_md5"
+#define ATTR_CHECK "user.fhash.check"
+#define ATTR_STAMP "user.fhash.stamp"
+
+// ctime is left out of the stamp: setting the attributes bumps it, and no
+// copy or restore can preserve it.
+static void format_stamp(const struct stat *st, char *out, size_t len) {
+    snprintf(out, len, "%lld %lld.%09ld", (long long)st->st_size, (long long)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec);
+}
+
+static int get_attr(const char *path, const char *name, char *out, size_t len) {
+    ssize_t n = getxattr(path, name, out, len - 1);
+    if (n < 0) {
+        out[0] = '\0';
+        return -1;
+    }
+    out[n] = '\0';
+    return 0;
+}
+
+void hashcache_read(const char *path, const struct stat *st, HashCache *cache) {
+    char value[64];
+    char expected[64];
+    memset(cache, 0, sizeof(*cache));
+    cache->check_result = -1;
+
+    format_stamp(st, expected, sizeof(expected));
+    if (get_attr(path, ATTR_STAMP, value, sizeof(value)) != 0 || strcmp(value, expected) != 0) return;
+    if (get_attr(path, ATTR_ALG, value, sizeof(value)) != 0 || strcmp(value, HASHCACHE_ALG) != 0) return;
+    cache->valid = 1;
+    get_attr(path, ATTR_MD5, cache->md5, sizeof(cache->md5));
+    get_attr(path, ATTR_AUDIO_MD5, cache->audio_md5, sizeof(cache->audio_md5));
+    int result, level;
+    if (get_attr(path, ATTR_CHECK, value, sizeof(value)) == 0 && sscanf(value, "%d %d", &result, &level) == 2) {
+        cache->check_result = result;
+        cache->check_level = level;
+    }
+}
+
+static int set_attr(const char *path, const char *name, const char *value) {
+    return setxattr(path, name, value, strlen(value), 0);
+}
+
+static int drop_attr(const char *path, const char *name) {
+    if (removexattr(path, name) == 0 || errno == ENODATA) return 0;
+    return -1;
+}
+
+int hashcache_write(const char *path, const struct stat *st, const HashCache *cache) {
+    struct stat now;
+    if (stat(path, &now) != 0) return -1;
+    if (now.st_size != st->st_size || now.st_mtim.tv_sec != st->st_mtim.tv_sec || now.st_mtim.tv_nsec != st->st_mtim.tv_nsec) {
+        // Changed while it was hashed; the values describe neither version.
+        errno = ESTALE;
+        return -1;
+    }
+
+    char value[64];
+    format_stamp(st, value, sizeof(value));
+    // The stamp goes last, so an interrupted write never vouches for a
+    // mix of old and new values.
+    if (!cache->valid) {
+        if (drop_attr(path, ATTR_STAMP) != 0 || drop_attr(path, ATTR_MD5) != 0 ||
+            drop_attr(path, ATTR_AUDIO_MD5) != 0 || drop_attr(path, ATTR_CHECK) != 0) {
+            return -1;
+        }
+    }
+    if (set_attr(path, ATTR_ALG, HASHCACHE_ALG) != 0) return -1;
+    if (cache->md5[0] && set_attr(path, ATTR_MD5, cache->md5) != 0) return -1;
+    if (cache->audio_md5[0] && set_attr(path, ATTR_AUDIO_MD5, cache->audio_md5) != 0) return -1;
+    if (cache->check_result >= 0) {
+        char check[32];
+        snprintf(check, sizeof(check), "%d %d", cache->check_result, cache->check_level);
+        if (set_attr(path, ATTR_CHECK, check) != 0) return -1;
+    }
+    return set_attr(path, ATTR_STAMP, value);
+}
@@ -1,11 +1,182 @@
 #include "hashing.h"
+#include "stats.h"
+#include "governor.h"
 #include <openssl/evp.h>
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/error.h>
 #include <errno.h>
 
-char current_processing_file[MAX_PATH_LENGTH] = {0};
+__thread char current_processing_file[MAX_PATH_LENGTH] = {0};
+__thread int current_file_log_errors = 0;
+
+// Quick-tier tolerances. A packet landing more than QUICK_CHECK_GAP_PACKETS
+// packet durations past the expected timestamp is a gap; a stream covering
+// less than QUICK_CHECK_MIN_COVERAGE of its declared duration, and short by
+// more than QUICK_CHECK_MIN_SHORTFALL_SEC, is treated as truncated.
+#define QUICK_CHECK_GAP_PACKETS 2
+#define QUICK_CHECK_MIN_COVERAGE 0.97
+#define QUICK_CHECK_MIN_SHORTFALL_SEC 1.0
+
+// Per-thread pool of the FFmpeg/OpenSSL objects that every hashing call
+// needs. Packets, frames and the digest context are allocated once per
+// thread; opened decoders are kept keyed by their codec parameters and
+// flushed between files instead of being torn down and re-opened.
+#define DECODER_POOL_SIZE 4
+
+typedef struct {
+    AVCodecContext *ctx;
+    enum AVCodecID codec_id;
+    uint32_t codec_tag;
+    int sample_rate;
+    AVChannelLayout ch_layout;
+    int format;
+    int block_align;
+    int bits_per_coded_sample;
+    uint8_t *extradata;
+    int extradata_size;
+    uint64_t last_used;
+} PooledDecoder;
+
+typedef struct {
+    AVPacket *pkt;
+    AVFrame *frame;
+    EVP_MD_CTX *mdctx;
+    PooledDecoder decoders[DECODER_POOL_SIZE];
+    uint64_t use_clock;
+} HashContextPool;
+
+static __thread HashContextPool *thread_pool = NULL;
+
+static HashContextPool *get_context_pool(void) {
+    if (thread_pool) {
+        return thread_pool;
+    }
+
+    HashContextPool *pool = calloc(1, sizeof(HashContextPool));
+    if (!pool) {
+        fprintf(stderr, "Memory: Error allocating hashing context pool\n");
+        return NULL;
+    }
+    pool->pkt = av_packet_alloc();
+    pool->frame = av_frame_alloc();
+    pool->mdctx = EVP_MD_CTX_new();
+    if (!pool->pkt || !pool->frame || !pool->mdctx) {
+        fprintf(stderr, "Memory: Error allocating hashing contexts\n");
+        av_packet_free(&pool->pkt);
+        av_frame_free(&pool->frame);
+        EVP_MD_CTX_free(pool->mdctx);
+        free(pool);
+        return NULL;
+    }
+    thread_pool = pool;
+    return pool;
+}
+
+static void free_pooled_decoder(PooledDecoder *dec) {
+    if (dec->ctx) {
+        avcodec_free_context(&dec->ctx);
+    }
+    av_channel_layout_uninit(&dec->ch_layout);
+    free(dec->extradata);
+    memset(dec, 0, sizeof(PooledDecoder));
+}
+
+// Everything avcodec_parameters_to_context() hands an audio decoder must
+// match, or the reused decoder would be set up for another stream.
+static int decoder_matches(const PooledDecoder *dec, const AVCodecParameters *par) {
+    return dec->ctx &&
+           dec->codec_id == par->codec_id &&
+           dec->codec_tag == par->codec_tag &&
+           dec->sample_rate == par->sample_rate &&
+           av_channel_layout_compare(&dec->ch_layout, &par->ch_layout) == 0 &&
+           dec->format == par->format &&
+           dec->block_align == par->block_align &&
+           dec->bits_per_coded_sample == par->bits_per_coded_sample &&
+           dec->extradata_size == par->extradata_size &&
+           (par->extradata_size == 0 || memcmp(dec->extradata, par->extradata, (size_t)par->extradata_size) == 0);
+}
+
+// Returns an opened decoder for the stream parameters, reusing a pooled one
+// when the parameters match. The caller hands it back with
+// release_decoder(), discarding it if decoding failed part-way.
+static AVCodecContext *acquire_decoder(HashContextPool *pool, const AVCodecParameters *par, PooledDecoder **slot_out) {
+    PooledDecoder *victim = &pool->decoders[0];
+    pool->use_clock++;
+    for (int i = 0; i < DECODER_POOL_SIZE; i++) {
+        PooledDecoder *dec = &pool->decoders[i];
+        if (decoder_matches(dec, par)) {
+            avcodec_flush_buffers(dec->ctx);
+            dec->last_used = pool->use_clock;
+            *slot_out = dec;
+            return dec->ctx;
+        }
+        if (!dec->ctx || (victim->ctx && dec->last_used < victim->last_used)) {
+            victim = dec;
+        }
+    }
+
+    free_pooled_decoder(victim);
+
+    const AVCodec *decoder = avcodec_find_decoder(par->codec_id);
+    if (!decoder) {
+        return NULL;
+    }
+    AVCodecContext *ctx = avcodec_alloc_context3(decoder);
+    if (!ctx) {
+        return NULL;
+    }
+    if (avcodec_parameters_to_context(ctx, par) < 0 || avcodec_open2(ctx, decoder, NULL) < 0) {
+        avcodec_free_context(&ctx);
+        return NULL;
+    }
+    if (par->extradata_size > 0) {
+        victim->extradata = malloc((size_t)par->extradata_size);
+        if (!victim->extradata) {
+            avcodec_free_context(&ctx);
+            return NULL;
+        }
+        memcpy(victim->extradata, par->extradata, (size_t)par->extradata_size);
+    }
+    if (av_channel_layout_copy(&victim->ch_layout, &par->ch_layout) < 0) {
+        free(victim->extradata);
+        victim->extradata = NULL;
+        avcodec_free_context(&ctx);
+        return NULL;
+    }
+    victim->ctx = ctx;
+    victim->codec_id = par->codec_id;
+    victim->codec_tag = par->codec_tag;
+    victim->sample_rate = par->sample_rate;
+    victim->format = par->format;
+    victim->block_align = par->block_align;
+    victim->bits_per_coded_sample = par->bits_per_coded_sample;
+    victim->extradata_size = par->extradata_size;
+    victim->last_used = pool->use_clock;
+    *slot_out = victim;
+    return ctx;
+}
+
+static void release_decoder(PooledDecoder *slot, int discard) {
+    if (slot && discard) {
+        free_pooled_decoder(slot);
+    }
+}
+
+void release_hash_context_pool(void) {
+    HashContextPool *pool = thread_pool;
+    if (!pool) {
+        return;
+    }
+    for (int i = 0; i < DECODER_POOL_SIZE; i++) {
+        free_pooled_decoder(&pool->decoders[i]);
+    }
+    av_packet_free(&pool->pkt);
+    av_frame_free(&pool->frame);
+    EVP_MD_CTX_free(pool->mdctx);
+    free(pool);
+    thread_pool = NULL;
+}
 
 const char *audio_check_result_to_string(int result) {
     switch (result) {
@@ -24,6 +195,19 @@ const char *audio_check_result_to_string(int result) {
     }
 }
 
+const char *audio_check_level_to_string(int level) {
+    switch (level) {
+        case AUDIO_CHECK_LEVEL_NONE:
+            return "none";
+        case AUDIO_CHECK_LEVEL_QUICK:
+            return "quick";
+        case AUDIO_CHECK_LEVEL_FULL:
+            return "full";
+        default:
+            return "unknown";
+    }
+}
+
 static int classify_stream_error(int err) {
     if (err == AVERROR_INVALIDDATA) {
         return AUDIO_CHECK_MISSING_CHUNKS;
@@ -31,6 +215,92 @@ static int classify_stream_error(int err) {
     return AUDIO_CHECK_CORRUPTED_STREAM;
 }
 
+// Demuxer input. With the governor or -nocache active, FFmpeg reads through
+// a custom AVIOContext over our own descriptor so its reads are paced and
+// fadvised like calculate_md5's; otherwise FFmpeg opens the file itself.
+#define GOVERNED_AVIO_BUFFER (64 * 1024)
+
+typedef struct {
+    int fd;
+    int drop_pages;
+} GovernedInput;
+
+static int governed_read(void *opaque, uint8_t *buf, int buf_size) {
+    GovernedInput *in = opaque;
+    uint64_t start = governor_read_begin();
+    ssize_t n = read(in->fd, buf, (size_t)buf_size);
+    if (n < 0) return AVERROR(errno);
+    if (n == 0) return AVERROR_EOF;
+    governor_read_end(start, (uint64_t)n);
+    return (int)n;
+}
+
+static int64_t governed_seek(void *opaque, int64_t offset, int whence) {
+    GovernedInput *in = opaque;
+    if (whence & AVSEEK_SIZE) {
+        struct stat st;
+        return (fstat(in->fd, &st) == 0) ? (int64_t)st.st_size : AVERROR(errno);
+    }
+    off_t pos = lseek(in->fd, (off_t)offset, whence & ~AVSEEK_FORCE);
+    return (pos < 0) ? AVERROR(errno) : (int64_t)pos;
+}
+
+static void free_governed_io(AVIOContext *pb) {
+    GovernedInput *in = pb->opaque;
+    governor_close(in->fd, in->drop_pages);
+    close(in->fd);
+    free(in);
+    av_freep(&pb->buffer);
+    avio_context_free(&pb);
+}
+
+static int open_media_input(AVFormatContext **fmt_ctx, const char *file_path, AVDictionary **opts) {
+    if (!governor_enabled && !governor_drop_cache) {
+        return avformat_open_input(fmt_ctx, file_path, NULL, opts);
+    }
+
+    GovernedInput *in = calloc(1, sizeof(GovernedInput));
+    if (!in) return AVERROR(ENOMEM);
+    in->fd = open(file_path, O_RDONLY);
+    if (in->fd < 0) {
+        int err = errno;
+        free(in);
+        return AVERROR(err);
+    }
+    in->drop_pages = governor_open(in->fd);
+
+    unsigned char *buffer = av_malloc(GOVERNED_AVIO_BUFFER);
+    AVIOContext *pb = buffer ? avio_alloc_context(buffer, GOVERNED_AVIO_BUFFER, 0, in, governed_read, NULL, governed_seek) : NULL;
+    AVFormatContext *ctx = pb ? avformat_alloc_context() : NULL;
+    if (!ctx) {
+        if (pb) {
+            free_governed_io(pb);
+        } else {
+            av_freep(&buffer);
+            close(in->fd);
+            free(in);
+        }
+        return AVERROR(ENOMEM);
+    }
+    ctx->pb = pb;
+    ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    // On failure FFmpeg frees ctx but leaves a caller-supplied pb alone.
+    int ret = avformat_open_input(&ctx, file_path, NULL, opts);
+    if (ret < 0) {
+        free_governed_io(pb);
+        return ret;
+    }
+    *fmt_ctx = ctx;
+    return 0;
+}
+
+static void close_media_input(AVFormatContext **fmt_ctx) {
+    AVIOContext *pb = (*fmt_ctx && ((*fmt_ctx)->flags & AVFMT_FLAG_CUSTOM_IO)) ? (*fmt_ctx)->pb : NULL;
+    avformat_close_input(fmt_ctx);
+    if (pb) free_governed_io(pb);
+}
+
 int validate_audio_stream(const char *file_path, int *result_out) {
     if (!result_out) {
         return -1;
@@ -47,16 +317,24 @@ int validate_audio_stream(const char *file_path, int *result_out) {
         return 0;
     }
 
+    HashContextPool *pool = get_context_pool();
+    if (!pool) {
+        current_processing_file[0] = '\0';
+        return -1;
+    }
+
     AVFormatContext *fmt_ctx = NULL;
     AVCodecContext *dec_ctx = NULL;
-    AVPacket *pkt = NULL;
-    AVFrame *frame = NULL;
+    PooledDecoder *dec_slot = NULL;
+    AVPacket *pkt = pool->pkt;
+    AVFrame *frame = pool->frame;
     int ret = 0;
     int status = AUDIO_CHECK_GOOD;
     int saw_audio_packet = 0;
     int decoded_frames = 0;
 
-    ret = avformat_open_input(&fmt_ctx, file_path, NULL, NULL);
+    uint64_t probe_start = stats_begin();
+    ret = open_media_input(&fmt_ctx, file_path, NULL);
     if (ret < 0) {
         status = AUDIO_CHECK_CORRUPTED_STREAM;
         goto done;
@@ -68,6 +346,8 @@ int validate_audio_stream(const char *file_path, int *result_out) {
         goto done;
     }
 
+    stats_end(PHASE_AUDIO_PROBE, probe_start, 0);
+
     int audio_stream_idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
     if (audio_stream_idx < 0) {
         status = AUDIO_CHECK_NO_AUDIO_DATA;
@@ -75,40 +355,18 @@ int validate_audio_stream(const char *file_path, int *result_out) {
     }
 
     AVStream *audio_stream = fmt_ctx->streams[audio_stream_idx];
-    const AVCodec *decoder = avcodec_find_decoder(audio_stream->codecpar->codec_id);
-    if (!decoder) {
-        status = AUDIO_CHECK_CORRUPTED_STREAM;
-        goto done;
-    }
-
-    dec_ctx = avcodec_alloc_context3(decoder);
+    dec_ctx = acquire_decoder(pool, audio_stream->codecpar, &dec_slot);
     if (!dec_ctx) {
         status = AUDIO_CHECK_CORRUPTED_STREAM;
         goto done;
     }
 
-    ret = avcodec_parameters_to_context(dec_ctx, audio_stream->codecpar);
-    if (ret < 0) {
-        status = AUDIO_CHECK_CORRUPTED_STREAM;
-        goto done;
-    }
-
-    ret = avcodec_open2(dec_ctx, decoder, NULL);
-    if (ret < 0) {
-        status = AUDIO_CHECK_CORRUPTED_STREAM;
-        goto done;
-    }
-
-    pkt = av_packet_alloc();
-    frame = av_frame_alloc();
-    if (!pkt || !frame) {
-        status = AUDIO_CHECK_CORRUPTED_STREAM;
-        goto done;
-    }
-
+    uint64_t decode_start = stats_begin();
+    uint64_t audio_bytes = 0;
     while ((ret = av_read_frame(fmt_ctx, pkt)) >= 0) {
         if (pkt->stream_index == audio_stream_idx) {
             saw_audio_packet = 1;
+            audio_bytes += (uint64_t)pkt->size;
             ret = avcodec_send_packet(dec_ctx, pkt);
             if (ret < 0 && ret != AVERROR(EAGAIN)) {
                 status = classify_stream_error(ret);
@@ -126,6 +384,7 @@ int validate_audio_stream(const char *file_path, int *result_out) {
                 }
                 if (ret < 0) {
                     status = classify_stream_error(ret);
+                    av_packet_unref(pkt);
                     goto done;
                 }
                 decoded_frames++;
@@ -159,6 +418,8 @@ int validate_audio_stream(const char *file_path, int *result_out) {
         av_frame_unref(frame);
     }
 
+    stats_end(PHASE_AUDIO_DECODE, decode_start, audio_bytes);
+
     if (!saw_audio_packet || decoded_frames == 0) {
         status = AUDIO_CHECK_NO_AUDIO_DATA;
     } else {
@@ -166,17 +427,146 @@ int validate_audio_stream(const char *file_path, int *result_out) {
     }
 
 done:
-    if (pkt) {
-        av_packet_free(&pkt);
+    av_frame_unref(frame);
+    // A decoder that failed mid-stream is not trusted for the next file.
+    release_decoder(dec_slot, status != AUDIO_CHECK_GOOD && status != AUDIO_CHECK_NO_AUDIO_DATA);
+    if (fmt_ctx) {
+        close_media_input(&fmt_ctx);
     }
-    if (frame) {
-        av_frame_free(&frame);
+
+    *result_out = status;
+    current_processing_file[0] = '\0';
+    return 0;
+}
+
+// Packet-level validation: demux the audio stream without decoding it and
+// look for container/bitstream damage (read errors, corrupt-flagged packets,
+// CRC failures reported by the demuxer, timestamp gaps, and a stream that is
+// shorter than its declared duration).
+int validate_audio_stream_quick(const char *file_path, int *result_out) {
+    if (!result_out) {
+        return -1;
     }
-    if (dec_ctx) {
-        avcodec_free_context(&dec_ctx);
+    *result_out = AUDIO_CHECK_CORRUPTED_STREAM;
+
+    strncpy(current_processing_file, file_path, MAX_PATH_LENGTH - 1);
+    current_processing_file[MAX_PATH_LENGTH - 1] = '\0';
+    current_file_log_errors = 0;
+
+    struct stat st;
+    if (stat(file_path, &st) == 0 && st.st_size == 0) {
+        *result_out = AUDIO_CHECK_NO_AUDIO_DATA;
+        current_processing_file[0] = '\0';
+        return 0;
+    }
+
+    HashContextPool *pool = get_context_pool();
+    if (!pool) {
+        current_processing_file[0] = '\0';
+        return -1;
+    }
+
+    AVFormatContext *fmt_ctx = NULL;
+    AVDictionary *opts = NULL;
+    AVPacket *pkt = pool->pkt;
+    int ret = 0;
+    int status = AUDIO_CHECK_GOOD;
+    int64_t audio_packets = 0;
+    int64_t first_ts = AV_NOPTS_VALUE;
+    int64_t expected_ts = AV_NOPTS_VALUE;
+    int64_t end_ts = AV_NOPTS_VALUE;
+
+    // Demuxers that carry checksums (Ogg pages, FLAC frames, ...) verify them
+    // while reading packets when crccheck is requested.
+    av_dict_set(&opts, "err_detect", "crccheck", 0);
+    uint64_t probe_start = stats_begin();
+    ret = open_media_input(&fmt_ctx, file_path, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        status = AUDIO_CHECK_CORRUPTED_STREAM;
+        goto done;
+    }
+
+    ret = avformat_find_stream_info(fmt_ctx, NULL);
+    if (ret < 0) {
+        status = AUDIO_CHECK_CORRUPTED_STREAM;
+        goto done;
+    }
+
+    stats_end(PHASE_AUDIO_PROBE, probe_start, 0);
+
+    int audio_stream_idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if (audio_stream_idx < 0) {
+        status = AUDIO_CHECK_NO_AUDIO_DATA;
+        goto done;
     }
+    AVStream *audio_stream = fmt_ctx->streams[audio_stream_idx];
+
+    uint64_t scan_start = stats_begin();
+    uint64_t audio_bytes = 0;
+    while ((ret = av_read_frame(fmt_ctx, pkt)) >= 0) {
+        if (pkt->stream_index == audio_stream_idx) {
+            audio_packets++;
+            audio_bytes += (uint64_t)pkt->size;
+            if (pkt->flags & AV_PKT_FLAG_CORRUPT) {
+                status = AUDIO_CHECK_CORRUPTED_STREAM;
+                av_packet_unref(pkt);
+                goto done;
+            }
+
+            int64_t ts = (pkt->dts != AV_NOPTS_VALUE) ? pkt->dts : pkt->pts;
+            if (ts != AV_NOPTS_VALUE) {
+                if (first_ts == AV_NOPTS_VALUE) {
+                    first_ts = ts;
+                }
+                if (expected_ts != AV_NOPTS_VALUE && pkt->duration > 0 &&
+                    ts - expected_ts > QUICK_CHECK_GAP_PACKETS * pkt->duration) {
+                    status = AUDIO_CHECK_MISSING_CHUNKS;
+                    av_packet_unref(pkt);
+                    goto done;
+                }
+                expected_ts = ts + pkt->duration;
+                if (end_ts == AV_NOPTS_VALUE || expected_ts > end_ts) {
+                    end_ts = expected_ts;
+                }
+            }
+        }
+        av_packet_unref(pkt);
+    }
+
+    stats_end(PHASE_AUDIO_QUICK, scan_start, audio_bytes);
+
+    if (ret != AVERROR_EOF && ret < 0) {
+        status = classify_stream_error(ret);
+        goto done;
+    }
+
+    if (audio_packets == 0) {
+        status = AUDIO_CHECK_NO_AUDIO_DATA;
+        goto done;
+    }
+
+    // Durations estimated from the bitrate (e.g. VBR MP3 without a Xing
+    // header) are too loose to compare against.
+    if (fmt_ctx->duration_estimation_method != AVFMT_DURATION_FROM_BITRATE &&
+        audio_stream->duration != AV_NOPTS_VALUE && audio_stream->duration > 0 &&
+        first_ts != AV_NOPTS_VALUE && end_ts != AV_NOPTS_VALUE) {
+        double declared = (double)audio_stream->duration * av_q2d(audio_stream->time_base);
+        double actual = (double)(end_ts - first_ts) * av_q2d(audio_stream->time_base);
+        if (actual < declared * QUICK_CHECK_MIN_COVERAGE &&
+            declared - actual > QUICK_CHECK_MIN_SHORTFALL_SEC) {
+            status = AUDIO_CHECK_MISSING_CHUNKS;
+            goto done;
+        }
+    }
+
+    // Lost frame sync and inconsistent headers are reported by the demuxer
+    // through the log callback rather than as read errors.
+    status = (current_file_log_errors > 0) ? AUDIO_CHECK_MISSING_CHUNKS : AUDIO_CHECK_GOOD;
+
+done:
     if (fmt_ctx) {
-        avformat_close_input(&fmt_ctx);
+        close_media_input(&fmt_ctx);
     }
 
     *result_out = status;
@@ -199,7 +589,17 @@ int calculate_audio_md5(const char *file_path, unsigned char *md5_hash) {
         return 0;
     }
 
-    if ((ret = avformat_open_input(&fmt_ctx, file_path, NULL, NULL)) < 0) {
+    HashContextPool *pool = get_context_pool();
+    if (!pool) {
+        memset(md5_hash, 0, MD5_DIGEST_LENGTH);
+        current_processing_file[0] = '\0';
+        return -1;
+    }
+    AVPacket *pkt = pool->pkt;
+    EVP_MD_CTX *mdctx = pool->mdctx;
+
+    uint64_t probe_start = stats_begin();
+    if ((ret = open_media_input(&fmt_ctx, file_path, NULL)) < 0) {
         char errbuf[AV_ERROR_MAX_STRING_SIZE];
         av_strerror(ret, errbuf, sizeof(errbuf));
         fprintf(stderr, "FFmpeg: Error opening input file %s: %s\n", file_path, errbuf);
@@ -212,24 +612,17 @@ int calculate_audio_md5(const char *file_path, unsigned char *md5_hash) {
         char errbuf[AV_ERROR_MAX_STRING_SIZE];
         av_strerror(ret, errbuf, sizeof(errbuf));
         fprintf(stderr, "FFmpeg: Error finding stream info for %s: %s\n", file_path, errbuf);
-        avformat_close_input(&fmt_ctx);
+        close_media_input(&fmt_ctx);
         memset(md5_hash, 0, MD5_DIGEST_LENGTH);
         current_processing_file[0] = '\0';
         return -1;
     }
 
+    stats_end(PHASE_AUDIO_PROBE, probe_start, 0);
+
     int audio_stream_idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
     if (audio_stream_idx < 0) {
-        avformat_close_input(&fmt_ctx);
-        memset(md5_hash, 0, MD5_DIGEST_LENGTH);
-        current_processing_file[0] = '\0';
-        return -1;
-    }
-
-    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
-    if (!mdctx) {
-        fprintf(stderr, "OpenSSL: Error creating MD context for %s\n", file_path);
-        avformat_close_input(&fmt_ctx);
+        close_media_input(&fmt_ctx);
         memset(md5_hash, 0, MD5_DIGEST_LENGTH);
         current_processing_file[0] = '\0';
         return -1;
@@ -237,30 +630,21 @@ int calculate_audio_md5(const char *file_path, unsigned char *md5_hash) {
 
     if (EVP_DigestInit_ex(mdctx, EVP_md5(), NULL) != 1) {
         fprintf(stderr, "OpenSSL: Error initializing MD5 for %s\n", file_path);
-        EVP_MD_CTX_free(mdctx);
-        avformat_close_input(&fmt_ctx);
-        memset(md5_hash, 0, MD5_DIGEST_LENGTH);
-        current_processing_file[0] = '\0';
-        return -1;
-    }
-
-    AVPacket *pkt = av_packet_alloc();
-    if (!pkt) {
-        fprintf(stderr, "FFmpeg: Error allocating packet for %s\n", file_path);
-        EVP_MD_CTX_free(mdctx);
-        avformat_close_input(&fmt_ctx);
+        close_media_input(&fmt_ctx);
         memset(md5_hash, 0, MD5_DIGEST_LENGTH);
         current_processing_file[0] = '\0';
         return -1;
     }
 
+    uint64_t digest_start = stats_begin();
+    uint64_t audio_bytes = 0;
     while ((ret = av_read_frame(fmt_ctx, pkt)) >= 0) {
         if (pkt->stream_index == audio_stream_idx) {
+            audio_bytes += (uint64_t)pkt->size;
             if (EVP_DigestUpdate(mdctx, pkt->data, pkt->size) != 1) {
                 fprintf(stderr, "OpenSSL: Error updating MD5 for %s\n", file_path);
-                av_packet_free(&pkt);
-                EVP_MD_CTX_free(mdctx);
-                avformat_close_input(&fmt_ctx);
+                av_packet_unref(pkt);
+                close_media_input(&fmt_ctx);
                 memset(md5_hash, 0, MD5_DIGEST_LENGTH);
                 current_processing_file[0] = '\0';
                 return -1;
@@ -269,13 +653,13 @@ int calculate_audio_md5(const char *file_path, unsigned char *md5_hash) {
         av_packet_unref(pkt);
     }
 
+    stats_end(PHASE_AUDIO_MD5, digest_start, audio_bytes);
+
     if (ret != AVERROR_EOF && ret < 0) {
         char errbuf[AV_ERROR_MAX_STRING_SIZE];
         av_strerror(ret, errbuf, sizeof(errbuf));
         fprintf(stderr, "FFmpeg: Error reading frame from %s: %s\n", file_path, errbuf);
-        av_packet_free(&pkt);
-        EVP_MD_CTX_free(mdctx);
-        avformat_close_input(&fmt_ctx);
+        close_media_input(&fmt_ctx);
         memset(md5_hash, 0, MD5_DIGEST_LENGTH);
         current_processing_file[0] = '\0';
         return -1;
@@ -283,17 +667,13 @@ int calculate_audio_md5(const char *file_path, unsigned char *md5_hash) {
 
     if (EVP_DigestFinal_ex(mdctx, md5_hash, NULL) != 1) {
         fprintf(stderr, "OpenSSL: Error finalizing MD5 for %s\n", file_path);
-        av_packet_free(&pkt);
-        EVP_MD_CTX_free(mdctx);
-        avformat_close_input(&fmt_ctx);
+        close_media_input(&fmt_ctx);
         memset(md5_hash, 0, MD5_DIGEST_LENGTH);
         current_processing_file[0] = '\0';
         return -1;
     }
 
-    av_packet_free(&pkt);
-    EVP_MD_CTX_free(mdctx);
-    avformat_close_input(&fmt_ctx);
+    close_media_input(&fmt_ctx);
     // Clear context
     current_processing_file[0] = '\0';
     return 0;
@@ -320,44 +700,48 @@ int calculate_md5(const char *file_path, unsigned char *md5_hash) {
         return 0;
     }
 
-    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
-    if (!mdctx) {
-        fprintf(stderr, "OpenSSL: Error creating MD context for %s\n", file_path);
+    HashContextPool *pool = get_context_pool();
+    if (!pool) {
         close(fd);
         return -1;
     }
+    EVP_MD_CTX *mdctx = pool->mdctx;
 
     if (EVP_DigestInit_ex(mdctx, EVP_md5(), NULL) != 1) {
         fprintf(stderr, "OpenSSL: Error initializing MD5 hash for %s\n", file_path);
-        EVP_MD_CTX_free(mdctx);
         close(fd);
         return -1;
     }
 
+    int drop_pages = governor_open(fd);
+    uint64_t read_start = stats_begin();
     unsigned char buffer[1024 * 1024];
     ssize_t bytes_read = 0;
-    while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
+    for (;;) {
+        uint64_t governed_start = governor_read_begin();
+        bytes_read = read(fd, buffer, sizeof(buffer));
+        if (bytes_read <= 0) break;
+        governor_read_end(governed_start, (uint64_t)bytes_read);
         if (EVP_DigestUpdate(mdctx, buffer, (size_t)bytes_read) != 1) {
             fprintf(stderr, "OpenSSL: Error updating MD5 hash for %s\n", file_path);
-            EVP_MD_CTX_free(mdctx);
+            governor_close(fd, drop_pages);
             close(fd);
             return -1;
         }
     }
+    stats_end(PHASE_FILE_MD5, read_start, (uint64_t)file_size);
+    governor_close(fd, drop_pages);
     if (bytes_read < 0) {
         fprintf(stderr, "OS: Error reading file %s: %m\n", file_path);
-        EVP_MD_CTX_free(mdctx);
         close(fd);
         return -1;
     }
     if (EVP_DigestFinal_ex(mdctx, md5_hash, NULL) != 1) {
         fprintf(stderr, "OpenSSL: Error finalizing MD5 hash for %s\n", file_path);
-        EVP_MD_CTX_free(mdctx);
         close(fd);
         return -1;
     }
 
-    EVP_MD_CTX_free(mdctx);
     close(fd);
     return 0;
 }
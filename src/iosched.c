@@ -0,0 +1,236 @@
+#include "iosched.h"
+#include <pthread.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+// Queue depth per worker before the submitter stops feeding a device. Deep
+// enough that other devices keep working while the walker blocks on one.
+#define IOSCHED_DEPTH_PER_WORKER 256
+
+typedef struct {
+    dev_t dev;
+    int rotational;
+    int workers;
+    int pending;            // queued + running
+    IoJob *head;
+    IoJob *tail;
+    pthread_cond_t cond;
+    pthread_t *threads;
+    int started;
+} IoDevice;
+
+static IoWorkFn work_fn = NULL;
+static IoSchedOptions sched_opts;
+static IoDevice **devices = NULL;
+static size_t device_count = 0;
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static IoJob *done_head = NULL;
+static IoJob *done_tail = NULL;
+static int in_flight = 0;
+static int stopping = 0;
+
+// Reads /sys/dev/block/M:m/queue/rotational, falling back to the parent
+// disk for partitions. Returns -1 when the device has no block queue
+// (network, tmpfs, overlay, ...).
+int device_is_rotational(dev_t dev) {
+    const char *suffixes[] = { "queue/rotational", "../queue/rotational" };
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s", major(dev), minor(dev), suffixes[i]);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        int value = -1;
+        if (fscanf(f, "%d", &value) != 1) value = -1;
+        fclose(f);
+        if (value >= 0) return value;
+    }
+    return -1;
+}
+
+int file_first_extent(const char *path, uint64_t *physical_out) {
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return -1;
+    // Room for exactly one extent record; the kernel stops after the first.
+    union {
+        struct fiemap map;
+        char bytes[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_start = 0;
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+    int rc = ioctl(fd, FS_IOC_FIEMAP, &request.map);
+    close(fd);
+    if (rc != 0) return -1;
+    *physical_out = (request.map.fm_mapped_extents > 0) ? request.map.fm_extents[0].fe_physical : 0;
+    return 0;
+}
+
+static void *device_worker(void *arg) {
+    IoDevice *device = arg;
+    pthread_mutex_lock(&sched_lock);
+    for (;;) {
+        while (!device->head && !stopping) {
+            pthread_cond_wait(&device->cond, &sched_lock);
+        }
+        if (!device->head) break;
+        IoJob *job = device->head;
+        device->head = job->next;
+        if (!device->head) device->tail = NULL;
+        pthread_mutex_unlock(&sched_lock);
+
+        work_fn(job);
+
+        pthread_mutex_lock(&sched_lock);
+        job->next = NULL;
+        if (done_tail) done_tail->next = job; else done_head = job;
+        done_tail = job;
+        device->pending--;
+        pthread_cond_signal(&done_cond);
+    }
+    pthread_mutex_unlock(&sched_lock);
+    if (sched_opts.worker_exit) sched_opts.worker_exit();
+    return NULL;
+}
+
+// Caller holds sched_lock.
+static IoDevice *find_device_locked(dev_t dev) {
+    for (size_t i = 0; i < device_count; i++) {
+        if (devices[i]->dev == dev) return devices[i];
+    }
+    return NULL;
+}
+
+// Caller holds sched_lock. Workers start on the first job for a device.
+static IoDevice *add_device_locked(dev_t dev) {
+    IoDevice **grown = realloc(devices, (device_count + 1) * sizeof(IoDevice *));
+    if (!grown) return NULL;
+    devices = grown;
+    IoDevice *device = calloc(1, sizeof(IoDevice));
+    if (!device) return NULL;
+    device->dev = dev;
+    device->rotational = device_is_rotational(dev);
+    device->workers = (device->rotational == 1) ? sched_opts.hdd_workers : sched_opts.ssd_workers;
+    device->threads = calloc((size_t)device->workers, sizeof(pthread_t));
+    pthread_cond_init(&device->cond, NULL);
+    if (!device->threads) {
+        free(device);
+        return NULL;
+    }
+    for (int i = 0; i < device->workers; i++) {
+        if (pthread_create(&device->threads[i], NULL, device_worker, device) != 0) break;
+        device->started++;
+    }
+    if (device->started == 0) {
+        fprintf(stderr, "Error: cannot start I/O workers for device %u:%u\n", major(dev), minor(dev));
+        free(device->threads);
+        free(device);
+        return NULL;
+    }
+    devices[device_count++] = device;
+    if (sched_opts.verbose) {
+        printf("I/O: device %u:%u (%s), %d worker%s\n", major(dev), minor(dev),
+               device->rotational == 1 ? "rotational" : (device->rotational == 0 ? "non-rotational" : "no block queue"),
+               device->started, device->started == 1 ? "" : "s");
+    }
+    return device;
+}
+
+int iosched_start(IoWorkFn work, const IoSchedOptions *opts) {
+    work_fn = work;
+    sched_opts = *opts;
+    if (sched_opts.ssd_workers < 1) sched_opts.ssd_workers = 1;
+    if (sched_opts.hdd_workers < 1) sched_opts.hdd_workers = 1;
+    stopping = 0;
+    return 0;
+}
+
+// Returns non-zero if the job could not be queued; the caller then runs it
+// inline.
+int iosched_submit(IoJob *job) {
+    pthread_mutex_lock(&sched_lock);
+    IoDevice *device = find_device_locked(job->dev);
+    if (!device) device = add_device_locked(job->dev);
+    if (!device) {
+        pthread_mutex_unlock(&sched_lock);
+        return 1;
+    }
+    job->next = NULL;
+    if (device->tail) device->tail->next = job; else device->head = job;
+    device->tail = job;
+    device->pending++;
+    in_flight++;
+    pthread_cond_signal(&device->cond);
+    pthread_mutex_unlock(&sched_lock);
+    return 0;
+}
+
+// Pops a finished job. With wait set, blocks until one is available or
+// nothing is in flight.
+IoJob *iosched_next_done(int wait) {
+    pthread_mutex_lock(&sched_lock);
+    while (!done_head && wait && in_flight > 0) {
+        pthread_cond_wait(&done_cond, &sched_lock);
+    }
+    IoJob *job = done_head;
+    if (job) {
+        done_head = job->next;
+        if (!done_head) done_tail = NULL;
+        in_flight--;
+    }
+    pthread_mutex_unlock(&sched_lock);
+    return job;
+}
+
+int iosched_pending(dev_t dev) {
+    pthread_mutex_lock(&sched_lock);
+    IoDevice *device = find_device_locked(dev);
+    int pending = device ? device->pending : 0;
+    pthread_mutex_unlock(&sched_lock);
+    return pending;
+}
+
+int iosched_device_limit(dev_t dev) {
+    pthread_mutex_lock(&sched_lock);
+    IoDevice *device = find_device_locked(dev);
+    int workers = device ? device->started : 1;
+    pthread_mutex_unlock(&sched_lock);
+    return workers * IOSCHED_DEPTH_PER_WORKER;
+}
+
+int iosched_in_flight(void) {
+    pthread_mutex_lock(&sched_lock);
+    int n = in_flight;
+    pthread_mutex_unlock(&sched_lock);
+    return n;
+}
+
+// Workers finish their queues before exiting; drain completions first.
+void iosched_stop(void) {
+    pthread_mutex_lock(&sched_lock);
+    stopping = 1;
+    for (size_t i = 0; i < device_count; i++) {
+        pthread_cond_broadcast(&devices[i]->cond);
+    }
+    pthread_mutex_unlock(&sched_lock);
+    for (size_t i = 0; i < device_count; i++) {
+        for (int t = 0; t < devices[i]->started; t++) {
+            pthread_join(devices[i]->threads[t], NULL);
+        }
+        pthread_cond_destroy(&devices[i]->cond);
+        free(devices[i]->threads);
+        free(devices[i]);
+    }
+    free(devices);
+    devices = NULL;
+    device_count = 0;
+    // Jobs nobody reaped are the caller's; the next start begins empty.
+    pthread_mutex_lock(&sched_lock);
+    done_head = NULL;
+    done_tail = NULL;
+    in_flight = 0;
+    pthread_mutex_unlock(&sched_lock);
+}
@@ -0,0 +1,384 @@
+#include "lookup.h"
+#include "hashing.h"
+#include "output.h"
+#include "utils.h"
+
+#define BLOOM_MAGIC "FHBLOOM1"
+#define BLOOM_MIN_BITS 8192
+
+typedef struct {
+    char magic[8];
+    uint64_t db_size;
+    int64_t db_mtime_ns;
+    uint64_t wal_size;
+    int64_t wal_mtime_ns;
+    uint64_t bit_count;
+    uint64_t key_count;
+} BloomHeader;
+
+typedef struct {
+    BloomHeader header;
+    uint64_t *words;
+} Bloom;
+
+typedef struct {
+    IoJob io;  // must stay first: workers get the IoJob pointer back
+    char *path;
+    off_t size;
+    int rc;
+    char md5[MD5_DIGEST_LENGTH * 2 + 1];
+    char audio_md5[MD5_DIGEST_LENGTH * 2 + 1];
+} LookupJob;
+
+typedef struct {
+    Bloom bloom;
+    sqlite3_stmt *md5_stmt;
+    sqlite3_stmt *audio_stmt;
+    long long files;
+    long long known;
+    long long unknown;
+    long long errors;
+    long long probes;
+    long long filtered;
+} LookupState;
+
+static int lookup_hash_audio = 0;
+
+// An md5 is already uniformly distributed, so its two halves serve directly
+// as the two hashes of the double-hashing scheme. Sentinels do not parse.
+static int parse_md5_hex(const char *hex, uint64_t *h1, uint64_t *h2) {
+    if (!is_md5_hex(hex)) return -1;
+    uint64_t parts[2] = {0, 0};
+    for (int i = 0; i < MD5_DIGEST_LENGTH * 2; i++) {
+        char c = hex[i];
+        int v = (c <= '9') ? c - '0' : c - 'a' + 10;
+        parts[i / 16] = (parts[i / 16] << 4) | (uint64_t)v;
+    }
+    *h1 = parts[0];
+    *h2 = parts[1] | 1;
+    return 0;
+}
+
+static void bloom_add(Bloom *bloom, const char *hex) {
+    uint64_t h1, h2;
+    if (parse_md5_hex(hex, &h1, &h2) != 0) return;
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        uint64_t bit = (h1 + (uint64_t)i * h2) % bloom->header.bit_count;
+        bloom->words[bit / 64] |= 1ULL << (bit % 64);
+    }
+    bloom->header.key_count++;
+}
+
+// Callers only pass digests; without a filter everything may be present.
+static int bloom_maybe(const Bloom *bloom, const char *hex) {
+    uint64_t h1, h2;
+    if (parse_md5_hex(hex, &h1, &h2) != 0) return 0;
+    if (!bloom->words) return 1;
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        uint64_t bit = (h1 + (uint64_t)i * h2) % bloom->header.bit_count;
+        if (!(bloom->words[bit / 64] & (1ULL << (bit % 64)))) return 0;
+    }
+    return 1;
+}
+
+static void stamp_file(const char *path, uint64_t *size, int64_t *mtime_ns) {
+    struct stat st;
+    *size = 0;
+    *mtime_ns = 0;
+    if (stat(path, &st) == 0) {
+        *size = (uint64_t)st.st_size;
+        *mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    }
+}
+
+// Taken before the filter is built, so a write racing the build leaves a
+// stale stamp and forces the next rebuild rather than hiding rows.
+static void db_stamp(const char *db_path, BloomHeader *header) {
+    char wal_path[PATH_MAX];
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, BLOOM_MAGIC, sizeof(header->magic));
+    stamp_file(db_path, &header->db_size, &header->db_mtime_ns);
+    snprintf(wal_path, sizeof(wal_path), "%s-wal", db_path);
+    stamp_file(wal_path, &header->wal_size, &header->wal_mtime_ns);
+}
+
+static int read_exact(int fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int bloom_load(Bloom *bloom, const char *sidecar, const BloomHeader *stamp) {
+    int fd = open(sidecar, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    BloomHeader header;
+    int ok = (read_exact(fd, &header, sizeof(header)) == 0 &&
+              memcmp(header.magic, BLOOM_MAGIC, sizeof(header.magic)) == 0 &&
+              header.db_size == stamp->db_size && header.db_mtime_ns == stamp->db_mtime_ns &&
+              header.wal_size == stamp->wal_size && header.wal_mtime_ns == stamp->wal_mtime_ns &&
+              header.bit_count >= BLOOM_MIN_BITS && header.bit_count % 64 == 0);
+    uint64_t *words = NULL;
+    if (ok) {
+        words = malloc(header.bit_count / 8);
+        ok = words && read_exact(fd, words, header.bit_count / 8) == 0;
+    }
+    close(fd);
+    if (!ok) {
+        free(words);
+        return -1;
+    }
+    bloom->header = header;
+    bloom->words = words;
+    return 0;
+}
+
+static int bloom_build(Bloom *bloom, sqlite3 *db, const BloomHeader *stamp) {
+    sqlite3_stmt *stmt;
+    int64_t rows = 0;
+    if (sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM files;", -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) rows = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    // Up to two keys per row: md5 and audio_md5.
+    uint64_t bits = (uint64_t)rows * 2 * BLOOM_BITS_PER_KEY;
+    if (bits < BLOOM_MIN_BITS) bits = BLOOM_MIN_BITS;
+    bits = (bits + 63) / 64 * 64;
+
+    bloom->header = *stamp;
+    bloom->header.bit_count = bits;
+    bloom->header.key_count = 0;
+    bloom->words = calloc(bits / 64, sizeof(uint64_t));
+    if (!bloom->words) {
+        fprintf(stderr, "Memory: Error allocating lookup filter\n");
+        return -1;
+    }
+    const char *sql = "SELECT md5 FROM files UNION ALL SELECT audio_md5 FROM files;";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL: Error preparing filter build: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        bloom_add(bloom, (const char *)sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL: Error building lookup filter: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+// Written under a temporary name and renamed, so a concurrent lookup only
+// ever sees a whole sidecar. A read-only DB directory just skips the save.
+static void bloom_save(const Bloom *bloom, const char *sidecar, int verbose) {
+    char tmp_path[PATH_MAX + 32];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%ld", sidecar, (long)getpid());
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) {
+        if (verbose) fprintf(stderr, "Warning: cannot write %s: %m\n", tmp_path);
+        return;
+    }
+    int ok = fwrite(&bloom->header, sizeof(bloom->header), 1, file) == 1 &&
+             fwrite(bloom->words, 1, bloom->header.bit_count / 8, file) == bloom->header.bit_count / 8;
+    if (fclose(file) != 0) ok = 0;
+    if (!ok || rename(tmp_path, sidecar) != 0) {
+        fprintf(stderr, "Warning: cannot save lookup filter %s: %m\n", sidecar);
+        unlink(tmp_path);
+    }
+}
+
+static void md5_to_hex(const unsigned char *raw, char *hex) {
+    for (int i = 0; i < MD5_DIGEST_LENGTH; i++) {
+        snprintf(&hex[i * 2], 3, "%02x", (unsigned int)raw[i]);
+    }
+}
+
+static void lookup_worker(IoJob *io) {
+    LookupJob *job = (LookupJob *)io;
+    unsigned char raw[MD5_DIGEST_LENGTH];
+    snprintf(job->audio_md5, sizeof(job->audio_md5), "Not calculated");
+    if (job->size == 0) {
+        snprintf(job->md5, sizeof(job->md5), "0-byte-file");
+        return;
+    }
+    if (calculate_md5(job->path, raw) != 0) {
+        fprintf(stderr, "Error calculating MD5 hash for file: %s\n", job->path);
+        job->rc = 1;
+        return;
+    }
+    md5_to_hex(raw, job->md5);
+    if (lookup_hash_audio) {
+        memset(raw, 0, sizeof(raw));
+        if (calculate_audio_md5(job->path, raw) != 0) {
+            snprintf(job->audio_md5, sizeof(job->audio_md5), "Bad audio");
+        } else {
+            md5_to_hex(raw, job->audio_md5);
+        }
+        log_sink_finish_file(NULL, 0);
+    }
+}
+
+static void report(const char *status, const char *path, const char *md5, const char *match) {
+    if (output_format == OUTPUT_TEXT) {
+        printf(match ? "[%s] %s -> %s\n" : "[%s] %s\n", status, path, match);
+        return;
+    }
+    output_record_begin(NULL, "lookup");
+    output_str(NULL, "status", status);
+    output_str(NULL, "path", path);
+    output_str(NULL, "md5", md5);
+    output_str(NULL, "match", match);
+    output_record_end(NULL);
+}
+
+// Returns how many rows matched. Only hashes the filter may hold reach SQLite.
+// Sentinels ('Bad audio', '0-byte-file') match nothing: two files that both
+// failed to decode are not the same audio.
+static int report_matches(LookupState *state, sqlite3_stmt *stmt, const char *hash, const char *status, const LookupJob *job, int skip_same_md5) {
+    if (!is_md5_hex(hash)) return 0;
+    if (!bloom_maybe(&state->bloom, hash)) {
+        state->filtered++;
+        return 0;
+    }
+    state->probes++;
+    int matches = 0;
+    sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *match = (const char *)sqlite3_column_text(stmt, 0);
+        const char *match_md5 = (const char *)sqlite3_column_text(stmt, 1);
+        if (!match) continue;
+        // Audio matches that are also file matches were reported already.
+        if (skip_same_md5 && match_md5 && strcmp(match_md5, job->md5) == 0) continue;
+        report(status, job->path, job->md5, match);
+        matches++;
+    }
+    sqlite3_reset(stmt);
+    return matches;
+}
+
+static void finish_job(LookupState *state, LookupJob *job) {
+    state->files++;
+    if (job->rc != 0) {
+        state->errors++;
+        report("error", job->path, "", NULL);
+    } else if (job->size == 0) {
+        report("empty", job->path, job->md5, NULL);
+    } else {
+        int matches = report_matches(state, state->md5_stmt, job->md5, "known", job, 0);
+        if (lookup_hash_audio) {
+            matches += report_matches(state, state->audio_stmt, job->audio_md5, "same audio", job, 1);
+        }
+        if (matches) {
+            state->known++;
+        } else {
+            state->unknown++;
+            report("unknown", job->path, job->md5, NULL);
+        }
+    }
+    free(job->path);
+    free(job);
+}
+
+static void reap(LookupState *state, int wait) {
+    IoJob *io;
+    while ((io = iosched_next_done(wait)) != NULL) {
+        finish_job(state, (LookupJob *)io);
+    }
+}
+
+static void submit_path(LookupState *state, const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "OS: Error stating %s: %m\n", path);
+        state->files++;
+        state->errors++;
+        report("error", path, "", NULL);
+        return;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Skipping %s (not a regular file)\n", path);
+        return;
+    }
+    LookupJob *job = calloc(1, sizeof(LookupJob));
+    if (!job || !(job->path = strdup(path))) {
+        fprintf(stderr, "Memory: Error allocating lookup job\n");
+        free(job);
+        return;
+    }
+    job->size = st.st_size;
+    job->io.dev = st.st_dev;
+    // Keep each device's queue bounded, finishing other files meanwhile.
+    while (iosched_pending(job->io.dev) >= iosched_device_limit(job->io.dev)) {
+        IoJob *io = iosched_next_done(1);
+        if (!io) break;
+        finish_job(state, (LookupJob *)io);
+    }
+    if (iosched_submit(&job->io) != 0) {
+        lookup_worker(&job->io);
+        finish_job(state, job);
+        return;
+    }
+    reap(state, 0);
+}
+
+int lookup_files(sqlite3 *db, const LookupOptions *opts) {
+    LookupState state = {0};
+    char sidecar[PATH_MAX];
+    snprintf(sidecar, sizeof(sidecar), "%s.bloom", opts->db_path);
+
+    BloomHeader stamp;
+    db_stamp(opts->db_path, &stamp);
+    if (bloom_load(&state.bloom, sidecar, &stamp) == 0) {
+        if (opts->verbose) printf("Loaded lookup filter %s (%llu keys)\n", sidecar, (unsigned long long)state.bloom.header.key_count);
+    } else if (bloom_build(&state.bloom, db, &stamp) == 0) {
+        if (opts->verbose) printf("Built lookup filter %s (%llu keys)\n", sidecar, (unsigned long long)state.bloom.header.key_count);
+        bloom_save(&state.bloom, sidecar, opts->verbose);
+    } else {
+        // Without a filter every hash goes to SQLite; results stay exact.
+        free(state.bloom.words);
+        state.bloom.words = NULL;
+    }
+
+    if (sqlite3_prepare_v2(db, "SELECT filepath, md5 FROM files WHERE md5 = ? ORDER BY filepath;", -1, &state.md5_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "SELECT filepath, md5 FROM files WHERE audio_md5 = ? ORDER BY filepath;", -1, &state.audio_stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL: Error preparing lookup queries: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(state.md5_stmt);
+        free(state.bloom.words);
+        return 1;
+    }
+
+    lookup_hash_audio = opts->hash_audio;
+    iosched_start(lookup_worker, &opts->sched);
+    if (opts->path_count > 0) {
+        for (int i = 0; i < opts->path_count; i++) {
+            submit_path(&state, opts->paths[i]);
+        }
+    } else {
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t len;
+        int delim = opts->nul_input ? '\0' : '\n';
+        while ((len = getdelim(&line, &cap, delim, stdin)) != -1) {
+            if (len > 0 && line[len - 1] == delim) line[--len] = '\0';
+            if (len > 0) submit_path(&state, line);
+        }
+        free(line);
+    }
+    reap(&state, 1);
+    iosched_stop();
+
+    if (opts->verbose) {
+        printf("Looked up %lld files: %lld known, %lld unknown, %lld errors; %lld SQLite probes, %lld answered by the filter\n",
+               state.files, state.known, state.unknown, state.errors, state.probes, state.filtered);
+    }
+    sqlite3_finalize(state.md5_stmt);
+    sqlite3_finalize(state.audio_stmt);
+    free(state.bloom.words);
+    return state.errors ? 1 : 0;
+}
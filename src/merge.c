@@ -0,0 +1,364 @@
+#include "merge.h"
+#include "db.h"
+#include "output.h"
+#include "stats.h"
+
+typedef struct {
+    char name[PATH_MAX];
+    char *maps;             // -map list as stored in merge_sources
+    int has_row_version;
+    int has_check_level;
+    int has_check_log;
+    int full;
+    int64_t watermark;      // rows above this are copied; -1 copies all
+    int64_t pending;
+} MergePlan;
+
+// Rebuilt afterwards by ensure_schema_and_version. The filepath index stays
+// (the upsert needs it), and so does idx_files_source, which the deletes use.
+static const char *droppable_indexes[] = {
+    "idx_files_md5",
+    "idx_files_audio_md5",
+    "idx_files_extension",
+    "idx_files_audio_check_result",
+    "idx_files_row_version"
+};
+
+// fhash_remap(path): the first -map whose prefix covers path, at a
+// directory boundary, swaps that prefix; other paths pass unchanged.
+static void remap_path(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    const MergeSource *source = sqlite3_user_data(context);
+    const char *path = (const char *)sqlite3_value_text(argv[0]);
+    if (!path) {
+        sqlite3_result_null(context);
+        return;
+    }
+    for (int i = 0; i < source->map_count; i++) {
+        const char *from = source->maps[i].from;
+        const char *to = source->maps[i].to;
+        size_t from_len = strlen(from);
+        size_t to_len = strlen(to);
+        while (from_len > 0 && from[from_len - 1] == '/') from_len--;
+        while (to_len > 0 && to[to_len - 1] == '/') to_len--;
+        if (strncmp(path, from, from_len) != 0 || (path[from_len] != '/' && path[from_len] != '\0')) continue;
+        char *mapped = sqlite3_mprintf("%.*s%s", (int)to_len, to, path + from_len);
+        if (!mapped) {
+            sqlite3_result_error_nomem(context);
+            return;
+        }
+        sqlite3_result_text(context, mapped, -1, sqlite3_free);
+        return;
+    }
+    sqlite3_result_value(context, argv[0]);
+}
+
+static int exec_sql(sqlite3 *db, const char *sql, const char *what) {
+    if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error %s: %s\n", what, sqlite3_errmsg(db));
+        return 1;
+    }
+    return 0;
+}
+
+// Single-value query; arg binds to the first parameter, if there is one.
+static int64_t query_int(sqlite3 *db, const char *sql, int64_t arg, int64_t fallback) {
+    sqlite3_stmt *stmt;
+    int64_t value = fallback;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) return fallback;
+    if (sqlite3_bind_parameter_count(stmt) >= 1) sqlite3_bind_int64(stmt, 1, arg);
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        value = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+static int attach_source(sqlite3 *db, const char *db_path) {
+    // ATTACH would quietly create a missing file.
+    if (access(db_path, R_OK) != 0) {
+        fprintf(stderr, "Error: cannot read source DB %s: %m\n", db_path);
+        return 1;
+    }
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "ATTACH DATABASE ? AS src;", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error attaching %s: %s\n", db_path, sqlite3_errmsg(db));
+        return 1;
+    }
+    sqlite3_bind_text(stmt, 1, db_path, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error attaching %s: %s\n", db_path, sqlite3_errmsg(db));
+        return 1;
+    }
+    return 0;
+}
+
+static void detach_source(sqlite3 *db) {
+    sqlite3_exec(db, "DETACH DATABASE src;", NULL, NULL, NULL);
+}
+
+// Decides between a full and an incremental copy. A source is copied in
+// full the first time, when it lacks row versions, and whenever its path,
+// its maps or its version counter no longer match what the last merge saw.
+static int plan_source(sqlite3 *db, const MergeSource *source, MergePlan *plan) {
+    sqlite3_stmt *stmt;
+    int has_files = 0;
+    if (sqlite3_prepare_v2(db, "PRAGMA src.table_info(files);", -1, &stmt, NULL) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char *column = (const char *)sqlite3_column_text(stmt, 1);
+            if (!column) continue;
+            has_files = 1;
+            if (strcmp(column, "row_version") == 0) plan->has_row_version = 1;
+            else if (strcmp(column, "audio_check_level") == 0) plan->has_check_level = 1;
+            else if (strcmp(column, "audio_check_log") == 0) plan->has_check_log = 1;
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (!has_files) {
+        fprintf(stderr, "Error: %s has no files table\n", source->db_path);
+        return 1;
+    }
+
+    int64_t version = query_int(db, "SELECT CAST(value AS INTEGER) FROM src.sys WHERE key = 'row_version';", 0, -1);
+    plan->full = 1;
+    plan->watermark = -1;
+    if (plan->has_row_version && version >= 0 &&
+        sqlite3_prepare_v2(db, "SELECT db_path, maps, row_version FROM merge_sources WHERE source = ?;", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, plan->name, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char *last_path = (const char *)sqlite3_column_text(stmt, 0);
+            const char *last_maps = (const char *)sqlite3_column_text(stmt, 1);
+            int64_t last_version = sqlite3_column_int64(stmt, 2);
+            if (last_path && strcmp(last_path, source->db_path) == 0 &&
+                last_maps && strcmp(last_maps, plan->maps) == 0 && last_version <= version) {
+                plan->full = 0;
+                plan->watermark = last_version;
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+    plan->pending = plan->full
+        ? query_int(db, "SELECT COUNT(*) FROM src.files;", 0, 0)
+        : query_int(db, "SELECT COUNT(*) FROM src.files WHERE row_version > ?;", plan->watermark, 0);
+    return 0;
+}
+
+static int64_t run_counted(sqlite3 *db, const char *sql, const char *name, int64_t watermark, const char *what) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error %s: %s\n", what, sqlite3_errmsg(db));
+        return -1;
+    }
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    if (sqlite3_bind_parameter_count(stmt) >= 2) sqlite3_bind_int64(stmt, 2, watermark);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error %s: %s\n", what, sqlite3_errmsg(db));
+        return -1;
+    }
+    return sqlite3_changes(db);
+}
+
+// A path this DB's own scans or another source already hold stays with its
+// owner; otherwise the upsert would hand the row over, and the owner's next
+// full merge or prune would not find it. Returns the rows skipped, or -1.
+static int64_t report_collisions(sqlite3 *db, const MergePlan *plan) {
+    sqlite3_stmt *stmt;
+    const char *sql = plan->full
+        ? "SELECT f.filepath, f.source FROM src.files s JOIN files f ON f.filepath = fhash_remap(s.filepath) "
+          "WHERE f.source IS NOT ?1;"
+        : "SELECT f.filepath, f.source FROM src.files s JOIN files f ON f.filepath = fhash_remap(s.filepath) "
+          "WHERE s.row_version > ?2 AND f.source IS NOT ?1;";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error checking merge collisions: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    sqlite3_bind_text(stmt, 1, plan->name, -1, SQLITE_STATIC);
+    if (!plan->full) sqlite3_bind_int64(stmt, 2, plan->watermark);
+    int64_t skipped = 0;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *path = (const char *)sqlite3_column_text(stmt, 0);
+        const char *owner = (const char *)sqlite3_column_text(stmt, 1);
+        if (owner) {
+            fprintf(stderr, "Skipping %s from %s (already merged from %s)\n", path, plan->name, owner);
+        } else {
+            fprintf(stderr, "Skipping %s from %s (already indexed by a local scan)\n", path, plan->name);
+        }
+        skipped++;
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error checking merge collisions: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return skipped;
+}
+
+// One transaction per source: the DB never holds half a source's rows.
+static int merge_source(sqlite3 *db, MergeSource *source, const MergePlan *plan) {
+    if (sqlite3_create_function(db, "fhash_remap", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, source, remap_path, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error registering fhash_remap: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    if (begin_transaction(db) != 0) return 1;
+
+    // A full copy replaces everything from this source, so rows left behind
+    // by an older path mapping go too.
+    int64_t removed = run_counted(db, plan->full
+        ? "DELETE FROM files WHERE source = ?1;"
+        : "DELETE FROM files WHERE source = ?1 AND source_id NOT IN (SELECT id FROM src.files);",
+        plan->name, 0, "removing merged rows");
+    char *insert_sql = sqlite3_mprintf(
+        "INSERT INTO files (md5, audio_md5, filepath, filename, extension, filesize, last_check_timestamp, modified_timestamp, "
+        "filetype, audio_check_result, audio_check_level, audio_check_log, source, source_id) "
+        "SELECT md5, audio_md5, fhash_remap(filepath), filename, extension, filesize, last_check_timestamp, modified_timestamp, "
+        "filetype, audio_check_result, %s, %s, ?1, id FROM src.files WHERE %s "
+        "ON CONFLICT(filepath) DO UPDATE SET "
+        "md5 = excluded.md5, audio_md5 = excluded.audio_md5, filename = excluded.filename, extension = excluded.extension, "
+        "filesize = excluded.filesize, last_check_timestamp = excluded.last_check_timestamp, "
+        "modified_timestamp = excluded.modified_timestamp, filetype = excluded.filetype, "
+        "audio_check_result = excluded.audio_check_result, audio_check_level = excluded.audio_check_level, "
+        "audio_check_log = excluded.audio_check_log, source = excluded.source, source_id = excluded.source_id "
+        "WHERE files.source IS ?1;",
+        plan->has_check_level ? "audio_check_level" : "0",
+        plan->has_check_log ? "audio_check_log" : "NULL",
+        plan->full ? "1" : "row_version > ?2");
+    int64_t skipped = (removed >= 0) ? report_collisions(db, plan) : -1;
+    int64_t copied = -1;
+    if (!insert_sql) {
+        fprintf(stderr, "Memory: Error allocating merge statement\n");
+    } else if (skipped >= 0) {
+        copied = run_counted(db, insert_sql, plan->name, plan->watermark, "copying rows");
+    }
+    sqlite3_free(insert_sql);
+
+    // Recorded inside the same transaction as the rows it vouches for.
+    int64_t version = query_int(db, "SELECT CAST(value AS INTEGER) FROM src.sys WHERE key = 'row_version';", 0, 0);
+    sqlite3_stmt *stmt = NULL;
+    int recorded = 0;
+    if (copied >= 0 &&
+        sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO merge_sources (source, db_path, maps, row_version, merged_at) VALUES (?, ?, ?, ?, ?);", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, plan->name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, source->db_path, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, plan->maps, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 4, plan->has_row_version ? version : 0);
+        sqlite3_bind_int64(stmt, 5, (int64_t)time(NULL));
+        recorded = (sqlite3_step(stmt) == SQLITE_DONE);
+        if (!recorded) fprintf(stderr, "SQL error recording merge of %s: %s\n", plan->name, sqlite3_errmsg(db));
+    }
+    sqlite3_finalize(stmt);
+    if (!recorded) {
+        rollback_transaction(db);
+        return 1;
+    }
+    if (commit_transaction(db) != 0) return 1;
+
+    if (output_format == OUTPUT_TEXT) {
+        if (plan->full) {
+            printf("Merged %s: %lld rows copied (full, replacing %lld)\n", plan->name, (long long)copied, (long long)removed);
+        } else {
+            printf("Merged %s: %lld rows copied, %lld removed (since version %lld)\n", plan->name, (long long)copied, (long long)removed, (long long)plan->watermark);
+        }
+        if (skipped > 0) {
+            printf("Skipped %lld rows of %s whose paths are indexed from elsewhere\n", (long long)skipped, plan->name);
+        }
+    } else {
+        output_record_begin(NULL, "merge");
+        output_str(NULL, "source", plan->name);
+        output_str(NULL, "db", source->db_path);
+        output_int(NULL, "copied", copied);
+        output_int(NULL, "removed", removed);
+        output_int(NULL, "skipped", skipped);
+        output_int(NULL, "since", plan->watermark);
+        output_record_end(NULL);
+    }
+    return 0;
+}
+
+static char *format_maps(const MergeSource *source) {
+    char *maps = sqlite3_mprintf("%s", "");
+    for (int i = 0; maps && i < source->map_count; i++) {
+        char *next = sqlite3_mprintf("%s%s%s=%s", maps, i ? "\n" : "", source->maps[i].from, source->maps[i].to);
+        sqlite3_free(maps);
+        maps = next;
+    }
+    return maps;
+}
+
+int merge_indexes(sqlite3 *db, MergeSource *sources, int source_count, int verbose) {
+    MergePlan *plans = calloc((size_t)source_count, sizeof(MergePlan));
+    if (!plans) {
+        fprintf(stderr, "Memory: Error allocating merge plans\n");
+        return 1;
+    }
+    int ret = 0;
+    int64_t pending = 0;
+    for (int i = 0; i < source_count && ret == 0; i++) {
+        MergePlan *plan = &plans[i];
+        if (sources[i].name) {
+            snprintf(plan->name, sizeof(plan->name), "%s", sources[i].name);
+        } else if (!realpath(sources[i].db_path, plan->name)) {
+            snprintf(plan->name, sizeof(plan->name), "%s", sources[i].db_path);
+        }
+        for (int j = 0; j < i; j++) {
+            if (strcmp(plans[j].name, plan->name) == 0) {
+                fprintf(stderr, "Error: source name %s is used twice; set -source\n", plan->name);
+                ret = 1;
+            }
+        }
+        if (ret || !(plan->maps = format_maps(&sources[i]))) {
+            if (!ret) fprintf(stderr, "Memory: Error allocating merge maps\n");
+            ret = 1;
+            break;
+        }
+        if (attach_source(db, sources[i].db_path) != 0) {
+            ret = 1;
+            break;
+        }
+        ret = plan_source(db, &sources[i], plan);
+        detach_source(db);
+        pending += plan->pending;
+        if (verbose && ret == 0) {
+            printf("%s: %lld rows to copy (%s)\n", plan->name, (long long)plan->pending, plan->full ? "full" : "incremental");
+        }
+    }
+
+    // Maintaining five secondary indexes row by row costs more than
+    // building them once, when the load at least doubles the table.
+    int dropped = 0;
+    if (ret == 0 && pending > 0 && pending >= query_int(db, "SELECT COUNT(*) FROM files;", 0, 0)) {
+        dropped = 1;
+        for (size_t i = 0; i < sizeof(droppable_indexes) / sizeof(droppable_indexes[0]) && ret == 0; i++) {
+            char *drop_sql = sqlite3_mprintf("DROP INDEX IF EXISTS %s;", droppable_indexes[i]);
+            ret = drop_sql ? exec_sql(db, drop_sql, "dropping indexes for the load") : 1;
+            sqlite3_free(drop_sql);
+        }
+        if (verbose && ret == 0) printf("Dropped secondary indexes for a %lld-row load\n", (long long)pending);
+    }
+
+    for (int i = 0; i < source_count && ret == 0; i++) {
+        if (attach_source(db, sources[i].db_path) != 0) {
+            ret = 1;
+            break;
+        }
+        ret = merge_source(db, &sources[i], &plans[i]);
+        detach_source(db);
+    }
+
+    // Rebuilt even after a failure, so the DB is never left without them.
+    if (dropped) {
+        uint64_t start = stats_now_ns();
+        if (ensure_schema_and_version(db) != 0) {
+            ret = 1;
+        } else if (verbose) {
+            printf("Rebuilt indexes in %.1f ms\n", (double)(stats_now_ns() - start) / 1e6);
+        }
+    }
+    for (int i = 0; i < source_count; i++) sqlite3_free(plans[i].maps);
+    free(plans);
+    return ret;
+}
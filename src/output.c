@@ -0,0 +1,257 @@
+#include "output.h"
+#include <errno.h>
+#include <stdarg.h>
+
+int output_format = OUTPUT_TEXT;
+
+static int output_fd = -1;
+static OutputBuf stream_buf;
+static int output_error = 0;
+
+int output_failed(void) {
+    return output_error;
+}
+
+// Link workers report from their own threads.
+static void note_output_error(void) {
+    __sync_fetch_and_or(&output_error, 1);
+}
+
+int parse_output_format(const char *text, int *format_out) {
+    if (strcmp(text, "text") == 0) *format_out = OUTPUT_TEXT;
+    else if (strcmp(text, "jsonl") == 0) *format_out = OUTPUT_JSONL;
+    else if (strcmp(text, "tsv") == 0) *format_out = OUTPUT_TSV;
+    else if (strcmp(text, "nul") == 0) *format_out = OUTPUT_NUL;
+    else return -1;
+    return 0;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+void output_flush(void) {
+    if (output_fd < 0 || stream_buf.len == 0) return;
+    if (write_all(output_fd, stream_buf.data, stream_buf.len) != 0) {
+        fprintf(stderr, "Error: writing output failed: %m\n");
+        note_output_error();
+    }
+    stream_buf.len = 0;
+}
+
+// Text output only gets its destination changed. Records to stdout take
+// over the real stdout, and the human-readable status lines printed
+// elsewhere move to stderr so they cannot corrupt the stream.
+int output_open(int format, const char *path) {
+    output_format = format;
+    if (format == OUTPUT_TEXT) {
+        if (path && !freopen(path, "w", stdout)) {
+            fprintf(stderr, "Error: cannot open output file %s: %m\n", path);
+            return -1;
+        }
+        if (path) setvbuf(stdout, NULL, _IOFBF, OUTPUT_FLUSH_BYTES);
+        return 0;
+    }
+    if (path) {
+        output_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    } else {
+        fflush(stdout);
+        output_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+        if (output_fd >= 0) dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    if (output_fd < 0) {
+        fprintf(stderr, "Error: cannot open output %s: %m\n", path ? path : "stdout");
+        return -1;
+    }
+    stream_buf.cap = OUTPUT_FLUSH_BYTES + 4096;
+    stream_buf.data = malloc(stream_buf.cap);
+    if (!stream_buf.data) {
+        fprintf(stderr, "Memory: Error allocating output buffer\n");
+        return -1;
+    }
+    atexit(output_close);
+    return 0;
+}
+
+static int buf_reserve(OutputBuf *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) return 0;
+    size_t new_cap = buf->cap ? buf->cap : 256;
+    while (new_cap < buf->len + extra) new_cap *= 2;
+    char *grown = realloc(buf->data, new_cap);
+    if (!grown) {
+        buf->failed = 1;
+        return -1;
+    }
+    buf->data = grown;
+    buf->cap = new_cap;
+    return 0;
+}
+
+// After a failed append the rest of the record is skipped, and
+// output_record_end drops what was written of it.
+static void buf_append(OutputBuf *buf, const char *data, size_t len) {
+    if (buf->failed || buf_reserve(buf, len) != 0) return;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void buf_append_json(OutputBuf *buf, const char *value) {
+    buf_append(buf, "\"", 1);
+    for (const unsigned char *p = (const unsigned char *)value; *p; p++) {
+        char esc[8];
+        switch (*p) {
+            case '"': buf_append(buf, "\\\"", 2); break;
+            case '\\': buf_append(buf, "\\\\", 2); break;
+            case '\n': buf_append(buf, "\\n", 2); break;
+            case '\r': buf_append(buf, "\\r", 2); break;
+            case '\t': buf_append(buf, "\\t", 2); break;
+            default:
+                if (*p < 0x20) {
+                    snprintf(esc, sizeof(esc), "\\u%04x", *p);
+                    buf_append(buf, esc, 6);
+                } else {
+                    buf_append(buf, (const char *)p, 1);
+                }
+                break;
+        }
+    }
+    buf_append(buf, "\"", 1);
+}
+
+static void buf_append_tsv(OutputBuf *buf, const char *value) {
+    for (const char *p = value; *p; p++) {
+        switch (*p) {
+            case '\t': buf_append(buf, "\\t", 2); break;
+            case '\n': buf_append(buf, "\\n", 2); break;
+            case '\r': buf_append(buf, "\\r", 2); break;
+            case '\\': buf_append(buf, "\\\\", 2); break;
+            default: buf_append(buf, p, 1); break;
+        }
+    }
+}
+
+// Starts a field: the separator and, for jsonl, the key.
+static void field_begin(OutputBuf *buf, const char *key) {
+    if (output_format == OUTPUT_JSONL) {
+        buf_append(buf, ",", 1);
+        buf_append_json(buf, key);
+        buf_append(buf, ":", 1);
+    } else if (output_format == OUTPUT_TSV) {
+        buf_append(buf, "\t", 1);
+    }
+}
+
+void output_record_begin(OutputBuf *buf, const char *kind) {
+    if (!buf) buf = &stream_buf;
+    buf->record_start = buf->len;
+    buf->failed = 0;
+    switch (output_format) {
+        case OUTPUT_JSONL:
+            buf_append(buf, "{\"type\":", 8);
+            buf_append_json(buf, kind);
+            break;
+        case OUTPUT_TSV:
+            buf_append_tsv(buf, kind);
+            break;
+        case OUTPUT_NUL:
+            buf_append(buf, kind, strlen(kind) + 1);
+            break;
+    }
+}
+
+void output_str(OutputBuf *buf, const char *key, const char *value) {
+    if (!buf) buf = &stream_buf;
+    if (!value) value = "";
+    field_begin(buf, key);
+    switch (output_format) {
+        case OUTPUT_JSONL: buf_append_json(buf, value); break;
+        case OUTPUT_TSV: buf_append_tsv(buf, value); break;
+        case OUTPUT_NUL: buf_append(buf, value, strlen(value) + 1); break;
+    }
+}
+
+void output_int(OutputBuf *buf, const char *key, int64_t value) {
+    if (!buf) buf = &stream_buf;
+    char text[32];
+    int len = snprintf(text, sizeof(text), "%lld", (long long)value);
+    field_begin(buf, key);
+    buf_append(buf, text, (size_t)len + (output_format == OUTPUT_NUL));
+}
+
+void output_record_end(OutputBuf *buf) {
+    int shared = !buf;
+    if (!buf) buf = &stream_buf;
+    if (output_format == OUTPUT_JSONL) buf_append(buf, "}\n", 2);
+    else if (output_format == OUTPUT_TSV) buf_append(buf, "\n", 1);
+    if (buf->failed) {
+        // A truncated record would corrupt the stream for the reader.
+        fprintf(stderr, "Memory: Error allocating output record; record dropped\n");
+        note_output_error();
+        buf->len = buf->record_start;
+        buf->failed = 0;
+    }
+    if (shared && stream_buf.len >= OUTPUT_FLUSH_BYTES) output_flush();
+}
+
+void output_printf(OutputBuf *buf, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int needed = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (needed < 0) return;
+    if (buf_reserve(buf, (size_t)needed + 1) != 0) {
+        fprintf(stderr, "Memory: Error allocating output line; line dropped\n");
+        note_output_error();
+        buf->failed = 0;
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, ap);
+    va_end(ap);
+    buf->len += (size_t)needed;
+}
+
+void output_emit(OutputBuf *buf) {
+    if (!buf || buf->len == 0) return;
+    if (stream_buf.len + buf->len > OUTPUT_FLUSH_BYTES) output_flush();
+    if (buf->len >= OUTPUT_FLUSH_BYTES) {
+        if (output_fd >= 0 && write_all(output_fd, buf->data, buf->len) != 0) {
+            fprintf(stderr, "Error: writing output failed: %m\n");
+            note_output_error();
+        }
+    } else if (buf_reserve(&stream_buf, buf->len) != 0) {
+        fprintf(stderr, "Memory: Error allocating output buffer; records dropped\n");
+        note_output_error();
+        stream_buf.failed = 0;
+    } else {
+        buf_append(&stream_buf, buf->data, buf->len);
+    }
+    buf->len = 0;
+}
+
+void output_buf_free(OutputBuf *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+void output_close(void) {
+    if (output_fd < 0) return;
+    output_flush();
+    if (close(output_fd) != 0) {
+        fprintf(stderr, "Error: writing output failed: %m\n");
+        note_output_error();
+    }
+    output_fd = -1;
+    output_buf_free(&stream_buf);
+}
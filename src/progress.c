@@ -0,0 +1,360 @@
+#include "progress.h"
+#include "stats.h"
+#include "utils.h"
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+// The reporter runs on its own thread and only reads the relaxed stats
+// counters, so the scan loop pays nothing beyond the counter increments and
+// one locked copy of the path per directory.
+#define PROGRESS_TTY_INTERVAL_MS 1000
+#define PROGRESS_LOG_INTERVAL_MS 10000
+#define PROGRESS_DIR_DISPLAY 60
+
+int progress_enabled = 0;
+
+static ProgressOptions progress_opts;
+static pthread_t reporter_thread;
+static pthread_t precount_thread;
+static int precount_started = 0;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
+static int progress_stopping = 0;
+static char current_dir[MAX_PATH_LENGTH];
+static uint64_t progress_start_ns = 0;
+static int stderr_is_tty = 0;
+static int snapshot_fd = -1;
+static int snapshot_is_fifo = 0;
+
+static _Atomic uint64_t total_files = 0;
+static _Atomic uint64_t total_bytes = 0;
+static _Atomic int precount_done = 0;
+static _Atomic int precount_abort = 0;
+static _Atomic int walk_complete = 0;
+
+void progress_set_directory(const char *path) {
+    pthread_mutex_lock(&progress_lock);
+    snprintf(current_dir, sizeof(current_dir), "%s", path);
+    pthread_mutex_unlock(&progress_lock);
+}
+
+static int precount_extension_ok(const char *name) {
+    if (progress_opts.ext_count == 0) return 1;
+    const char *dot = strrchr(name, '.');
+    if (!dot || dot[1] == '\0') return 0;
+    return ext_matches_filter(dot + 1, progress_opts.ext_list, progress_opts.ext_count);
+}
+
+// Walks the same tree as the scan, relying on d_type so only matching
+// regular files are stat'ed (for their size).
+static void *precount_main(void *arg) {
+    (void)arg;
+    DirStack *stack = create_dir_stack(1024);
+    if (!stack) return NULL;
+    int failed = push_dir(stack, progress_opts.root) != 0;
+
+    while (!failed && stack->size > 0 && !atomic_load(&precount_abort)) {
+        char dir_path[MAX_PATH_LENGTH];
+        snprintf(dir_path, sizeof(dir_path), "%s", pop_dir(stack));
+
+        DIR *dir = opendir(dir_path);
+        if (!dir) continue;
+        int dfd = dirfd(dir);
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL && !atomic_load(&precount_abort)) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+            unsigned char type = entry->d_type;
+            struct stat st;
+            int have_stat = 0;
+            if (type == DT_UNKNOWN) {
+                if (fstatat(dfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                have_stat = 1;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+            }
+
+            if (type == DT_DIR) {
+                if (progress_opts.recurse_dirs) {
+                    char child[MAX_PATH_LENGTH];
+                    if (snprintf(child, sizeof(child), "%s/%s", dir_path, entry->d_name) < (int)sizeof(child) &&
+                        push_dir(stack, child) != 0) {
+                        failed = 1;
+                        break;
+                    }
+                }
+            } else if (type == DT_REG && precount_extension_ok(entry->d_name)) {
+                if (!have_stat && fstatat(dfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                atomic_fetch_add(&total_files, 1);
+                atomic_fetch_add(&total_bytes, (uint64_t)st.st_size);
+            }
+        }
+        closedir(dir);
+    }
+
+    destroy_dir_stack(stack);
+    // A pre-count cut short by an allocation failure leaves the ETA off.
+    if (!failed && !atomic_load(&precount_abort)) {
+        atomic_store(&precount_done, 1);
+    }
+    return NULL;
+}
+
+static void format_duration(char *out, size_t out_len, double seconds) {
+    uint64_t s = (uint64_t)(seconds + 0.5);
+    if (s >= 86400) {
+        snprintf(out, out_len, "%llud%02lluh", (unsigned long long)(s / 86400), (unsigned long long)((s % 86400) / 3600));
+    } else if (s >= 3600) {
+        snprintf(out, out_len, "%lluh%02llum", (unsigned long long)(s / 3600), (unsigned long long)((s % 3600) / 60));
+    } else {
+        snprintf(out, out_len, "%llum%02llus", (unsigned long long)(s / 60), (unsigned long long)(s % 60));
+    }
+}
+
+typedef struct {
+    double elapsed;
+    uint64_t files;
+    uint64_t skipped;
+    uint64_t hashed;
+    uint64_t bytes;
+    uint64_t bytes_hashed;
+    uint64_t errors;
+    double files_per_s;
+    double mb_per_s;
+    int have_totals;
+    uint64_t total_files;
+    uint64_t total_bytes;
+    double eta;
+    char dir[MAX_PATH_LENGTH];
+} ProgressSnapshot;
+
+static void take_snapshot(ProgressSnapshot *snap) {
+    memset(snap, 0, sizeof(*snap));
+    snap->elapsed = (double)(stats_now_ns() - progress_start_ns) / 1e9;
+    snap->files = stats_counter_value(COUNTER_FILES_SEEN);
+    snap->skipped = stats_counter_value(COUNTER_FILES_SKIPPED);
+    snap->hashed = stats_counter_value(COUNTER_FILES_HASHED);
+    snap->bytes = stats_counter_value(COUNTER_BYTES_SEEN);
+    snap->bytes_hashed = stats_counter_value(COUNTER_BYTES_HASHED);
+    snap->errors = stats_counter_value(COUNTER_ERRORS);
+    if (snap->elapsed > 0) {
+        snap->files_per_s = (double)snap->files / snap->elapsed;
+        snap->mb_per_s = (double)snap->bytes_hashed / (1024.0 * 1024.0) / snap->elapsed;
+    }
+    snap->eta = -1;
+    if (atomic_load(&precount_done)) {
+        snap->have_totals = 1;
+        snap->total_files = atomic_load(&total_files);
+        snap->total_bytes = atomic_load(&total_bytes);
+        // Byte progress is the better predictor when files vary in size.
+        if (snap->bytes > 0 && snap->total_bytes > snap->bytes) {
+            snap->eta = (double)(snap->total_bytes - snap->bytes) * snap->elapsed / (double)snap->bytes;
+        } else if (snap->files > 0 && snap->total_files > snap->files) {
+            snap->eta = (double)(snap->total_files - snap->files) * snap->elapsed / (double)snap->files;
+        } else {
+            snap->eta = 0;
+        }
+    } else if (atomic_load(&walk_complete)) {
+        // The walk beat the pre-count; what it saw is the exact total.
+        snap->have_totals = 1;
+        snap->total_files = snap->files;
+        snap->total_bytes = snap->bytes;
+        snap->eta = 0;
+    }
+    pthread_mutex_lock(&progress_lock);
+    snprintf(snap->dir, sizeof(snap->dir), "%s", current_dir);
+    pthread_mutex_unlock(&progress_lock);
+}
+
+static void print_status_line(const ProgressSnapshot *snap, int final) {
+    char files_part[64];
+    char eta_part[48] = "";
+    if (snap->have_totals) {
+        snprintf(files_part, sizeof(files_part), "%llu/%llu files", (unsigned long long)snap->files, (unsigned long long)snap->total_files);
+        if (!final) {
+            char eta[32];
+            format_duration(eta, sizeof(eta), snap->eta);
+            snprintf(eta_part, sizeof(eta_part), " ETA %s", eta);
+        }
+    } else {
+        snprintf(files_part, sizeof(files_part), "%llu files", (unsigned long long)snap->files);
+    }
+
+    char elapsed[32];
+    format_duration(elapsed, sizeof(elapsed), snap->elapsed);
+    size_t dir_len = strlen(snap->dir);
+    const char *dir = (dir_len > PROGRESS_DIR_DISPLAY) ? snap->dir + dir_len - PROGRESS_DIR_DISPLAY : snap->dir;
+
+    fprintf(stderr, "%s[%s] %s (%llu hashed, %llu skipped) %.1f files/s %.1f MB/s, %llu errors%s%s%s%s",
+            stderr_is_tty ? "\r\033[K" : "",
+            elapsed, files_part,
+            (unsigned long long)snap->hashed, (unsigned long long)snap->skipped,
+            snap->files_per_s, snap->mb_per_s, (unsigned long long)snap->errors, eta_part,
+            final ? "" : " | ", dir_len > PROGRESS_DIR_DISPLAY && !final ? "..." : "", final ? "" : dir);
+    if (!stderr_is_tty || final) {
+        fputc('\n', stderr);
+    }
+    fflush(stderr);
+}
+
+static void write_snapshot(const ProgressSnapshot *snap, int final) {
+    if (snapshot_fd < 0) {
+        // O_NONBLOCK: opening a FIFO without a reader fails instead of
+        // blocking, and a full pipe drops the snapshot instead of stalling.
+        snapshot_fd = open(progress_opts.snapshot_path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK | O_CLOEXEC, 0644);
+        if (snapshot_fd < 0) return;
+        struct stat st;
+        snapshot_is_fifo = fstat(snapshot_fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    }
+
+    char dir_json[MAX_PATH_LENGTH * 2];
+    json_escape(dir_json, sizeof(dir_json), snap->dir);
+    char totals[128] = "\"total_files\":null,\"total_bytes\":null,\"eta_s\":null";
+    if (snap->have_totals) {
+        snprintf(totals, sizeof(totals), "\"total_files\":%llu,\"total_bytes\":%llu,\"eta_s\":%.0f",
+                 (unsigned long long)snap->total_files, (unsigned long long)snap->total_bytes, snap->eta);
+    }
+
+    char line[MAX_PATH_LENGTH * 2 + 512];
+    int n = snprintf(line, sizeof(line),
+                     "{\"elapsed_s\":%.1f,\"final\":%s,\"files\":%llu,\"files_hashed\":%llu,\"files_skipped\":%llu,"
+                     "\"bytes\":%llu,\"bytes_hashed\":%llu,\"errors\":%llu,\"files_per_s\":%.1f,\"mb_per_s\":%.2f,%s,\"dir\":\"%s\"}\n",
+                     snap->elapsed, final ? "true" : "false",
+                     (unsigned long long)snap->files, (unsigned long long)snap->hashed, (unsigned long long)snap->skipped,
+                     (unsigned long long)snap->bytes, (unsigned long long)snap->bytes_hashed, (unsigned long long)snap->errors,
+                     snap->files_per_s, snap->mb_per_s, totals, dir_json);
+    if (n <= 0) return;
+    if (n >= (int)sizeof(line)) n = (int)sizeof(line) - 1;
+
+    if (snapshot_is_fifo) {
+        // Pipe writes up to PIPE_BUF are atomic: either the whole line goes
+        // in or EAGAIN drops it. Longer lines could tear or be cut short, so
+        // skip them rather than hand the reader half a record.
+        if (n > PIPE_BUF) return;
+        if (write(snapshot_fd, line, (size_t)n) < 0 && errno == EPIPE) {
+            // Reader went away; SIGPIPE is blocked on this thread, so clear
+            // the pending signal and reopen on the next tick.
+            sigset_t pipe_set;
+            sigemptyset(&pipe_set);
+            sigaddset(&pipe_set, SIGPIPE);
+            struct timespec zero = {0, 0};
+            while (sigtimedwait(&pipe_set, NULL, &zero) == SIGPIPE) {
+            }
+            close(snapshot_fd);
+            snapshot_fd = -1;
+        }
+        return;
+    }
+
+    // A regular file never returns EAGAIN, so finish any short write to keep
+    // the line whole.
+    const char *p = line;
+    size_t left = (size_t)n;
+    while (left > 0) {
+        ssize_t w = write(snapshot_fd, p, left);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        p += w;
+        left -= (size_t)w;
+    }
+}
+
+static void report(int final) {
+    ProgressSnapshot snap;
+    take_snapshot(&snap);
+    if (progress_opts.status_line) print_status_line(&snap, final);
+    if (progress_opts.snapshot_path) write_snapshot(&snap, final);
+}
+
+static void *reporter_main(void *arg) {
+    (void)arg;
+    if (progress_opts.snapshot_path) {
+        // Only this thread writes the snapshot FIFO; block SIGPIPE here so a
+        // vanished reader shows up as EPIPE without touching the process-wide
+        // disposition.
+        sigset_t pipe_set;
+        sigemptyset(&pipe_set);
+        sigaddset(&pipe_set, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &pipe_set, NULL);
+    }
+    int interval_ms = (progress_opts.status_line && !stderr_is_tty) ? PROGRESS_LOG_INTERVAL_MS : PROGRESS_TTY_INTERVAL_MS;
+
+    pthread_mutex_lock(&progress_lock);
+    while (!progress_stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval_ms / 1000;
+        deadline.tv_nsec += (long)(interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&progress_cond, &progress_lock, &deadline);
+        if (progress_stopping) break;
+        pthread_mutex_unlock(&progress_lock);
+        report(0);
+        pthread_mutex_lock(&progress_lock);
+    }
+    pthread_mutex_unlock(&progress_lock);
+
+    report(1);
+    return NULL;
+}
+
+int progress_start(const ProgressOptions *opts) {
+    progress_opts = *opts;
+    stderr_is_tty = isatty(STDERR_FILENO);
+    stats_enable_counters();
+    progress_start_ns = stats_now_ns();
+    progress_stopping = 0;
+
+    if (progress_opts.precount) {
+        if (pthread_create(&precount_thread, NULL, precount_main, NULL) != 0) {
+            fprintf(stderr, "Progress: Error starting pre-count thread\n");
+        } else {
+            precount_started = 1;
+        }
+    }
+
+    if (pthread_create(&reporter_thread, NULL, reporter_main, NULL) != 0) {
+        fprintf(stderr, "Progress: Error starting reporter thread\n");
+        if (precount_started) {
+            atomic_store(&precount_abort, 1);
+            pthread_join(precount_thread, NULL);
+            precount_started = 0;
+        }
+        return 1;
+    }
+    progress_enabled = 1;
+    return 0;
+}
+
+void progress_set_walk_complete(void) {
+    atomic_store(&walk_complete, 1);
+}
+
+void progress_stop(void) {
+    if (!progress_enabled) return;
+
+    if (precount_started) {
+        atomic_store(&precount_abort, 1);
+        pthread_join(precount_thread, NULL);
+        precount_started = 0;
+    }
+
+    pthread_mutex_lock(&progress_lock);
+    progress_stopping = 1;
+    pthread_cond_signal(&progress_cond);
+    pthread_mutex_unlock(&progress_lock);
+    pthread_join(reporter_thread, NULL);
+
+    if (snapshot_fd >= 0) {
+        close(snapshot_fd);
+        snapshot_fd = -1;
+    }
+    progress_enabled = 0;
+}
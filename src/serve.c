@@ -0,0 +1,691 @@
+#include "serve.h"
+#include "output.h"
+#include "stats.h"
+#include "utils.h"
+#include <sqlite3.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#define SERVE_NONE UINT32_MAX
+#define SERVE_MIN_BUCKETS 1024
+#define SERVE_IO_TIMEOUT_SEC 5
+
+typedef struct {
+    size_t path_off;
+    int64_t size;
+    int64_t mtime;
+    uint32_t next_path;
+    uint32_t next_md5;
+    uint32_t next_audio;
+    char md5[MD5_DIGEST_LENGTH * 2 + 1];
+    char audio_md5[MD5_DIGEST_LENGTH * 2 + 1];
+} ServeRow;
+
+// Rows live in one array and their paths in one arena; the three tables
+// are bucket heads chained through the rows' next_* indices.
+typedef struct {
+    ServeRow *rows;
+    uint32_t count;
+    uint32_t cap;
+    char *paths;
+    size_t paths_len;
+    size_t paths_cap;
+    uint32_t *by_path;
+    uint32_t *by_md5;
+    uint32_t *by_audio;
+    uint32_t mask;
+} ServeIndex;
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;     // an append was dropped for lack of memory
+} ByteBuf;
+
+// Per-connection buffers; the socket is non-blocking, so a request may
+// arrive, and a response leave, over several poll rounds.
+typedef struct {
+    ByteBuf in;         // received bytes not yet answered
+    ByteBuf out;        // framed responses the socket has not taken yet
+    size_t out_sent;
+} ServeClient;
+
+// Rebuilds run on their own thread and DB connection while the main loop
+// keeps answering from the current index.
+typedef struct {
+    sqlite3 *db;
+    ServeIndex index;
+    int64_t version;    // data_version sampled before the rebuild began
+    int rc;
+    int verbose;
+    int wake_fd;        // written once the rebuild is done
+} ServeLoader;
+
+static uint64_t fnv1a(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static const char *row_path(const ServeIndex *index, const ServeRow *row) {
+    return index->paths + row->path_off;
+}
+
+static void index_free(ServeIndex *index) {
+    free(index->rows);
+    free(index->paths);
+    free(index->by_path);
+    free(index->by_md5);
+    free(index->by_audio);
+    memset(index, 0, sizeof(*index));
+}
+
+static int index_add(ServeIndex *index, const char *path, const char *md5, const char *audio_md5, int64_t size, int64_t mtime) {
+    if (index->count == index->cap) {
+        if (index->cap >= SERVE_NONE / 2) return -1;
+        uint32_t new_cap = index->cap ? index->cap * 2 : 4096;
+        ServeRow *grown = realloc(index->rows, (size_t)new_cap * sizeof(ServeRow));
+        if (!grown) return -1;
+        index->rows = grown;
+        index->cap = new_cap;
+    }
+    size_t path_len = strlen(path) + 1;
+    if (index->paths_len + path_len > index->paths_cap) {
+        size_t new_cap = index->paths_cap ? index->paths_cap * 2 : 1 << 20;
+        while (new_cap < index->paths_len + path_len) new_cap *= 2;
+        char *grown = realloc(index->paths, new_cap);
+        if (!grown) return -1;
+        index->paths = grown;
+        index->paths_cap = new_cap;
+    }
+    ServeRow *row = &index->rows[index->count++];
+    memset(row, 0, sizeof(*row));
+    row->path_off = index->paths_len;
+    memcpy(index->paths + index->paths_len, path, path_len);
+    index->paths_len += path_len;
+    snprintf(row->md5, sizeof(row->md5), "%s", md5 ? md5 : "");
+    snprintf(row->audio_md5, sizeof(row->audio_md5), "%s", audio_md5 ? audio_md5 : "");
+    row->size = size;
+    row->mtime = mtime;
+    return 0;
+}
+
+static int index_build_tables(ServeIndex *index) {
+    size_t buckets = SERVE_MIN_BUCKETS;
+    while (buckets < (size_t)index->count * 2) buckets *= 2;
+    index->by_path = malloc(buckets * sizeof(uint32_t));
+    index->by_md5 = malloc(buckets * sizeof(uint32_t));
+    index->by_audio = malloc(buckets * sizeof(uint32_t));
+    if (!index->by_path || !index->by_md5 || !index->by_audio) return -1;
+    memset(index->by_path, 0xff, buckets * sizeof(uint32_t));
+    memset(index->by_md5, 0xff, buckets * sizeof(uint32_t));
+    memset(index->by_audio, 0xff, buckets * sizeof(uint32_t));
+    index->mask = (uint32_t)(buckets - 1);
+    for (uint32_t i = 0; i < index->count; i++) {
+        ServeRow *row = &index->rows[i];
+        uint32_t b = (uint32_t)fnv1a(row_path(index, row)) & index->mask;
+        row->next_path = index->by_path[b];
+        index->by_path[b] = i;
+        row->next_md5 = SERVE_NONE;
+        if (is_md5_hex(row->md5)) {
+            b = (uint32_t)fnv1a(row->md5) & index->mask;
+            row->next_md5 = index->by_md5[b];
+            index->by_md5[b] = i;
+        }
+        row->next_audio = SERVE_NONE;
+        if (is_md5_hex(row->audio_md5)) {
+            b = (uint32_t)fnv1a(row->audio_md5) & index->mask;
+            row->next_audio = index->by_audio[b];
+            index->by_audio[b] = i;
+        }
+    }
+    return 0;
+}
+
+static int index_load(ServeIndex *index, sqlite3 *db) {
+    memset(index, 0, sizeof(*index));
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT filepath, md5, audio_md5, filesize, modified_timestamp FROM files;", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL: Error preparing index load: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *path = (const char *)sqlite3_column_text(stmt, 0);
+        if (!path) continue;
+        if (index_add(index, path, (const char *)sqlite3_column_text(stmt, 1), (const char *)sqlite3_column_text(stmt, 2),
+                      sqlite3_column_int64(stmt, 3), sqlite3_column_int64(stmt, 4)) != 0) {
+            fprintf(stderr, "Memory: Error growing the in-memory index\n");
+            rc = SQLITE_NOMEM;
+            break;
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        if (rc != SQLITE_NOMEM) fprintf(stderr, "SQL: Error loading the index: %s\n", sqlite3_errmsg(db));
+        index_free(index);
+        return -1;
+    }
+    if (index_build_tables(index) != 0) {
+        fprintf(stderr, "Memory: Error allocating index tables\n");
+        index_free(index);
+        return -1;
+    }
+    return 0;
+}
+
+static int64_t data_version(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    int64_t version = -1;
+    if (sqlite3_prepare_v2(db, "PRAGMA data_version;", -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) version = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    return version;
+}
+
+static int buf_reserve(ByteBuf *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) return 0;
+    size_t new_cap = buf->cap ? buf->cap : 4096;
+    while (new_cap < buf->len + extra) new_cap *= 2;
+    char *grown = realloc(buf->data, new_cap);
+    if (!grown) {
+        buf->failed = 1;
+        return -1;
+    }
+    buf->data = grown;
+    buf->cap = new_cap;
+    return 0;
+}
+
+static int buf_put(ByteBuf *buf, const void *data, size_t len) {
+    if (buf_reserve(buf, len) != 0) return -1;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+static void buf_put_str(ByteBuf *buf, const char *s) {
+    buf_put(buf, s, strlen(s) + 1);
+}
+
+static void put_row(ByteBuf *resp, const ServeIndex *index, uint32_t i) {
+    const ServeRow *row = &index->rows[i];
+    char number[32];
+    buf_put_str(resp, row_path(index, row));
+    buf_put_str(resp, row->md5);
+    buf_put_str(resp, row->audio_md5);
+    snprintf(number, sizeof(number), "%lld", (long long)row->size);
+    buf_put_str(resp, number);
+    snprintf(number, sizeof(number), "%lld", (long long)row->mtime);
+    buf_put_str(resp, number);
+}
+
+static uint32_t find_path(const ServeIndex *index, const char *path) {
+    if (!index->by_path) return SERVE_NONE;
+    uint32_t i = index->by_path[(uint32_t)fnv1a(path) & index->mask];
+    while (i != SERVE_NONE && strcmp(row_path(index, &index->rows[i]), path) != 0) {
+        i = index->rows[i].next_path;
+    }
+    return i;
+}
+
+static void put_md5_matches(ByteBuf *resp, const ServeIndex *index, const char *md5) {
+    if (!index->by_md5 || !is_md5_hex(md5)) return;
+    for (uint32_t i = index->by_md5[(uint32_t)fnv1a(md5) & index->mask]; i != SERVE_NONE; i = index->rows[i].next_md5) {
+        if (strcmp(index->rows[i].md5, md5) == 0) put_row(resp, index, i);
+    }
+}
+
+static void put_audio_matches(ByteBuf *resp, const ServeIndex *index, const char *audio_md5) {
+    if (!index->by_audio || !is_md5_hex(audio_md5)) return;
+    for (uint32_t i = index->by_audio[(uint32_t)fnv1a(audio_md5) & index->mask]; i != SERVE_NONE; i = index->rows[i].next_audio) {
+        if (strcmp(index->rows[i].audio_md5, audio_md5) == 0) put_row(resp, index, i);
+    }
+}
+
+// Builds the response payload for one request; arg is NUL-terminated.
+static void answer(ByteBuf *resp, const ServeIndex *index, int op, const char *arg) {
+    uint32_t i;
+    buf_put(resp, "O", 1);
+    switch (op) {
+        case SERVE_OP_HASH:
+            put_md5_matches(resp, index, arg);
+            break;
+        case SERVE_OP_AUDIO:
+            put_audio_matches(resp, index, arg);
+            break;
+        case SERVE_OP_PATH:
+            if ((i = find_path(index, arg)) != SERVE_NONE) put_row(resp, index, i);
+            break;
+        case SERVE_OP_GROUP:
+            if ((i = find_path(index, arg)) == SERVE_NONE) break;
+            if (is_md5_hex(index->rows[i].md5)) {
+                put_md5_matches(resp, index, index->rows[i].md5);
+            } else {
+                put_row(resp, index, i);
+            }
+            break;
+        default:
+            resp->len = 0;
+            buf_put(resp, "Eunknown op", 11);
+            break;
+    }
+}
+
+static int read_full(int fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_frame(int fd, const char *payload, size_t len) {
+    uint32_t header = htonl((uint32_t)len);
+    if (write_full(fd, &header, sizeof(header)) != 0) return -1;
+    return write_full(fd, payload, len);
+}
+
+// Reads a frame of at most max bytes into a malloc'd, NUL-terminated buffer.
+static char *read_frame(int fd, size_t max, size_t *len_out) {
+    uint32_t header;
+    if (read_full(fd, &header, sizeof(header)) != 0) return NULL;
+    size_t len = ntohl(header);
+    if (len > max) return NULL;
+    char *payload = malloc(len + 1);
+    if (!payload) return NULL;
+    if (read_full(fd, payload, len) != 0) {
+        free(payload);
+        return NULL;
+    }
+    payload[len] = '\0';
+    *len_out = len;
+    return payload;
+}
+
+// Takes what the socket has ready, one recv per poll round, always leaving
+// a spare byte after the data. Returns -1 on EOF or error.
+static int client_read(int fd, ServeClient *client) {
+    if (buf_reserve(&client->in, 4096) != 0) return -1;
+    for (;;) {
+        ssize_t n = recv(fd, client->in.data + client->in.len, client->in.cap - client->in.len - 1, 0);
+        if (n > 0) {
+            client->in.len += (size_t)n;
+            return 0;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        return (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : -1;
+    }
+}
+
+// Answers every complete request in the input buffer into the output
+// buffer. Returns -1 when the client should be dropped.
+static int client_answer(ServeClient *client, const ServeIndex *index, ByteBuf *resp) {
+    size_t used = 0;
+    while (client->in.len - used >= sizeof(uint32_t)) {
+        uint32_t header;
+        memcpy(&header, client->in.data + used, sizeof(header));
+        size_t len = ntohl(header);
+        if (len > SERVE_MAX_REQUEST) return -1;
+        if (client->in.len - used - sizeof(header) < len) break;
+        char *request = client->in.data + used + sizeof(header);
+        // answer() wants a C string; the byte after the payload is the next
+        // frame's or the spare one, and is put back afterwards.
+        char saved = request[len];
+        request[len] = '\0';
+        resp->len = 0;
+        resp->failed = 0;
+        if (len == 0) {
+            buf_put(resp, "Eempty request", 14);
+        } else {
+            answer(resp, index, (unsigned char)request[0], request + 1);
+        }
+        request[len] = saved;
+        if (resp->failed) {
+            resp->len = 0;
+            buf_put(resp, "Eout of memory", 14);
+        }
+        uint32_t out_header = htonl((uint32_t)resp->len);
+        if (buf_put(&client->out, &out_header, sizeof(out_header)) != 0 ||
+            buf_put(&client->out, resp->data, resp->len) != 0) {
+            fprintf(stderr, "Memory: Error buffering a response\n");
+            return -1;
+        }
+        used += sizeof(header) + len;
+    }
+    memmove(client->in.data, client->in.data + used, client->in.len - used);
+    client->in.len -= used;
+    return 0;
+}
+
+// Sends as much of the output buffer as the socket takes now.
+static int client_flush(int fd, ServeClient *client) {
+    while (client->out_sent < client->out.len) {
+        ssize_t n = send(fd, client->out.data + client->out_sent, client->out.len - client->out_sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            client->out_sent += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        return (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : -1;
+    }
+    client->out.len = 0;
+    client->out_sent = 0;
+    return 0;
+}
+
+static void client_free(ServeClient *client) {
+    free(client->in.data);
+    free(client->out.data);
+    memset(client, 0, sizeof(*client));
+}
+
+static int fill_sockaddr(struct sockaddr_un *addr, const char *sock_path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Error: socket path too long: %s\n", sock_path);
+        return -1;
+    }
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", sock_path);
+    return 0;
+}
+
+static int connect_socket(const char *sock_path) {
+    struct sockaddr_un addr;
+    if (fill_sockaddr(&addr, sock_path) != 0) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+// The query client gives up on a server that stops answering.
+static void set_io_timeouts(int fd) {
+    struct timeval tv = { .tv_sec = SERVE_IO_TIMEOUT_SEC, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int open_listener(const char *sock_path) {
+    struct sockaddr_un addr;
+    if (fill_sockaddr(&addr, sock_path) != 0) return -1;
+    int probe = connect_socket(sock_path);
+    if (probe >= 0) {
+        close(probe);
+        fprintf(stderr, "Error: another server is listening on %s\n", sock_path);
+        return -1;
+    }
+    unlink(sock_path);  // stale socket from a server that did not exit cleanly
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Error: cannot listen on %s: %m\n", sock_path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int load_logged(ServeIndex *index, sqlite3 *db, int verbose, const char *what) {
+    uint64_t start = stats_now_ns();
+    if (index_load(index, db) != 0) return -1;
+    if (verbose || strcmp(what, "Loaded") == 0) {
+        printf("%s %u rows in %.1f ms\n", what, index->count, (double)(stats_now_ns() - start) / 1e6);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+static void *loader_main(void *arg) {
+    ServeLoader *loader = arg;
+    char done = 1;
+    loader->rc = load_logged(&loader->index, loader->db, loader->verbose, "Reloaded");
+    if (write(loader->wake_fd, &done, 1) < 0) {
+        fprintf(stderr, "OS: Error waking the server loop: %m\n");
+    }
+    return NULL;
+}
+
+int serve_run(const char *db_path, const char *sock_path, int verbose, volatile sig_atomic_t *stop) {
+    sqlite3 *db;
+    ServeLoader loader = { .verbose = verbose };
+    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+        sqlite3_open_v2(db_path, &loader.db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(loader.db ? loader.db : db));
+        sqlite3_close(loader.db);
+        sqlite3_close(db);
+        return 1;
+    }
+    // Scans hold the write lock for a whole batch.
+    sqlite3_busy_timeout(db, 5000);
+    sqlite3_busy_timeout(loader.db, 5000);
+
+    ServeIndex index;
+    int64_t version = data_version(db);
+    int wake[2] = { -1, -1 };
+    int listener = -1;
+    if (load_logged(&index, db, verbose, "Loaded") != 0) {
+        sqlite3_close(loader.db);
+        sqlite3_close(db);
+        return 1;
+    }
+    if (pipe2(wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+        fprintf(stderr, "OS: Error creating the reload pipe: %m\n");
+    } else {
+        listener = open_listener(sock_path);
+    }
+    if (listener < 0) {
+        if (wake[0] >= 0) {
+            close(wake[0]);
+            close(wake[1]);
+        }
+        index_free(&index);
+        sqlite3_close(loader.db);
+        sqlite3_close(db);
+        return 1;
+    }
+    loader.wake_fd = wake[1];
+    printf("Serving %s on %s; stop with Ctrl-C\n", db_path, sock_path);
+    fflush(stdout);
+
+    // fds[0] is the listener and fds[1] the reload pipe; clients follow,
+    // with their buffers at the same index in clients.
+    struct pollfd fds[2 + SERVE_MAX_CLIENTS];
+    ServeClient clients[2 + SERVE_MAX_CLIENTS];
+    memset(clients, 0, sizeof(clients));
+    nfds_t nfds = 2;
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake[0];
+    fds[1].events = POLLIN;
+    ByteBuf resp = {0};
+    pthread_t loader_thread;
+    int loading = 0;
+    uint64_t next_check_ns = stats_now_ns() + (uint64_t)SERVE_RELOAD_MS * 1000000ULL;
+
+    while (!*stop) {
+        int ready = poll(fds, nfds, SERVE_RELOAD_MS);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "Error: poll failed: %m\n");
+            break;
+        }
+
+        uint64_t now = stats_now_ns();
+        if (!loading && now >= next_check_ns) {
+            next_check_ns = now + (uint64_t)SERVE_RELOAD_MS * 1000000ULL;
+            int64_t current = data_version(db);
+            if (current != version) {
+                loader.version = current;
+                if (pthread_create(&loader_thread, NULL, loader_main, &loader) == 0) {
+                    loading = 1;
+                } else {
+                    fprintf(stderr, "OS: Error starting the index rebuild\n");
+                }
+            }
+        }
+        if (ready <= 0) continue;
+
+        if (fds[1].revents & POLLIN) {
+            char drained[16];
+            while (read(wake[0], drained, sizeof(drained)) > 0) {
+            }
+            if (loading) {
+                pthread_join(loader_thread, NULL);
+                loading = 0;
+                // Commits made while the rebuild ran show up as a newer
+                // data_version at the next check.
+                if (loader.rc == 0) {
+                    index_free(&index);
+                    index = loader.index;
+                    version = loader.version;
+                }
+            }
+        }
+
+        // Clients are walked backwards so a dropped one can be replaced by
+        // the last entry without skipping anything.
+        for (nfds_t i = nfds - 1; i >= 2; i--) {
+            short revents = fds[i].revents;
+            if (!revents) continue;
+            ServeClient *client = &clients[i];
+            int rc = (revents & (POLLIN | POLLOUT)) ? 0 : -1;
+            if (rc == 0 && (revents & POLLIN)) {
+                rc = client_read(fds[i].fd, client);
+                if (rc == 0) rc = client_answer(client, &index, &resp);
+            }
+            if (rc == 0) rc = client_flush(fds[i].fd, client);
+            if (rc == 0) {
+                // A client with unsent responses is not read from until it
+                // takes them.
+                fds[i].events = (client->out_sent < client->out.len) ? POLLOUT : POLLIN;
+                continue;
+            }
+            close(fds[i].fd);
+            client_free(client);
+            fds[i] = fds[--nfds];
+            clients[i] = clients[nfds];
+            memset(&clients[nfds], 0, sizeof(clients[nfds]));
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd >= 0 && nfds == 2 + SERVE_MAX_CLIENTS) {
+                close(fd);
+            } else if (fd >= 0) {
+                fds[nfds].fd = fd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                nfds++;
+            }
+        }
+    }
+
+    if (loading) {
+        pthread_join(loader_thread, NULL);
+        if (loader.rc == 0) index_free(&loader.index);
+    }
+    for (nfds_t i = 2; i < nfds; i++) {
+        close(fds[i].fd);
+        client_free(&clients[i]);
+    }
+    close(listener);
+    close(wake[0]);
+    close(wake[1]);
+    unlink(sock_path);
+    free(resp.data);
+    index_free(&index);
+    sqlite3_close(loader.db);
+    sqlite3_close(db);
+    return 0;
+}
+
+int serve_query(const char *sock_path, int op, const char *arg) {
+    size_t arg_len = strlen(arg);
+    if (arg_len + 1 > SERVE_MAX_REQUEST) {
+        fprintf(stderr, "Error: query argument too long\n");
+        return 2;
+    }
+    int fd = connect_socket(sock_path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: cannot connect to %s: %m\n", sock_path);
+        return 2;
+    }
+    set_io_timeouts(fd);
+    ByteBuf request = {0};
+    char op_byte = (char)op;
+    buf_put(&request, &op_byte, 1);
+    buf_put(&request, arg, arg_len);
+    size_t len = 0;
+    char *payload = NULL;
+    if (request.len == arg_len + 1 && write_frame(fd, request.data, request.len) == 0) {
+        payload = read_frame(fd, SIZE_MAX - 1, &len);
+    }
+    free(request.data);
+    close(fd);
+    if (!payload || len == 0) {
+        fprintf(stderr, "Error: no valid response from %s\n", sock_path);
+        free(payload);
+        return 2;
+    }
+    if (payload[0] != 'O') {
+        fprintf(stderr, "Error: server: %s\n", payload + 1);
+        free(payload);
+        return 2;
+    }
+
+    int matches = 0;
+    const char *p = payload + 1;
+    const char *end = payload + len;
+    while (p < end) {
+        const char *fields[5];
+        int n = 0;
+        for (; n < 5 && p < end; n++) {
+            fields[n] = p;
+            p += strlen(p) + 1;
+        }
+        if (n < 5) break;
+        matches++;
+        if (output_format == OUTPUT_TEXT) {
+            printf("%s\n", fields[0]);
+            continue;
+        }
+        output_record_begin(NULL, "match");
+        output_str(NULL, "path", fields[0]);
+        output_str(NULL, "md5", fields[1]);
+        output_str(NULL, "audio_md5", fields[2]);
+        output_int(NULL, "size", strtoll(fields[3], NULL, 10));
+        output_int(NULL, "mtime", strtoll(fields[4], NULL, 10));
+        output_record_end(NULL);
+    }
+    free(payload);
+    return matches ? 0 : 1;
+}
@@ -0,0 +1,145 @@
+#include "stats.h"
+#include "trace.h"
+
+// Latencies are bucketed by power of two in microseconds: bucket 0 holds
+// samples under 1us, bucket i holds [2^(i-1), 2^i) us, the last bucket
+// everything slower.
+#define STATS_HIST_BUCKETS 32
+
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t total_ns;
+    _Atomic uint64_t max_ns;
+    _Atomic uint64_t hist[STATS_HIST_BUCKETS];
+} PhaseStats;
+
+int stats_enabled = 0;
+int stats_counting = 0;
+
+static PhaseStats phase_stats[PHASE_COUNT];
+static _Atomic uint64_t counters[COUNTER_COUNT];
+static uint64_t stats_start_ns = 0;
+
+static const char *phase_names[PHASE_COUNT] = {
+    "readdir",
+    "lstat",
+    "fiemap",
+    "lookup",
+    "file_md5",
+    "audio_probe",
+    "audio_md5",
+    "audio_quick",
+    "audio_decode",
+    "upsert",
+    "commit"
+};
+
+static const char *counter_names[COUNTER_COUNT] = {
+    "dirs",
+    "dirs_skipped",
+    "files_seen",
+    "bytes_seen",
+    "files_skipped",
+    "files_hashed",
+    "bytes_hashed",
+    "checks_reused",
+    "xattr_hits",
+    "errors"
+};
+
+uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    // Never return 0: callers use 0 as "not timing".
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec + 1;
+}
+
+void stats_enable(void) {
+    stats_enabled = 1;
+    stats_enable_counters();
+}
+
+void stats_enable_counters(void) {
+    stats_counting = 1;
+    if (!stats_start_ns) {
+        stats_start_ns = stats_now_ns();
+    }
+}
+
+uint64_t stats_counter_value(StatsCounter counter) {
+    return atomic_load_explicit(&counters[counter], memory_order_relaxed);
+}
+
+static int hist_bucket(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+    while (us > 0 && bucket < STATS_HIST_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+const char *stats_phase_name(StatsPhase phase) {
+    return phase_names[phase];
+}
+
+void stats_record(StatsPhase phase, uint64_t start_ns, uint64_t bytes) {
+    uint64_t now = stats_now_ns();
+    uint64_t elapsed = now - start_ns;
+    PhaseStats *ps = &phase_stats[phase];
+    atomic_fetch_add_explicit(&ps->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ps->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ps->total_ns, elapsed, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ps->hist[hist_bucket(elapsed)], 1, memory_order_relaxed);
+
+    uint64_t prev = atomic_load_explicit(&ps->max_ns, memory_order_relaxed);
+    while (elapsed > prev &&
+           !atomic_compare_exchange_weak_explicit(&ps->max_ns, &prev, elapsed, memory_order_relaxed, memory_order_relaxed)) {
+    }
+    // Individual readdir calls are too fine-grained for a timeline; the
+    // per-directory span covers them.
+    if (trace_enabled && phase != PHASE_READDIR) {
+        trace_span(phase, start_ns, now, bytes, NULL);
+    }
+}
+
+void stats_add(StatsCounter counter, uint64_t n) {
+    atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
+
+void stats_print_json(FILE *out, const char *command) {
+    uint64_t wall_ns = stats_start_ns ? stats_now_ns() - stats_start_ns : 0;
+
+    fprintf(out, "{\"command\":\"%s\",\"wall_ms\":%.3f,\"counters\":{", command, (double)wall_ns / 1e6);
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        fprintf(out, "%s\"%s\":%llu", c ? "," : "", counter_names[c],
+                (unsigned long long)atomic_load(&counters[c]));
+    }
+    fprintf(out, "},\"phases\":{");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        PhaseStats *ps = &phase_stats[p];
+        uint64_t count = atomic_load(&ps->count);
+        fprintf(out, "%s\"%s\":{\"count\":%llu,\"bytes\":%llu,\"total_ms\":%.3f,\"max_ms\":%.3f,\"hist_us\":[",
+                p ? "," : "", phase_names[p],
+                (unsigned long long)count,
+                (unsigned long long)atomic_load(&ps->bytes),
+                (double)atomic_load(&ps->total_ns) / 1e6,
+                (double)atomic_load(&ps->max_ns) / 1e6);
+        int first = 1;
+        for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+            uint64_t n = atomic_load(&ps->hist[b]);
+            if (n == 0) continue;
+            // Upper bound of the bucket in microseconds; the last bucket is open-ended.
+            if (b == STATS_HIST_BUCKETS - 1) {
+                fprintf(out, "%s{\"le_us\":null,\"count\":%llu}", first ? "" : ",", (unsigned long long)n);
+            } else {
+                fprintf(out, "%s{\"le_us\":%llu,\"count\":%llu}", first ? "" : ",", 1ULL << b, (unsigned long long)n);
+            }
+            first = 0;
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "}}\n");
+}
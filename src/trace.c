@@ -0,0 +1,266 @@
+#include "trace.h"
+#include "utils.h"
+#include <pthread.h>
+
+// Each thread appends fixed-size events plus their path strings to its own
+// buffer, so recording takes no lock. A full buffer is handed to the writer
+// thread, which formats it to the trace file and returns it to a free list;
+// the recording thread only holds trace_lock to swap buffers. trace_close
+// stops the writer and drains what is left.
+#define TRACE_EVENTS_PER_BUFFER 8192
+#define TRACE_STRING_BYTES (256 * 1024)
+#define TRACE_NO_DETAIL UINT32_MAX
+
+typedef struct {
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    uint64_t bytes;
+    uint32_t detail_off;
+    uint16_t kind;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    TraceEvent events[TRACE_EVENTS_PER_BUFFER];
+    char strings[TRACE_STRING_BYTES];
+    size_t event_count;
+    size_t string_used;
+    int tid;
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+// One per recording thread; current is the buffer it is filling.
+typedef struct TraceThread {
+    int tid;
+    TraceBuffer *current;
+    struct TraceThread *next;
+} TraceThread;
+
+int trace_enabled = 0;
+
+static FILE *trace_file = NULL;
+static uint64_t trace_start_ns = 0;
+static uint64_t trace_min_ns = 0;
+static int trace_events_written = 0;
+static int trace_next_tid = 1;
+static TraceThread *trace_threads = NULL;
+static TraceBuffer *full_head = NULL;
+static TraceBuffer *full_tail = NULL;
+static TraceBuffer *free_buffers = NULL;
+static pthread_t writer_thread;
+static int writer_started = 0;
+static int writer_stopping = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+// Bumped by every trace_open, so a thread's cached state from an earlier
+// (closed and freed) trace is never reused.
+static unsigned trace_generation = 0;
+static __thread TraceThread *local_thread = NULL;
+static __thread unsigned local_generation = 0;
+
+static const char *trace_kind_name(int kind) {
+    if (kind < PHASE_COUNT) return stats_phase_name((StatsPhase)kind);
+    return kind == TRACE_FILE ? "file" : "dir";
+}
+
+// Only the writer thread, or trace_close once it has stopped, touches the
+// trace file.
+static void write_event(const TraceBuffer *buf, const TraceEvent *ev) {
+    fprintf(trace_file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+            trace_events_written++ ? "," : "", trace_kind_name(ev->kind), buf->tid,
+            (double)(ev->start_ns - trace_start_ns) / 1e3, (double)ev->dur_ns / 1e3);
+    if (ev->bytes || ev->detail_off != TRACE_NO_DETAIL) {
+        fprintf(trace_file, ",\"args\":{");
+        if (ev->bytes) {
+            fprintf(trace_file, "\"bytes\":%llu", (unsigned long long)ev->bytes);
+        }
+        if (ev->detail_off != TRACE_NO_DETAIL) {
+            char escaped[MAX_PATH_LENGTH * 2];
+            json_escape(escaped, sizeof(escaped), buf->strings + ev->detail_off);
+            fprintf(trace_file, "%s\"path\":\"%s\"", ev->bytes ? "," : "", escaped);
+        }
+        fputc('}', trace_file);
+    }
+    fputc('}', trace_file);
+}
+
+static void write_buffer(TraceBuffer *buf) {
+    for (size_t i = 0; i < buf->event_count; i++) {
+        write_event(buf, &buf->events[i]);
+    }
+    buf->event_count = 0;
+    buf->string_used = 0;
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&trace_lock);
+    for (;;) {
+        while (!full_head && !writer_stopping) {
+            pthread_cond_wait(&trace_cond, &trace_lock);
+        }
+        if (!full_head) break;
+        TraceBuffer *batch = full_head;
+        full_head = full_tail = NULL;
+        pthread_mutex_unlock(&trace_lock);
+
+        TraceBuffer *last = batch;
+        for (TraceBuffer *buf = batch; buf; buf = buf->next) {
+            write_buffer(buf);
+            last = buf;
+        }
+
+        pthread_mutex_lock(&trace_lock);
+        last->next = free_buffers;
+        free_buffers = batch;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return NULL;
+}
+
+static TraceThread *get_local_thread(void) {
+    if (local_thread && local_generation == trace_generation) return local_thread;
+    TraceThread *thread = calloc(1, sizeof(TraceThread));
+    if (!thread) return NULL;
+    thread->current = calloc(1, sizeof(TraceBuffer));
+    if (!thread->current) {
+        free(thread);
+        return NULL;
+    }
+    pthread_mutex_lock(&trace_lock);
+    thread->tid = trace_next_tid++;
+    thread->current->tid = thread->tid;
+    thread->next = trace_threads;
+    trace_threads = thread;
+    local_generation = trace_generation;
+    pthread_mutex_unlock(&trace_lock);
+    local_thread = thread;
+    return thread;
+}
+
+// Queues the thread's full buffer for the writer and takes an empty one.
+// Returns -1, keeping the full buffer, when no empty one can be had.
+static int swap_buffer(TraceThread *thread) {
+    pthread_mutex_lock(&trace_lock);
+    TraceBuffer *fresh = free_buffers;
+    if (fresh) free_buffers = fresh->next;
+    pthread_mutex_unlock(&trace_lock);
+    if (!fresh && !(fresh = calloc(1, sizeof(TraceBuffer)))) return -1;
+
+    TraceBuffer *full = thread->current;
+    full->next = NULL;
+    fresh->tid = thread->tid;
+    fresh->next = NULL;
+    thread->current = fresh;
+
+    pthread_mutex_lock(&trace_lock);
+    if (full_tail) full_tail->next = full;
+    else full_head = full;
+    full_tail = full;
+    pthread_cond_signal(&trace_cond);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+void trace_span(int kind, uint64_t start_ns, uint64_t end_ns, uint64_t bytes, const char *detail) {
+    uint64_t dur = end_ns - start_ns;
+    if (dur < trace_min_ns) return;
+    TraceThread *thread = get_local_thread();
+    if (!thread) return;
+
+    TraceBuffer *buf = thread->current;
+    size_t detail_len = detail ? strlen(detail) + 1 : 0;
+    if (buf->event_count == TRACE_EVENTS_PER_BUFFER || buf->string_used + detail_len > TRACE_STRING_BYTES) {
+        // Out of memory for a new buffer: drop this span, keep the rest.
+        if (swap_buffer(thread) != 0) return;
+        buf = thread->current;
+    }
+    TraceEvent *ev = &buf->events[buf->event_count++];
+    ev->start_ns = start_ns;
+    ev->dur_ns = dur;
+    ev->bytes = bytes;
+    ev->kind = (uint16_t)kind;
+    ev->detail_off = TRACE_NO_DETAIL;
+    if (detail && detail_len <= TRACE_STRING_BYTES) {
+        memcpy(buf->strings + buf->string_used, detail, detail_len);
+        ev->detail_off = (uint32_t)buf->string_used;
+        buf->string_used += detail_len;
+    }
+}
+
+int trace_open(const char *path, uint64_t min_us, const char *command) {
+    trace_file = fopen(path, "w");
+    if (!trace_file) {
+        fprintf(stderr, "Error: cannot open trace file %s: %m\n", path);
+        return -1;
+    }
+    setvbuf(trace_file, NULL, _IOFBF, 1 << 20);
+    trace_min_ns = min_us * 1000;
+    trace_start_ns = stats_now_ns();
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    fprintf(trace_file, "\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"fhash %s\"}}", command);
+    trace_events_written = 1;
+    trace_next_tid = 1;
+    trace_generation++;
+    writer_stopping = 0;
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+        fprintf(stderr, "Error: cannot start trace writer thread\n");
+        fclose(trace_file);
+        trace_file = NULL;
+        return -1;
+    }
+    writer_started = 1;
+    stats_enable();
+    trace_enabled = 1;
+    return 0;
+}
+
+static void free_buffer_list(TraceBuffer *buf) {
+    while (buf) {
+        TraceBuffer *next = buf->next;
+        free(buf);
+        buf = next;
+    }
+}
+
+// Call once recording threads have finished.
+void trace_close(void) {
+    if (!trace_file) return;
+    trace_enabled = 0;
+    if (writer_started) {
+        pthread_mutex_lock(&trace_lock);
+        writer_stopping = 1;
+        pthread_cond_signal(&trace_cond);
+        pthread_mutex_unlock(&trace_lock);
+        pthread_join(writer_thread, NULL);
+        writer_started = 0;
+    }
+
+    // The writer drained the queue before exiting; what is left are the
+    // buffers each thread was still filling.
+    TraceThread *thread = trace_threads;
+    while (thread) {
+        TraceThread *next = thread->next;
+        char name[32];
+        if (thread->tid == 1) {
+            snprintf(name, sizeof(name), "main");
+        } else {
+            snprintf(name, sizeof(name), "worker-%d", thread->tid - 1);
+        }
+        fprintf(trace_file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                trace_events_written++ ? "," : "", thread->tid, name);
+        write_buffer(thread->current);
+        free(thread->current);
+        free(thread);
+        thread = next;
+    }
+    trace_threads = NULL;
+    free_buffer_list(free_buffers);
+    free_buffers = NULL;
+    // Other threads' cached pointers are caught by the generation check.
+    local_thread = NULL;
+    fprintf(trace_file, "\n]}\n");
+    if (fclose(trace_file) != 0) {
+        fprintf(stderr, "Error: writing trace file failed: %m\n");
+    }
+    trace_file = NULL;
+}
@@ -1,7 +1,15 @@
 #include "utils.h"
 #include "db.h"
 #include "fhash.h"
+#include "iosched.h"
+#include "output.h"
 #include <libavutil/log.h>
+#include <pthread.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
 
 static int verbose_global = 0;
 
@@ -9,6 +17,7 @@ void help() {
     printf("fhash version: %s (DB schema: %s)\n", FHASH_VERSION, DB_VERSION);
     printf("fhash scan [options]\n");
     printf("fhash check [options]\n");
+    printf("fhash watch [scan options] [-inotify]\n");
     printf("  -s <startpath>\tdirectory to process (default .)\n");
     printf("  -e <extlist>\tcomma-separated extensions to include (e.g., mp3,flac)\n");
     printf("  -r\t\trecurse into subdirectories (scan/check), or recurse path filter (dupe/link)\n");
@@ -16,59 +25,193 @@ void help() {
     printf("  -a\t\t(scan only) calculate audio-stream MD5 hash\n");
     printf("  -f\t\tforce refresh: re-index hashes in scan, or re-run validation in check\n");
     printf("\n");
-    printf("check options: -s <startpath>, -e <extlist>, -r, -f\n");
+    printf("check options: -s <startpath>, -e <extlist>, -r, -f, -q\n");
     printf("  validates embedded audio stream and stores result in files.audio_check_result\n");
+    printf("  -q\t\t(check only) quick packet-level check without full decode\n");
+    printf("  -logdb\t\t(scan/check) store the per-file FFmpeg message summary in files.audio_check_log\n");
+    printf("  -j <n>\t\t(scan/check/link) hash or link on per-device worker threads, n per SSD/NVMe device (default 4 with -jr)\n");
+    printf("  -jr <n>\t(scan/check/link) workers per rotational disk with -j (default 1)\n");
+    printf("  -order <m>\t(scan/check) hash in physical order: inode or extent (FIEMAP)\n");
+    printf("  -xattr\t\t(scan/check/watch) cache hashes and check results in user.fhash.* xattrs and reuse matching ones\n");
+    printf("  -prune\t\t(scan/check) after a complete walk, delete rows of files no longer on disk (-dry lists them)\n");
     printf("\n");
     printf("fhash dupe [options] (-xa<n> | -xh<n>)\n");
     printf("fhash link [options] (-xa<n> | -xh<n>) -l{mode}\n");
     printf("  -xa<n>\t\t(dupe/link) group by audio_md5, min duplicate group size n (default 2)\n");
     printf("  -xh<n>\t\t(dupe/link) group by md5, min duplicate group size n (default 2)\n");
-    printf("  -l{mode}\tlink duplicates (s=shallow, d=deep, m=metadata, o=oldest, n=newest)\n");
+    printf("  -l{mode}\tlink duplicates (s=shallow, d=deep, m=metadata, o=oldest, n=newest); files changed since\n");
+    printf("\t\tindexed are skipped and -xh groups are byte-compared first; one master per device\n");
+    printf("  -lr{mode}\t(link -xh) share extents with the kept file via FIDEDUPERANGE instead of hard-linking\n");
+    printf("  -top <k>\t(dupe) only print the k groups wasting the most bytes, largest first\n");
     printf("  -s/-r/-e\tlimit duplicate queries to path/recursion/extensions (applies to dupe and link)\n");
     printf("\n");
     printf("Global options:\n");
     printf("  -d <dbpath>\tSQLite database path (default ./file_hashes.db)\n");
     printf("  -v\t\tverbose output\n");
     printf("  -dry\t\tdry run; report actions only\n");
+    printf("  -o <fmt>\toutput text (default), jsonl, tsv or nul records for groups, link actions, files and checks\n");
+    printf("  -out <file>\twrite that output to a file instead of stdout\n");
+    printf("  -stats\t\tprint per-phase timings and counters as JSON on stderr at exit\n");
+    printf("  -trace <file>\t(scan/check) write a Chrome trace-event timeline of per-file work\n");
+    printf("  -tracemin <us>\t(scan/check) drop trace spans shorter than this (default 0)\n");
     printf("  -help\t\tshow this help\n");
     printf("\n");
+    printf("Resumable runs (scan/check):\n");
+    printf("  -budget <t>\tstop after a duration (45s, 30m, 2h, 1h30m) and save the pending frontier\n");
+    printf("  -restart\tdiscard a saved unfinished run and start over from the root\n");
+    printf("\n");
+    printf("Watch mode:\n");
+    printf("  watch\t\tscan once, then index changed directories as filesystem events arrive\n");
+    printf("  -inotify\tuse per-directory inotify watches instead of fanotify\n");
+    printf("\n");
+    printf("Query server:\n");
+    printf("fhash serve -sock <path> [-d <dbpath>]\n");
+    printf("  keep the index in memory and answer lookups on a Unix socket; reloads after scans commit\n");
+    printf("fhash query -sock <path> (-hash <md5> | -ahash <audio_md5> | -path <file> | -group <file>)\n");
+    printf("  print matching paths (or -o records); exit 0 on a match, 1 on none, 2 on error\n");
+    printf("\n");
+    printf("Lookup:\n");
+    printf("fhash lookup [-d <dbpath>] [-a] [-0] [-j <n>] [file...]\n");
+    printf("  hash files (from args, or one path per stdin line) and report known/unknown against the index\n");
+    printf("  -0\t\tstdin paths are NUL-terminated\n");
+    printf("\n");
+    printf("Compare:\n");
+    printf("fhash compare -d <dbpath> -d2 <dbpath> [-s <root>] [-s2 <root>]\n");
+    printf("  diff two indexes by relative path and md5: changed, moved, missing and extra files\n");
+    printf("  -s/-s2\t\troot of each index's tree (default: the directory all its paths share)\n");
+    printf("\n");
+    printf("Merge:\n");
+    printf("fhash merge -d <dbpath> -from <dbpath> [-source <name>] [-map <old>=<new>]... [-from ...]\n");
+    printf("  import other fhash DBs; re-merging copies only rows changed there since the last merge\n");
+    printf("  -source <name>\tname recorded for the preceding -from (default: its resolved path)\n");
+    printf("  -map <old>=<new>\trewrite a path prefix of the preceding -from\n");
+    printf("\n");
+    printf("Fast rescans (scan):\n");
+    printf("  -fast\t\tskip listing directories unchanged since their last complete scan\n");
+    printf("  -fastverify <days>\tlist every directory again after this many days (default 30, 0 = never)\n");
+    printf("\n");
+    printf("Governor options (scan/check):\n");
+    printf("  -maxbps <rate>\tcap read throughput, e.g. 500K, 40M, 1G bytes/s\n");
+    printf("  -maxfps <n>\tcap files examined per second\n");
+    printf("  -maxlat <ms>\tback off while smoothed read latency exceeds this\n");
+    printf("  -idle\t\tidle I/O priority class and nice 19\n");
+    printf("  -nocache\tdrop hashed files from the page cache unless already cached\n");
+    printf("\n");
+    printf("Progress options (scan/check):\n");
+    printf("  -progress\tstatus line on stderr with files/s, MB/s, ETA and current directory\n");
+    printf("  -progfile <path>\tappend JSON progress snapshots to a file or FIFO\n");
+    printf("  -precount\tcount files/bytes in the background so progress can show totals and ETA\n");
+    printf("\n");
+}
+
+// Parses a duration such as "45", "90s", "30m", "2h" or "1h30m" (bare
+// numbers are seconds). Returns 0 and stores whole seconds on success.
+int parse_duration(const char *text, long *seconds_out) {
+    long total = 0;
+    const char *p = text;
+    if (!*p) return -1;
+    while (*p) {
+        char *end = NULL;
+        long value = strtol(p, &end, 10);
+        if (end == p || value < 0) return -1;
+        long unit = 1;
+        switch (*end) {
+            case 's': unit = 1; end++; break;
+            case 'm': unit = 60; end++; break;
+            case 'h': unit = 3600; end++; break;
+            case 'd': unit = 86400; end++; break;
+            case '\0': break;
+            default: return -1;
+        }
+        total += value * unit;
+        p = end;
+    }
+    if (total <= 0) return -1;
+    *seconds_out = total;
+    return 0;
+}
+
+// Stored hashes are lowercase hex; sentinels such as 'Not calculated',
+// 'Bad audio' and '0-byte-file' are not.
+int is_md5_hex(const char *value) {
+    if (!value || strlen(value) != MD5_DIGEST_LENGTH * 2) return 0;
+    for (const char *p = value; *p; p++) {
+        if (!((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f'))) return 0;
+    }
+    return 1;
+}
+
+// Escapes a string for use inside a JSON string literal. Control characters
+// become \u00XX; other bytes (including UTF-8 sequences) pass through. The
+// output is truncated to fit and always NUL-terminated.
+size_t json_escape(char *out, size_t out_len, const char *in) {
+    size_t used = 0;
+    if (out_len == 0) return 0;
+    for (const unsigned char *p = (const unsigned char *)in; *p; p++) {
+        char esc[8];
+        size_t len;
+        switch (*p) {
+            case '"': memcpy(esc, "\\\"", 2); len = 2; break;
+            case '\\': memcpy(esc, "\\\\", 2); len = 2; break;
+            case '\n': memcpy(esc, "\\n", 2); len = 2; break;
+            case '\r': memcpy(esc, "\\r", 2); len = 2; break;
+            case '\t': memcpy(esc, "\\t", 2); len = 2; break;
+            default:
+                if (*p < 0x20) {
+                    snprintf(esc, sizeof(esc), "\\u%04x", *p);
+                    len = 6;
+                } else {
+                    esc[0] = (char)*p;
+                    len = 1;
+                }
+                break;
+        }
+        if (used + len >= out_len) break;
+        memcpy(out + used, esc, len);
+        used += len;
+    }
+    out[used] = '\0';
+    return used;
 }
 
 DirStack* create_dir_stack(int capacity) {
     DirStack *stack = (DirStack*)malloc(sizeof(DirStack));
     if (!stack) {
-        fprintf(stderr, "Memory allocation error\n");
-        exit(1);
+        fprintf(stderr, "Memory: Error allocating directory stack\n");
+        return NULL;
     }
     stack->entries = (DirEntry*)malloc(capacity * sizeof(DirEntry));
     if (!stack->entries) {
-        fprintf(stderr, "Memory allocation error\n");
+        fprintf(stderr, "Memory: Error allocating directory stack\n");
         free(stack);
-        exit(1);
+        return NULL;
     }
     stack->capacity = capacity;
     stack->size = 0;
     return stack;
 }
 
-void push_dir(DirStack *stack, const char *path) {
+// Returns -1 when the stack cannot grow; an over-long path is skipped with a
+// warning and still returns 0.
+int push_dir(DirStack *stack, const char *path) {
     if (stack->size >= stack->capacity) {
         int new_capacity = stack->capacity * 2;
         DirEntry *new_entries = realloc(stack->entries, new_capacity * sizeof(DirEntry));
         if (!new_entries) {
-            fprintf(stderr, "Memory allocation error while growing directory stack\n");
-            exit(1);
+            fprintf(stderr, "Memory: Error growing directory stack for %s\n", path);
+            return -1;
         }
         stack->entries = new_entries;
         stack->capacity = new_capacity;
     }
     if (strlen(path) >= MAX_PATH_LENGTH) {
         fprintf(stderr, "OS: Path too long, skipping directory: %s\n", path);
-        return;
+        return 0;
     }
     strncpy(stack->entries[stack->size].path, path, MAX_PATH_LENGTH - 1);
     stack->entries[stack->size].path[MAX_PATH_LENGTH - 1] = '\0';
     stack->size++;
+    return 0;
 }
 
 char* pop_dir(DirStack *stack) {
@@ -87,20 +230,117 @@ void destroy_dir_stack(DirStack *stack) {
 
 // FFmpeg logging callback logic
 // Needs to access current file path from hashing module
-extern char current_processing_file[MAX_PATH_LENGTH];
+extern __thread char current_processing_file[MAX_PATH_LENGTH];
+extern __thread int current_file_log_errors;
+
+// Messages logged while a file is being processed are not written straight
+// to stderr: a damaged file can emit tens of thousands of identical lines.
+// Each thread buffers the distinct messages for its current file with a
+// repeat count, and log_sink_finish_file() emits one summary line per file.
+#define LOG_SINK_MAX_DISTINCT 8
+#define LOG_SINK_MSG_LEN 160
+
+typedef struct {
+    char text[LOG_SINK_MSG_LEN];
+    unsigned long count;
+} LogSinkEntry;
+
+typedef struct {
+    char file[MAX_PATH_LENGTH];
+    LogSinkEntry entries[LOG_SINK_MAX_DISTINCT];
+    int distinct;
+    unsigned long total;
+    unsigned long uncounted;
+} LogSinkState;
+
+static __thread LogSinkState log_sink;
+static pthread_mutex_t log_output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void format_log_summary(char *out, size_t out_len) {
+    size_t used = 0;
+    int n = snprintf(out, out_len, "%lu message%s", log_sink.total, log_sink.total == 1 ? "" : "s");
+    if (n < 0) {
+        out[0] = '\0';
+        return;
+    }
+    used = (size_t)n < out_len ? (size_t)n : out_len - 1;
+    for (int i = 0; i < log_sink.distinct && used < out_len - 1; i++) {
+        n = snprintf(out + used, out_len - used, "%s\"%s\" x%lu", i == 0 ? ": " : "; ", log_sink.entries[i].text, log_sink.entries[i].count);
+        if (n < 0) break;
+        used += (size_t)n < out_len - used ? (size_t)n : out_len - used - 1;
+    }
+    if (log_sink.uncounted > 0 && used < out_len - 1) {
+        snprintf(out + used, out_len - used, "; %lu other", log_sink.uncounted);
+    }
+}
+
+int log_sink_finish_file(char *summary_out, size_t summary_len) {
+    if (summary_out && summary_len > 0) summary_out[0] = '\0';
+    if (log_sink.file[0] == '\0') return 0;
+
+    unsigned long total = log_sink.total;
+    if (total > 0) {
+        char summary[LOG_SINK_SUMMARY_LEN];
+        format_log_summary(summary, sizeof(summary));
+        pthread_mutex_lock(&log_output_lock);
+        fprintf(stderr, "[FFmpeg] File: %s: %s\n", log_sink.file, summary);
+        pthread_mutex_unlock(&log_output_lock);
+        if (summary_out && summary_len > 0) {
+            snprintf(summary_out, summary_len, "%s", summary);
+        }
+    }
+    memset(&log_sink, 0, sizeof(log_sink));
+    return total > 0;
+}
+
+static void log_sink_record(const char *file, const char *text) {
+    if (strcmp(log_sink.file, file) != 0) {
+        log_sink_finish_file(NULL, 0);
+        snprintf(log_sink.file, sizeof(log_sink.file), "%s", file);
+    }
+
+    log_sink.total++;
+    for (int i = 0; i < log_sink.distinct; i++) {
+        if (strcmp(log_sink.entries[i].text, text) == 0) {
+            log_sink.entries[i].count++;
+            return;
+        }
+    }
+    if (log_sink.distinct < LOG_SINK_MAX_DISTINCT) {
+        LogSinkEntry *entry = &log_sink.entries[log_sink.distinct++];
+        snprintf(entry->text, sizeof(entry->text), "%s", text);
+        entry->count = 1;
+    } else {
+        log_sink.uncounted++;
+    }
+}
 
 void custom_log_callback(void *ptr, int level, const char *fmt, va_list vl) {
+    (void)ptr;
+    if (level <= AV_LOG_ERROR && current_processing_file[0] != '\0') {
+        current_file_log_errors++;
+    }
     if (level > av_log_get_level()) return;
     
     // Only print errors/warnings if not verbose, or everything if verbose
     if (!verbose_global && level > AV_LOG_ERROR) return;
 
+    char line[LOG_SINK_MSG_LEN];
+    vsnprintf(line, sizeof(line), fmt, vl);
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        line[--len] = '\0';
+    }
+    if (len == 0) return;
+
     if (current_processing_file[0] != '\0') {
-        fprintf(stderr, "[FFmpeg] File: %s ", current_processing_file);
-    } else {
-        fprintf(stderr, "[FFmpeg] ");
+        log_sink_record(current_processing_file, line);
+        return;
     }
-    vfprintf(stderr, fmt, vl);
+
+    pthread_mutex_lock(&log_output_lock);
+    fprintf(stderr, "[FFmpeg] %s\n", line);
+    pthread_mutex_unlock(&log_output_lock);
 }
 
 void init_logging_callback(int verbose) {
@@ -121,6 +361,7 @@ typedef struct {
     char filename[MAX_PATH_LENGTH];
     char extension[64];
     int64_t filesize;
+    int64_t modified_timestamp;
     time_t last_check;
     struct stat st;
     int has_stat;
@@ -182,7 +423,7 @@ static const DupeEntry* choose_target(DupeEntry *entries, int count, int link_mo
     const DupeEntry *target = &entries[0];
     for (int i = 1; i < count; i++) {
         const DupeEntry *candidate = &entries[i];
-        switch (link_mode) {
+        switch (link_mode & LINK_KEEPER_MASK) {
             case LINK_SHALLOW:
                 if (candidate->depth < target->depth) target = candidate;
                 break;
@@ -215,58 +456,360 @@ static const DupeEntry* choose_target(DupeEntry *entries, int count, int link_mo
 
 static void print_group(DupeEntry *entries, int count) {
     for (int i = 0; i < count; i++) {
-        printf("%s\n", entries[i].filepath);
+        if (output_format == OUTPUT_TEXT) {
+            printf("%s\n", entries[i].filepath);
+            continue;
+        }
+        output_record_begin(NULL, "dupe");
+        output_str(NULL, "hash", entries[i].hash);
+        output_int(NULL, "size", entries[i].filesize);
+        output_str(NULL, "path", entries[i].filepath);
+        output_record_end(NULL);
     }
 }
 
-static void handle_group(sqlite3 *db, DupeEntry *group, int group_size, int link_mode, int dry_run, int type, sqlite3_stmt *ts_stmt, sqlite3_stmt *size_stmt) {
-    if (group_size == 0) return;
-    if (link_mode == LINK_NONE) {
-        print_group(group, group_size);
-        printf("\n");
+// Text mode separates groups with a blank line; records need no separator.
+static void end_group(void) {
+    if (output_format == OUTPUT_TEXT) printf("\n");
+}
+
+// One planned or finished action on a group member: "[action] path -> target"
+// in text mode, a "link" record with -o. buf NULL prints or emits at once;
+// link tasks pass their own buffer.
+static void report_link(OutputBuf *buf, const char *action, const char *path, const char *target) {
+    if (output_format == OUTPUT_TEXT) {
+        if (buf) {
+            output_printf(buf, target ? "[%s] %s -> %s\n" : "[%s] %s\n", action, path, target);
+        } else {
+            printf(target ? "[%s] %s -> %s\n" : "[%s] %s\n", action, path, target);
+        }
         return;
     }
-    const DupeEntry *target = choose_target(group, group_size, link_mode);
+    output_record_begin(buf, "link");
+    output_str(buf, "action", action);
+    output_str(buf, "path", path);
+    output_str(buf, "target", target);
+    output_record_end(buf);
+}
+
+// Extents are deduplicated in chunks, each one FIDEDUPERANGE call against
+// up to REFLINK_BATCH duplicates of the same keeper; filesystems cap the
+// length of a single request (Btrfs at 16 MiB).
+#define REFLINK_CHUNK (16LL * 1024 * 1024)
+#define REFLINK_BATCH 64
+
+typedef struct {
+    DupeEntry *entry;
+    int fd;
+    int done;       // differs, failed or finished
+    int64_t shared;
+} ReflinkDest;
+
+static int open_dedupe_dest(const char *path) {
+    // Writable unless we only own the file (allowed since Linux 4.19).
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1 && (errno == EACCES || errno == EROFS || errno == ETXTBSY)) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    return fd;
+}
+
+// Shares the keeper's extents with each same-sized duplicate. The kernel
+// compares the bytes under lock and only shares ranges that are identical,
+// so a stale hash cannot lose data; each path keeps its own inode and
+// metadata. A duplicate only counts as reflinked once every chunk came back
+// FILE_DEDUPE_RANGE_SAME in full. Returns the bytes now shared.
+static int64_t reflink_group(DupeEntry *group, int group_size, const DupeEntry *target, int dry_run) {
+    ReflinkDest *dests = calloc((size_t)group_size, sizeof(ReflinkDest));
+    if (!dests) {
+        fprintf(stderr, "Memory: Error allocating reflink batch\n");
+        return 0;
+    }
+    int dest_count = 0;
     for (int i = 0; i < group_size; i++) {
         DupeEntry *entry = &group[i];
         if (entry == target) {
-            printf("[keep] %s\n", entry->filepath);
+            report_link(NULL, "keep", entry->filepath, NULL);
             continue;
         }
         if (!target->has_stat || !entry->has_stat) {
-            fprintf(stderr, "Skipping link for %s (missing stat info)\n", entry->filepath);
+            fprintf(stderr, "Skipping reflink for %s (missing stat info)\n", entry->filepath);
             continue;
         }
         if (target->st.st_dev != entry->st.st_dev) {
-            fprintf(stderr, "Skipping cross-device link %s -> %s\n", entry->filepath, target->filepath);
+            fprintf(stderr, "Skipping cross-device reflink %s -> %s\n", entry->filepath, target->filepath);
+            continue;
+        }
+        if (target->st.st_ino == entry->st.st_ino) {
+            fprintf(stderr, "Skipping reflink for %s (hard link to keeper)\n", entry->filepath);
+            continue;
+        }
+        if (target->st.st_size != entry->st.st_size) {
+            fprintf(stderr, "Skipping reflink for %s (size differs from keeper)\n", entry->filepath);
             continue;
         }
         if (dry_run) {
-            printf("[link] %s -> %s\n", entry->filepath, target->filepath);
+            report_link(NULL, "reflink", entry->filepath, target->filepath);
             continue;
         }
-
-        char tmp_path[MAX_PATH_LENGTH];
-        snprintf(tmp_path, sizeof(tmp_path), "%s.fhash_linkXXXXXX", entry->filepath);
-        int tmp_fd = mkstemp(tmp_path);
-        if (tmp_fd == -1) {
-            fprintf(stderr, "Error creating temp link path for %s: %m\n", entry->filepath);
+        int fd = open_dedupe_dest(entry->filepath);
+        if (fd == -1) {
+            fprintf(stderr, "Error opening %s for reflink: %m\n", entry->filepath);
             continue;
         }
-        close(tmp_fd);
-        unlink(tmp_path); // free the path for link()
+        dests[dest_count].entry = entry;
+        dests[dest_count].fd = fd;
+        dest_count++;
+    }
+
+    int src_fd = -1;
+    if (dest_count > 0 && (src_fd = open(target->filepath, O_RDONLY | O_CLOEXEC)) == -1) {
+        fprintf(stderr, "Error opening keeper %s for reflink: %m\n", target->filepath);
+    }
+    struct file_dedupe_range *range = NULL;
+    if (src_fd != -1) {
+        range = calloc(1, sizeof(struct file_dedupe_range) + REFLINK_BATCH * sizeof(struct file_dedupe_range_info));
+        if (!range) fprintf(stderr, "Memory: Error allocating reflink batch\n");
+    }
+
+    int64_t size = (int64_t)target->st.st_size;
+    for (int64_t offset = 0; range && offset < size; offset += REFLINK_CHUNK) {
+        int64_t length = (size - offset < REFLINK_CHUNK) ? size - offset : REFLINK_CHUNK;
+        int first = 0;
+        while (first < dest_count) {
+            int batch[REFLINK_BATCH];
+            int batch_count = 0;
+            for (; first < dest_count && batch_count < REFLINK_BATCH; first++) {
+                if (!dests[first].done) batch[batch_count++] = first;
+            }
+            if (batch_count == 0) break;
+            memset(range, 0, sizeof(struct file_dedupe_range) + REFLINK_BATCH * sizeof(struct file_dedupe_range_info));
+            range->src_offset = (uint64_t)offset;
+            range->src_length = (uint64_t)length;
+            range->dest_count = (uint16_t)batch_count;
+            for (int b = 0; b < batch_count; b++) {
+                range->info[b].dest_fd = dests[batch[b]].fd;
+                range->info[b].dest_offset = (uint64_t)offset;
+            }
+            if (ioctl(src_fd, FIDEDUPERANGE, range) != 0) {
+                fprintf(stderr, "Error deduplicating against %s: %m\n", target->filepath);
+                for (int b = 0; b < batch_count; b++) dests[batch[b]].done = 1;
+                continue;
+            }
+            for (int b = 0; b < batch_count; b++) {
+                ReflinkDest *dest = &dests[batch[b]];
+                const struct file_dedupe_range_info *info = &range->info[b];
+                if (info->status == FILE_DEDUPE_RANGE_DIFFERS) {
+                    fprintf(stderr, "Skipping reflink for %s (contents differ from keeper at offset %lld)\n",
+                            dest->entry->filepath, (long long)offset);
+                    dest->done = 1;
+                } else if (info->status < 0) {
+                    fprintf(stderr, "Error reflinking %s -> %s: %s\n", dest->entry->filepath, target->filepath, strerror(-info->status));
+                    dest->done = 1;
+                } else {
+                    dest->shared += (int64_t)info->bytes_deduped;
+                }
+            }
+        }
+    }
+
+    // Left not done but short of the full size: the keeper could not be
+    // opened, the batch not allocated, or the kernel shared less than asked.
+    int64_t shared = 0;
+    for (int i = 0; i < dest_count; i++) {
+        if (!dests[i].done && size > 0 && dests[i].shared == size) {
+            report_link(NULL, "reflinked", dests[i].entry->filepath, target->filepath);
+            shared += dests[i].shared;
+        } else if (!dests[i].done) {
+            fprintf(stderr, "Skipping reflink for %s (%lld of %lld bytes shared)\n", dests[i].entry->filepath,
+                    (long long)dests[i].shared, (long long)size);
+        }
+        close(dests[i].fd);
+    }
+    if (src_fd != -1) close(src_fd);
+    free(range);
+    free(dests);
+    return shared;
+}
+
+// One group's hard-link work, run on a device worker (or inline without
+// -j). Workers touch only the filesystem; the DB updates and the group's
+// output happen on the calling thread once the task comes back, so groups
+// print whole and in one piece.
+#define LINK_COMPARE_BLOCK (1024 * 1024)
+#define LINK_TEMP_ATTEMPTS 100
+
+typedef struct {
+    IoJob io;  // must stay first: workers get the IoJob pointer back
+    DupeEntry *group;
+    int group_size;
+    int target;
+    int type;
+    int *linked;
+    OutputBuf out;
+} LinkTask;
+
+// Streams both files and stops at the first differing block. Returns 0 when
+// identical, 1 when they differ, -1 on a read error.
+static int files_identical_cmp(const char *a, const char *b, char *buf_a, char *buf_b) {
+    int fd_a = open(a, O_RDONLY | O_CLOEXEC);
+    if (fd_a == -1) return -1;
+    int fd_b = open(b, O_RDONLY | O_CLOEXEC);
+    if (fd_b == -1) {
+        close(fd_a);
+        return -1;
+    }
+    posix_fadvise(fd_a, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd_b, 0, 0, POSIX_FADV_SEQUENTIAL);
+    int result = 0;
+    for (;;) {
+        ssize_t n_a = read(fd_a, buf_a, LINK_COMPARE_BLOCK);
+        if (n_a < 0) {
+            result = -1;
+            break;
+        }
+        ssize_t got_b = 0;
+        while (got_b < n_a) {
+            ssize_t n = read(fd_b, buf_b + got_b, (size_t)(n_a - got_b));
+            if (n <= 0) break;
+            got_b += n;
+        }
+        if (got_b != n_a || memcmp(buf_a, buf_b, (size_t)n_a) != 0) {
+            result = 1;
+            break;
+        }
+        if (n_a == 0) {
+            // a is done; b must be too, or it has bytes a lacks.
+            ssize_t n = read(fd_b, buf_b, 1);
+            if (n != 0) result = n > 0 ? 1 : -1;
+            break;
+        }
+    }
+    close(fd_a);
+    close(fd_b);
+    return result;
+}
+
+// The row is only trusted while the file still has the size and mtime the
+// hash was taken at.
+static int matches_index(const DupeEntry *entry, const struct stat *st) {
+    return (int64_t)st->st_size == entry->filesize && (int64_t)st->st_mtime == entry->modified_timestamp;
+}
+
+// Replaces path with a hard link to target: link to a temporary name in the
+// same directory, then rename over, both relative to the directory fd.
+static int replace_with_link(const char *target, const char *path) {
+    char dir_buf[MAX_PATH_LENGTH];
+    char base_buf[MAX_PATH_LENGTH];
+    snprintf(dir_buf, sizeof(dir_buf), "%s", path);
+    snprintf(base_buf, sizeof(base_buf), "%s", path);
+    const char *base = basename(base_buf);
+    int dir_fd = open(dirname(dir_buf), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) return -1;
 
-        if (link(target->filepath, tmp_path) != 0) {
-            fprintf(stderr, "Error linking %s -> %s: %m\n", tmp_path, target->filepath);
-            unlink(tmp_path);
+    static volatile int temp_seq = 0;
+    char tmp_name[64];
+    int rc = -1;
+    for (int attempt = 0; attempt < LINK_TEMP_ATTEMPTS; attempt++) {
+        snprintf(tmp_name, sizeof(tmp_name), ".fhash_link.%ld.%d", (long)getpid(), __sync_fetch_and_add(&temp_seq, 1));
+        rc = linkat(AT_FDCWD, target, dir_fd, tmp_name, 0);
+        if (rc == 0 || errno != EEXIST) break;
+    }
+    if (rc == 0 && renameat(dir_fd, tmp_name, dir_fd, base) != 0) {
+        int saved = errno;
+        unlinkat(dir_fd, tmp_name, 0);
+        errno = saved;
+        rc = -1;
+    }
+    int saved = errno;
+    close(dir_fd);
+    errno = saved;
+    return rc;
+}
+
+static void run_link_task(LinkTask *task) {
+    DupeEntry *target = &task->group[task->target];
+    char *buf_a = NULL;
+    char *buf_b = NULL;
+    struct stat target_st;
+    int target_ok = (stat(target->filepath, &target_st) == 0);
+    if (!target_ok) {
+        fprintf(stderr, "OS: Error stating keeper %s: %m\n", target->filepath);
+    } else if (!matches_index(target, &target_st)) {
+        fprintf(stderr, "Skipping group of %s: keeper changed since it was indexed; rescan first\n", target->filepath);
+        target_ok = 0;
+    }
+
+    for (int i = 0; i < task->group_size; i++) {
+        DupeEntry *entry = &task->group[i];
+        if (i == task->target) {
+            report_link(&task->out, "keep", entry->filepath, NULL);
+            continue;
+        }
+        if (!target_ok) continue;
+        struct stat st;
+        if (stat(entry->filepath, &st) != 0) {
+            fprintf(stderr, "Skipping link for %s (missing stat info)\n", entry->filepath);
+            continue;
+        }
+        if (target_st.st_dev != st.st_dev) {
+            fprintf(stderr, "Skipping cross-device link %s -> %s\n", entry->filepath, target->filepath);
             continue;
         }
-        if (rename(tmp_path, entry->filepath) != 0) {
-            fprintf(stderr, "Error renaming temp link %s -> %s: %m\n", tmp_path, entry->filepath);
-            unlink(tmp_path);
+        if (target_st.st_ino == st.st_ino) {
+            report_link(&task->out, "already linked", entry->filepath, target->filepath);
             continue;
         }
-        printf("[linked] %s -> %s\n", entry->filepath, target->filepath);
+        if (!matches_index(entry, &st)) {
+            fprintf(stderr, "Skipping link for %s (changed since it was indexed; rescan first)\n", entry->filepath);
+            continue;
+        }
+        // File-hash groups must be byte-identical; audio-hash groups differ
+        // in their tags by design.
+        if (task->type == DUPE_FILE) {
+            if (st.st_size != target_st.st_size) {
+                fprintf(stderr, "Skipping link for %s (size differs from %s despite matching hash)\n", entry->filepath, target->filepath);
+                continue;
+            }
+            if (!buf_a) {
+                buf_a = malloc(LINK_COMPARE_BLOCK);
+                buf_b = malloc(LINK_COMPARE_BLOCK);
+            }
+            int cmp = (buf_a && buf_b) ? files_identical_cmp(target->filepath, entry->filepath, buf_a, buf_b) : -1;
+            if (cmp != 0) {
+                fprintf(stderr, cmp > 0 ? "Skipping link for %s (contents differ from %s despite matching hash)\n"
+                                        : "Skipping link for %s (cannot compare with %s)\n",
+                        entry->filepath, target->filepath);
+                continue;
+            }
+        }
+        if (replace_with_link(target->filepath, entry->filepath) != 0) {
+            fprintf(stderr, "Error linking %s -> %s: %m\n", entry->filepath, target->filepath);
+            continue;
+        }
+        task->linked[i] = 1;
+        report_link(&task->out, "linked", entry->filepath, target->filepath);
+    }
+    free(buf_a);
+    free(buf_b);
+}
+
+static void link_task_worker(IoJob *io) {
+    run_link_task((LinkTask *)io);
+}
+
+// Prints a finished task and records its links. Frees the task and its group.
+static void finish_link_task(sqlite3 *db, LinkTask *task, sqlite3_stmt *ts_stmt, sqlite3_stmt *size_stmt) {
+    if (output_format == OUTPUT_TEXT) {
+        fwrite(task->out.data, 1, task->out.len, stdout);
+        printf("\n");
+    } else {
+        output_emit(&task->out);
+    }
+    const DupeEntry *target = &task->group[task->target];
+    for (int i = 0; i < task->group_size; i++) {
+        if (!task->linked[i]) continue;
+        DupeEntry *entry = &task->group[i];
 
         if (ts_stmt) {
             time_t now = time(NULL);
@@ -281,7 +824,7 @@ static void handle_group(sqlite3 *db, DupeEntry *group, int group_size, int link
             sqlite3_clear_bindings(ts_stmt);
         }
 
-        if (type == DUPE_AUDIO && size_stmt) {
+        if (task->type == DUPE_AUDIO && size_stmt) {
             int64_t target_size = target->has_stat ? (int64_t)target->st.st_size : target->filesize;
             int64_t entry_size = entry->has_stat ? (int64_t)entry->st.st_size : entry->filesize;
             if (target_size != entry_size) {
@@ -299,10 +842,183 @@ static void handle_group(sqlite3 *db, DupeEntry *group, int group_size, int link
             }
         }
     }
-    printf("\n");
+    free_dupe_entries(task->group, task->group_size);
+    free(task->linked);
+    output_buf_free(&task->out);
+    free(task);
+}
+
+static void reap_link_tasks(sqlite3 *db, int wait, sqlite3_stmt *ts_stmt, sqlite3_stmt *size_stmt) {
+    IoJob *io;
+    while ((io = iosched_next_done(wait)) != NULL) {
+        finish_link_task(db, (LinkTask *)io, ts_stmt, size_stmt);
+    }
+}
+
+// Hands one device's share of a group to a link task, which takes ownership
+// of the entries.
+static void link_partition(sqlite3 *db, DupeEntry *part, int part_size, int target, int type, sqlite3_stmt *ts_stmt, sqlite3_stmt *size_stmt, int scheduled) {
+    LinkTask *task = calloc(1, sizeof(LinkTask));
+    int *linked = calloc((size_t)part_size, sizeof(int));
+    if (!task || !linked) {
+        fprintf(stderr, "Memory: Error allocating link task\n");
+        free(task);
+        free(linked);
+        free_dupe_entries(part, part_size);
+        return;
+    }
+    task->group = part;
+    task->group_size = part_size;
+    task->target = target;
+    task->type = type;
+    task->linked = linked;
+    task->io.dev = part[target].st.st_dev;
+    if (scheduled) {
+        // Keep each device's queue bounded, finishing other groups meanwhile.
+        while (iosched_pending(task->io.dev) >= iosched_device_limit(task->io.dev)) {
+            IoJob *io = iosched_next_done(1);
+            if (!io) break;
+            finish_link_task(db, (LinkTask *)io, ts_stmt, size_stmt);
+        }
+        if (iosched_submit(&task->io) == 0) {
+            reap_link_tasks(db, 0, ts_stmt, size_stmt);
+            return;
+        }
+    }
+    run_link_task(task);
+    finish_link_task(db, task, ts_stmt, size_stmt);
+}
+
+// Orders entries by device, then path, so each device's copies form one run;
+// entries that could not be stated go last.
+static int compare_dupe_device(const void *a, const void *b) {
+    const DupeEntry *x = (const DupeEntry *)a;
+    const DupeEntry *y = (const DupeEntry *)b;
+    if (x->has_stat != y->has_stat) return y->has_stat - x->has_stat;
+    if (x->has_stat && x->st.st_dev != y->st.st_dev) return (x->st.st_dev < y->st.st_dev) ? -1 : 1;
+    return strcmp(x->filepath, y->filepath);
+}
+
+static int same_device(const DupeEntry *a, const DupeEntry *b) {
+    return a->has_stat == b->has_stat && (!a->has_stat || a->st.st_dev == b->st.st_dev);
+}
+
+// Space the dupe report could free: on each device, every distinct inode
+// beyond the first would become a link to it.
+typedef struct {
+    dev_t dev;
+    int64_t bytes;
+    int64_t files;
+} DeviceReclaim;
+
+typedef struct {
+    DeviceReclaim *devices;
+    int count;
+    int capacity;
+} ReclaimTally;
+
+static void tally_reclaimable(ReclaimTally *tally, DupeEntry *group, int group_size) {
+    // dupe skips the per-row stat; only reported groups are stated.
+    for (int i = 0; i < group_size; i++) {
+        if (!group[i].has_stat) group[i].has_stat = (stat(group[i].filepath, &group[i].st) == 0);
+    }
+    for (int i = 0; i < group_size; i++) {
+        const DupeEntry *entry = &group[i];
+        if (!entry->has_stat) continue;
+        int device_seen = 0;
+        int inode_seen = 0;
+        for (int j = 0; j < i && !inode_seen; j++) {
+            if (!group[j].has_stat || group[j].st.st_dev != entry->st.st_dev) continue;
+            device_seen = 1;
+            inode_seen = (group[j].st.st_ino == entry->st.st_ino);
+        }
+        if (!device_seen || inode_seen) continue;
+
+        DeviceReclaim *slot = NULL;
+        for (int d = 0; d < tally->count; d++) {
+            if (tally->devices[d].dev == entry->st.st_dev) slot = &tally->devices[d];
+        }
+        if (!slot) {
+            if (tally->count == tally->capacity) {
+                int new_capacity = tally->capacity ? tally->capacity * 2 : 8;
+                DeviceReclaim *grown = realloc(tally->devices, (size_t)new_capacity * sizeof(DeviceReclaim));
+                if (!grown) return;
+                tally->devices = grown;
+                tally->capacity = new_capacity;
+            }
+            slot = &tally->devices[tally->count++];
+            slot->dev = entry->st.st_dev;
+            slot->bytes = 0;
+            slot->files = 0;
+        }
+        slot->bytes += (int64_t)entry->st.st_size;
+        slot->files++;
+    }
+}
+
+// Links cannot cross filesystems, so a group is split by device and each
+// device's copies collapse onto a keeper of their own, chosen by the same
+// -l{mode} rule.
+static void handle_group(sqlite3 *db, DupeEntry *group, int group_size, int link_mode, int dry_run, int type, sqlite3_stmt *ts_stmt, sqlite3_stmt *size_stmt, int64_t *reflinked_bytes, int scheduled, ReclaimTally *tally) {
+    if (group_size == 0) return;
+    if (link_mode == LINK_NONE) {
+        print_group(group, group_size);
+        end_group();
+        tally_reclaimable(tally, group, group_size);
+        return;
+    }
+
+    qsort(group, (size_t)group_size, sizeof(DupeEntry), compare_dupe_device);
+    for (int start = 0, end; start < group_size; start = end) {
+        for (end = start + 1; end < group_size && same_device(&group[start], &group[end]); end++) {
+        }
+        DupeEntry *part = &group[start];
+        int part_size = end - start;
+        if (!part[0].has_stat) {
+            for (int i = 0; i < part_size; i++) {
+                fprintf(stderr, "Skipping link for %s (missing stat info)\n", part[i].filepath);
+            }
+            continue;
+        }
+        if (part_size < 2) {
+            if (output_format == OUTPUT_TEXT) {
+                printf("[keep] %s (only copy on its device)\n\n", part[0].filepath);
+            } else {
+                report_link(NULL, "keep", part[0].filepath, NULL);
+            }
+            continue;
+        }
+        const DupeEntry *target = choose_target(part, part_size, link_mode);
+        if (link_mode & LINK_REFLINK) {
+            *reflinked_bytes += reflink_group(part, part_size, target, dry_run);
+            end_group();
+            continue;
+        }
+        if (dry_run) {
+            for (int i = 0; i < part_size; i++) {
+                report_link(NULL, (&part[i] == target) ? "keep" : "link", part[i].filepath,
+                            (&part[i] == target) ? NULL : target->filepath);
+            }
+            end_group();
+            continue;
+        }
+
+        // The task outlives this group, so it gets its own copy of the
+        // partition; the moved paths are cleared here so they are freed once.
+        DupeEntry *copy = malloc((size_t)part_size * sizeof(DupeEntry));
+        if (!copy) {
+            fprintf(stderr, "Memory: Error allocating link task\n");
+            continue;
+        }
+        memcpy(copy, part, (size_t)part_size * sizeof(DupeEntry));
+        for (int i = 0; i < part_size; i++) {
+            part[i].filepath = NULL;
+        }
+        link_partition(db, copy, part_size, (int)(target - part), type, ts_stmt, size_stmt, scheduled);
+    }
 }
 
-void process_duplicates(sqlite3 *db, int type, int min_count, int link_mode, int dry_run, const char *path_filter, int recurse_filter, char **ext_list, int ext_count) {
+void process_duplicates(sqlite3 *db, int type, int min_count, int link_mode, int dry_run, const char *path_filter, int recurse_filter, char **ext_list, int ext_count, const IoSchedOptions *sched) {
     const char *column = (type == DUPE_AUDIO) ? "audio_md5" : "md5";
     char *sql = NULL;
     sqlite3_stmt *ts_stmt = NULL;
@@ -330,7 +1046,7 @@ void process_duplicates(sqlite3 *db, int type, int min_count, int link_mode, int
     }
 
     if (asprintf(&sql, 
-        "SELECT filepath, %s, md5, audio_md5, filename, extension, filesize, last_check_timestamp "
+        "SELECT filepath, %s, md5, audio_md5, filename, extension, filesize, last_check_timestamp, modified_timestamp "
         "FROM files "
         "WHERE %s NOT IN ('N/A', 'Not calculated', 'Bad audio', '0-byte-file') "
         "ORDER BY %s, filepath;", 
@@ -348,7 +1064,14 @@ void process_duplicates(sqlite3 *db, int type, int min_count, int link_mode, int
         return;
     }
 
+    // Hard links run on per-device workers with -j; everything else, and
+    // every dry run, stays on this thread.
+    int scheduled = (sched && !dry_run && link_mode != LINK_NONE && !(link_mode & LINK_REFLINK) &&
+                     iosched_start(link_task_worker, sched) == 0);
+
     char prev_hash[MD5_DIGEST_LENGTH * 2 + 1] = {0};
+    int64_t reflinked_bytes = 0;
+    ReclaimTally tally = {0};
     DupeEntry *group = NULL;
     int group_size = 0;
     int group_capacity = 0;
@@ -364,7 +1087,7 @@ void process_duplicates(sqlite3 *db, int type, int min_count, int link_mode, int
 
         if (prev_hash[0] != '\0' && strcmp(hash, prev_hash) != 0) {
             if (group_size >= min_count) {
-                handle_group(db, group, group_size, link_mode, dry_run, type, ts_stmt, size_stmt);
+                handle_group(db, group, group_size, link_mode, dry_run, type, ts_stmt, size_stmt, &reflinked_bytes, scheduled, &tally);
             }
             free_dupe_entries(group, group_size);
             group = NULL;
@@ -396,6 +1119,7 @@ void process_duplicates(sqlite3 *db, int type, int min_count, int link_mode, int
             const unsigned char *ext = sqlite3_column_text(stmt, 5);
             entry->filesize = sqlite3_column_int64(stmt, 6);
             entry->last_check = sqlite3_column_int64(stmt, 7);
+            entry->modified_timestamp = sqlite3_column_int64(stmt, 8);
             if (md5) strncpy(entry->md5, (const char *)md5, sizeof(entry->md5) - 1);
             if (audio) strncpy(entry->audio_md5, (const char *)audio, sizeof(entry->audio_md5) - 1);
             if (fname) strncpy(entry->filename, (const char *)fname, sizeof(entry->filename) - 1);
@@ -415,14 +1139,42 @@ void process_duplicates(sqlite3 *db, int type, int min_count, int link_mode, int
     }
 
     if (group_size >= min_count) {
-        handle_group(db, group, group_size, link_mode, dry_run, type, ts_stmt, size_stmt);
+        handle_group(db, group, group_size, link_mode, dry_run, type, ts_stmt, size_stmt, &reflinked_bytes, scheduled, &tally);
     }
     if (group_size > 0) {
         free_dupe_entries(group, group_size);
     }
+    if (scheduled) {
+        reap_link_tasks(db, 1, ts_stmt, size_stmt);
+        iosched_stop();
+    }
 
     sqlite3_finalize(stmt);
     free(sql);
+    if ((link_mode & LINK_REFLINK) && !dry_run) {
+        if (output_format == OUTPUT_TEXT) {
+            printf("Reflinked %lld bytes\n", (long long)reflinked_bytes);
+        } else {
+            output_record_begin(NULL, "reflinked");
+            output_int(NULL, "bytes", reflinked_bytes);
+            output_record_end(NULL);
+        }
+    }
+    for (int d = 0; d < tally.count; d++) {
+        if (output_format == OUTPUT_TEXT) {
+            printf("Reclaimable on device %u:%u: %lld bytes in %lld files\n", major(tally.devices[d].dev), minor(tally.devices[d].dev),
+                   (long long)tally.devices[d].bytes, (long long)tally.devices[d].files);
+            continue;
+        }
+        char device[32];
+        snprintf(device, sizeof(device), "%u:%u", major(tally.devices[d].dev), minor(tally.devices[d].dev));
+        output_record_begin(NULL, "reclaimable");
+        output_str(NULL, "device", device);
+        output_int(NULL, "bytes", tally.devices[d].bytes);
+        output_int(NULL, "files", tally.devices[d].files);
+        output_record_end(NULL);
+    }
+    free(tally.devices);
 
     if (ts_stmt) sqlite3_finalize(ts_stmt);
     if (size_stmt) sqlite3_finalize(size_stmt);
@@ -432,3 +1184,197 @@ void process_duplicates(sqlite3 *db, int type, int min_count, int link_mode, int
         }
     }
 }
+
+// -top K: groups are only counted while streaming, in index order, and a
+// min-heap keeps the K most wasteful; their paths are looked up again at
+// print time, so memory is bounded by K rather than by the DB.
+typedef struct {
+    char hash[MD5_DIGEST_LENGTH * 2 + 1];
+    int64_t waste;
+    int64_t filesize;
+    int count;
+} WasteGroup;
+
+static int waste_less(const WasteGroup *a, const WasteGroup *b) {
+    if (a->waste != b->waste) return a->waste < b->waste;
+    return strcmp(a->hash, b->hash) > 0;
+}
+
+static void waste_sift_down(WasteGroup *heap, int size, int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < size && waste_less(&heap[left], &heap[smallest])) smallest = left;
+        if (right < size && waste_less(&heap[right], &heap[smallest])) smallest = right;
+        if (smallest == i) return;
+        WasteGroup tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static void waste_push(WasteGroup *heap, int *size, int capacity, const WasteGroup *group) {
+    if (*size < capacity) {
+        int i = (*size)++;
+        heap[i] = *group;
+        while (i > 0 && waste_less(&heap[i], &heap[(i - 1) / 2])) {
+            WasteGroup tmp = heap[i];
+            heap[i] = heap[(i - 1) / 2];
+            heap[(i - 1) / 2] = tmp;
+            i = (i - 1) / 2;
+        }
+    } else if (waste_less(&heap[0], group)) {
+        heap[0] = *group;
+        waste_sift_down(heap, *size, 0);
+    }
+}
+
+static int compare_waste_desc(const void *a, const void *b) {
+    const WasteGroup *x = (const WasteGroup *)a;
+    const WasteGroup *y = (const WasteGroup *)b;
+    if (waste_less(x, y)) return 1;
+    if (waste_less(y, x)) return -1;
+    return 0;
+}
+
+void report_top_dupes(sqlite3 *db, int type, int min_count, int top_k, const char *path_filter, int recurse_filter, char **ext_list, int ext_count) {
+    const char *column = (type == DUPE_AUDIO) ? "audio_md5" : "md5";
+    char *sql = NULL;
+    // No secondary sort key: the hash index alone yields the groups in order.
+    if (asprintf(&sql,
+        "SELECT filepath, %s, filesize, extension, filetype "
+        "FROM files "
+        "WHERE %s NOT IN ('N/A', 'Not calculated', 'Bad audio', '0-byte-file') "
+        "ORDER BY %s;",
+        column, column, column) == -1) {
+        fprintf(stderr, "Memory: Error allocating SQL query\n");
+        return;
+    }
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL: Error preparing duplicate query: %s\n", sqlite3_errmsg(db));
+        free(sql);
+        return;
+    }
+    free(sql);
+
+    WasteGroup *heap = calloc((size_t)top_k, sizeof(WasteGroup));
+    if (!heap) {
+        fprintf(stderr, "Memory: Error allocating top-%d heap\n", top_k);
+        sqlite3_finalize(stmt);
+        return;
+    }
+    int heap_size = 0;
+    long long total_groups = 0;
+    int64_t total_waste = 0;
+
+    // Waste is every copy's size but the largest one's (for file hashes,
+    // (count - 1) x filesize); rows already linked ('L') take no space.
+    WasteGroup current = {0};
+    int64_t unlinked_bytes = 0;
+    int rc;
+    do {
+        rc = sqlite3_step(stmt);
+        const char *hash = NULL;
+        if (rc == SQLITE_ROW) {
+            hash = (const char *)sqlite3_column_text(stmt, 1);
+            const char *filepath = (const char *)sqlite3_column_text(stmt, 0);
+            if (!hash || !filepath) continue;
+            if (!path_matches_filter(filepath, path_filter, recurse_filter) ||
+                !ext_matches_filter((const char *)sqlite3_column_text(stmt, 3), ext_list, ext_count)) {
+                continue;
+            }
+        }
+        if (current.count > 0 && (!hash || strcmp(hash, current.hash) != 0)) {
+            if (current.count >= min_count) {
+                current.waste = (unlinked_bytes > current.filesize) ? unlinked_bytes - current.filesize : 0;
+                total_groups++;
+                total_waste += current.waste;
+                waste_push(heap, &heap_size, top_k, &current);
+            }
+            current.count = 0;
+            current.filesize = 0;
+            unlinked_bytes = 0;
+        }
+        if (!hash) break;
+        if (current.count == 0) {
+            snprintf(current.hash, sizeof(current.hash), "%s", hash);
+        }
+        int64_t size = sqlite3_column_int64(stmt, 2);
+        const char *filetype = (const char *)sqlite3_column_text(stmt, 4);
+        current.count++;
+        if (size > current.filesize) current.filesize = size;
+        if (!filetype || filetype[0] != 'L') unlinked_bytes += size;
+    } while (rc == SQLITE_ROW);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL: Error reading duplicates: %s\n", sqlite3_errmsg(db));
+    }
+    sqlite3_finalize(stmt);
+
+    qsort(heap, (size_t)heap_size, sizeof(WasteGroup), compare_waste_desc);
+    char *paths_sql = NULL;
+    sqlite3_stmt *paths_stmt = NULL;
+    if (asprintf(&paths_sql, "SELECT filepath, extension FROM files WHERE %s = ? ORDER BY filepath;", column) == -1) {
+        paths_sql = NULL;
+    }
+    if (!paths_sql || sqlite3_prepare_v2(db, paths_sql, -1, &paths_stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL: Error preparing group lookup: %s\n", sqlite3_errmsg(db));
+        paths_stmt = NULL;
+    }
+    free(paths_sql);
+
+    int64_t shown_waste = 0;
+    for (int i = 0; i < heap_size; i++) {
+        const WasteGroup *group = &heap[i];
+        shown_waste += group->waste;
+        if (output_format == OUTPUT_TEXT) {
+            printf("Wasted %lld bytes: %d copies of %lld bytes (%s)\n",
+                   (long long)group->waste, group->count, (long long)group->filesize, group->hash);
+        } else {
+            output_record_begin(NULL, "waste");
+            output_int(NULL, "rank", i + 1);
+            output_str(NULL, "hash", group->hash);
+            output_int(NULL, "waste", group->waste);
+            output_int(NULL, "copies", group->count);
+            output_int(NULL, "size", group->filesize);
+            output_record_end(NULL);
+        }
+        if (paths_stmt) {
+            sqlite3_bind_text(paths_stmt, 1, group->hash, -1, SQLITE_STATIC);
+            while (sqlite3_step(paths_stmt) == SQLITE_ROW) {
+                const char *filepath = (const char *)sqlite3_column_text(paths_stmt, 0);
+                if (filepath && path_matches_filter(filepath, path_filter, recurse_filter) &&
+                    ext_matches_filter((const char *)sqlite3_column_text(paths_stmt, 1), ext_list, ext_count)) {
+                    if (output_format == OUTPUT_TEXT) {
+                        printf("%s\n", filepath);
+                        continue;
+                    }
+                    output_record_begin(NULL, "dupe");
+                    output_str(NULL, "hash", group->hash);
+                    output_int(NULL, "size", group->filesize);
+                    output_str(NULL, "path", filepath);
+                    output_record_end(NULL);
+                }
+            }
+            sqlite3_reset(paths_stmt);
+        }
+        end_group();
+    }
+    if (paths_stmt) sqlite3_finalize(paths_stmt);
+
+    if (output_format == OUTPUT_TEXT) {
+        printf("Top %d of %lld groups: %lld of %lld wasted bytes (%.1f%%)\n",
+               heap_size, total_groups, (long long)shown_waste, (long long)total_waste,
+               total_waste > 0 ? 100.0 * (double)shown_waste / (double)total_waste : 0.0);
+    } else {
+        output_record_begin(NULL, "waste_total");
+        output_int(NULL, "shown_groups", heap_size);
+        output_int(NULL, "groups", total_groups);
+        output_int(NULL, "shown_waste", shown_waste);
+        output_int(NULL, "waste", total_waste);
+        output_record_end(NULL);
+    }
+    free(heap);
+}
@@ -0,0 +1,4 @@
+#include "fhash.h"
+
+const char *FHASH_VERSION = "1.01";
+const char *DB_VERSION = "1.01";
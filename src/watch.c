@@ -0,0 +1,373 @@
+#include "watch.h"
+#include "stats.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+
+#define WATCH_EVENT_BUFFER 65536
+#define INOTIFY_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+struct Watcher {
+    int backend;
+    int fd;
+    int mount_fd;      // fanotify: resolves directory handles
+    char *root;
+    size_t root_len;
+    int recursive;
+    WatchAcceptFn accept;
+    void *accept_arg;
+    char **wd_paths;   // inotify: watch descriptor -> directory
+    int wd_cap;
+    int limit_warned;
+    WatchChange *changes;
+    size_t count;
+    size_t cap;
+    uint64_t first_ns;
+    uint64_t last_ns;
+};
+
+static void add_change(Watcher *watcher, const char *path, int subtree) {
+    // Bursts land in one directory; skip repeats of the last change cheaply
+    // and leave the rest to watch_take.
+    if (watcher->count > 0) {
+        const WatchChange *last = &watcher->changes[watcher->count - 1];
+        if (last->subtree == subtree && strcmp(last->path, path) == 0) {
+            watcher->last_ns = stats_now_ns();
+            return;
+        }
+    }
+    if (watcher->count == watcher->cap) {
+        size_t new_cap = watcher->cap ? watcher->cap * 2 : 64;
+        WatchChange *grown = realloc(watcher->changes, new_cap * sizeof(WatchChange));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation error while queueing %s\n", path);
+            exit(1);
+        }
+        watcher->changes = grown;
+        watcher->cap = new_cap;
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        fprintf(stderr, "Memory allocation error while queueing %s\n", path);
+        exit(1);
+    }
+    watcher->changes[watcher->count].path = copy;
+    watcher->changes[watcher->count].subtree = subtree;
+    watcher->count++;
+    watcher->last_ns = stats_now_ns();
+    if (watcher->count == 1) watcher->first_ns = watcher->last_ns;
+}
+
+static int under_root(const Watcher *watcher, const char *dir) {
+    if (strcmp(dir, watcher->root) == 0) return 1;
+    if (!watcher->recursive) return 0;
+    if (watcher->root_len == 1) return dir[0] == '/';
+    return strncmp(dir, watcher->root, watcher->root_len) == 0 && dir[watcher->root_len] == '/';
+}
+
+static void set_wd_path(Watcher *watcher, int wd, const char *path) {
+    if (wd >= watcher->wd_cap) {
+        int new_cap = watcher->wd_cap ? watcher->wd_cap : 256;
+        while (new_cap <= wd) new_cap *= 2;
+        char **grown = realloc(watcher->wd_paths, (size_t)new_cap * sizeof(char *));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation error while watching %s\n", path);
+            exit(1);
+        }
+        memset(grown + watcher->wd_cap, 0, (size_t)(new_cap - watcher->wd_cap) * sizeof(char *));
+        watcher->wd_paths = grown;
+        watcher->wd_cap = new_cap;
+    }
+    // A directory renamed inside the tree keeps its watch descriptor; the
+    // walk of its new location replaces the stale path.
+    free(watcher->wd_paths[wd]);
+    watcher->wd_paths[wd] = strdup(path);
+}
+
+static void forget_wd(Watcher *watcher, int wd) {
+    if (wd >= 0 && wd < watcher->wd_cap) {
+        free(watcher->wd_paths[wd]);
+        watcher->wd_paths[wd] = NULL;
+    }
+}
+
+static void inotify_add_dir(Watcher *watcher, const char *path) {
+    int wd = inotify_add_watch(watcher->fd, path, INOTIFY_MASK);
+    if (wd >= 0) {
+        set_wd_path(watcher, wd, path);
+    } else if (errno == ENOSPC) {
+        if (!watcher->limit_warned) {
+            fprintf(stderr, "Warning: inotify watch limit reached at %s; raise fs.inotify.max_user_watches or run as root for fanotify\n", path);
+            watcher->limit_warned = 1;
+        }
+    } else if (errno != ENOENT && errno != ENOTDIR) {
+        fprintf(stderr, "Warning: cannot watch %s: %m\n", path);
+    }
+}
+
+// Watches path and, when recursive, every directory below it.
+static void inotify_add_tree(Watcher *watcher, const char *path) {
+    char **stack = NULL;
+    size_t depth = 0, cap = 0;
+    char *top = strdup(path);
+    while (top) {
+        inotify_add_dir(watcher, top);
+        DIR *dir = watcher->recursive ? opendir(top) : NULL;
+        struct dirent *entry;
+        while (dir && (entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+            if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) continue;
+            char child[PATH_MAX];
+            if (snprintf(child, sizeof(child), "%s/%s", top, entry->d_name) >= (int)sizeof(child)) continue;
+            struct stat st;
+            if (entry->d_type == DT_UNKNOWN && (lstat(child, &st) != 0 || !S_ISDIR(st.st_mode))) continue;
+            if (depth == cap) {
+                cap = cap ? cap * 2 : 64;
+                char **grown = realloc(stack, cap * sizeof(char *));
+                if (!grown) {
+                    fprintf(stderr, "Memory allocation error while watching %s\n", child);
+                    exit(1);
+                }
+                stack = grown;
+            }
+            stack[depth++] = strdup(child);
+        }
+        if (dir) closedir(dir);
+        free(top);
+        top = depth ? stack[--depth] : NULL;
+    }
+    free(stack);
+}
+
+// One directory entry changed. name is relative to dir.
+static void note_entry(Watcher *watcher, const char *dir, const char *name, int is_dir) {
+    if (!under_root(watcher, dir)) return;
+    if (is_dir) {
+        if (!watcher->recursive || strcmp(name, ".") == 0) return;
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", (strcmp(dir, "/") == 0) ? "" : dir, name) >= (int)sizeof(path)) return;
+        if (watcher->backend == WATCH_INOTIFY) {
+            inotify_add_tree(watcher, path);
+        }
+        add_change(watcher, path, 1);
+    } else if (!watcher->accept || watcher->accept(watcher->accept_arg, name)) {
+        add_change(watcher, dir, 0);
+    }
+}
+
+static int read_inotify(Watcher *watcher) {
+    char buf[WATCH_EVENT_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t len = read(watcher->fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR) return 0;
+            fprintf(stderr, "OS: Error reading inotify events: %m\n");
+            return -1;
+        }
+        for (char *p = buf; p < buf + len; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                add_change(watcher, watcher->root, 1);
+            } else if (event->mask & IN_IGNORED) {
+                forget_wd(watcher, event->wd);
+            } else if (event->len > 0 && event->wd >= 0 && event->wd < watcher->wd_cap && watcher->wd_paths[event->wd]) {
+                note_entry(watcher, watcher->wd_paths[event->wd], event->name, (event->mask & IN_ISDIR) != 0);
+            }
+        }
+    }
+}
+
+static int resolve_dir_handle(const Watcher *watcher, struct file_handle *handle, char *out, size_t out_len) {
+    int fd = open_by_handle_at(watcher->mount_fd, handle, O_PATH | O_CLOEXEC);
+    if (fd < 0) return -1;  // gone again (ESTALE) before we got to it
+    char link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(link, out, out_len - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    out[n] = '\0';
+    return 0;
+}
+
+static int read_fanotify(Watcher *watcher) {
+    char buf[WATCH_EVENT_BUFFER] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    for (;;) {
+        ssize_t len = read(watcher->fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR) return 0;
+            fprintf(stderr, "OS: Error reading fanotify events: %m\n");
+            return -1;
+        }
+        struct fanotify_event_metadata *meta = (struct fanotify_event_metadata *)buf;
+        for (; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+            if (meta->vers != FANOTIFY_METADATA_VERSION) {
+                fprintf(stderr, "Error: unsupported fanotify event version %d\n", meta->vers);
+                return -1;
+            }
+            if (meta->fd >= 0) close(meta->fd);
+            if (meta->mask & FAN_Q_OVERFLOW) {
+                add_change(watcher, watcher->root, 1);
+                continue;
+            }
+            struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *)(meta + 1);
+            if ((char *)fid + sizeof(*fid) > (char *)meta + meta->event_len ||
+                fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                continue;
+            }
+            struct file_handle *handle = (struct file_handle *)fid->handle;
+            const char *name = (const char *)handle->f_handle + handle->handle_bytes;
+            char dir[PATH_MAX];
+            if (resolve_dir_handle(watcher, handle, dir, sizeof(dir)) == 0) {
+                note_entry(watcher, dir, name, (meta->mask & FAN_ONDIR) != 0);
+            }
+        }
+    }
+}
+
+static int open_fanotify(Watcher *watcher) {
+    int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY);
+    if (fd < 0) return -1;
+    uint64_t mask = FAN_CLOSE_WRITE | FAN_CREATE | FAN_MOVED_TO | FAN_ONDIR;
+    if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, watcher->root) != 0) {
+        close(fd);
+        return -1;
+    }
+    watcher->mount_fd = open(watcher->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (watcher->mount_fd < 0) {
+        close(fd);
+        return -1;
+    }
+    watcher->fd = fd;
+    watcher->backend = WATCH_FANOTIFY;
+    return 0;
+}
+
+static int open_inotify(Watcher *watcher) {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "OS: Error initializing inotify: %m\n");
+        return -1;
+    }
+    watcher->fd = fd;
+    watcher->backend = WATCH_INOTIFY;
+    inotify_add_tree(watcher, watcher->root);
+    return 0;
+}
+
+Watcher *watch_open(const char *root, int recursive, int force_inotify, WatchAcceptFn accept, void *accept_arg) {
+    Watcher *watcher = calloc(1, sizeof(Watcher));
+    if (!watcher || !(watcher->root = strdup(root))) {
+        fprintf(stderr, "Memory allocation error while watching %s\n", root);
+        free(watcher);
+        return NULL;
+    }
+    watcher->root_len = strlen(root);
+    watcher->recursive = recursive;
+    watcher->accept = accept;
+    watcher->accept_arg = accept_arg;
+    watcher->fd = -1;
+    watcher->mount_fd = -1;
+
+    if ((force_inotify || open_fanotify(watcher) != 0) && open_inotify(watcher) != 0) {
+        watch_close(watcher);
+        return NULL;
+    }
+    return watcher;
+}
+
+int watch_backend(const Watcher *watcher) {
+    return watcher->backend;
+}
+
+// Waits up to timeout_ms for events and folds them into the pending set.
+// An interrupting signal returns 0 so the caller can check its stop flag.
+int watch_poll(Watcher *watcher, int timeout_ms) {
+    struct pollfd pfd = { .fd = watcher->fd, .events = POLLIN };
+    int rc = poll(&pfd, 1, timeout_ms);
+    if (rc < 0) {
+        if (errno == EINTR) return 0;
+        fprintf(stderr, "OS: Error waiting for filesystem events: %m\n");
+        return -1;
+    }
+    if (rc == 0) return 0;
+    return (watcher->backend == WATCH_FANOTIFY) ? read_fanotify(watcher) : read_inotify(watcher);
+}
+
+int watch_ready(const Watcher *watcher) {
+    if (watcher->count == 0) return 0;
+    uint64_t now = stats_now_ns();
+    return now - watcher->last_ns >= (uint64_t)WATCH_SETTLE_MS * 1000000ULL ||
+           now - watcher->first_ns >= (uint64_t)WATCH_MAX_DELAY_MS * 1000000ULL;
+}
+
+// Path order with '/' lowest, so a directory's descendants sort right after
+// it; a subtree entry sorts before a plain entry for the same directory.
+static int change_cmp(const void *a, const void *b) {
+    const WatchChange *ca = a;
+    const WatchChange *cb = b;
+    const unsigned char *pa = (const unsigned char *)ca->path;
+    const unsigned char *pb = (const unsigned char *)cb->path;
+    while (*pa && *pa == *pb) {
+        pa++;
+        pb++;
+    }
+    int ka = (*pa == '/') ? 1 : *pa;
+    int kb = (*pb == '/') ? 1 : *pb;
+    if (ka != kb) return ka - kb;
+    return cb->subtree - ca->subtree;
+}
+
+static int covered_by(const char *path, const char *subtree) {
+    size_t len = strlen(subtree);
+    if (strncmp(path, subtree, len) != 0) return 0;
+    return path[len] == '\0' || path[len] == '/' || (len > 0 && subtree[len - 1] == '/');
+}
+
+// Hands over the pending set, deduplicated and with everything inside a
+// subtree entry folded into it. The caller frees it with watch_free_changes.
+size_t watch_take(Watcher *watcher, WatchChange **changes_out) {
+    WatchChange *changes = watcher->changes;
+    size_t count = watcher->count;
+    watcher->changes = NULL;
+    watcher->count = 0;
+    watcher->cap = 0;
+
+    qsort(changes, count, sizeof(WatchChange), change_cmp);
+    size_t kept = 0;
+    const char *cover = NULL;
+    for (size_t i = 0; i < count; i++) {
+        int redundant = (cover && covered_by(changes[i].path, cover)) ||
+                        (kept > 0 && strcmp(changes[kept - 1].path, changes[i].path) == 0);
+        if (redundant) {
+            free(changes[i].path);
+            continue;
+        }
+        changes[kept] = changes[i];
+        if (changes[kept].subtree) cover = changes[kept].path;
+        kept++;
+    }
+    *changes_out = changes;
+    return kept;
+}
+
+void watch_free_changes(WatchChange *changes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(changes[i].path);
+    }
+    free(changes);
+}
+
+void watch_close(Watcher *watcher) {
+    if (!watcher) return;
+    if (watcher->fd >= 0) close(watcher->fd);
+    if (watcher->mount_fd >= 0) close(watcher->mount_fd);
+    for (int i = 0; i < watcher->wd_cap; i++) {
+        free(watcher->wd_paths[i]);
+    }
+    free(watcher->wd_paths);
+    watch_free_changes(watcher->changes, watcher->count);
+    free(watcher->root);
+    free(watcher);
+}
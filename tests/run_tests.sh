@@ -7,6 +7,19 @@ WORK="${ROOT}/tests/workdir"
 SRC="${ROOT}/test_source"
 DB="${WORK}/test.db"
 MIG_DB="${WORK}/legacy_v1_0.db"
+QUICK_DB="${WORK}/quick.db"
+JOBS_DB="${WORK}/jobs.db"
+ORDER_DB="${WORK}/order.db"
+GOV_DB="${WORK}/governor.db"
+RUN_DB="${WORK}/resume.db"
+FAST_DB="${WORK}/fast.db"
+WATCH_DB="${WORK}/watch.db"
+PRUNE_DB="${WORK}/prune.db"
+LINK_DB="${WORK}/link.db"
+OUT_DB="${WORK}/output.db"
+XATTR_DB="${WORK}/xattr.db"
+COPY_DB="${WORK}/copy.db"
+MERGE_DB="${WORK}/merged.db"
 
 echo "[INFO] Preparing test workspace..."
 rm -f "${OUT}"
@@ -32,13 +45,25 @@ run_step() {
     local label="$1"; shift
     log_start "$label"
     set +e
-    "$@" >> "${OUT}" 2>&1
+    if declare -F "$1" > /dev/null; then
+        # Scenario functions run in a subshell that stops at their first
+        # failing line. Without pipefail, `cmd | grep -q` does not fail on
+        # the SIGPIPE that cmd gets once grep has its match.
+        ( set -e +o pipefail; "$@" ) >> "${OUT}" 2>&1
+    else
+        "$@" >> "${OUT}" 2>&1
+    fi
     local rc=$?
     set -e
     log_result "$rc" "$label"
     return "$rc"
 }
 
+# Passes when every file indexed in DB has the same md5 in the given DB.
+same_md5_as_serial() {
+    test "$(sqlite3 "$1" "ATTACH '${DB}' AS s; SELECT COUNT(*) FROM files f JOIN s.files g USING (filepath) WHERE f.md5 = g.md5;")" = "$(sqlite3 "${DB}" 'SELECT COUNT(*) FROM files;')"
+}
+
 echo "[INFO] Copying source samples (root files only, ignoring other_songs)..."
 find "${SRC}" -maxdepth 1 -type f -name "*.mp3" -print0 | while IFS= read -r -d '' f; do
   cp "$f" "${WORK}/"
@@ -53,34 +78,327 @@ done
 run_step "scan (file+audio over workdir)" "${ROOT}/fhash" scan -v -r -h -a -f -s "${WORK}" -e mp3 -d "${DB}"
 run_step "scan results (md5/audio_md5 summary)" sqlite3 "${DB}" "SELECT filename, md5, audio_md5 FROM files ORDER BY filename;"
 
+scan_without_logdb_stores_no_log() {
+    sqlite3 "${DB}" "SELECT COUNT(*) FROM files WHERE audio_check_log IS NOT NULL;" | grep -qx '0'
+}
+run_step "scan without -logdb leaves audio_check_log NULL" scan_without_logdb_stores_no_log
+
 # 2) File-hash duplicates (should group identical hard-link hearts copies)
 run_step "dupe by file hash" "${ROOT}/fhash" dupe -v -xh2 -s "${WORK}" -r -e mp3 -d "${DB}"
 
+dupe_reports_reclaimable() {
+    "${ROOT}/fhash" dupe -xh2 -s "${WORK}" -r -e mp3 -d "${DB}" | grep -q '^Reclaimable on device [0-9]*:[0-9]*: [1-9][0-9]* bytes in [1-9][0-9]* files'
+}
+run_step "dupe report totals reclaimable bytes per device" dupe_reports_reclaimable
+
+dupe_top_one() {
+    "${ROOT}/fhash" dupe -xh2 -top 1 -s "${WORK}" -r -e mp3 -d "${DB}" > "${WORK}/top.txt"
+    test "$(grep -c '^Wasted ' "${WORK}/top.txt")" = 1
+    grep -q '^Wasted [1-9][0-9]* bytes: 4 copies' "${WORK}/top.txt"
+    grep -q '^Top 1 of [2-9][0-9]* groups: ' "${WORK}/top.txt"
+}
+run_step "dupe -top 1 prints only the most wasteful group" dupe_top_one
+
 # 2b) Audio stream validation and enum persistence
 run_step "check audio streams" "${ROOT}/fhash" check -v -r -s "${WORK}" -e mp3 -d "${DB}"
 run_step "check results (audio_check_result summary)" sqlite3 "${DB}" "SELECT filename, audio_check_result FROM files ORDER BY filename;"
+
 run_step "check sentinel values (0-byte=1, all checked)" bash -lc "sqlite3 '${DB}' \"SELECT COUNT(*) FROM files WHERE extension='mp3' AND audio_check_result=4;\" | grep -qx '0' && sqlite3 '${DB}' \"SELECT audio_check_result FROM files WHERE filename='0bytes.mp3';\" | grep -qx '1'"
+
+check_level_full() {
+    sqlite3 "${DB}" "SELECT COUNT(*) FROM files WHERE extension='mp3' AND audio_check_level!=2;" | grep -qx '0'
+}
+run_step "check level recorded as full decode" check_level_full
+
 run_step "check force re-run with -f" bash -lc "'${ROOT}/fhash' check -v -f -r -s '${WORK}' -e mp3 -d '${DB}' 2>&1 | tee '${WORK}/check_force.log' && grep -q 'Treated 12 files\\.' '${WORK}/check_force.log'"
 
+# 2c) Quick (packet-level) tier is recorded separately and upgraded by a later full check
+run_step "quick check audio streams" "${ROOT}/fhash" check -q -r -s "${WORK}" -e mp3 -d "${QUICK_DB}"
+
+quick_check_level() {
+    sqlite3 "${QUICK_DB}" "SELECT COUNT(*) FROM files WHERE audio_check_level!=1 OR audio_check_result=4;" | grep -qx '0'
+}
+run_step "quick check level recorded" quick_check_level
+
+full_check_upgrades_quick() {
+    "${ROOT}/fhash" check -v -r -s "${WORK}" -e mp3 -d "${QUICK_DB}" 2>&1 | grep -q 'Treated 12 files\.'
+    sqlite3 "${QUICK_DB}" "SELECT COUNT(*) FROM files WHERE audio_check_level!=2;" | grep -qx '0'
+}
+run_step "full check upgrades quick results" full_check_upgrades_quick
+
 # 3) Audio-hash duplicates (should group take 2 variants with different metadata)
 run_step "dupe by audio hash" "${ROOT}/fhash" dupe -v -xa2 -s "${WORK}" -r -e mp3 -d "${DB}"
 
 # 4) Link dry-run on dupes folder (file-hash mode) to show planned hardlinks
 run_step "link dry-run (file hash, shallowest)" "${ROOT}/fhash" link -v -xh2 -ls -s "${WORK}" -r -e mp3 -d "${DB}" -dry
 
+reflink_dry_run() {
+    "${ROOT}/fhash" link -xh2 -lrs -s "${WORK}" -r -e mp3 -d "${DB}" -dry | grep -q '^\[reflink\] '
+}
+run_step "reflink dry-run (-lr) plans extent sharing" reflink_dry_run
+
+reflink_keeps_inodes() {
+    "${ROOT}/fhash" link -xh2 -lrs -s "${WORK}/dupes" -e mp3 -d "${DB}" | grep -q '^Reflinked [0-9]* bytes'
+    test "$(find "${WORK}/dupes" -type f -links +1 | wc -l)" = 0
+}
+run_step "reflink run keeps separate inodes" reflink_keeps_inodes
+
+# ext4 and tmpfs reject FIDEDUPERANGE; elsewhere there is nothing to check.
+reflink_unsupported_shares_nothing() {
+    "${ROOT}/fhash" link -xh2 -lrs -s "${WORK}/dupes" -e mp3 -d "${DB}" > "${WORK}/reflink.log" 2> "${WORK}/reflink.err"
+    grep -q 'Error deduplicating .*: Operation not supported' "${WORK}/reflink.err" || return 0
+    test "$(grep -c '^\[reflinked\] ' "${WORK}/reflink.log")" = 0
+    grep -qx 'Reflinked 0 bytes' "${WORK}/reflink.log"
+}
+run_step "reflink without FIDEDUPERANGE support reports nothing reflinked" reflink_unsupported_shares_nothing
+
 # 5) Sentinel coverage check for 0-byte and bad-audio entries
 run_step "sentinel rows check" sqlite3 "${DB}" "SELECT filename, md5, audio_md5 FROM files WHERE md5='0-byte-file' OR audio_md5='Bad audio' ORDER BY filename;"
 
 # 6) Incremental update without -f (mtime/filesize change should trigger rehash)
 run_step "incremental baseline md5" bash -lc "sqlite3 '${DB}' \"SELECT md5 FROM files WHERE filepath='${WORK}/Hard Link Hearts.mp3';\" > '${WORK}/md5_before.txt' && test -s '${WORK}/md5_before.txt'"
+
 run_step "mutate tracked file" bash -lc "printf 'x' >> '${WORK}/Hard Link Hearts.mp3'"
 run_step "incremental rescan without -f" "${ROOT}/fhash" scan -v -r -h -s "${WORK}" -e mp3 -d "${DB}"
+
 run_step "incremental md5 changed check" bash -lc "sqlite3 '${DB}' \"SELECT md5 FROM files WHERE filepath='${WORK}/Hard Link Hearts.mp3';\" > '${WORK}/md5_after.txt' && test -s '${WORK}/md5_after.txt' && ! cmp -s '${WORK}/md5_before.txt' '${WORK}/md5_after.txt'"
 
+noop_rescan_stats() {
+    "${ROOT}/fhash" scan -r -h -s "${WORK}" -e mp3 -d "${DB}" -stats 2> "${WORK}/stats.json"
+    grep -q '"files_skipped":12' "${WORK}/stats.json"
+    grep -q '"phases":{"readdir":{' "${WORK}/stats.json"
+}
+run_step "no-op rescan reports skipped files in -stats JSON" noop_rescan_stats
+
+progress_snapshots() {
+    "${ROOT}/fhash" scan -r -h -s "${WORK}" -e mp3 -d "${DB}" -precount -progfile "${WORK}/progress.jsonl"
+    grep -q '"final":true,"files":12,.*"total_files":12' "${WORK}/progress.jsonl"
+}
+run_step "progress snapshots with pre-count totals" progress_snapshots
+
+trace_export() {
+    "${ROOT}/fhash" scan -r -h -s "${WORK}" -e mp3 -d "${DB}" -f -trace "${WORK}/trace.json"
+    grep -q '"name":"file_md5"' "${WORK}/trace.json"
+    grep -q '"name":"file".*"path":' "${WORK}/trace.json"
+    tail -n 1 "${WORK}/trace.json" | grep -q '^]}$'
+}
+run_step "trace export writes per-file spans" trace_export
+
+parallel_scan() {
+    "${ROOT}/fhash" scan -r -h -s "${WORK}" -e mp3 -d "${JOBS_DB}" -j 2 -jr 2
+    same_md5_as_serial "${JOBS_DB}"
+}
+run_step "per-device parallel scan (-j) matches serial hashes" parallel_scan
+
+extent_order_scan() {
+    "${ROOT}/fhash" scan -r -h -s "${WORK}" -e mp3 -d "${ORDER_DB}" -order extent
+    same_md5_as_serial "${ORDER_DB}"
+}
+run_step "physical-order scan (-order extent) matches serial hashes" extent_order_scan
+
+governed_scan() {
+    "${ROOT}/fhash" scan -r -h -s "${WORK}" -e mp3 -d "${GOV_DB}" -maxbps 64M -maxfps 1000 -nocache
+    same_md5_as_serial "${GOV_DB}"
+}
+run_step "governed scan (-maxbps/-nocache) matches serial hashes" governed_scan
+
+budgeted_scan_pauses() {
+    "${ROOT}/fhash" scan -r -h -s "${WORK}" -e mp3 -d "${RUN_DB}" -maxfps 4 -budget 1s | grep -q 'Budget reached'
+    sqlite3 "${RUN_DB}" "SELECT status FROM scan_runs;" | grep -qx 'paused'
+    test "$(sqlite3 "${RUN_DB}" 'SELECT COUNT(*) FROM scan_frontier;')" -gt 0
+}
+run_step "budgeted scan pauses with a saved frontier" budgeted_scan_pauses
+
+resumed_scan_completes() {
+    "${ROOT}/fhash" scan -r -h -s "${WORK}" -e mp3 -d "${RUN_DB}" | grep -q '^Resuming scan run 1 (paused): [1-9][0-9]* directories pending'
+    sqlite3 "${RUN_DB}" "SELECT status, sessions FROM scan_runs;" | grep -qx 'done|2'
+    same_md5_as_serial "${RUN_DB}"
+}
+run_step "resumed scan completes the run" resumed_scan_completes
+
+finished_runs_pruned() {
+    sqlite3 "${RUN_DB}" "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 60) INSERT INTO scan_runs (command, root, params, status) SELECT 'scan', '/old', '', 'done' FROM n;"
+    sqlite3 "${RUN_DB}" "INSERT INTO scan_runs (command, root, params, status) VALUES ('scan', '/elsewhere', '', 'paused');"
+    "${ROOT}/fhash" scan -r -h -s "${WORK}" -e mp3 -d "${RUN_DB}"
+    test "$(sqlite3 "${RUN_DB}" "SELECT COUNT(*) FROM scan_runs WHERE status IN ('done', 'abandoned');")" = 51
+    sqlite3 "${RUN_DB}" "SELECT COUNT(*) FROM scan_runs WHERE status = 'paused';" | grep -qx '1'
+}
+run_step "a new run prunes old finished runs but keeps unfinished ones" finished_runs_pruned
+
+fast_rescan_skips() {
+    "${ROOT}/fhash" scan -r -h -s "${WORK}" -e mp3 -d "${FAST_DB}" -fast
+    "${ROOT}/fhash" scan -r -h -s "${WORK}" -e mp3 -d "${FAST_DB}" -fast -stats 2> "${WORK}/fast_stats.json"
+    grep -q '"dirs_skipped":[1-9]' "${WORK}/fast_stats.json"
+    test "$(sqlite3 "${FAST_DB}" 'SELECT COUNT(*) FROM files;')" = "$(sqlite3 "${DB}" 'SELECT COUNT(*) FROM files;')"
+}
+run_step "fast rescan skips unchanged directories" fast_rescan_skips
+
+fast_rescan_finds_new() {
+    local rc=0
+    cp "${WORK}/dupes/Hard Link Hearts.mp3" "${WORK}/dupes/fast-new.mp3"
+    "${ROOT}/fhash" scan -r -h -s "${WORK}" -e mp3 -d "${FAST_DB}" -fast || rc=$?
+    rm -f "${WORK}/dupes/fast-new.mp3"
+    test $rc -eq 0
+    sqlite3 "${FAST_DB}" "SELECT COUNT(*) FROM files WHERE filename='fast-new.mp3';" | grep -qx '1'
+}
+run_step "fast rescan finds a file added to a skipped directory" fast_rescan_finds_new
+
+watch_indexes_new_file() {
+    mkdir -p "${WORK}/watched/new"
+    "${ROOT}/fhash" watch -r -h -s "${WORK}/watched" -e mp3 -d "${WATCH_DB}" -inotify > "${WORK}/watch.log" 2>&1 &
+    local pid=$!
+    for i in $(seq 50); do grep -qs '^Watching' "${WORK}/watch.log" && break; sleep 0.1; done
+    cp "${WORK}/dupes/BadAudio.mp3" "${WORK}/watched/new/landed.mp3"
+    for i in $(seq 100); do
+        test "$(sqlite3 "${WATCH_DB}" "SELECT COUNT(*) FROM files WHERE filename='landed.mp3';" 2>/dev/null)" = 1 && break
+        sleep 0.1
+    done
+    kill -INT $pid
+    wait $pid
+    sqlite3 "${WATCH_DB}" "SELECT COUNT(*) FROM files WHERE filename='landed.mp3';" | grep -qx '1'
+}
+run_step "watch indexes a file landing after the baseline scan" watch_indexes_new_file
+
+prune_vanished() {
+    mkdir -p "${WORK}/prune/sub"
+    cp "${WORK}/dupes/BadAudio.mp3" "${WORK}/prune/kept.mp3"
+    cp "${WORK}/dupes/BadAudio.mp3" "${WORK}/prune/sub/gone.mp3"
+    "${ROOT}/fhash" scan -r -h -s "${WORK}/prune" -e mp3 -d "${PRUNE_DB}"
+    rm "${WORK}/prune/sub/gone.mp3"
+    "${ROOT}/fhash" scan -r -h -s "${WORK}/prune" -e mp3 -d "${PRUNE_DB}" -prune -dry | grep -q 'Would prune: .*/sub/gone.mp3'
+    test "$(sqlite3 "${PRUNE_DB}" 'SELECT COUNT(*) FROM files;')" = 2
+    "${ROOT}/fhash" scan -r -h -s "${WORK}/prune" -e mp3 -d "${PRUNE_DB}" -prune | grep -q 'Pruned 1 vanished files'
+    sqlite3 "${PRUNE_DB}" 'SELECT filename FROM files;' | grep -qx 'kept.mp3'
+    test "$(sqlite3 "${PRUNE_DB}" 'SELECT COUNT(*) FROM files;')" = 1
+}
+run_step "prune reports then removes rows of deleted files" prune_vanished
+
+parallel_link_skips_changed() {
+    mkdir -p "${WORK}/linkset"
+    for n in a b c; do cp "${WORK}/dupes/BadAudio.mp3" "${WORK}/linkset/$n.mp3"; done
+    touch -d '2001-01-01' "${WORK}/linkset/a.mp3"
+    "${ROOT}/fhash" scan -h -s "${WORK}/linkset" -e mp3 -d "${LINK_DB}"
+    touch -d '2002-02-02' "${WORK}/linkset/c.mp3"
+    "${ROOT}/fhash" link -xh2 -lo -j 2 -s "${WORK}/linkset" -e mp3 -d "${LINK_DB}" 2> "${WORK}/link.err" | grep -q '^\[linked\] .*/b.mp3'
+    grep -q 'c.mp3 (changed since it was indexed' "${WORK}/link.err"
+    test "$(stat -c %h "${WORK}/linkset/a.mp3")" = 2
+    test "$(stat -c %h "${WORK}/linkset/c.mp3")" = 1
+}
+run_step "parallel link (-j) skips a copy changed since the scan" parallel_link_skips_changed
+
+structured_output() {
+    mkdir -p "${WORK}/outfmt"
+    cp "${WORK}/dupes/BadAudio.mp3" "${WORK}/outfmt/plain.mp3"
+    cp "${WORK}/dupes/BadAudio.mp3" "${WORK}/outfmt/$(printf 'odd\nname.mp3')"
+    "${ROOT}/fhash" scan -h -s "${WORK}/outfmt" -e mp3 -d "${OUT_DB}" -o jsonl > "${WORK}/scan.jsonl"
+    test "$(grep -c '^{"type":"file",' "${WORK}/scan.jsonl")" = 2
+    grep -qF 'odd\nname.mp3' "${WORK}/scan.jsonl"
+    "${ROOT}/fhash" dupe -xh -s "${WORK}/outfmt" -d "${OUT_DB}" -o nul -out "${WORK}/dupe.nul"
+    test "$(tr '\0' '\n' < "${WORK}/dupe.nul" | grep -cx dupe)" = 2
+    test "$(tr -cd '\0' < "${WORK}/dupe.nul" | wc -c)" = 12
+}
+run_step "structured output (-o jsonl/nul) keeps a newline in a path intact" structured_output
+
+structured_output_write_failure() {
+    local rc=0
+    "${ROOT}/fhash" dupe -xh -s "${WORK}/outfmt" -d "${OUT_DB}" -o jsonl > /dev/full 2> "${WORK}/full.err" || rc=$?
+    test $rc -ne 0
+    grep -q '^Error: writing output failed' "${WORK}/full.err"
+}
+run_step "structured output exits non-zero when the records cannot be written" structured_output_write_failure
+
+serve_answers_queries() {
+    local sock="${WORK}/fhash.sock"
+    "${ROOT}/fhash" serve -d "${DB}" -sock "$sock" > "${WORK}/serve.log" 2>&1 &
+    local pid=$! rc=0 md5
+    for i in $(seq 50); do test -S "$sock" && break; sleep 0.1; done
+    md5=$(sqlite3 "${DB}" "SELECT md5 FROM files WHERE filepath='${WORK}/dupes/BadAudio.mp3';")
+    { "${ROOT}/fhash" query -sock "$sock" -hash "$md5" | grep -qx "${WORK}/dupes/BadAudio.mp3" &&
+      test "$("${ROOT}/fhash" query -sock "$sock" -group "${WORK}/BadAudio.mp3" -o jsonl | grep -c '^{"type":"match",')" = 2 &&
+      { "${ROOT}/fhash" query -sock "$sock" -path "${WORK}/missing.mp3"; test $? -eq 1; }; } || rc=$?
+    kill -INT $pid
+    wait $pid
+    test $rc -eq 0
+    test ! -e "$sock"
+}
+run_step "serve answers hash, group and missing-path queries" serve_answers_queries
+
+lookup_known_unknown() {
+    local rows
+    mkdir -p "${WORK}/incoming"
+    cp "${WORK}/dupes/BadAudio.mp3" "${WORK}/incoming/copy.mp3"
+    printf 'not in the index\n' > "${WORK}/incoming/new.mp3"
+    rows=$(sqlite3 "${DB}" 'SELECT COUNT(*) FROM files;')
+    printf '%s\n' "${WORK}/incoming/copy.mp3" "${WORK}/incoming/new.mp3" | "${ROOT}/fhash" lookup -d "${DB}" > "${WORK}/lookup.log"
+    grep -q "^\[known\] .*/incoming/copy.mp3 -> ${WORK}/dupes/BadAudio.mp3" "${WORK}/lookup.log"
+    grep -qx '\[unknown\] .*/incoming/new.mp3' "${WORK}/lookup.log"
+    test -s "${DB}.bloom"
+    test "$(sqlite3 "${DB}" 'SELECT COUNT(*) FROM files;')" = "$rows"
+}
+run_step "lookup reports known and unknown files without indexing them" lookup_known_unknown
+
+lookup_audio_skips_sentinels() {
+    "${ROOT}/fhash" lookup -a -d "${DB}" "${WORK}/incoming/new.mp3" > "${WORK}/lookup_audio.log"
+    test "$(sqlite3 "${DB}" "SELECT COUNT(*) FROM files WHERE audio_md5='Bad audio';")" -gt 0
+    test "$(grep -c '^\[same audio\]' "${WORK}/lookup_audio.log")" = 0
+    grep -qx '\[unknown\] .*/incoming/new.mp3' "${WORK}/lookup_audio.log"
+}
+run_step "lookup -a never matches an undecodable file on 'Bad audio'" lookup_audio_skips_sentinels
+
+xattr_reuse() {
+    mkdir -p "${WORK}/xattr"
+    cp "${WORK}/dupes/BadAudio.mp3" "${WORK}/xattr/kept.mp3"
+    cp "${WORK}/dupes/BadAudio.mp3" "${WORK}/xattr/edited.mp3"
+    "${ROOT}/fhash" scan -h -xattr -s "${WORK}/xattr" -e mp3 -d "${XATTR_DB}"
+    rm "${XATTR_DB}"
+    touch -d '2003-03-03' "${WORK}/xattr/edited.mp3"
+    "${ROOT}/fhash" scan -h -xattr -s "${WORK}/xattr" -e mp3 -d "${XATTR_DB}" -stats 2>&1 >/dev/null | grep -q '"xattr_hits":1,'
+    sqlite3 "${XATTR_DB}" 'SELECT COUNT(*), COUNT(DISTINCT md5) FROM files;' | grep -qx '2|1'
+}
+run_step "-xattr rescan into a new DB reuses cached hashes of unchanged files" xattr_reuse
+
+compare_indexes() {
+    local rc=0
+    mkdir -p "${WORK}/copy"
+    cp "${WORK}/xattr/kept.mp3" "${WORK}/copy/renamed.mp3"
+    cp "${WORK}/dupes/0bytes.mp3" "${WORK}/copy/added.mp3"
+    "${ROOT}/fhash" scan -h -s "${WORK}/copy" -e mp3 -d "${COPY_DB}"
+    "${ROOT}/fhash" compare -d "${XATTR_DB}" -d2 "${COPY_DB}" > "${WORK}/compare.log" || rc=$?
+    test $rc -eq 1
+    grep -qx '\[moved\] \(kept\|edited\).mp3 -> renamed.mp3' "${WORK}/compare.log"
+    grep -qx '\[extra\] added.mp3' "${WORK}/compare.log"
+    grep -q '1 moved, 1 missing, 1 extra' "${WORK}/compare.log"
+    "${ROOT}/fhash" compare -d "${COPY_DB}" -d2 "${COPY_DB}" | grep -q ' 2 same, 0 changed'
+}
+run_step "compare reports moved, missing and extra files between two indexes" compare_indexes
+
+merge_two_sources() {
+    "${ROOT}/fhash" merge -d "${MERGE_DB}" -from "${XATTR_DB}" -source vol1 -map "${WORK}/xattr=/mnt/vol1" -from "${COPY_DB}" -source vol2 -map "${WORK}/copy=/mnt/vol2" | grep -q '^Merged vol2: 2 rows copied'
+    test "$(sqlite3 "${MERGE_DB}" "SELECT COUNT(*) FROM files WHERE filepath LIKE '/mnt/vol_/%';")" = 4
+    "${ROOT}/fhash" dupe -xh -d "${MERGE_DB}" | grep -q '^/mnt/vol2/renamed.mp3'
+    rm "${WORK}/copy/added.mp3"
+    "${ROOT}/fhash" scan -h -s "${WORK}/copy" -e mp3 -d "${COPY_DB}" -prune
+    "${ROOT}/fhash" merge -d "${MERGE_DB}" -from "${XATTR_DB}" -source vol1 -map "${WORK}/xattr=/mnt/vol1" -from "${COPY_DB}" -source vol2 -map "${WORK}/copy=/mnt/vol2" > "${WORK}/merge.log"
+    grep -qx 'Merged vol1: 0 rows copied, 0 removed (since version [0-9]*)' "${WORK}/merge.log"
+    grep -qx 'Merged vol2: 0 rows copied, 1 removed (since version [0-9]*)' "${WORK}/merge.log"
+}
+run_step "merge remaps two indexes into one, dupe spans them, re-merge copies only changes" merge_two_sources
+
+merge_skips_other_sources_rows() {
+    "${ROOT}/fhash" merge -d "${MERGE_DB}" -from "${XATTR_DB}" -source vol3 -map "${WORK}/xattr=/mnt/vol1" > "${WORK}/merge_clash.log" 2> "${WORK}/merge_clash.err"
+    grep -qx 'Merged vol3: 0 rows copied (full, replacing 0)' "${WORK}/merge_clash.log"
+    grep -qx 'Skipped 2 rows of vol3 whose paths are indexed from elsewhere' "${WORK}/merge_clash.log"
+    grep -q '^Skipping /mnt/vol1/kept.mp3 from vol3 (already merged from vol1)' "${WORK}/merge_clash.err"
+    sqlite3 "${MERGE_DB}" "SELECT DISTINCT source FROM files WHERE filepath LIKE '/mnt/vol1/%';" | grep -qx 'vol1'
+}
+run_step "merge leaves rows owned by another source alone" merge_skips_other_sources_rows
+
 # 7) Migration coverage: upgrade legacy 1.0 DB to 1.01 and backfill check results
 run_step "create legacy 1.0 DB fixture" sqlite3 "${MIG_DB}" "CREATE TABLE sys (key TEXT PRIMARY KEY, value TEXT); INSERT INTO sys(key, value) VALUES ('version','1.0'),('db_version','1.0'); CREATE TABLE files (id INTEGER PRIMARY KEY AUTOINCREMENT, md5 TEXT, audio_md5 TEXT, filepath TEXT, filename TEXT, extension TEXT, filesize INTEGER, last_check_timestamp TIMESTAMP, modified_timestamp INTEGER DEFAULT 0, filetype TEXT DEFAULT 'F', UNIQUE(filepath)); INSERT INTO files(md5,audio_md5,filepath,filename,extension,filesize,last_check_timestamp,modified_timestamp,filetype) VALUES ('0-byte-file','0-byte-file','/legacy/zero.mp3','zero.mp3','mp3',0,0,0,'F'),('Not calculated','Bad audio','/legacy/bad.mp3','bad.mp3','mp3',123,0,0,'F'),('Not calculated','Not calculated','/legacy/unchecked.mp3','unchecked.mp3','mp3',321,0,0,'F');"
 run_step "trigger 1.0 -> 1.01 migration" "${ROOT}/fhash" check -s "${WORK}" -r -e mp3 -d "${MIG_DB}"
+
 run_step "migration schema/version checks" bash -lc "sqlite3 '${MIG_DB}' \"PRAGMA table_info(files);\" | grep -q '|audio_check_result|' && sqlite3 '${MIG_DB}' \"SELECT value FROM sys WHERE key='db_version';\" | grep -qx '1.01' && sqlite3 '${MIG_DB}' \"SELECT value FROM sys WHERE key='version';\" | grep -qx '1.01'"
+
 run_step "migration backfill checks" bash -lc "sqlite3 '${MIG_DB}' \"SELECT audio_check_result FROM files WHERE filepath='/legacy/zero.mp3';\" | grep -qx '1' && sqlite3 '${MIG_DB}' \"SELECT audio_check_result FROM files WHERE filepath='/legacy/bad.mp3';\" | grep -qx '3' && sqlite3 '${MIG_DB}' \"SELECT audio_check_result FROM files WHERE filepath='/legacy/unchecked.mp3';\" | grep -qx '4'"
 
 echo "[INFO] Results written to ${OUT}"